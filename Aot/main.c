@@ -0,0 +1,16 @@
+#include "aot/aot.h"
+
+#include "core/exitCode.h"
+#include "core/log.h"
+
+// Compiles a script to C: aot script.mtr script.c
+// The exit code is the compiler's (core/exitCode.h).
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        MTR_LOG("Usage: %s <script.mtr> <output.c>", argv[0]);
+        return MTR_FILE_ERROR;
+    }
+
+    return mtr_aot_compile(argv[1], argv[2]);
+}
@@ -0,0 +1,97 @@
+#include "core/exitCode.h"
+#include "core/log.h"
+#include "core/types.h"
+#include "launch.h"
+
+#include "jit/jit.h"
+#include "jit/trace.h"
+
+#include "runtime/memory.h"
+#include "runtime/vector.h"
+
+#include <stdio.h>
+#include <time.h>
+
+#ifdef MTR_MK
+#   define MTR_PATH(path) "Benchmarks/"path
+#else
+#   define MTR_PATH(path) "../../../Benchmarks/"path
+#endif
+
+#define RUNS 5
+
+static f64 now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (f64) ts.tv_sec + (f64) ts.tv_nsec * 1e-9;
+}
+
+static void benchmark(const char* name, const char* path) {
+    f64 best = 0.0;
+    f64 total = 0.0;
+
+    for (int i = 0; i < RUNS; ++i) {
+        f64 start = now();
+        enum mtr_exit_code ec = mtr_launch(path);
+        f64 elapsed = now() - start;
+
+        if (ec != MTR_OK) {
+            MTR_LOG_ERROR("Benchmark %s failed.", name);
+            return;
+        }
+
+        total += elapsed;
+        best = (i == 0 || elapsed < best) ? elapsed : best;
+    }
+
+    MTR_LOG(MTR_BOLD_DARK(MTR_WHITE) "%-24s" MTR_RESET " best %8.2f ms   mean %8.2f ms", name, best * 1000.0, total / RUNS * 1000.0);
+}
+
+// With no arguments the bundled scripts are timed, otherwise every argument is a script path.
+int main(int argc, char** argv)
+{
+    if (argc > 1) {
+        for (int i = 1; i < argc; ++i) {
+            benchmark(argv[i], argv[i]);
+        }
+        return 0;
+    }
+
+    benchmark("loop", MTR_PATH("loop.mtr"));
+    benchmark("fib", MTR_PATH("fib.mtr"));
+    benchmark("array", MTR_PATH("array.mtr"));
+    benchmark("map", MTR_PATH("map.mtr"));
+    benchmark("tail call", MTR_PATH("tailCall.mtr"));
+    // the same arithmetic written with array operators and as a loop over the elements
+    MTR_LOG("element-wise loops use %s", mtr_vector_isa());
+    benchmark("vector operators", MTR_PATH("vector.mtr"));
+    benchmark("vector loop", MTR_PATH("vectorLoop.mtr"));
+    benchmark("reduce natives", MTR_PATH("reduce.mtr"));
+    benchmark("reduce loop", MTR_PATH("reduceLoop.mtr"));
+    benchmark("garbage", MTR_PATH("garbage.mtr"));
+    benchmark("heap", MTR_PATH("heap.mtr"));
+
+#ifdef MTR_GC_PARALLEL
+    // the same heap marked and swept by more threads, gc=report prints how long that took
+    u32 threads = mtr_gc_threads;
+    for (u32 count = 1; count <= 8; count *= 2) {
+        char name[32];
+        snprintf(name, sizeof(name), "heap (%u gc threads)", count);
+        mtr_gc_threads = count;
+        benchmark(name, MTR_PATH("heap.mtr"));
+    }
+    mtr_gc_threads = threads;
+#endif
+
+#ifdef MTR_JIT_ENABLED
+    u32 threshold = mtr_jit_threshold;
+    u32 trace_threshold = mtr_trace_threshold;
+    mtr_trace_threshold = 0;
+    benchmark("loop (method jit)", MTR_PATH("loop.mtr"));
+    mtr_jit_threshold = 0;
+    benchmark("loop (interpreter)", MTR_PATH("loop.mtr"));
+    benchmark("fib (interpreter)", MTR_PATH("fib.mtr"));
+    mtr_jit_threshold = threshold;
+    mtr_trace_threshold = trace_threshold;
+#endif
+}
@@ -14,6 +14,7 @@ struct mtr_symbol {
             u8 is_global : 1;
             u8 assignable : 1;
             u8 upvalue : 1;
+            u8 native : 1;
         };
         u8 flags;
     };
@@ -21,6 +22,7 @@ struct mtr_symbol {
 
 struct mtr_upvalue_symbol {
     struct mtr_token token;
+    struct mtr_type* type;
     size_t index;
     bool local;
 };
@@ -168,16 +168,18 @@ static struct mtr_type* insert(struct mtr_type_list* list, void* type, size_t si
         return entry->type;
     }
 
-    entry->type = malloc(size_type);
-    memcpy(entry->type, type, size_type);
+    struct mtr_type* inserted = malloc(size_type);
+    memcpy(inserted, type, size_type);
+    entry->type = inserted;
     entry->hash = hash_type(type);
     list->count++;
 
+    // entry points into the old table after a resize
     if (list->count >= list->capacity * LOAD_FACTOR) {
         list->types = resize(list->types, list->capacity);
         list->capacity *= 2;
     }
-    return entry->type;
+    return inserted;
 }
 
 struct mtr_type* mtr_type_list_register_from_token(struct mtr_type_list* list, struct mtr_token token) {
@@ -0,0 +1,825 @@
+#include "aot.h"
+
+#include "bytecode.h"
+#include "compiler.h"
+#include "runtime/object.h"
+
+#include "debug/opcodeStats.h"
+
+#include "core/file.h"
+#include "core/log.h"
+
+#include <inttypes.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef MTR_REGISTER_VM
+
+// Every function of the package gets an index: the globals keep theirs, closure bodies found
+// in the constant tables come after them
+struct body {
+    const struct mtr_function* function; // NULL for natives and types
+    const char* name;                    // of the global, or of the function the closure is in
+    u32 length;
+    bool closure;
+};
+
+struct program {
+    struct body* bodies;
+    u32 count;
+    u32 capacity;
+    u32 globals;
+};
+
+static void add_body(struct program* p, struct body body) {
+    if (p->count == p->capacity) {
+        p->capacity = p->capacity ? p->capacity * 2 : 16;
+        p->bodies = realloc(p->bodies, sizeof(struct body) * p->capacity);
+    }
+    p->bodies[p->count++] = body;
+}
+
+static u32 find_body(const struct program* p, const struct mtr_function* f) {
+    for (u32 i = 0; i < p->count; ++i) {
+        if (p->bodies[i].function == f) {
+            return i;
+        }
+    }
+    MTR_ASSERT(false, "Function without a body.");
+    return 0;
+}
+
+static bool is_function(const struct mtr_chunk* chunk, u32 constant) {
+    return chunk->constant_types[constant] == MTR_VAL_OBJ
+        && MTR_AS_OBJ(chunk->constants[constant])->type == MTR_OBJ_FUNCTION;
+}
+
+static void load_program(struct program* p, const struct mtr_package* package) {
+    p->bodies = NULL;
+    p->count = 0;
+    p->capacity = 0;
+    p->globals = (u32) package->count;
+
+    for (u32 i = 0; i < p->globals; ++i) {
+        add_body(p, (struct body) { .function = NULL, .name = NULL, .length = 0, .closure = false });
+    }
+
+    for (size_t i = 0; i < package->symbols.capacity; ++i) {
+        const struct mtr_symbol* s = mtr_symbol_table_at(&package->symbols, i);
+        if (NULL == s) {
+            continue;
+        }
+        struct body* b = p->bodies + s->index;
+        b->name = s->token.start;
+        b->length = (u32) s->token.length;
+        const struct mtr_object* o = package->objects[s->index];
+        if (NULL != o && o->type == MTR_OBJ_FUNCTION) {
+            b->function = (const struct mtr_function*) o;
+        }
+    }
+
+    // the list grows while it is walked, closures inside closures are found too
+    for (u32 i = 0; i < p->count; ++i) {
+        const struct mtr_function* f = p->bodies[i].function;
+        if (NULL == f) {
+            continue;
+        }
+        for (u32 c = 0; c < f->chunk.constant_count; ++c) {
+            if (is_function(&f->chunk, c)) {
+                const struct body closure = {
+                    .function = (const struct mtr_function*) MTR_AS_OBJ(f->chunk.constants[c]),
+                    .name = p->bodies[i].name,
+                    .length = p->bodies[i].length,
+                    .closure = true
+                };
+                add_body(p, closure);
+            }
+        }
+    }
+}
+
+static u16 read_u16(const u8* ip) {
+    u16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+static i16 read_i16(const u8* ip) {
+    i16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+// The stack depth before every instruction, -1 for the ones no path reaches. The engine's
+// stack above the frame becomes the C locals s0, s1, ... with the parameters first.
+struct function {
+    FILE* out;
+    const struct program* program;
+    const struct mtr_chunk* chunk;
+    u32 self;
+    i32* depths;
+    bool* labels;
+    u32* worklist;
+    u32 pending;
+    u32 max_depth;
+    bool restarts;    // calls itself in tail position
+    bool upvalues;
+};
+
+static bool reach(struct function* fn, u32 offset, i32 depth) {
+    if (offset >= fn->chunk->size || depth < 0) {
+        MTR_LOG_ERROR("Malformed bytecode at %u.", offset);
+        return false;
+    }
+    if (fn->depths[offset] >= 0) {
+        if (fn->depths[offset] != depth) {
+            MTR_LOG_ERROR("Stack depths differ at %u.", offset);
+            return false;
+        }
+        return true;
+    }
+    fn->depths[offset] = depth;
+    fn->worklist[fn->pending++] = offset;
+    fn->max_depth = (u32) depth > fn->max_depth ? (u32) depth : fn->max_depth;
+    return true;
+}
+
+static bool jump(struct function* fn, u32 target, i32 depth) {
+    if (!reach(fn, target, depth)) {
+        return false;
+    }
+    fn->labels[target] = true;
+    return true;
+}
+
+// Reaches whatever follows the instruction at offset, which has depth values below it
+static bool step(struct function* fn, u32 offset, i32 depth) {
+    const u8* ip = fn->chunk->bytecode + offset;
+    const u32 next = offset + mtr_instruction_length(ip);
+
+    switch (*ip) {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG:
+    case MTR_OP_SMALL_INT:
+    case MTR_OP_FALSE:
+    case MTR_OP_TRUE:
+    case MTR_OP_STRING_LITERAL:
+    case MTR_OP_CLOSURE:
+    case MTR_OP_NIL:
+    case MTR_OP_EMPTY_ARRAY:
+    case MTR_OP_FRAME_EMPTY_ARRAY:
+    case MTR_OP_EMPTY_MAP:
+    case MTR_OP_GET:
+    case MTR_OP_GLOBAL_GET:
+    case MTR_OP_UPVALUE_GET:
+        return reach(fn, next, depth + 1);
+
+    case MTR_OP_GET_GET:
+        return reach(fn, next, depth + 2);
+
+    case MTR_OP_ARRAY_LITERAL:
+    case MTR_OP_FRAME_ARRAY_LITERAL:
+    case MTR_OP_CONSTRUCTOR:
+    case MTR_OP_FRAME_CONSTRUCTOR:
+        return reach(fn, next, depth - ip[1] + 1);
+
+    case MTR_OP_MAP_LITERAL:
+        return reach(fn, next, depth - 2 * ip[1] + 1);
+
+    case MTR_OP_BOX:
+    case MTR_OP_NOT:
+    case MTR_OP_NEGATE_I:
+    case MTR_OP_NEGATE_F:
+    case MTR_OP_LOCAL_ADD_I:
+    case MTR_OP_LOCAL_SUB_I:
+    case MTR_OP_LOCAL_INC_I:
+    case MTR_OP_SET_GET:
+    case MTR_OP_STRUCT_GET:
+    case MTR_OP_INT_CAST:
+    case MTR_OP_FLOAT_CAST:
+        return reach(fn, next, depth);
+
+    case MTR_OP_ADD_I:
+    case MTR_OP_SUB_I:
+    case MTR_OP_MUL_I:
+    case MTR_OP_DIV_I:
+    case MTR_OP_ADD_F:
+    case MTR_OP_SUB_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_DIV_F:
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F:
+    case MTR_OP_LESS_I:
+    case MTR_OP_GREATER_I:
+    case MTR_OP_EQUAL_I:
+    case MTR_OP_LESS_EQUAL_I:
+    case MTR_OP_GREATER_EQUAL_I:
+    case MTR_OP_NOT_EQUAL_I:
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+    case MTR_OP_SET:
+    case MTR_OP_UPVALUE_SET:
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_MAP:
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+    case MTR_OP_POP:
+        return reach(fn, next, depth - 1);
+
+    case MTR_OP_STRUCT_SET:
+    case MTR_OP_CHECK_BOUNDS:
+        return reach(fn, next, depth - 2);
+
+    case MTR_OP_INDEX_SET:
+    case MTR_OP_INDEX_SET_ARRAY:
+    case MTR_OP_INDEX_SET_MAP:
+    case MTR_OP_INDEX_SET_ARRAY_UNCHECKED:
+        return reach(fn, next, depth - 3);
+
+    case MTR_OP_POP_V:
+        return reach(fn, next, depth - read_u16(ip + 1));
+
+    // the condition stays for whoever jumped
+    case MTR_OP_OR:
+    case MTR_OP_AND:
+        return jump(fn, next + read_i16(ip + 1), depth) && reach(fn, next, depth - 1);
+
+    case MTR_OP_JMP:
+        return jump(fn, next + read_i16(ip + 1), depth);
+
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ:
+        return jump(fn, next + read_i16(ip + 1), depth - 1) && reach(fn, next, depth - 1);
+
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:
+        return jump(fn, next + read_i16(ip + 1), depth - 2) && reach(fn, next, depth - 2);
+
+    // the callee and its arguments make way for the result
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE:
+        return reach(fn, next, depth - ip[1]);
+
+    case MTR_OP_CALL_GLOBAL:
+    case MTR_OP_CALL_GLOBAL_NATIVE:
+        return reach(fn, next, depth - ip[3] + 1);
+
+    case MTR_OP_TAIL_CALL_GLOBAL:
+        fn->restarts = fn->restarts || read_u16(ip + 1) == fn->self;
+        return true;
+
+    case MTR_OP_TAIL_CALL:
+    case MTR_OP_RETURN:
+        return true;
+
+    default:
+        MTR_LOG_ERROR("%s can't be compiled ahead of time.", mtr_op_code_to_str(*ip));
+        return false;
+    }
+}
+
+static bool analyze(struct function* fn) {
+    const size_t size = fn->chunk->size;
+    fn->depths = malloc(sizeof(i32) * size);
+    fn->labels = calloc(size, sizeof(bool));
+    fn->worklist = malloc(sizeof(u32) * size);
+    fn->pending = 0;
+    fn->max_depth = 0;
+    fn->restarts = false;
+    fn->upvalues = false;
+    for (size_t i = 0; i < size; ++i) {
+        fn->depths[i] = -1;
+    }
+
+    bool ok = reach(fn, 0, fn->chunk->arity);
+    while (ok && fn->pending > 0) {
+        const u32 offset = fn->worklist[--fn->pending];
+        const u8 op = fn->chunk->bytecode[offset];
+        fn->upvalues = fn->upvalues || op == MTR_OP_UPVALUE_GET || op == MTR_OP_UPVALUE_SET || op == MTR_OP_CLOSURE;
+        ok = step(fn, offset, fn->depths[offset]);
+    }
+    return ok;
+}
+
+#define OUT(...) fprintf(fn->out, __VA_ARGS__)
+
+static bool write_constant(struct function* fn, u32 index) {
+    const mtr_value value = fn->chunk->constants[index];
+    switch (fn->chunk->constant_types[index]) {
+    case MTR_VAL_INT: {
+        const i64 i = MTR_AS_INT(value);
+        if (i == INT64_MIN) {
+            OUT("MTR_INT(INT64_MIN)");
+        } else {
+            OUT("MTR_INT(INT64_C(%" PRId64 "))", i);
+        }
+        return true;
+    }
+    case MTR_VAL_FLOAT: {
+        const f64 f = MTR_AS_FLOAT(value);
+        if (!isfinite(f)) {
+            MTR_LOG_ERROR("Float constant %f can't be written as C.", f);
+            return false;
+        }
+        OUT("MTR_FLOAT(%a)", f);
+        return true;
+    }
+    default:
+        MTR_LOG_ERROR("Object constants can't be pushed.");
+        return false;
+    }
+}
+
+static void write_string(struct function* fn, const struct mtr_string* s) {
+    OUT("\"");
+    for (size_t i = 0; i < s->length; ++i) {
+        const unsigned char c = (unsigned char) s->s[i];
+        if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?') {
+            OUT("%c", c);
+        } else {
+            OUT("\\%03o", c);
+        }
+    }
+    OUT("\"");
+}
+
+// The arguments of a call, from s<first> up, as the array a
+static void write_args(struct function* fn, u32 first, u8 argc) {
+    if (argc == 0) {
+        return;
+    }
+    OUT("        mtr_value a[%u] = {", argc);
+    for (u8 i = 0; i < argc; ++i) {
+        OUT(i == 0 ? " s%u" : ", s%u", first + i);
+    }
+    OUT(" };\n");
+}
+
+static const char* args_of(u8 argc) {
+    return argc == 0 ? "NULL" : "a";
+}
+
+static void write_tail_call(struct function* fn, u32 first, u8 argc) {
+    for (u8 i = 0; i < argc; ++i) {
+        OUT("    aot->tail_args[%u] = s%u;\n", i, first + i);
+    }
+    OUT("    aot->tail_argc = %u;\n", argc);
+}
+
+static bool write_instruction(struct function* fn, u32 offset) {
+    const u8* ip = fn->chunk->bytecode + offset;
+    const u32 d = (u32) fn->depths[offset];
+    const u32 next = offset + mtr_instruction_length(ip);
+
+#define BINARY(op, as, make) OUT("    s%u = %s(%s(s%u) %s %s(s%u));\n", d - 2, #make, #as, d - 2, #op, #as, d - 1)
+#define COMPARE_JMP(op) OUT("    if (!(MTR_AS_INT(s%u) %s MTR_AS_INT(s%u))) goto L%u;\n", d - 2, #op, d - 1, next + read_i16(ip + 1))
+
+    switch (*ip) {
+    case MTR_OP_CONSTANT:
+        OUT("    s%u = ", d);
+        if (!write_constant(fn, ip[1])) {
+            return false;
+        }
+        OUT(";\n");
+        break;
+    case MTR_OP_CONSTANT_LONG:
+        OUT("    s%u = ", d);
+        if (!write_constant(fn, read_u16(ip + 1))) {
+            return false;
+        }
+        OUT(";\n");
+        break;
+    case MTR_OP_SMALL_INT: OUT("    s%u = MTR_INT(%d);\n", d, read_i16(ip + 1)); break;
+    case MTR_OP_FALSE: OUT("    s%u = MTR_INT(0);\n", d); break;
+    case MTR_OP_TRUE: OUT("    s%u = MTR_INT(1);\n", d); break;
+    case MTR_OP_NIL: OUT("    s%u = MTR_NIL;\n", d); break;
+
+    case MTR_OP_STRING_LITERAL: {
+        const struct mtr_string* s = (const struct mtr_string*) MTR_AS_OBJ(fn->chunk->constants[read_u16(ip + 1)]);
+        OUT("    s%u = mtr_aot_string(aot, ", d);
+        write_string(fn, s);
+        OUT(", %zu);\n", s->length);
+        break;
+    }
+
+    // Popped from the top, the last element pushed is the first one. The objects the escape
+    // analysis keeps in the frame are made on the heap like the others.
+    case MTR_OP_ARRAY_LITERAL:
+    case MTR_OP_FRAME_ARRAY_LITERAL: {
+        const u8 count = ip[1];
+        OUT("    {\n");
+        OUT("        struct mtr_array* o = mtr_aot_array(aot, %u, %u);\n", count, ip[2]);
+        for (u8 i = 0; i < count; ++i) {
+            OUT("        mtr_array_store(o, %u, s%u);\n", i, d - 1 - i);
+        }
+        OUT("        s%u = MTR_OBJ(o);\n", d - count);
+        OUT("    }\n");
+        break;
+    }
+
+    case MTR_OP_EMPTY_ARRAY:
+    case MTR_OP_FRAME_EMPTY_ARRAY:
+        OUT("    s%u = MTR_OBJ(mtr_aot_array(aot, 0, %u));\n", d, ip[1]);
+        break;
+
+    case MTR_OP_MAP_LITERAL: {
+        const u8 count = ip[1];
+        OUT("    {\n");
+        OUT("        struct mtr_map* o = mtr_aot_map(aot, %u, %u);\n", ip[2], ip[3]);
+        for (u8 i = 0; i < count; ++i) {
+            OUT("        mtr_map_insert(o, s%u, s%u);\n", d - 2 - 2 * i, d - 1 - 2 * i);
+        }
+        OUT("        s%u = MTR_OBJ(o);\n", d - 2 * count);
+        OUT("    }\n");
+        break;
+    }
+
+    case MTR_OP_EMPTY_MAP:
+        OUT("    s%u = MTR_OBJ(mtr_aot_map(aot, %u, %u));\n", d, ip[1], ip[2]);
+        break;
+
+    case MTR_OP_CONSTRUCTOR:
+    case MTR_OP_FRAME_CONSTRUCTOR: {
+        const u8 count = ip[1];
+        OUT("    {\n");
+        OUT("        struct mtr_struct* o = mtr_aot_struct(aot, %u);\n", count);
+        for (u8 i = 0; i < count; ++i) {
+            OUT("        o->members[%u] = s%u;\n", i, d - count + i);
+        }
+        OUT("        s%u = MTR_OBJ(o);\n", d - count);
+        OUT("    }\n");
+        break;
+    }
+
+    case MTR_OP_CLOSURE: {
+        const struct mtr_function* body = (const struct mtr_function*) MTR_AS_OBJ(fn->chunk->constants[read_u16(ip + 1)]);
+        const u8 count = ip[3];
+        OUT("    {\n");
+        OUT("        struct mtr_closure* o = mtr_aot_closure(aot, bodies + %u, %u);\n", find_body(fn->program, body), count);
+        for (u8 i = 0; i < count; ++i) {
+            const u8* capture = ip + 4 + 3 * i;
+            OUT("        o->upvalues[%u] = %s%u%s;\n", i, capture[2] ? "s" : "upvalues[", read_u16(capture), capture[2] ? "" : "]");
+        }
+        OUT("        s%u = MTR_OBJ(o);\n", d);
+        OUT("    }\n");
+        break;
+    }
+
+    case MTR_OP_BOX: OUT("    s%u = mtr_aot_box(aot, s%u, %u);\n", d - 1, d - 1, ip[1]); break;
+
+    case MTR_OP_OR: OUT("    if (MTR_AS_INT(s%u)) goto L%u;\n", d - 1, next + read_i16(ip + 1)); break;
+    case MTR_OP_AND: OUT("    if (!MTR_AS_INT(s%u)) goto L%u;\n", d - 1, next + read_i16(ip + 1)); break;
+
+    case MTR_OP_NOT: OUT("    s%u = MTR_INT(!MTR_AS_INT(s%u));\n", d - 1, d - 1); break;
+    case MTR_OP_NEGATE_I: OUT("    s%u = MTR_INT(-MTR_AS_INT(s%u));\n", d - 1, d - 1); break;
+    case MTR_OP_NEGATE_F: OUT("    s%u = MTR_FLOAT(-MTR_AS_FLOAT(s%u));\n", d - 1, d - 1); break;
+
+    case MTR_OP_ADD_I: BINARY(+, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_SUB_I: BINARY(-, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_MUL_I: BINARY(*, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_DIV_I: BINARY(/, MTR_AS_INT, MTR_INT); break;
+
+    case MTR_OP_ADD_F: BINARY(+, MTR_AS_FLOAT, MTR_FLOAT); break;
+    case MTR_OP_SUB_F: BINARY(-, MTR_AS_FLOAT, MTR_FLOAT); break;
+    case MTR_OP_MUL_F: BINARY(*, MTR_AS_FLOAT, MTR_FLOAT); break;
+    case MTR_OP_DIV_F: BINARY(/, MTR_AS_FLOAT, MTR_FLOAT); break;
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F: {
+        const char* layout = ip[0] == MTR_OP_ELEMENTWISE_I ? "MTR_ARRAY_INTS" : "MTR_ARRAY_FLOATS";
+        OUT("    s%u = mtr_aot_elementwise(aot, %s, %u, %u, s%u, s%u);\n", d - 2, layout, ip[1], ip[2], d - 2, d - 1);
+        break;
+    }
+
+    // comparisons always produce an Int
+    case MTR_OP_LESS_I: BINARY(<, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_GREATER_I: BINARY(>, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_EQUAL_I: BINARY(==, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_LESS_EQUAL_I: BINARY(<=, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_GREATER_EQUAL_I: BINARY(>=, MTR_AS_INT, MTR_INT); break;
+    case MTR_OP_NOT_EQUAL_I: BINARY(!=, MTR_AS_INT, MTR_INT); break;
+
+    case MTR_OP_LESS_F: BINARY(<, MTR_AS_FLOAT, MTR_INT); break;
+    case MTR_OP_GREATER_F: BINARY(>, MTR_AS_FLOAT, MTR_INT); break;
+    case MTR_OP_EQUAL_F: BINARY(==, MTR_AS_FLOAT, MTR_INT); break;
+    case MTR_OP_LESS_EQUAL_F: BINARY(<=, MTR_AS_FLOAT, MTR_INT); break;
+    case MTR_OP_GREATER_EQUAL_F: BINARY(>=, MTR_AS_FLOAT, MTR_INT); break;
+    case MTR_OP_NOT_EQUAL_F: BINARY(!=, MTR_AS_FLOAT, MTR_INT); break;
+
+    case MTR_OP_GET: OUT("    s%u = s%u;\n", d, read_u16(ip + 1)); break;
+    case MTR_OP_SET:
+    case MTR_OP_SET_GET:
+        if (read_u16(ip + 1) != d - 1) {
+            OUT("    s%u = s%u;\n", read_u16(ip + 1), d - 1);
+        }
+        break;
+
+    case MTR_OP_GET_GET:
+        OUT("    s%u = s%u;\n", d, read_u16(ip + 1));
+        OUT("    s%u = s%u;\n", d + 1, read_u16(ip + 3));
+        break;
+
+    case MTR_OP_LOCAL_ADD_I:
+        OUT("    s%u = MTR_INT(MTR_AS_INT(s%u) + MTR_AS_INT(s%u));\n", read_u16(ip + 1), read_u16(ip + 3), read_u16(ip + 5));
+        break;
+    case MTR_OP_LOCAL_SUB_I:
+        OUT("    s%u = MTR_INT(MTR_AS_INT(s%u) - MTR_AS_INT(s%u));\n", read_u16(ip + 1), read_u16(ip + 3), read_u16(ip + 5));
+        break;
+    case MTR_OP_LOCAL_INC_I:
+        OUT("    s%u = MTR_INT(MTR_AS_INT(s%u) + %d);\n", read_u16(ip + 1), read_u16(ip + 1), read_i16(ip + 3));
+        break;
+
+    case MTR_OP_GLOBAL_GET: OUT("    s%u = MTR_OBJ(aot->globals[%u]);\n", d, read_u16(ip + 1)); break;
+    case MTR_OP_UPVALUE_GET: OUT("    s%u = upvalues[%u];\n", d, read_u16(ip + 1)); break;
+    case MTR_OP_UPVALUE_SET: OUT("    upvalues[%u] = s%u;\n", read_u16(ip + 1), d - 1); break;
+
+    case MTR_OP_INDEX_GET: OUT("    s%u = mtr_aot_index_get(s%u, s%u);\n", d - 2, d - 2, d - 1); break;
+    case MTR_OP_INDEX_GET_ARRAY: OUT("    s%u = mtr_aot_array_get(s%u, s%u);\n", d - 2, d - 2, d - 1); break;
+    case MTR_OP_INDEX_GET_MAP: OUT("    s%u = mtr_aot_map_get(s%u, s%u);\n", d - 2, d - 2, d - 1); break;
+    case MTR_OP_INDEX_SET: OUT("    mtr_aot_index_set(s%u, s%u, s%u);\n", d - 2, d - 1, d - 3); break;
+    case MTR_OP_INDEX_SET_ARRAY: OUT("    mtr_aot_array_set(s%u, s%u, s%u);\n", d - 2, d - 1, d - 3); break;
+    case MTR_OP_INDEX_SET_MAP: OUT("    mtr_aot_map_set(s%u, s%u, s%u);\n", d - 2, d - 1, d - 3); break;
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED: OUT("    s%u = mtr_aot_element(s%u, s%u);\n", d - 2, d - 2, d - 1); break;
+    case MTR_OP_INDEX_SET_ARRAY_UNCHECKED: OUT("    mtr_aot_set_element(s%u, s%u, s%u);\n", d - 2, d - 1, d - 3); break;
+    case MTR_OP_CHECK_BOUNDS: OUT("    s%u = MTR_INT(mtr_aot_check_bounds(s%u, s%u, s%u));\n", d - 3, d - 3, d - 2, d - 1); break;
+
+    case MTR_OP_STRUCT_GET: OUT("    s%u = MTR_AOT_MEMBER(s%u, %u);\n", d - 1, d - 1, read_u16(ip + 1)); break;
+    case MTR_OP_STRUCT_SET: OUT("    MTR_AOT_MEMBER(s%u, %u) = s%u;\n", d - 1, read_u16(ip + 1), d - 2); break;
+
+    case MTR_OP_JMP: OUT("    goto L%u;\n", next + read_i16(ip + 1)); break;
+    case MTR_OP_JMP_Z: OUT("    if (!MTR_AS_INT(s%u)) goto L%u;\n", d - 1, next + read_i16(ip + 1)); break;
+    case MTR_OP_JMP_NZ: OUT("    if (MTR_AS_INT(s%u)) goto L%u;\n", d - 1, next + read_i16(ip + 1)); break;
+
+    case MTR_OP_LESS_I_JMP_Z: COMPARE_JMP(<); break;
+    case MTR_OP_GREATER_I_JMP_Z: COMPARE_JMP(>); break;
+    case MTR_OP_EQUAL_I_JMP_Z: COMPARE_JMP(==); break;
+    case MTR_OP_LESS_EQUAL_I_JMP_Z: COMPARE_JMP(<=); break;
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z: COMPARE_JMP(>=); break;
+    case MTR_OP_NOT_EQUAL_I_JMP_Z: COMPARE_JMP(!=); break;
+
+    // popped values are dropped, the casts only keep the C compiler from warning about them
+    case MTR_OP_POP:
+        OUT("    (void) s%u;\n", d - 1);
+        break;
+    case MTR_OP_POP_V:
+        for (u32 i = d - read_u16(ip + 1); i < d; ++i) {
+            OUT("    (void) s%u;\n", i);
+        }
+        break;
+
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE: {
+        const u8 argc = ip[1];
+        const u32 first = d - 1 - argc;
+        OUT("    {\n");
+        write_args(fn, first, argc);
+        OUT("        s%u = mtr_aot_call(aot, MTR_AS_OBJ(s%u), %u, %s);\n", first, d - 1, argc, args_of(argc));
+        OUT("    }\n");
+        break;
+    }
+
+    case MTR_OP_CALL_GLOBAL: {
+        const u16 index = read_u16(ip + 1);
+        const u8 argc = ip[3];
+        const u32 first = d - argc;
+        OUT("    {\n");
+        write_args(fn, first, argc);
+        OUT("        s%u = f%u(aot, %s, NULL);\n", first, index, args_of(argc));
+        OUT("        MTR_AOT_TAIL_CALLS(aot, s%u);\n", first);
+        OUT("    }\n");
+        break;
+    }
+
+    case MTR_OP_CALL_GLOBAL_NATIVE: {
+        const u16 index = read_u16(ip + 1);
+        const u8 argc = ip[3];
+        const u32 first = d - argc;
+        OUT("    {\n");
+        write_args(fn, first, argc);
+        OUT("        s%u = MTR_AOT_NATIVE(aot, %u)(%u, %s);\n", first, index, argc, args_of(argc));
+        OUT("        MTR_AOT_CHECK_NATIVE(aot);\n");
+        OUT("    }\n");
+        break;
+    }
+
+    // the arguments always sit above the parameters, copying forward is safe
+    case MTR_OP_TAIL_CALL_GLOBAL: {
+        const u16 index = read_u16(ip + 1);
+        const u8 argc = ip[3];
+        const u32 first = d - argc;
+        if (index == fn->self) {
+            for (u8 i = 0; i < argc; ++i) {
+                OUT("    s%u = s%u;\n", i, first + i);
+            }
+            OUT("    goto start;\n");
+            break;
+        }
+        write_tail_call(fn, first, argc);
+        OUT("    aot->tail = aot->globals[%u];\n", index);
+        OUT("    MTR_AOT_LEAVE(aot);\n");
+        OUT("    return MTR_NIL;\n");
+        break;
+    }
+
+    case MTR_OP_TAIL_CALL: {
+        const u8 argc = ip[1];
+        write_tail_call(fn, d - 1 - argc, argc);
+        OUT("    aot->tail = MTR_AS_OBJ(s%u);\n", d - 1);
+        OUT("    MTR_AOT_LEAVE(aot);\n");
+        OUT("    return MTR_NIL;\n");
+        break;
+    }
+
+    case MTR_OP_RETURN:
+        OUT("    MTR_AOT_LEAVE(aot);\n");
+        OUT("    return s%u;\n", d - 1);
+        break;
+
+    case MTR_OP_INT_CAST: OUT("    s%u = MTR_INT((i64) MTR_AS_FLOAT(s%u));\n", d - 1, d - 1); break;
+    case MTR_OP_FLOAT_CAST: OUT("    s%u = MTR_FLOAT((f64) MTR_AS_INT(s%u));\n", d - 1, d - 1); break;
+
+    default:
+        MTR_LOG_ERROR("%s can't be compiled ahead of time.", mtr_op_code_to_str(*ip));
+        return false;
+    }
+
+#undef COMPARE_JMP
+#undef BINARY
+
+    return true;
+}
+
+static void write_signature(FILE* out, u32 index) {
+    fprintf(out, "static mtr_value f%u(struct mtr_aot* aot, mtr_value* args, mtr_value* upvalues)", index);
+}
+
+static bool write_function(FILE* out, const struct program* program, u32 index) {
+    const struct body* body = program->bodies + index;
+    struct function fn = {
+        .out = out,
+        .program = program,
+        .chunk = &body->function->chunk,
+        .self = index
+    };
+
+    bool ok = analyze(&fn);
+    if (ok) {
+        fprintf(out, "\n// %s%.*s\n", body->closure ? "closure in " : "", (int) body->length, body->name);
+        write_signature(out, index);
+        fprintf(out, " {\n");
+        for (u32 i = 0; i < fn.max_depth; ++i) {
+            if (i < fn.chunk->arity) {
+                fprintf(out, "    mtr_value s%u = args[%u];\n", i, i);
+            } else {
+                fprintf(out, "    mtr_value s%u;\n", i);
+            }
+        }
+        if (fn.chunk->arity == 0) {
+            fprintf(out, "    (void) args;\n");
+        }
+        if (!fn.upvalues) {
+            fprintf(out, "    (void) upvalues;\n");
+        }
+        fprintf(out, "    MTR_AOT_ENTER(aot);\n");
+        if (fn.restarts) {
+            fprintf(out, "start:\n");
+        }
+    }
+
+    for (u32 offset = 0; ok && offset < fn.chunk->size; ++offset) {
+        if (fn.depths[offset] < 0) {
+            continue;
+        }
+        if (fn.labels[offset]) {
+            fprintf(out, "L%u:\n", offset);
+        }
+        ok = write_instruction(&fn, offset);
+        offset += mtr_instruction_length(fn.chunk->bytecode + offset) - 1;
+    }
+
+    if (ok) {
+        fprintf(out, "}\n");
+    }
+
+    free(fn.worklist);
+    free(fn.labels);
+    free(fn.depths);
+    return ok;
+}
+
+#undef OUT
+
+bool mtr_write_c(const struct mtr_package* package, FILE* out) {
+    struct program program;
+    load_program(&program, package);
+
+    u32 main_index = 0;
+    for (u32 i = 0; i < program.globals; ++i) {
+        if (program.bodies[i].function == package->main) {
+            main_index = i;
+        }
+    }
+
+    fprintf(out, "// Written by the Matiria ahead of time compiler (aot/aot.h), link it against libMatiria.a\n\n");
+    fprintf(out, "#include \"aot/runtime.h\"\n\n");
+    fprintf(out, "static struct mtr_function bodies[%u];\n\n", program.count);
+
+    for (u32 i = 0; i < program.count; ++i) {
+        if (NULL != program.bodies[i].function) {
+            write_signature(out, i);
+            fprintf(out, ";\n");
+        }
+    }
+
+    bool ok = NULL != package->main;
+    if (!ok) {
+        MTR_LOG_ERROR("Did not find main.");
+    }
+
+    for (u32 i = 0; ok && i < program.count; ++i) {
+        if (NULL != program.bodies[i].function) {
+            ok = write_function(out, &program, i);
+        }
+    }
+
+    if (ok) {
+        fprintf(out, "\nstatic const mtr_aot_function code[%u] = {\n", program.count);
+        for (u32 i = 0; i < program.count; ++i) {
+            if (NULL != program.bodies[i].function) {
+                fprintf(out, "    f%u,\n", i);
+            } else {
+                fprintf(out, "    NULL,\n");
+            }
+        }
+        fprintf(out, "};\n\n");
+
+        fprintf(out, "static const char* const names[%u] = {\n", program.globals);
+        for (u32 i = 0; i < program.globals; ++i) {
+            fprintf(out, "    \"%.*s\",\n", (int) program.bodies[i].length, program.bodies[i].name);
+        }
+        fprintf(out, "};\n\n");
+
+        fprintf(out, "int main(void) {\n");
+        fprintf(out, "    static const struct mtr_aot_program program = { bodies, code, names, %u, %u, %u };\n", program.count, program.globals, main_index);
+        fprintf(out, "    return (int) mtr_aot_run(&program);\n");
+        fprintf(out, "}\n");
+    }
+
+    free(program.bodies);
+    return ok;
+}
+
+#else
+
+bool mtr_write_c(const struct mtr_package* package, FILE* out) {
+    (void) package;
+    (void) out;
+    MTR_LOG_ERROR("Only the stack engine's bytecode can be compiled ahead of time.");
+    return false;
+}
+
+#endif // MTR_REGISTER_VM
+
+enum mtr_exit_code mtr_aot_compile(const char* path, const char* output) {
+    char* source = mtr_read_file(path);
+    if (!source) {
+        return MTR_FILE_ERROR;
+    }
+
+    struct mtr_package package;
+    mtr_init_package(&package);
+
+    enum mtr_exit_code ec = mtr_compile(source, &package);
+    if (ec != MTR_OK) {
+        goto end;
+    }
+
+    FILE* out = fopen(output, "w");
+    if (!out) {
+        MTR_LOG_ERROR("Could not open %s.", output);
+        ec = MTR_FILE_ERROR;
+        goto end;
+    }
+
+    if (!mtr_write_c(&package, out)) {
+        ec = MTR_COMPILER_ERROR;
+    }
+    fclose(out);
+
+end:
+    mtr_delete_package(&package);
+    free(source);
+    return ec;
+}
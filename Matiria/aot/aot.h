@@ -0,0 +1,29 @@
+#ifndef MTR_AOT_H
+#define MTR_AOT_H
+
+#include "package.h"
+
+#include "core/exitCode.h"
+#include "core/types.h"
+
+#include <stdio.h>
+
+// Ahead of time compilation of a package to a C translation unit, for deployments that can't
+// JIT. Every function's stack bytecode becomes a C function whose stack slots are C locals, so
+// the C compiler keeps them in registers and optimizes across instructions. Calls between
+// global functions are direct C calls, a call in tail position to the function itself is a jump
+// to its start, other tail calls are made by the caller (aot/runtime.h) so they don't grow the C
+// stack. Objects are made and read through the same runtime the engine uses (runtime/object.h).
+//
+// The output includes "aot/runtime.h" and its main runs the package's main. Build it with the
+// flags libMatiria.a was built with, -I pointing at Matiria/, and link it against the library.
+// Only the stack engine's bytecode can be compiled, a vm=register build refuses to.
+
+// Writes the C for a package mtr_compile filled, false when it holds something that can't be
+// compiled. The package's symbols have to be alive, they point into the source.
+bool mtr_write_c(const struct mtr_package* package, FILE* out);
+
+// Compiles the script at path and writes its C to output
+enum mtr_exit_code mtr_aot_compile(const char* path, const char* output);
+
+#endif
@@ -0,0 +1,224 @@
+#include "runtime.h"
+
+#include "package.h"
+#include "runtime/vector.h"
+#include "stl/mtr_stdlib.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LINK(aot, o) link_object(aot, (struct mtr_object*) (o))
+
+static void link_object(struct mtr_aot* aot, struct mtr_object* object) {
+    object->next = aot->objects;
+    aot->objects = object;
+}
+
+// maps only remember what they hold when values are untagged
+#ifdef MTR_UNTAGGED_VALUES
+#   define SET_TYPE(field, type) field = (enum mtr_value_type) (type)
+#else
+#   define SET_TYPE(field, type) (void) (type)
+#endif
+
+static mtr_value call(struct mtr_aot* aot, const struct mtr_object* callable, u8 argc, mtr_value* args) {
+    const struct mtr_aot_program* program = aot->program;
+    switch (callable->type) {
+    case MTR_OBJ_FUNCTION: {
+        const struct mtr_function* f = (const struct mtr_function*) callable;
+        return program->code[f - program->bodies](aot, args, NULL);
+    }
+    case MTR_OBJ_CLOSURE: {
+        struct mtr_closure* c = (struct mtr_closure*) callable;
+        return program->code[c->function - program->bodies](aot, args, c->upvalues);
+    }
+    case MTR_OBJ_NATIVE_FN: {
+        const struct mtr_native_fn* n = (const struct mtr_native_fn*) callable;
+        const mtr_value result = n->function(argc, args);
+        MTR_AOT_CHECK_NATIVE(aot);
+        return result;
+    }
+    default:
+        MTR_ASSERT(false, "Object is not invokable");
+        return MTR_NIL;
+    }
+}
+
+mtr_value mtr_aot_call(struct mtr_aot* aot, const struct mtr_object* callable, u8 argc, mtr_value* args) {
+    mtr_value result = call(aot, callable, argc, args);
+    MTR_AOT_TAIL_CALLS(aot, result);
+    return result;
+}
+
+mtr_value mtr_aot_tail_calls(struct mtr_aot* aot) {
+    mtr_value result;
+    do {
+        const struct mtr_object* callable = aot->tail;
+        aot->tail = NULL;
+        // the callee copies its arguments out before it can leave a tail call of its own
+        result = call(aot, callable, aot->tail_argc, aot->tail_args);
+    } while (NULL != aot->tail);
+    return result;
+}
+
+_Noreturn void mtr_aot_stack_overflow(struct mtr_aot* aot) {
+    MTR_LOG_ERROR("Stack overflow (%u nested calls).", aot->depth - 1);
+    longjmp(aot->error, 1);
+}
+
+_Noreturn void mtr_aot_out_of_bounds(size_t size, size_t index) {
+    MTR_LOG_ERROR("Out of bounds: Indexing array of size %zu with index %zu", size, index);
+    exit(-1);
+}
+
+mtr_value mtr_aot_string(struct mtr_aot* aot, const char* string, size_t length) {
+    struct mtr_string* s = mtr_new_string(string, length);
+    LINK(aot, s);
+    return MTR_OBJ(s);
+}
+
+mtr_value mtr_aot_elementwise(struct mtr_aot* aot, enum mtr_array_layout layout, u8 op, u8 arrays, mtr_value l, mtr_value r) {
+    size_t size;
+    if (!mtr_elementwise_size(arrays, l, r, &size)) {
+        MTR_LOG_ERROR("Element-wise operation between arrays of size %zu and %zu",
+            ((const struct mtr_array*) MTR_AS_OBJ(l))->size, ((const struct mtr_array*) MTR_AS_OBJ(r))->size);
+        exit(-1);
+    }
+    struct mtr_array* array = mtr_aot_array(aot, size, layout);
+    mtr_elementwise(array, (enum mtr_elementwise) op, arrays, l, r);
+    return MTR_OBJ(array);
+}
+
+struct mtr_array* mtr_aot_array(struct mtr_aot* aot, size_t count, u8 layout) {
+    struct mtr_array* array = mtr_new_array(count > 0 ? count : 8, (enum mtr_array_layout) layout);
+    LINK(aot, array);
+    array->size = count;
+    return array;
+}
+
+struct mtr_map* mtr_aot_map(struct mtr_aot* aot, u8 key_type, u8 value_type) {
+    struct mtr_map* map = mtr_new_map();
+    LINK(aot, map);
+    SET_TYPE(map->key_type, key_type);
+    SET_TYPE(map->value_type, value_type);
+    return map;
+}
+
+struct mtr_struct* mtr_aot_struct(struct mtr_aot* aot, u8 count) {
+    struct mtr_struct* s = mtr_new_struct(count);
+    LINK(aot, s);
+    return s;
+}
+
+struct mtr_closure* mtr_aot_closure(struct mtr_aot* aot, const struct mtr_function* body, u8 count) {
+    struct mtr_closure* c = mtr_new_closure(body, count);
+    LINK(aot, c);
+    return c;
+}
+
+mtr_value mtr_aot_box(struct mtr_aot* aot, mtr_value value, u8 type) {
+#ifdef MTR_UNTAGGED_VALUES
+    struct mtr_box* box = mtr_new_box(value, (enum mtr_value_type) type);
+    LINK(aot, box);
+    return MTR_OBJ(box);
+#else
+    (void) aot;
+    (void) type;
+    return value;
+#endif
+}
+
+mtr_value mtr_aot_index_get(mtr_value object, mtr_value key) {
+    switch (MTR_AS_OBJ(object)->type) {
+    case MTR_OBJ_ARRAY: return mtr_aot_array_get(object, key);
+    case MTR_OBJ_MAP:   return mtr_aot_map_get(object, key);
+    case MTR_OBJ_STRING: {
+        const struct mtr_string* string = (const struct mtr_string*) MTR_AS_OBJ(object);
+        const size_t index = mtr_aot_index(key);
+        if (index >= string->length) {
+            MTR_LOG_ERROR("Indexing string of size %zu with index %zu", string->length, index);
+            exit(-1);
+        }
+        MTR_LOG_ERROR("String indexing not yet implemented");
+        exit(-1);
+    }
+    default:
+        exit(-1);
+    }
+}
+
+void mtr_aot_index_set(mtr_value object, mtr_value key, mtr_value value) {
+    switch (MTR_AS_OBJ(object)->type) {
+    case MTR_OBJ_ARRAY: mtr_aot_array_set(object, key, value); break;
+    case MTR_OBJ_MAP:   mtr_aot_map_set(object, key, value); break;
+    case MTR_OBJ_STRING:
+        MTR_LOG_ERROR("<String> object does not support item assignment.");
+        exit(-1);
+    default:
+        MTR_ASSERT(false, "Invalid object type");
+        break;
+    }
+}
+
+// The natives come from the same place the interpreter gets them, a package that only knows
+// the names of the globals
+static void load_natives(struct mtr_package* natives, const struct mtr_aot_program* program) {
+    mtr_init_package(natives);
+    natives->objects = calloc(program->global_count, sizeof(struct mtr_object*));
+    natives->count = program->global_count;
+    for (u32 i = 0; i < program->global_count; ++i) {
+        const char* name = program->names[i];
+        struct mtr_symbol symbol = { .token = { .start = name, .length = strlen(name) }, .index = i };
+        mtr_symbol_table_insert(&natives->symbols, name, strlen(name), symbol);
+    }
+    mtr_add_io(natives);
+    mtr_add_array(natives);
+    mtr_add_fail(natives);
+}
+
+enum mtr_exit_code mtr_aot_run(const struct mtr_aot_program* program) {
+    struct mtr_package natives;
+    load_natives(&natives, program);
+
+    struct mtr_aot* aot = malloc(sizeof(*aot));
+    aot->program = program;
+    aot->globals = calloc(program->global_count, sizeof(struct mtr_object*));
+    aot->objects = NULL;
+    aot->depth = 0;
+    aot->tail = NULL;
+
+    for (u32 i = 0; i < program->function_count; ++i) {
+        program->bodies[i].obj.type = MTR_OBJ_FUNCTION;
+        program->bodies[i].obj.next = NULL;
+    }
+
+    for (u32 i = 0; i < program->global_count; ++i) {
+        if (NULL != program->code[i]) {
+            aot->globals[i] = &program->bodies[i].obj;
+        } else if (NULL != natives.objects[i]) {
+            aot->globals[i] = natives.objects[i];
+        }
+    }
+
+    enum mtr_exit_code ec = MTR_OK;
+    if (0 == setjmp(aot->error)) {
+        mtr_aot_call(aot, &program->bodies[program->main].obj, 0, NULL);
+    } else {
+        ec = MTR_RUNTIME_ERROR;
+    }
+
+    struct mtr_object* o = aot->objects;
+    while (o) {
+        struct mtr_object* next = o->next;
+        mtr_delete_object(o);
+        o = next;
+    }
+
+    free(aot->globals);
+    free(aot);
+    mtr_delete_package(&natives);
+    return ec;
+}
+
+#undef SET_TYPE
+#undef LINK
@@ -0,0 +1,149 @@
+#ifndef MTR_AOT_RUNTIME_H
+#define MTR_AOT_RUNTIME_H
+
+#include "runtime/engine.h"
+#include "runtime/object.h"
+#include "runtime/value.h"
+
+#include "core/exitCode.h"
+#include "core/log.h"
+#include "core/macros.h"
+#include "core/types.h"
+
+#include <setjmp.h>
+
+// What the C written by the ahead of time compiler (aot.h) calls into. Everything the engine
+// does in an instruction body that isn't plain arithmetic on locals is a function here, the
+// rest is inline so the C compiler sees through it. The generated file has to be compiled with
+// the same value representation (nan=on, untagged=on) as the libMatiria.a it is linked against.
+
+struct mtr_aot;
+
+// Every Matiria function becomes one of these, args are the caller's and upvalues are the
+// closure's (NULL for global functions)
+typedef mtr_value (*mtr_aot_function)(struct mtr_aot* aot, mtr_value* args, mtr_value* upvalues);
+
+struct mtr_aot_program {
+    struct mtr_function* bodies;  // only the object header is used, the globals come first
+    const mtr_aot_function* code; // of every body, NULL for natives and types
+    const char* const* names;     // of every global, natives are looked up by name
+    u32 function_count;
+    u32 global_count;
+    u32 main;
+};
+
+struct mtr_aot {
+    const struct mtr_aot_program* program;
+    struct mtr_object** globals;
+    struct mtr_object* objects;  // everything the program allocated, freed when it ends
+    u32 depth;                   // calls in progress, refused past MTR_MAX_FRAMES like the engine does
+    // Calls in tail position that aren't to the function itself are returned to the caller,
+    // which makes them (mtr_aot_tail_calls), so chains of them don't grow the C stack
+    const struct mtr_object* tail;
+    u8 tail_argc;
+    mtr_value tail_args[UINT8_MAX + 1];
+    jmp_buf error;
+};
+
+// Runs main, the exit code is MTR_RUNTIME_ERROR when it stopped on a runtime error
+enum mtr_exit_code mtr_aot_run(const struct mtr_aot_program* program);
+
+// Calls a function, closure or native and any tail calls it leaves behind
+mtr_value mtr_aot_call(struct mtr_aot* aot, const struct mtr_object* callable, u8 argc, mtr_value* args);
+// Runs the pending tail call and the ones it leaves behind, returns the last one's result
+mtr_value mtr_aot_tail_calls(struct mtr_aot* aot);
+
+// Logs the engine's message and unwinds to mtr_aot_run
+_Noreturn void mtr_aot_stack_overflow(struct mtr_aot* aot);
+_Noreturn void mtr_aot_out_of_bounds(size_t size, size_t index);
+
+mtr_value mtr_aot_string(struct mtr_aot* aot, const char* string, size_t length);
+// ELEMENTWISE_I and ELEMENTWISE_F
+mtr_value mtr_aot_elementwise(struct mtr_aot* aot, enum mtr_array_layout layout, u8 op, u8 arrays, mtr_value l, mtr_value r);
+struct mtr_array* mtr_aot_array(struct mtr_aot* aot, size_t count, u8 layout);
+struct mtr_map* mtr_aot_map(struct mtr_aot* aot, u8 key_type, u8 value_type);
+struct mtr_struct* mtr_aot_struct(struct mtr_aot* aot, u8 count);
+struct mtr_closure* mtr_aot_closure(struct mtr_aot* aot, const struct mtr_function* body, u8 count);
+mtr_value mtr_aot_box(struct mtr_aot* aot, mtr_value value, u8 type);
+
+// The generic forms, for objects whose type the compiler didn't know
+mtr_value mtr_aot_index_get(mtr_value object, mtr_value key);
+void mtr_aot_index_set(mtr_value object, mtr_value key, mtr_value value);
+
+#define MTR_AOT_ENTER(aot)                                              \
+    do {                                                                \
+        if (++(aot)->depth > MTR_MAX_FRAMES) {                          \
+            mtr_aot_stack_overflow(aot);                                \
+        }                                                               \
+    } while (false)
+
+#define MTR_AOT_LEAVE(aot) (--(aot)->depth)
+
+// After a direct call, the callee may have left a tail call for its caller to make
+#define MTR_AOT_TAIL_CALLS(aot, result)                                 \
+    do {                                                                \
+        if (NULL != (aot)->tail) {                                      \
+            (result) = mtr_aot_tail_calls(aot);                         \
+        }                                                               \
+    } while (false)
+
+#define MTR_AOT_MEMBER(value, index) (((struct mtr_struct*) MTR_AS_OBJ(value))->members[index])
+
+#define MTR_AOT_NATIVE(aot, index) (((const struct mtr_native_fn*) (aot)->globals[index])->function)
+
+// After a native, one that failed logged why already
+#define MTR_AOT_CHECK_NATIVE(aot)                                       \
+    do {                                                                \
+        if (mtr_native_failed()) {                                      \
+            longjmp((aot)->error, 1);                                   \
+        }                                                               \
+    } while (false)
+
+static inline size_t mtr_aot_index(mtr_value key) {
+    const i64 i = MTR_AS_INT(key);
+    return mtr_reinterpret_cast(size_t, i);
+}
+
+static inline mtr_value mtr_aot_array_get(mtr_value array, mtr_value key) {
+    const struct mtr_array* a = (const struct mtr_array*) MTR_AS_OBJ(array);
+    const size_t index = mtr_aot_index(key);
+    if (index >= a->size) {
+        mtr_aot_out_of_bounds(a->size, index);
+    }
+    return mtr_array_get(a, index);
+}
+
+static inline void mtr_aot_array_set(mtr_value array, mtr_value key, mtr_value value) {
+    struct mtr_array* a = (struct mtr_array*) MTR_AS_OBJ(array);
+    const size_t index = mtr_aot_index(key);
+    if (index >= a->size) {
+        mtr_aot_out_of_bounds(a->size, index);
+    }
+    mtr_array_store(a, index, value);
+}
+
+// for the indices the range analysis knows are in bounds
+static inline mtr_value mtr_aot_element(mtr_value array, mtr_value key) {
+    return mtr_array_get((const struct mtr_array*) MTR_AS_OBJ(array), mtr_aot_index(key));
+}
+
+static inline void mtr_aot_set_element(mtr_value array, mtr_value key, mtr_value value) {
+    mtr_array_store((struct mtr_array*) MTR_AS_OBJ(array), mtr_aot_index(key), value);
+}
+
+static inline bool mtr_aot_check_bounds(mtr_value array, mtr_value first, mtr_value end) {
+    const struct mtr_array* a = (const struct mtr_array*) MTR_AS_OBJ(array);
+    const i64 i = MTR_AS_INT(first);
+    const i64 n = MTR_AS_INT(end);
+    return i >= n || (i >= 0 && (size_t) n <= a->size);
+}
+
+static inline mtr_value mtr_aot_map_get(mtr_value map, mtr_value key) {
+    return mtr_map_get((struct mtr_map*) MTR_AS_OBJ(map), key);
+}
+
+static inline void mtr_aot_map_set(mtr_value map, mtr_value key, mtr_value value) {
+    mtr_map_insert((struct mtr_map*) MTR_AS_OBJ(map), key, value);
+}
+
+#endif
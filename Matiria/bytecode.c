@@ -1,14 +1,33 @@
 #include "bytecode.h"
 
+#include "runtime/object.h"
+#include "jit/jit.h"
+#include "jit/trace.h"
+
 #include "core/log.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 struct mtr_chunk mtr_new_chunk(void) {
     struct mtr_chunk chunk = {
         .bytecode = NULL,
         .capacity = 0,
-        .size = 0
+        .size = 0,
+        .constants = NULL,
+        .constant_types = NULL,
+        .constant_count = 0,
+        .constant_capacity = 0,
+        .stack_maps = NULL,
+        .stack_map_count = 0,
+        .stack_map_capacity = 0,
+        .arity = 0,
+        .max_depth = 0,
+#ifdef MTR_JIT_ENABLED
+        .jit = NULL,
+        .hotness = 0,
+        .traces = NULL
+#endif
     };
 
     void* temp = malloc(sizeof(u8) * 8);
@@ -25,6 +44,116 @@ void mtr_delete_chunk(struct mtr_chunk* chunk) {
     free(chunk->bytecode);
     chunk->capacity = 0;
     chunk->size = 0;
+
+    for (u32 i = 0; i < chunk->constant_count; ++i) {
+        if (chunk->constant_types[i] == MTR_VAL_OBJ) {
+            mtr_delete_object(MTR_AS_OBJ(chunk->constants[i]));
+        }
+    }
+    free(chunk->constants);
+    free(chunk->constant_types);
+    chunk->constants = NULL;
+    chunk->constant_types = NULL;
+    chunk->constant_count = 0;
+    chunk->constant_capacity = 0;
+
+    for (u32 i = 0; i < chunk->stack_map_count; ++i) {
+        free(chunk->stack_maps[i].objects);
+    }
+    free(chunk->stack_maps);
+    chunk->stack_maps = NULL;
+    chunk->stack_map_count = 0;
+    chunk->stack_map_capacity = 0;
+
+#ifdef MTR_JIT_ENABLED
+    mtr_jit_free(chunk->jit);
+    chunk->jit = NULL;
+    mtr_trace_free(chunk->traces);
+    chunk->traces = NULL;
+#endif
+}
+
+static u16 append_constant(struct mtr_chunk* chunk, mtr_value value, enum mtr_value_type type) {
+    if (chunk->constant_count == MTR_MAX_CONSTANTS) {
+        MTR_LOG_ERROR("Too many constants in one function (max %u).", MTR_MAX_CONSTANTS);
+        exit(-1);
+    }
+
+    if (chunk->constant_count == chunk->constant_capacity) {
+        u32 new_cap = chunk->constant_capacity == 0 ? 8 : chunk->constant_capacity * 2;
+        chunk->constants = realloc(chunk->constants, sizeof(mtr_value) * new_cap);
+        chunk->constant_types = realloc(chunk->constant_types, sizeof(enum mtr_value_type) * new_cap);
+        chunk->constant_capacity = new_cap;
+    }
+
+    chunk->constants[chunk->constant_count] = value;
+    chunk->constant_types[chunk->constant_count] = type;
+    return (u16) chunk->constant_count++;
+}
+
+u16 mtr_add_constant(struct mtr_chunk* chunk, mtr_value value, enum mtr_value_type type) {
+    // objects are only equal to themselves
+    for (u32 i = 0; i < chunk->constant_count; ++i) {
+        if (chunk->constant_types[i] != type) {
+            continue;
+        }
+
+        mtr_value constant = chunk->constants[i];
+        bool same = type == MTR_VAL_INT ? MTR_AS_INT(constant) == MTR_AS_INT(value) : MTR_BITS(constant) == MTR_BITS(value);
+        if (same) {
+            return (u16) i;
+        }
+    }
+    return append_constant(chunk, value, type);
+}
+
+u16 mtr_add_string_constant(struct mtr_chunk* chunk, const char* string, size_t length) {
+    for (u32 i = 0; i < chunk->constant_count; ++i) {
+        if (chunk->constant_types[i] != MTR_VAL_OBJ || MTR_AS_OBJ(chunk->constants[i])->type != MTR_OBJ_STRING) {
+            continue;
+        }
+
+        struct mtr_string* s = (struct mtr_string*) MTR_AS_OBJ(chunk->constants[i]);
+        if (s->length == length && memcmp(s->s, string, length) == 0) {
+            return (u16) i;
+        }
+    }
+    return append_constant(chunk, MTR_OBJ(mtr_new_string(string, length)), MTR_VAL_OBJ);
+}
+
+void mtr_add_stack_map(struct mtr_chunk* chunk, u32 offset, const enum mtr_value_type* types, u32 count) {
+    if (chunk->stack_map_count == chunk->stack_map_capacity) {
+        u32 new_cap = chunk->stack_map_capacity == 0 ? 8 : chunk->stack_map_capacity * 2;
+        chunk->stack_maps = realloc(chunk->stack_maps, sizeof(struct mtr_stack_map) * new_cap);
+        chunk->stack_map_capacity = new_cap;
+    }
+
+    struct mtr_stack_map* map = chunk->stack_maps + chunk->stack_map_count++;
+    map->offset = offset;
+    map->count = count;
+    map->objects = calloc(count / 64 + 1, sizeof(u64));
+    for (u32 i = 0; i < count; ++i) {
+        if (types[i] == MTR_VAL_OBJ) {
+            map->objects[i / 64] |= (u64) 1 << (i % 64);
+        }
+    }
+}
+
+const struct mtr_stack_map* mtr_find_stack_map(const struct mtr_chunk* chunk, u32 offset) {
+    u32 low = 0;
+    u32 high = chunk->stack_map_count;
+    while (low < high) {
+        u32 mid = low + (high - low) / 2;
+        const struct mtr_stack_map* map = chunk->stack_maps + mid;
+        if (map->offset == offset) {
+            return map;
+        } else if (map->offset < offset) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
 }
 
 void mtr_write_chunk(struct mtr_chunk* chunk, u8 bytecode) {
@@ -39,3 +168,328 @@ void mtr_write_chunk(struct mtr_chunk* chunk, u8 bytecode) {
     }
     chunk->bytecode[chunk->size++] = bytecode;
 }
+
+void mtr_write_u64(struct mtr_chunk* chunk, u64 value) {
+    // this is definetly dangerous, but fun :). it probably breaks for big endian
+    mtr_write_chunk(chunk, (u8) (value >> 0));
+    mtr_write_chunk(chunk, (u8) (value >> 8));
+    mtr_write_chunk(chunk, (u8) (value >> 16));
+    mtr_write_chunk(chunk, (u8) (value >> 24));
+    mtr_write_chunk(chunk, (u8) (value >> 32));
+    mtr_write_chunk(chunk, (u8) (value >> 40));
+    mtr_write_chunk(chunk, (u8) (value >> 48));
+    mtr_write_chunk(chunk, (u8) (value >> 56));
+}
+
+void mtr_write_u32(struct mtr_chunk* chunk, u32 value) {
+    mtr_write_chunk(chunk, (u8) (value >> 0));
+    mtr_write_chunk(chunk, (u8) (value >> 8));
+    mtr_write_chunk(chunk, (u8) (value >> 16));
+    mtr_write_chunk(chunk, (u8) (value >> 24));
+}
+
+void mtr_write_u16(struct mtr_chunk* chunk, u16 value) {
+    mtr_write_chunk(chunk, (u8) (value >> 0));
+    mtr_write_chunk(chunk, (u8) (value >> 8));
+}
+
+static u16 read_u16(const u8* ip) {
+    u16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+u32 mtr_instruction_length(const u8* ip) {
+    switch (*ip)
+    {
+    case MTR_OP_CLOSURE:
+        return 1 + 2 + 1 + 4 * ip[3];
+
+    case MTR_OP_CONSTRUCTOR:
+    case MTR_OP_FRAME_CONSTRUCTOR:
+        return 1 + 1 + ip[1];
+
+    case MTR_OP_CONSTANT:
+    case MTR_OP_EMPTY_ARRAY:
+    case MTR_OP_FRAME_EMPTY_ARRAY:
+    case MTR_OP_BOX:
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE:
+    case MTR_OP_TAIL_CALL:
+        return 1 + 1;
+
+    case MTR_OP_ARRAY_LITERAL:
+    case MTR_OP_FRAME_ARRAY_LITERAL:
+    case MTR_OP_EMPTY_MAP:
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F:
+        return 1 + 1 + 1;
+
+    case MTR_OP_MAP_LITERAL:
+        return 1 + 1 + 1 + 1;
+
+    case MTR_OP_CONSTANT_LONG:
+    case MTR_OP_SMALL_INT:
+    case MTR_OP_STRING_LITERAL:
+    case MTR_OP_OR:
+    case MTR_OP_AND:
+    case MTR_OP_JMP:
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ:
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:
+    case MTR_OP_GET:
+    case MTR_OP_SET:
+    case MTR_OP_SET_GET:
+    case MTR_OP_GLOBAL_GET:
+    case MTR_OP_UPVALUE_GET:
+    case MTR_OP_UPVALUE_SET:
+    case MTR_OP_STRUCT_GET:
+    case MTR_OP_STRUCT_SET:
+    case MTR_OP_POP_V:
+        return 1 + 2;
+
+    case MTR_OP_GET_GET:
+        return 1 + 2 + 2;
+
+    case MTR_OP_CALL_GLOBAL:
+    case MTR_OP_CALL_GLOBAL_NATIVE:
+    case MTR_OP_TAIL_CALL_GLOBAL:
+        return 1 + 2 + 1;
+
+    case MTR_OP_LOCAL_ADD_I:
+    case MTR_OP_LOCAL_SUB_I:
+        return 1 + 2 + 2 + 2;
+
+    case MTR_OP_LOCAL_INC_I:
+        return 1 + 2 + 2;
+
+    default:
+        return 1;
+    }
+}
+
+bool mtr_stack_effect(const u8* ip, u32* pops, u32* pushes) {
+    *pops = 0;
+    *pushes = 1;
+    switch (ip[0])
+    {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG:
+    case MTR_OP_SMALL_INT:
+    case MTR_OP_FALSE:
+    case MTR_OP_TRUE:
+    case MTR_OP_STRING_LITERAL:
+    case MTR_OP_CLOSURE:
+    case MTR_OP_NIL:
+    case MTR_OP_EMPTY_STRING:
+    case MTR_OP_EMPTY_ARRAY:
+    case MTR_OP_FRAME_EMPTY_ARRAY:
+    case MTR_OP_EMPTY_MAP:
+    case MTR_OP_GET:
+    case MTR_OP_GLOBAL_GET:
+    case MTR_OP_UPVALUE_GET:
+        return true;
+
+    case MTR_OP_GET_GET:
+        *pushes = 2;
+        return true;
+
+    case MTR_OP_ARRAY_LITERAL:
+    case MTR_OP_FRAME_ARRAY_LITERAL:
+    case MTR_OP_CONSTRUCTOR:
+    case MTR_OP_FRAME_CONSTRUCTOR:
+        *pops = ip[1];
+        return true;
+
+    case MTR_OP_MAP_LITERAL:
+        *pops = 2u * ip[1];
+        return true;
+
+    case MTR_OP_BOX:
+    case MTR_OP_NOT:
+    case MTR_OP_NEGATE_I:
+    case MTR_OP_NEGATE_F:
+    case MTR_OP_INT_CAST:
+    case MTR_OP_FLOAT_CAST:
+    case MTR_OP_STRUCT_GET:
+    case MTR_OP_SET_GET:
+        *pops = 1;
+        return true;
+
+    case MTR_OP_ADD_I:
+    case MTR_OP_SUB_I:
+    case MTR_OP_MUL_I:
+    case MTR_OP_DIV_I:
+    case MTR_OP_ADD_F:
+    case MTR_OP_SUB_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_DIV_F:
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F:
+    case MTR_OP_LESS_I:
+    case MTR_OP_GREATER_I:
+    case MTR_OP_EQUAL_I:
+    case MTR_OP_LESS_EQUAL_I:
+    case MTR_OP_GREATER_EQUAL_I:
+    case MTR_OP_NOT_EQUAL_I:
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_MAP:
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+        *pops = 2;
+        return true;
+
+    case MTR_OP_CHECK_BOUNDS:
+        *pops = 3;
+        return true;
+
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE:
+        *pops = ip[1] + 1u;
+        return true;
+
+    case MTR_OP_CALL_GLOBAL:
+    case MTR_OP_CALL_GLOBAL_NATIVE:
+        *pops = ip[3];
+        return true;
+
+    default:
+        break;
+    }
+
+    *pushes = 0;
+    switch (ip[0])
+    {
+    case MTR_OP_LOCAL_ADD_I:
+    case MTR_OP_LOCAL_SUB_I:
+    case MTR_OP_LOCAL_INC_I:
+    case MTR_OP_JMP:
+        return true;
+
+    case MTR_OP_SET:
+    case MTR_OP_UPVALUE_SET:
+    case MTR_OP_POP:
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ:
+    case MTR_OP_AND:
+    case MTR_OP_OR:
+    case MTR_OP_RETURN:
+        *pops = 1;
+        return true;
+
+    case MTR_OP_STRUCT_SET:
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:
+        *pops = 2;
+        return true;
+
+    case MTR_OP_INDEX_SET:
+    case MTR_OP_INDEX_SET_ARRAY:
+    case MTR_OP_INDEX_SET_MAP:
+    case MTR_OP_INDEX_SET_ARRAY_UNCHECKED:
+        *pops = 3;
+        return true;
+
+    case MTR_OP_POP_V:
+        *pops = read_u16(ip + 1);
+        return true;
+
+    case MTR_OP_TAIL_CALL:
+        *pops = ip[1] + 1u;
+        return true;
+
+    case MTR_OP_TAIL_CALL_GLOBAL:
+        *pops = ip[3];
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static bool is_jump(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_JMP:
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ:
+    case MTR_OP_AND:
+    case MTR_OP_OR:
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void reach(i32* depths, u32* work, u32* count, u32 offset, i32 depth) {
+    if (depths[offset] < 0) {
+        depths[offset] = depth;
+        work[(*count)++] = offset;
+    }
+}
+
+void mtr_find_max_depth(struct mtr_chunk* chunk) {
+    // the depth every reached instruction starts with, the compiler leaves the same one on every path
+    i32* depths = malloc(sizeof(i32) * (chunk->size + 1));
+    u32* work = malloc(sizeof(u32) * (chunk->size + 1));
+    for (size_t i = 0; i <= chunk->size; ++i) {
+        depths[i] = -1;
+    }
+
+    u32 count = 0;
+    u32 max = chunk->arity;
+    reach(depths, work, &count, 0, chunk->arity);
+    while (count > 0) {
+        const u32 offset = work[--count];
+        const u8* ip = chunk->bytecode + offset;
+        const u32 length = mtr_instruction_length(ip);
+        const i32 before = depths[offset];
+
+        u32 pops, pushes;
+        if (!mtr_stack_effect(ip, &pops, &pushes) || pops > (u32) before) {
+            MTR_ASSERT(false, "Unknown op code or stack underflow.");
+            continue;
+        }
+        const i32 after = before - (i32) pops + (i32) pushes;
+        max = (u32) after > max ? (u32) after : max;
+
+        const u8 op = ip[0];
+        if (is_jump(op)) {
+            const u32 target = (u32) ((i32) (offset + length) + (i16) read_u16(ip + 1));
+            // AND and OR leave what they tested on the stack when they jump
+            reach(depths, work, &count, target, (op == MTR_OP_AND || op == MTR_OP_OR) ? before : after);
+        }
+        if (op != MTR_OP_JMP && op != MTR_OP_RETURN && op != MTR_OP_TAIL_CALL && op != MTR_OP_TAIL_CALL_GLOBAL && offset + length < chunk->size) {
+            reach(depths, work, &count, offset + length, after);
+        }
+    }
+
+    free(depths);
+    free(work);
+    chunk->max_depth = max;
+}
@@ -1,26 +1,41 @@
 #ifndef MTR_BYTECODE_H
 #define MTR_BYTECODE_H
 
+#include "runtime/value.h"
 #include "core/types.h"
 
+// Ints, floats, strings and closure bodies are not written into the bytecode.
+// Every chunk owns a table of constants and instructions refer to them by index.
+#define MTR_MAX_CONSTANTS (UINT16_MAX + 1)
+
 enum mtr_op_code {
-    MTR_OP_INT,
-    MTR_OP_FLOAT,
+    MTR_OP_CONSTANT,        // CONSTANT u8          push constants[u8]
+    MTR_OP_CONSTANT_LONG,   // CONSTANT_LONG u16    push constants[u16]
+    MTR_OP_SMALL_INT,       // SMALL_INT i16        push an Int that fits in the operand
 
     MTR_OP_FALSE,
     MTR_OP_TRUE,
 
-    MTR_OP_STRING_LITERAL,
-    MTR_OP_ARRAY_LITERAL,
-    MTR_OP_MAP_LITERAL,
-    MTR_OP_CONSTRUCTOR,
-    MTR_OP_CLOSURE,
+    MTR_OP_STRING_LITERAL,  // STRING_LITERAL u16   push a copy of the string constants[u16]
+    MTR_OP_ARRAY_LITERAL,   // ARRAY_LITERAL u8 count, u8 layout
+    MTR_OP_MAP_LITERAL,     // MAP_LITERAL u8 count, u8 key type, u8 value type
+    MTR_OP_CONSTRUCTOR,     // CONSTRUCTOR u8 count, u8 type*          the type of every member
+    MTR_OP_CLOSURE,         // CLOSURE u16 u8 (u16 index, u8 local)* u8 type*   the body is the function constants[u16]
 
     MTR_OP_NIL,
 
     MTR_OP_EMPTY_STRING,
-    MTR_OP_EMPTY_ARRAY,
-    MTR_OP_EMPTY_MAP,
+    MTR_OP_EMPTY_ARRAY,     // EMPTY_ARRAY u8 layout (enum mtr_array_layout, runtime/object.h)
+    MTR_OP_EMPTY_MAP,       // EMPTY_MAP u8 key type, u8 value type
+
+    // Written by the escape analysis (optimizer/ssa.h) for objects that never outlive the frame
+    // that makes them. They go in the frame storage of the engine, which is given back when the
+    // frame returns, instead of the heap. Same operands as the heap forms.
+    MTR_OP_FRAME_ARRAY_LITERAL,
+    MTR_OP_FRAME_CONSTRUCTOR,
+    MTR_OP_FRAME_EMPTY_ARRAY,
+
+    MTR_OP_BOX,             // BOX u8 type          an Int or Float becomes Any or a union (only written for untagged values)
 
     MTR_OP_OR,
     MTR_OP_AND,
@@ -40,35 +55,83 @@ enum mtr_op_code {
     MTR_OP_MUL_F,
     MTR_OP_DIV_F,
 
+    // + - * / between [Int] or [Float] arrays, or an array and a number (runtime/vector.h)
+    MTR_OP_ELEMENTWISE_I,   // ELEMENTWISE_I u8 operator, u8 arrays   enum mtr_elementwise, which sides are arrays
+    MTR_OP_ELEMENTWISE_F,   // ELEMENTWISE_F u8 operator, u8 arrays
+
     MTR_OP_LESS_I,
     MTR_OP_GREATER_I,
     MTR_OP_EQUAL_I,
+    MTR_OP_LESS_EQUAL_I,
+    MTR_OP_GREATER_EQUAL_I,
+    MTR_OP_NOT_EQUAL_I,
 
     MTR_OP_LESS_F,
     MTR_OP_GREATER_F,
     MTR_OP_EQUAL_F,
+    MTR_OP_LESS_EQUAL_F,
+    MTR_OP_GREATER_EQUAL_F,
+    MTR_OP_NOT_EQUAL_F,
 
     MTR_OP_GET,
     MTR_OP_SET,
 
+    // Superinstructions, picked from the n-gram counts of a stats=on build (debug/opcodeStats.h)
+    MTR_OP_GET_GET,         // GET_GET a b          GET a; GET b
+    MTR_OP_LOCAL_ADD_I,     // LOCAL_ADD_I dst a b  GET a; GET b; ADD_I; SET dst
+    MTR_OP_LOCAL_SUB_I,     // LOCAL_SUB_I dst a b  GET a; GET b; SUB_I; SET dst
+    MTR_OP_LOCAL_INC_I,     // LOCAL_INC_I dst i16  GET dst; SMALL_INT i16; ADD_I; SET dst
+    MTR_OP_SET_GET,         // SET_GET x            SET x; GET x (only written by the peephole pass)
+
     MTR_OP_GLOBAL_GET,
 
     MTR_OP_UPVALUE_GET,
     MTR_OP_UPVALUE_SET,
 
+    // The generic forms look at the object and rewrite themselves into the matching form below,
+    // which checks the object type and goes back to the generic form when it doesn't match.
+    // The compiler writes the specialized forms directly when the type is known.
     MTR_OP_INDEX_GET,
     MTR_OP_INDEX_SET,
+    MTR_OP_INDEX_GET_ARRAY,
+    MTR_OP_INDEX_GET_MAP,
+    MTR_OP_INDEX_SET_ARRAY,
+    MTR_OP_INDEX_SET_MAP,
+
+    // Written by the range analysis (optimizer/ssa.h) where the object is an array and the index
+    // is known to be in bounds. Neither is checked.
+    MTR_OP_INDEX_GET_ARRAY_UNCHECKED,
+    MTR_OP_INDEX_SET_ARRAY_UNCHECKED,
+    // pops an array, an Int i and an Int n and pushes whether i, i + 1 ... n - 1 are all in bounds
+    MTR_OP_CHECK_BOUNDS,
 
     MTR_OP_STRUCT_GET,
     MTR_OP_STRUCT_SET,
 
     MTR_OP_JMP,
     MTR_OP_JMP_Z,
+    MTR_OP_JMP_NZ,
+
+    // compare the two ints on top of the stack and jump if the comparison is false
+    MTR_OP_LESS_I_JMP_Z,
+    MTR_OP_GREATER_I_JMP_Z,
+    MTR_OP_EQUAL_I_JMP_Z,
+    MTR_OP_LESS_EQUAL_I_JMP_Z,
+    MTR_OP_GREATER_EQUAL_I_JMP_Z,
+    MTR_OP_NOT_EQUAL_I_JMP_Z,
 
     MTR_OP_POP,
     MTR_OP_POP_V,
 
-    MTR_OP_CALL,
+    MTR_OP_CALL,            // CALL u8 argc, rewritten like INDEX_GET
+    MTR_OP_CALL_FUNCTION,
+    MTR_OP_CALL_CLOSURE,
+    MTR_OP_CALL_NATIVE,
+    MTR_OP_CALL_GLOBAL,         // CALL_GLOBAL u16 index, u8 argc          call the function globals[u16]
+    MTR_OP_CALL_GLOBAL_NATIVE,  // CALL_GLOBAL_NATIVE u16 index, u8 argc   call the native globals[u16]
+    // return f(...) runs f in the current frame, these end the function like RETURN
+    MTR_OP_TAIL_CALL,           // TAIL_CALL u8 argc
+    MTR_OP_TAIL_CALL_GLOBAL,    // TAIL_CALL_GLOBAL u16 index, u8 argc
 
     MTR_OP_INT_CAST,
     MTR_OP_FLOAT_CAST,
@@ -76,15 +139,82 @@ enum mtr_op_code {
     MTR_OP_RETURN
 };
 
+// Which slots of a frame hold objects while a call made from that frame runs, the caller's
+// arguments included, and while an instruction that allocates runs, its operands included.
+// Untagged values (MTR_UNTAGGED_VALUES) can't tell an object from an Int so anything that walks
+// the stack goes through these.
+struct mtr_stack_map {
+    u32 offset;     // of the instruction after the call or allocation, where the frame's ip is left
+    u32 count;      // slots in use
+    u64* objects;   // bit i is set when slot i holds an object (or nil)
+};
+
+// jit=on compiles hot chunks to x86-64 machine code (jit/jit.h), anywhere else it is ignored
+#if defined(MTR_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#   define MTR_JIT_ENABLED
+#endif
+
+#if defined(MTR_JIT) && (defined(MTR_NAN_BOXING) || defined(MTR_UNTAGGED_VALUES) || defined(MTR_REGISTER_VM))
+#   error "The JIT only works with the stack engine and tagged values"
+#endif
+
+struct mtr_jit_code;
+struct mtr_trace;
+
 struct mtr_chunk {
     u8* bytecode;
     size_t size;
     size_t capacity;
+    mtr_value* constants;
+    enum mtr_value_type* constant_types;
+    u32 constant_count;
+    u32 constant_capacity;
+    struct mtr_stack_map* stack_maps; // sorted by offset
+    u32 stack_map_count;
+    u32 stack_map_capacity;
+    u8 arity;                 // parameters, the first slots of the frame
+    u32 max_depth;            // slots the frame can fill at most, its parameters included
+#ifdef MTR_JIT_ENABLED
+    struct mtr_jit_code* jit; // NULL until the chunk gets hot
+    u32 hotness;              // calls and loop iterations the interpreter ran
+    struct mtr_trace* traces; // of its hot loops (jit/trace.h)
+#endif
 };
 
 struct mtr_chunk mtr_new_chunk(void);
+// Also deletes the strings and functions in the constant table
 void mtr_delete_chunk(struct mtr_chunk* chunk);
 
+// Return the index of the constant, equal Ints, Floats and strings are only stored once.
+// The chunk takes ownership of objects added with mtr_add_constant.
+u16 mtr_add_constant(struct mtr_chunk* chunk, mtr_value value, enum mtr_value_type type);
+u16 mtr_add_string_constant(struct mtr_chunk* chunk, const char* string, size_t length);
+
+// Maps have to be added in increasing offset order, types holds the type of every slot
+void mtr_add_stack_map(struct mtr_chunk* chunk, u32 offset, const enum mtr_value_type* types, u32 count);
+const struct mtr_stack_map* mtr_find_stack_map(const struct mtr_chunk* chunk, u32 offset);
+
+// Op code and operands, in bytes
+u32 mtr_instruction_length(const u8* ip);
+
+// How many values an instruction pops and pushes, false for the ones it doesn't know.
+// AND and OR only pop when they don't jump.
+bool mtr_stack_effect(const u8* ip, u32* pops, u32* pushes);
+
+// Follows every path through the finished stack bytecode of a function and sets max_depth,
+// which the engine checks before it lets a call in
+void mtr_find_max_depth(struct mtr_chunk* chunk);
+
+#define MTR_IS_CALL(op) ((op) >= MTR_OP_CALL && (op) <= MTR_OP_TAIL_CALL_GLOBAL)
+// The instructions that may run a collection
+#define MTR_ALLOCATES(op) (((op) >= MTR_OP_STRING_LITERAL && (op) <= MTR_OP_BOX && (op) != MTR_OP_NIL) || (op) == MTR_OP_ELEMENTWISE_I || (op) == MTR_OP_ELEMENTWISE_F)
+#define MTR_HAS_STACK_MAP(op) (MTR_IS_CALL(op) || MTR_ALLOCATES(op))
+
+#define MTR_STACK_MAP_HAS_OBJECT(map, slot) (((map)->objects[(slot) / 64] >> ((slot) % 64)) & 1u)
+
 void mtr_write_chunk(struct mtr_chunk* chunk, u8 bytecode);
+void mtr_write_u16(struct mtr_chunk* chunk, u16 value);
+void mtr_write_u32(struct mtr_chunk* chunk, u32 value);
+void mtr_write_u64(struct mtr_chunk* chunk, u64 value);
 
 #endif
@@ -3,6 +3,7 @@
 #include "AST/symbol.h"
 #include "bytecode.h"
 #include "package.h"
+#include "registerCompiler.h"
 
 #include "scanner/scanner.h"
 
@@ -10,124 +11,390 @@
 
 #include "validator/validator.h"
 
+#include "optimizer/peephole.h"
+#include "optimizer/ssa.h"
+
 #include "runtime/object.h"
+#include "runtime/vector.h"
 
 #include "core/log.h"
 #include "core/macros.h"
+#include "core/report.h"
 
 #include "debug/disassemble.h"
 #include "debug/dump.h"
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-static u64 evaluate_int(struct mtr_token token) {
-    u64 s = 0;
-    for (u32 i = 0; i < token.length; ++i) {
-        s *= 10;
-        s += token.start[i] - '0';
+// returns the location of where to jump relative to the chunk
+static u16 write_jump(struct mtr_chunk* chunk, u8 instruction) {
+    mtr_write_chunk(chunk, instruction);
+    mtr_write_u16(chunk, (u16) 0xFFFFu);
+    return chunk->size - 2;
+}
+
+// patch the jump address after a block of bytecode
+static void patch_jump(struct mtr_chunk* chunk, i16 offset) {
+    i16 where = chunk->size - offset - 2;
+    i16* to_patch = (i16*)(chunk->bytecode + offset);
+    *to_patch = where;
+}
+
+static void write_loop(struct mtr_chunk* chunk, u16 offset) {
+    mtr_write_chunk(chunk, MTR_OP_JMP);
+    i16 where = offset - chunk->size - 3;
+    mtr_write_u16(chunk, mtr_reinterpret_cast(u16, where));
+}
+
+// What the stack of the function being written holds: its locals followed by the temporaries
+// of the statement being written. write_expr and write keep it in step with the bytecode so every
+// call can record a stack map (bytecode.h).
+struct frame_layout {
+    enum mtr_value_type* types;
+    u32 count;
+    u32 capacity;
+    const struct mtr_type* return_type;
+};
+
+static struct frame_layout* layout = NULL;
+
+static void push_slot(enum mtr_value_type type) {
+    if (layout->count == layout->capacity) {
+        layout->capacity = layout->capacity == 0 ? 16 : layout->capacity * 2;
+        layout->types = realloc(layout->types, sizeof(enum mtr_value_type) * layout->capacity);
     }
-    return s;
+    layout->types[layout->count++] = type;
 }
 
-static f64 evaluate_float(struct mtr_token token) {
-    f64 s = 0;
-    const char* c = token.start;
-    while (*c != '.') {
-        s *= 10;
-        s += *c - '0';
-        c++;
+// Written right after an instruction that allocates, before its effect on the layout: the
+// collection it may run sees its operands still on the stack
+static void add_allocation_map(struct mtr_chunk* chunk) {
+    mtr_add_stack_map(chunk, (u32) chunk->size, layout->types, layout->count);
+}
+
+static enum mtr_value_type kind_of_type(const struct mtr_type* type) {
+    if (NULL == type) {
+        return MTR_VAL_INT;
     }
 
-    c++;
+    switch (type->type) {
+    case MTR_DATA_INVALID:
+    case MTR_DATA_VOID:
+    case MTR_DATA_BOOL:
+    case MTR_DATA_INT:
+        return MTR_VAL_INT;
+    case MTR_DATA_FLOAT:
+        return MTR_VAL_FLOAT;
+    default:
+        return MTR_VAL_OBJ;
+    }
+}
 
-    u64 i = 10;
-    while (c != token.start + token.length) {
-        f64 x = (f64)(*c - '0') / i;
-        s += x;
-        c++;
-        i *= 10;
+// The validator leaves the type of an expression in its symbols. Literals don't have one.
+static const struct mtr_type* type_of(struct mtr_expr* expr) {
+    switch (expr->type) {
+    case MTR_EXPR_PRIMARY: return ((struct mtr_primary*) expr)->symbol.type;
+    case MTR_EXPR_BINARY:  return ((struct mtr_binary*) expr)->operator.type;
+    case MTR_EXPR_UNARY:   return ((struct mtr_unary*) expr)->operator.type;
+    case MTR_EXPR_GROUPING: return type_of(((struct mtr_grouping*) expr)->expression);
+    case MTR_EXPR_CAST:    return &((struct mtr_cast*) expr)->to;
+    case MTR_EXPR_CALL: {
+        const struct mtr_type* callable = type_of(((struct mtr_call*) expr)->callable);
+        return callable ? mtr_get_underlying_type(callable) : NULL;
+    }
+    case MTR_EXPR_SUBSCRIPT: {
+        const struct mtr_type* object = type_of(((struct mtr_access*) expr)->object);
+        return object ? mtr_get_underlying_type(object) : NULL;
+    }
+    case MTR_EXPR_ACCESS: {
+        struct mtr_access* a = (struct mtr_access*) expr;
+        const struct mtr_struct_type* st = (const struct mtr_struct_type*) type_of(a->object);
+        return st ? st->members[((struct mtr_primary*) a->element)->symbol.index]->type : NULL;
+    }
+    case MTR_EXPR_LITERAL:
+    case MTR_EXPR_ARRAY_LITERAL:
+    case MTR_EXPR_MAP_LITERAL:
+        return NULL;
     }
-    return s;
+    return NULL;
 }
 
-static void write_u64(struct mtr_chunk* chunk, u64 value) {
-    // this is definetly dangerous, but fun :). it probably breaks for big endian
-    mtr_write_chunk(chunk, (u8) (value >> 0));
-    mtr_write_chunk(chunk, (u8) (value >> 8));
-    mtr_write_chunk(chunk, (u8) (value >> 16));
-    mtr_write_chunk(chunk, (u8) (value >> 24));
-    mtr_write_chunk(chunk, (u8) (value >> 32));
-    mtr_write_chunk(chunk, (u8) (value >> 40));
-    mtr_write_chunk(chunk, (u8) (value >> 48));
-    mtr_write_chunk(chunk, (u8) (value >> 56));
+static enum mtr_value_type kind_of(struct mtr_expr* expr) {
+    switch (expr->type) {
+    case MTR_EXPR_LITERAL: {
+        enum mtr_token_type t = ((struct mtr_literal*) expr)->literal.type;
+        return t == MTR_TOKEN_FLOAT_LITERAL ? MTR_VAL_FLOAT
+            : t == MTR_TOKEN_STRING_LITERAL ? MTR_VAL_OBJ
+            : MTR_VAL_INT;
+    }
+    case MTR_EXPR_ARRAY_LITERAL:
+    case MTR_EXPR_MAP_LITERAL:
+        return MTR_VAL_OBJ;
+    case MTR_EXPR_GROUPING:
+        return kind_of(((struct mtr_grouping*) expr)->expression);
+    case MTR_EXPR_UNARY:
+        if (((struct mtr_unary*) expr)->operator.token.type == MTR_TOKEN_BANG) {
+            return MTR_VAL_INT;
+        }
+        break;
+    case MTR_EXPR_BINARY:
+        // the operator type of a comparison is the type of its operands
+        switch (((struct mtr_binary*) expr)->operator.token.type) {
+        case MTR_TOKEN_PLUS:
+        case MTR_TOKEN_MINUS:
+        case MTR_TOKEN_STAR:
+        case MTR_TOKEN_SLASH:
+            break;
+        default:
+            return MTR_VAL_INT;
+        }
+        break;
+    case MTR_EXPR_SUBSCRIPT: {
+        struct mtr_expr* object = ((struct mtr_access*) expr)->object;
+        if (object->type == MTR_EXPR_ARRAY_LITERAL) {
+            return kind_of(((struct mtr_array_literal*) object)->expressions[0]);
+        } else if (object->type == MTR_EXPR_MAP_LITERAL) {
+            return kind_of(((struct mtr_map_literal*) object)->entries[0].value);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return kind_of_type(type_of(expr));
 }
 
-static void write_u32(struct mtr_chunk* chunk, u32 value) {
-    mtr_write_chunk(chunk, (u8) (value >> 0));
-    mtr_write_chunk(chunk, (u8) (value >> 8));
-    mtr_write_chunk(chunk, (u8) (value >> 16));
-    mtr_write_chunk(chunk, (u8) (value >> 24));
+// Bools are Ints to the runtime, so kind_of can't tell them apart
+static bool is_bool(struct mtr_expr* expr) {
+    switch (expr->type) {
+    case MTR_EXPR_LITERAL: {
+        enum mtr_token_type t = ((struct mtr_literal*) expr)->literal.type;
+        return t == MTR_TOKEN_TRUE || t == MTR_TOKEN_FALSE;
+    }
+    case MTR_EXPR_GROUPING:
+        return is_bool(((struct mtr_grouping*) expr)->expression);
+    case MTR_EXPR_UNARY:
+        if (((struct mtr_unary*) expr)->operator.token.type == MTR_TOKEN_BANG) {
+            return true;
+        }
+        break;
+    case MTR_EXPR_BINARY:
+        switch (((struct mtr_binary*) expr)->operator.token.type) {
+        case MTR_TOKEN_PLUS:
+        case MTR_TOKEN_MINUS:
+        case MTR_TOKEN_STAR:
+        case MTR_TOKEN_SLASH:
+            break;
+        default:
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+    const struct mtr_type* type = type_of(expr);
+    return NULL != type && type->type == MTR_DATA_BOOL;
 }
 
-static void write_u16(struct mtr_chunk* chunk, u16 value) {
-    mtr_write_chunk(chunk, (u8) (value >> 0));
-    mtr_write_chunk(chunk, (u8) (value >> 8));
+static enum mtr_array_layout array_layout_of_type(const struct mtr_type* element) {
+    if (NULL == element) {
+        return MTR_ARRAY_VALUES;
+    }
+
+    switch (element->type) {
+    case MTR_DATA_BOOL:  return MTR_ARRAY_BOOLS;
+    case MTR_DATA_INT:   return MTR_ARRAY_INTS;
+    case MTR_DATA_FLOAT: return MTR_ARRAY_FLOATS;
+    default:             return MTR_ARRAY_VALUES;
+    }
 }
 
-// returns the location of where to jump relative to the chunk
-static u16 write_jump(struct mtr_chunk* chunk, u8 instruction) {
-    mtr_write_chunk(chunk, instruction);
-    write_u16(chunk, (u16) 0xFFFFu);
-    return chunk->size - 2;
+// The type of a literal is the type of its first element
+static enum mtr_array_layout array_layout_of(struct mtr_array_literal* array) {
+    struct mtr_expr* first = array->expressions[0];
+    switch (kind_of(first)) {
+    case MTR_VAL_INT:   return is_bool(first) ? MTR_ARRAY_BOOLS : MTR_ARRAY_INTS;
+    case MTR_VAL_FLOAT: return MTR_ARRAY_FLOATS;
+    default:            return MTR_ARRAY_VALUES;
+    }
 }
 
-// patch the jump address after a block of bytecode
-static void patch_jump(struct mtr_chunk* chunk, i16 offset) {
-    i16 where = chunk->size - offset - 2;
-    i16* to_patch = (i16*)(chunk->bytecode + offset);
-    *to_patch = where;
+static void write_expr(struct mtr_chunk* chunk, struct mtr_expr* expr);
+static void write(struct mtr_chunk* chunk, struct mtr_stmt* stmt);
+static void write_array_literal(struct mtr_chunk* chunk, struct mtr_array_literal* array, enum mtr_array_layout array_layout, const struct mtr_type* element);
+
+// Ints and Floats that become Any or a union are boxed, so those are always objects
+static bool needs_box(struct mtr_expr* expr, const struct mtr_type* to) {
+#ifdef MTR_UNTAGGED_VALUES
+    return NULL != to && (to->type == MTR_DATA_ANY || to->type == MTR_DATA_UNION) && kind_of(expr) != MTR_VAL_OBJ;
+#else
+    (void) expr;
+    (void) to;
+    return false;
+#endif
 }
 
-static void write_loop(struct mtr_chunk* chunk, u16 offset) {
-    mtr_write_chunk(chunk, MTR_OP_JMP);
-    i16 where = offset - chunk->size - 3;
-    write_u16(chunk, mtr_reinterpret_cast(u16, where));
+static void write_converted(struct mtr_chunk* chunk, struct mtr_expr* expr, const struct mtr_type* to) {
+    // [1, 2] that becomes [Any] has to be able to hold anything, its elements become Any one by
+    // one. Other arrays only become [Any] with tagged values (the validator's check_assignemnt).
+    if (expr->type == MTR_EXPR_ARRAY_LITERAL && NULL != to && to->type == MTR_DATA_ARRAY) {
+        struct mtr_array_literal* array = (struct mtr_array_literal*) expr;
+        const struct mtr_type* element = ((const struct mtr_array_type*) to)->element;
+        const enum mtr_array_layout array_layout = array_layout_of(array);
+        const bool same = array_layout == array_layout_of_type(element);
+        const u32 base = layout->count;
+        write_array_literal(chunk, array, same ? array_layout : MTR_ARRAY_VALUES, element);
+        layout->count = base;
+        push_slot(MTR_VAL_OBJ);
+        return;
+    }
+
+    write_expr(chunk, expr);
+    if (needs_box(expr, to)) {
+        mtr_write_chunk(chunk, MTR_OP_BOX);
+        mtr_write_chunk(chunk, (u8) kind_of(expr));
+        add_allocation_map(chunk);
+        layout->types[layout->count - 1] = MTR_VAL_OBJ;
+    }
 }
 
-static void write_expr(struct mtr_chunk* chunk, struct mtr_expr* expr);
+// Small global functions are written into their callers instead of being called (write_inlined).
+// Only functions whose body returns a single expression qualify, so their parameters are the only
+// locals they read. Arguments that are locals or number literals are written where the parameter
+// is read, the others are evaluated into temporaries first like a call would.
+#define MAX_INLINE_SIZE 16  // nodes of the returned expression
+#define MAX_INLINE_DEPTH 4
+
+struct inlining {
+    const struct mtr_function_decl* fn; // NULL for the members of a struct being constructed
+    struct mtr_expr* args[UINT8_MAX];   // written for the parameter, NULL when it was evaluated into slots[i]
+    u16 slots[UINT8_MAX];
+    struct inlining* enclosing;
+};
+
+static struct inlining* inlined = NULL;                    // the function whose body is being written into its caller
+static const struct mtr_function_decl* compiling = NULL;   // the function whose chunk is being written
+static struct mtr_block* globals = NULL;                   // declarations of the package, by global index
+
+enum { INLINE_UNKNOWN, INLINE_YES, INLINE_NO };
+static u8* inlinable = NULL;                               // whether each global function is, by global index
+
+// Where a local is in the frame being written, -1 for anything else. The parameters of an
+// inlined function are where their argument is.
+static i32 resolve_local(struct mtr_expr* expr) {
+    for (struct inlining* i = inlined; ; i = i->enclosing) {
+        if (expr->type != MTR_EXPR_PRIMARY) {
+            return -1;
+        }
+        struct mtr_primary* p = (struct mtr_primary*) expr;
+        if (p->symbol.is_global || p->symbol.upvalue) {
+            return -1;
+        }
+        if (NULL == i) {
+            return (i32) p->symbol.index;
+        }
+        if (NULL == i->args[p->symbol.index]) {
+            return i->slots[p->symbol.index];
+        }
+        expr = i->args[p->symbol.index];
+    }
+}
+
+static bool is_local(struct mtr_expr* expr) {
+    return resolve_local(expr) >= 0;
+}
+
+// locals and number literals can be read again instead of being kept in a temporary
+static bool is_substitutable(struct mtr_expr* expr) {
+    for (struct inlining* i = inlined; ; i = i->enclosing) {
+        if (expr->type == MTR_EXPR_LITERAL) {
+            return kind_of(expr) != MTR_VAL_OBJ;
+        }
+        if (expr->type != MTR_EXPR_PRIMARY) {
+            return false;
+        }
+        struct mtr_primary* p = (struct mtr_primary*) expr;
+        if (p->symbol.is_global || p->symbol.upvalue) {
+            return false;
+        }
+        if (NULL == i || NULL == i->args[p->symbol.index]) {
+            return true;
+        }
+        expr = i->args[p->symbol.index];
+    }
+}
+
+static u16 local_index(struct mtr_expr* expr) {
+    return (u16) resolve_local(expr);
+}
+
+static bool is_int_literal(struct mtr_expr* expr) {
+    return expr->type == MTR_EXPR_LITERAL && ((struct mtr_literal*) expr)->literal.type == MTR_TOKEN_INT_LITERAL;
+}
 
 static void write_primary(struct mtr_chunk* chunk, struct mtr_primary* expr) {
+    if (NULL != inlined && !expr->symbol.is_global && !expr->symbol.upvalue) {
+        struct inlining* parameter = inlined;
+        struct mtr_expr* arg = parameter->args[expr->symbol.index];
+        if (NULL == arg) {
+            mtr_write_chunk(chunk, MTR_OP_GET);
+            mtr_write_u16(chunk, parameter->slots[expr->symbol.index]);
+            return;
+        }
+
+        // the argument belongs to the caller
+        inlined = parameter->enclosing;
+        write_expr(chunk, arg);
+        inlined = parameter;
+        return;
+    }
+
     u8 op = expr->symbol.is_global ? MTR_OP_GLOBAL_GET
         : expr->symbol.upvalue ? MTR_OP_UPVALUE_GET
         : MTR_OP_GET;
     mtr_write_chunk(chunk, op);
-    write_u16(chunk, (u16)expr->symbol.index);
+    mtr_write_u16(chunk, (u16)expr->symbol.index);
+}
+
+// small Ints go in the instruction, everything else in the constant table
+static void write_constant(struct mtr_chunk* chunk, mtr_value value, enum mtr_value_type type) {
+    if (type == MTR_VAL_INT && MTR_AS_INT(value) >= INT16_MIN && MTR_AS_INT(value) <= INT16_MAX) {
+        mtr_write_chunk(chunk, MTR_OP_SMALL_INT);
+        mtr_write_u16(chunk, (u16) (i16) MTR_AS_INT(value));
+        return;
+    }
+
+    u16 index = mtr_add_constant(chunk, value, type);
+    if (index <= UINT8_MAX) {
+        mtr_write_chunk(chunk, MTR_OP_CONSTANT);
+        mtr_write_chunk(chunk, (u8) index);
+    } else {
+        mtr_write_chunk(chunk, MTR_OP_CONSTANT_LONG);
+        mtr_write_u16(chunk, index);
+    }
 }
 
 static void write_literal(struct mtr_chunk* chunk, struct mtr_literal* expr) {
     switch (expr->literal.type)
     {
     case MTR_TOKEN_INT_LITERAL: {
-        mtr_write_chunk(chunk, MTR_OP_INT);
-        u64 value = evaluate_int(expr->literal);
-        write_u64(chunk, value);
+        write_constant(chunk, MTR_INT(mtr_token_to_int(expr->literal)), MTR_VAL_INT);
         break;
     }
 
     case MTR_TOKEN_FLOAT_LITERAL: {
-        mtr_write_chunk(chunk, MTR_OP_FLOAT);
-        f64 value = evaluate_float(expr->literal);
-        write_u64(chunk, mtr_reinterpret_cast(u64, value));
+        write_constant(chunk, MTR_FLOAT(mtr_token_to_float(expr->literal)), MTR_VAL_FLOAT);
         break;
     }
 
     case MTR_TOKEN_STRING_LITERAL: {
-        // this is weird
-        mtr_write_chunk(chunk, MTR_OP_STRING_LITERAL);
         const char* string_start = expr->literal.start+1; // skip opening "
-        write_u64(chunk, mtr_reinterpret_cast(u64, string_start));
-        write_u32(chunk, expr->literal.length - 2); // skip closing "
+        u16 index = mtr_add_string_constant(chunk, string_start, expr->literal.length - 2); // skip closing "
+        mtr_write_chunk(chunk, MTR_OP_STRING_LITERAL);
+        mtr_write_u16(chunk, index);
+        add_allocation_map(chunk);
         break;
     }
 
@@ -146,16 +413,19 @@ static void write_literal(struct mtr_chunk* chunk, struct mtr_literal* expr) {
     }
 }
 
-static void write_array_literal(struct mtr_chunk* chunk, struct mtr_array_literal* array) {
+// element is the type the elements are converted to, NULL to write them as they are
+static void write_array_literal(struct mtr_chunk* chunk, struct mtr_array_literal* array, enum mtr_array_layout array_layout, const struct mtr_type* element) {
     for (u8 i = 0; i < array->count; ++i) {
         // We need to write them from last to first to keep the array order
         // Doing the for loop that way results in unsigned int wrapping around\, so it doesnt work
         u8 actual_index = array->count - i - 1;
-        write_expr(chunk, array->expressions[actual_index]);
+        write_converted(chunk, array->expressions[actual_index], element);
     }
 
     mtr_write_chunk(chunk, MTR_OP_ARRAY_LITERAL);
     mtr_write_chunk(chunk, array->count);
+    mtr_write_chunk(chunk, (u8) array_layout);
+    add_allocation_map(chunk);
 }
 
 static void write_map_literal(struct mtr_chunk* chunk, struct mtr_map_literal* map) {
@@ -168,11 +438,15 @@ static void write_map_literal(struct mtr_chunk* chunk, struct mtr_map_literal* m
 
     mtr_write_chunk(chunk, MTR_OP_MAP_LITERAL);
     mtr_write_chunk(chunk, map->count);
+    mtr_write_chunk(chunk, (u8) kind_of(map->entries[0].key));
+    mtr_write_chunk(chunk, (u8) kind_of(map->entries[0].value));
+    add_allocation_map(chunk);
 }
 
 static void write_and(struct mtr_chunk* chunk, struct mtr_binary* expr) {
     write_expr(chunk, expr->left);
     u16 offset = write_jump(chunk, MTR_OP_AND);
+    layout->count -= 1; // the right side only runs once the left one is popped
 
     write_expr(chunk, expr->right);
     patch_jump(chunk, offset);
@@ -181,11 +455,45 @@ static void write_and(struct mtr_chunk* chunk, struct mtr_binary* expr) {
 static void write_or(struct mtr_chunk* chunk, struct mtr_binary* expr) {
     write_expr(chunk, expr->left);
     u16 left_true = write_jump(chunk, MTR_OP_OR);
+    layout->count -= 1;
 
     write_expr(chunk, expr->right);
     patch_jump(chunk, left_true);
 }
 
+static void write_operands(struct mtr_chunk* chunk, struct mtr_binary* expr) {
+    if (is_local(expr->left) && is_local(expr->right)) {
+        mtr_write_chunk(chunk, MTR_OP_GET_GET);
+        mtr_write_u16(chunk, local_index(expr->left));
+        mtr_write_u16(chunk, local_index(expr->right));
+        push_slot(kind_of(expr->left));
+        push_slot(kind_of(expr->right));
+        return;
+    }
+
+    write_expr(chunk, expr->left);
+    write_expr(chunk, expr->right);
+}
+
+// + - * / with an array on either side, the validator only lets [Int] and [Float] through
+static void write_elementwise(struct mtr_chunk* chunk, struct mtr_binary* expr) {
+    const struct mtr_type* element = ((const struct mtr_array_type*) expr->operator.type)->element;
+    mtr_write_chunk(chunk, element->type == MTR_DATA_INT ? MTR_OP_ELEMENTWISE_I : MTR_OP_ELEMENTWISE_F);
+
+    switch (expr->operator.token.type)
+    {
+    case MTR_TOKEN_PLUS:  mtr_write_chunk(chunk, MTR_ELEMENTWISE_ADD); break;
+    case MTR_TOKEN_MINUS: mtr_write_chunk(chunk, MTR_ELEMENTWISE_SUB); break;
+    case MTR_TOKEN_STAR:  mtr_write_chunk(chunk, MTR_ELEMENTWISE_MUL); break;
+    default:              mtr_write_chunk(chunk, MTR_ELEMENTWISE_DIV); break;
+    }
+
+    const u8 left = kind_of(expr->left) == MTR_VAL_OBJ ? MTR_ELEMENTWISE_LEFT : 0;
+    const u8 right = kind_of(expr->right) == MTR_VAL_OBJ ? MTR_ELEMENTWISE_RIGHT : 0;
+    mtr_write_chunk(chunk, left | right);
+    add_allocation_map(chunk);
+}
+
 static void write_binary(struct mtr_chunk* chunk, struct mtr_binary* expr) {
     // handle && and || as they are short circuited
     if (expr->operator.token.type == MTR_TOKEN_AND) {
@@ -196,8 +504,14 @@ static void write_binary(struct mtr_chunk* chunk, struct mtr_binary* expr) {
         return;
     }
 
-    write_expr(chunk, expr->left);
-    write_expr(chunk, expr->right);
+    write_operands(chunk, expr);
+
+    const enum mtr_token_type op = expr->operator.token.type;
+    const bool arithmetic = op == MTR_TOKEN_PLUS || op == MTR_TOKEN_MINUS || op == MTR_TOKEN_STAR || op == MTR_TOKEN_SLASH;
+    if (arithmetic && expr->operator.type->type == MTR_DATA_ARRAY) {
+        write_elementwise(chunk, expr);
+        return;
+    }
 
 #define BINARY_OP(op)                                             \
     do {                                                          \
@@ -233,8 +547,7 @@ static void write_binary(struct mtr_chunk* chunk, struct mtr_binary* expr) {
         break;
 
     case MTR_TOKEN_LESS_EQUAL:
-        BINARY_OP(GREATER);
-        mtr_write_chunk(chunk, MTR_OP_NOT);
+        BINARY_OP(LESS_EQUAL);
         break;
 
     case MTR_TOKEN_GREATER:
@@ -242,8 +555,7 @@ static void write_binary(struct mtr_chunk* chunk, struct mtr_binary* expr) {
         break;
 
     case MTR_TOKEN_GREATER_EQUAL:
-        BINARY_OP(LESS);
-        mtr_write_chunk(chunk, MTR_OP_NOT);
+        BINARY_OP(GREATER_EQUAL);
         break;
 
     case MTR_TOKEN_EQUAL:
@@ -251,8 +563,7 @@ static void write_binary(struct mtr_chunk* chunk, struct mtr_binary* expr) {
         break;
 
     case MTR_TOKEN_BANG_EQUAL:
-        BINARY_OP(EQUAL);
-        mtr_write_chunk(chunk, MTR_OP_NOT);
+        BINARY_OP(NOT_EQUAL);
         break;
 
     default:
@@ -282,15 +593,363 @@ static void write_unary(struct mtr_chunk* chunk, struct mtr_unary* unary) {
     }
 }
 
-static void write_call(struct mtr_chunk* chunk, struct mtr_call* call) {
+static struct mtr_type any_type = { MTR_DATA_ANY };
+
+static u32 expression_size(struct mtr_expr* expr) {
+    switch (expr->type) {
+    case MTR_EXPR_PRIMARY:
+    case MTR_EXPR_LITERAL:
+        return 1;
+    case MTR_EXPR_GROUPING:
+        return expression_size(((struct mtr_grouping*) expr)->expression);
+    case MTR_EXPR_UNARY:
+        return 1 + expression_size(((struct mtr_unary*) expr)->right);
+    case MTR_EXPR_CAST:
+        return 1 + expression_size(((struct mtr_cast*) expr)->right);
+    case MTR_EXPR_BINARY: {
+        struct mtr_binary* b = (struct mtr_binary*) expr;
+        return 1 + expression_size(b->left) + expression_size(b->right);
+    }
+    case MTR_EXPR_SUBSCRIPT:
+    case MTR_EXPR_ACCESS: {
+        struct mtr_access* a = (struct mtr_access*) expr;
+        return 1 + expression_size(a->object) + expression_size(a->element);
+    }
+    case MTR_EXPR_CALL: {
+        struct mtr_call* call = (struct mtr_call*) expr;
+        u32 size = 1 + expression_size(call->callable);
+        for (u8 i = 0; i < call->argc; ++i) {
+            size += expression_size(call->argv[i]);
+        }
+        return size;
+    }
+    case MTR_EXPR_ARRAY_LITERAL: {
+        struct mtr_array_literal* a = (struct mtr_array_literal*) expr;
+        u32 size = 1;
+        for (u8 i = 0; i < a->count; ++i) {
+            size += expression_size(a->expressions[i]);
+        }
+        return size;
+    }
+    case MTR_EXPR_MAP_LITERAL: {
+        struct mtr_map_literal* m = (struct mtr_map_literal*) expr;
+        u32 size = 1;
+        for (u8 i = 0; i < m->count; ++i) {
+            size += expression_size(m->entries[i].key) + expression_size(m->entries[i].value);
+        }
+        return size;
+    }
+    }
+    return MAX_INLINE_SIZE + 1;
+}
+
+// the expression a function returns when that is all its body does, NULL otherwise
+static struct mtr_expr* returned_expression(const struct mtr_function_decl* fn) {
+    struct mtr_stmt* body = fn->body;
+    if (body->type == MTR_STMT_BLOCK || body->type == MTR_STMT_SCOPE) {
+        struct mtr_block* block = (struct mtr_block*) body;
+        body = block->size == 1 ? block->statements[0] : NULL;
+    }
+    if (NULL == body || body->type != MTR_STMT_RETURN) {
+        return NULL;
+    }
+    return ((struct mtr_return*) body)->expr;
+}
+
+static bool stmt_reaches(struct mtr_stmt* stmt, const struct mtr_function_decl* fn, bool* visited);
+
+// whether evaluating expr can call fn, through the global functions it calls
+static bool expr_reaches(struct mtr_expr* expr, const struct mtr_function_decl* fn, bool* visited) {
+    switch (expr->type) {
+    case MTR_EXPR_PRIMARY:
+    case MTR_EXPR_LITERAL:
+        return false;
+    case MTR_EXPR_GROUPING:
+        return expr_reaches(((struct mtr_grouping*) expr)->expression, fn, visited);
+    case MTR_EXPR_UNARY:
+        return expr_reaches(((struct mtr_unary*) expr)->right, fn, visited);
+    case MTR_EXPR_CAST:
+        return expr_reaches(((struct mtr_cast*) expr)->right, fn, visited);
+    case MTR_EXPR_BINARY: {
+        struct mtr_binary* b = (struct mtr_binary*) expr;
+        return expr_reaches(b->left, fn, visited) || expr_reaches(b->right, fn, visited);
+    }
+    case MTR_EXPR_SUBSCRIPT:
+    case MTR_EXPR_ACCESS: {
+        struct mtr_access* a = (struct mtr_access*) expr;
+        return expr_reaches(a->object, fn, visited) || expr_reaches(a->element, fn, visited);
+    }
+    case MTR_EXPR_ARRAY_LITERAL: {
+        struct mtr_array_literal* a = (struct mtr_array_literal*) expr;
+        for (u8 i = 0; i < a->count; ++i) {
+            if (expr_reaches(a->expressions[i], fn, visited)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    case MTR_EXPR_MAP_LITERAL: {
+        struct mtr_map_literal* m = (struct mtr_map_literal*) expr;
+        for (u8 i = 0; i < m->count; ++i) {
+            if (expr_reaches(m->entries[i].key, fn, visited) || expr_reaches(m->entries[i].value, fn, visited)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    case MTR_EXPR_CALL: {
+        struct mtr_call* call = (struct mtr_call*) expr;
+        for (u8 i = 0; i < call->argc; ++i) {
+            if (expr_reaches(call->argv[i], fn, visited)) {
+                return true;
+            }
+        }
+        if (call->callable->type != MTR_EXPR_PRIMARY) {
+            return expr_reaches(call->callable, fn, visited);
+        }
+
+        const struct mtr_symbol* symbol = &((struct mtr_primary*) call->callable)->symbol;
+        if (!symbol->is_global || symbol->native || symbol->index >= globals->size || visited[symbol->index]) {
+            return false;
+        }
+        struct mtr_stmt* callee = globals->statements[symbol->index];
+        if ((const struct mtr_stmt*) fn == callee) {
+            return true;
+        }
+        visited[symbol->index] = true;
+        return callee->type == MTR_STMT_FN && stmt_reaches(((struct mtr_function_decl*) callee)->body, fn, visited);
+    }
+    }
+    return true;
+}
+
+static bool stmt_reaches(struct mtr_stmt* stmt, const struct mtr_function_decl* fn, bool* visited) {
+    switch (stmt->type) {
+    case MTR_STMT_BLOCK:
+    case MTR_STMT_SCOPE: {
+        struct mtr_block* block = (struct mtr_block*) stmt;
+        for (size_t i = 0; i < block->size; ++i) {
+            if (stmt_reaches(block->statements[i], fn, visited)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    case MTR_STMT_VAR: {
+        struct mtr_variable* var = (struct mtr_variable*) stmt;
+        return NULL != var->value && expr_reaches(var->value, fn, visited);
+    }
+    case MTR_STMT_IF: {
+        struct mtr_if* i = (struct mtr_if*) stmt;
+        return expr_reaches(i->condition, fn, visited) || stmt_reaches(i->then, fn, visited)
+            || (NULL != i->otherwise && stmt_reaches(i->otherwise, fn, visited));
+    }
+    case MTR_STMT_WHILE: {
+        struct mtr_while* w = (struct mtr_while*) stmt;
+        return expr_reaches(w->condition, fn, visited) || stmt_reaches(w->body, fn, visited);
+    }
+    case MTR_STMT_ASSIGNMENT: {
+        struct mtr_assignment* a = (struct mtr_assignment*) stmt;
+        return expr_reaches(a->right, fn, visited) || expr_reaches(a->expression, fn, visited);
+    }
+    case MTR_STMT_RETURN: {
+        struct mtr_return* r = (struct mtr_return*) stmt;
+        return NULL != r->expr && expr_reaches(r->expr, fn, visited);
+    }
+    case MTR_STMT_CALL:
+        return expr_reaches(((struct mtr_call_stmt*) stmt)->call, fn, visited);
+    case MTR_STMT_CLOSURE:
+        return stmt_reaches(((struct mtr_closure_decl*) stmt)->function->body, fn, visited);
+    case MTR_STMT_UNION:
+    case MTR_STMT_STRUCT:
+    case MTR_STMT_NATIVE_FN:
+    case MTR_STMT_FN:
+        return false;
+    }
+    return true;
+}
+
+static bool is_recursive(const struct mtr_function_decl* fn) {
+    bool* visited = calloc(globals->size, sizeof(bool));
+    const bool recursive = stmt_reaches(fn->body, fn, visited);
+    free(visited);
+    return recursive;
+}
+
+// The function a call goes to when it can be inlined there: a global function that is small
+// enough and can't call itself.
+static const struct mtr_function_decl* inline_target(struct mtr_call* call) {
+    if (NULL == globals || call->callable->type != MTR_EXPR_PRIMARY) {
+        return NULL;
+    }
+
+    const struct mtr_symbol* symbol = &((struct mtr_primary*) call->callable)->symbol;
+    if (!symbol->is_global || symbol->native || symbol->index >= globals->size) {
+        return NULL;
+    }
+
+    // the validator resolved the call to this declaration, overloads included
+    struct mtr_stmt* stmt = globals->statements[symbol->index];
+    if (stmt->type != MTR_STMT_FN) {
+        return NULL;
+    }
+
+    const struct mtr_function_decl* fn = (const struct mtr_function_decl*) stmt;
+    if (inlinable[symbol->index] == INLINE_UNKNOWN) {
+        struct mtr_expr* body = returned_expression(fn);
+        const bool small = NULL != body && expression_size(body) <= MAX_INLINE_SIZE;
+        inlinable[symbol->index] = small && !is_recursive(fn) ? INLINE_YES : INLINE_NO;
+    }
+
+    u32 depth = 0;
+    for (const struct inlining* i = inlined; NULL != i; i = i->enclosing) {
+        depth++;
+    }
+    return inlinable[symbol->index] == INLINE_YES && depth < MAX_INLINE_DEPTH ? fn : NULL;
+}
+
+#ifdef MTR_REPORT_INLINING
+static const char* source_code = NULL;
+
+static void report_inlined(struct mtr_call* call, const struct mtr_function_decl* fn) {
+    char message[256];
+    const struct mtr_token caller = compiling->symbol.token;
+    snprintf(message, sizeof(message), "Inlined '%.*s' into '%.*s'.",
+        (int) fn->symbol.token.length, fn->symbol.token.start, (int) caller.length, caller.start);
+    mtr_report_message(((struct mtr_primary*) call->callable)->symbol.token, message, source_code);
+}
+#endif
+
+static bool write_inlined(struct mtr_chunk* chunk, struct mtr_call* call) {
+    const struct mtr_function_decl* fn = inline_target(call);
+    if (NULL == fn) {
+        return false;
+    }
+
+    const struct mtr_function_type* f = (const struct mtr_function_type*) fn->symbol.type;
+    struct inlining frame;
+    frame.fn = fn;
+    frame.enclosing = inlined;
+
+    u16 evaluated = 0;
+    u16 first = 0;
+    for (u8 i = 0; i < call->argc; ++i) {
+        struct mtr_expr* arg = call->argv[i];
+        if (is_substitutable(arg) && !needs_box(arg, f->argv[i])) {
+            frame.args[i] = arg;
+            continue;
+        }
+
+        write_converted(chunk, arg, f->argv[i]);
+        frame.args[i] = NULL;
+        frame.slots[i] = (u16) (layout->count - 1);
+        first = evaluated++ == 0 ? frame.slots[i] : first;
+    }
+
+    inlined = &frame;
+    write_converted(chunk, returned_expression(fn), mtr_get_underlying_type(fn->symbol.type));
+    inlined = frame.enclosing;
+
+    // the result takes the place of the arguments
+    if (evaluated > 0) {
+        mtr_write_chunk(chunk, MTR_OP_SET);
+        mtr_write_u16(chunk, first);
+    }
+    if (evaluated > 1) {
+        mtr_write_chunk(chunk, MTR_OP_POP_V);
+        mtr_write_u16(chunk, evaluated - 1);
+    }
+
+#ifdef MTR_REPORT_INLINING
+    report_inlined(call, fn);
+#endif
+    return true;
+}
+
+// The members are on the stack, the types let untagged values be collected (runtime/memory.h)
+static void write_constructor(struct mtr_chunk* chunk, const struct mtr_struct_decl* s) {
+    mtr_write_chunk(chunk, MTR_OP_CONSTRUCTOR);
+    mtr_write_chunk(chunk, s->argc);
+    for (u8 i = 0; i < s->argc; ++i) {
+        mtr_write_chunk(chunk, (u8) kind_of_type(s->members[i]->symbol.type));
+    }
+    add_allocation_map(chunk);
+}
+
+// A struct constructor writes the members into the caller and makes the struct there, where the
+// escape analysis can see what happens to it (optimizer/ssa.h). The members are written like the
+// constructor does, with the locals they read at the slots the members take in the caller.
+static bool write_constructed(struct mtr_chunk* chunk, struct mtr_call* call) {
+    if (NULL == globals || call->argc > 0 || call->callable->type != MTR_EXPR_PRIMARY) {
+        return false;
+    }
+
+    const struct mtr_symbol* symbol = &((struct mtr_primary*) call->callable)->symbol;
+    if (!symbol->is_global || symbol->native || symbol->index >= globals->size || globals->statements[symbol->index]->type != MTR_STMT_STRUCT) {
+        return false;
+    }
+
+    // a struct that holds one of its own is constructed by calls past this depth
+    u32 depth = 0;
+    for (const struct inlining* i = inlined; NULL != i; i = i->enclosing) {
+        depth++;
+    }
+    if (depth >= MAX_INLINE_DEPTH) {
+        return false;
+    }
+
+    const struct mtr_struct_decl* s = (const struct mtr_struct_decl*) globals->statements[symbol->index];
+    struct inlining frame;
+    frame.fn = NULL;
+    frame.enclosing = inlined;
+    for (u8 i = 0; i < s->argc; ++i) {
+        frame.args[i] = NULL;
+        frame.slots[i] = (u16) (layout->count + i);
+    }
+
+    inlined = &frame;
+    for (u8 i = 0; i < s->argc; ++i) {
+        write(chunk, (struct mtr_stmt*) s->members[i]);
+    }
+    inlined = frame.enclosing;
+
+    write_constructor(chunk, s);
+    return true;
+}
+
+// With tail set the call ends the function and runs in the caller's frame, natives excepted.
+// Return whether it was written as a tail call.
+static bool write_call(struct mtr_chunk* chunk, struct mtr_call* call, bool tail) {
+    if (write_inlined(chunk, call) || write_constructed(chunk, call)) {
+        return false;
+    }
+
+    const struct mtr_function_type* f = (const struct mtr_function_type*) type_of(call->callable);
+    // natives can't see the static types so they get every argument as Any
+    const bool native = call->callable->type == MTR_EXPR_PRIMARY && ((struct mtr_primary*) call->callable)->symbol.native;
     for (u8 i = 0; i < call->argc; ++i) {
         struct mtr_expr* expr = call->argv[i];
-        write_expr(chunk, expr);
+        write_converted(chunk, expr, native ? &any_type : f->argv[i]);
+    }
+
+    // global names are functions, struct constructors or natives and never change,
+    // they are called straight out of the globals table. Everything else is quickened by the engine.
+    if (call->callable->type == MTR_EXPR_PRIMARY && ((struct mtr_primary*) call->callable)->symbol.is_global) {
+        tail = tail && !native;
+        mtr_write_chunk(chunk, native ? MTR_OP_CALL_GLOBAL_NATIVE : tail ? MTR_OP_TAIL_CALL_GLOBAL : MTR_OP_CALL_GLOBAL);
+        mtr_write_u16(chunk, (u16) ((struct mtr_primary*) call->callable)->symbol.index);
+        mtr_write_chunk(chunk, call->argc);
+        mtr_add_stack_map(chunk, (u32) chunk->size, layout->types, layout->count);
+        return tail;
     }
 
     write_expr(chunk, call->callable);
-    mtr_write_chunk(chunk, MTR_OP_CALL);
+    mtr_write_chunk(chunk, tail ? MTR_OP_TAIL_CALL : MTR_OP_CALL);
     mtr_write_chunk(chunk, call->argc);
+
+    // the callable is popped before the callee runs
+    mtr_add_stack_map(chunk, (u32) chunk->size, layout->types, layout->count - 1);
+    return tail;
 }
 
 static void write_cast(struct mtr_chunk* chunk, struct mtr_cast* cast) {
@@ -312,37 +971,52 @@ static void write_cast(struct mtr_chunk* chunk, struct mtr_cast* cast) {
     }
 }
 
+// Arrays and maps get their own INDEX_GET and INDEX_SET, anything else is left for the engine to quicken
+static u8 index_op(struct mtr_expr* object, u8 array_op, u8 map_op, u8 generic_op) {
+    const struct mtr_type* type = type_of(object);
+    if (object->type == MTR_EXPR_ARRAY_LITERAL || (type && type->type == MTR_DATA_ARRAY)) {
+        return array_op;
+    } else if (object->type == MTR_EXPR_MAP_LITERAL || (type && type->type == MTR_DATA_MAP)) {
+        return map_op;
+    }
+    return generic_op;
+}
+
 static void write_subscript(struct mtr_chunk* chunk, struct mtr_access* expr) {
     write_expr(chunk, expr->object);
     write_expr(chunk, expr->element);
-    mtr_write_chunk(chunk, MTR_OP_INDEX_GET);
+    mtr_write_chunk(chunk, index_op(expr->object, MTR_OP_INDEX_GET_ARRAY, MTR_OP_INDEX_GET_MAP, MTR_OP_INDEX_GET));
 }
 
 static void write_access(struct mtr_chunk* chunk, struct mtr_access* expr) {
     write_expr(chunk, expr->object);
     struct mtr_primary* p = (struct mtr_primary*) expr->element;
     mtr_write_chunk(chunk, MTR_OP_STRUCT_GET);
-    write_u16(chunk, p->symbol.index);
+    mtr_write_u16(chunk, p->symbol.index);
 }
 
 static void write_expr(struct mtr_chunk* chunk, struct mtr_expr* expr) {
+    const u32 base = layout->count;
+
     switch (expr->type)
     {
-    case MTR_EXPR_BINARY:  write_binary(chunk, (struct mtr_binary*) expr); return;
-    case MTR_EXPR_PRIMARY: write_primary(chunk, (struct mtr_primary*) expr); return;
-    case MTR_EXPR_LITERAL: write_literal(chunk, (struct mtr_literal*) expr); return;
-    case MTR_EXPR_ARRAY_LITERAL: write_array_literal(chunk, (struct mtr_array_literal*) expr); return;
-    case MTR_EXPR_MAP_LITERAL: write_map_literal(chunk, (struct mtr_map_literal*) expr); return;
-    case MTR_EXPR_UNARY:   write_unary(chunk, (struct mtr_unary*) expr); return;
-    case MTR_EXPR_GROUPING: write_expr(chunk, ((struct mtr_grouping*) expr)->expression); return;
-    case MTR_EXPR_CALL: write_call(chunk, (struct mtr_call*) expr); return;
-    case MTR_EXPR_CAST: write_cast(chunk, (struct mtr_cast*) expr); return;
-    case MTR_EXPR_ACCESS: write_access(chunk, (struct mtr_access*) expr); return;
-    case MTR_EXPR_SUBSCRIPT: write_subscript(chunk, (struct mtr_access*) expr); return;
+    case MTR_EXPR_BINARY:  write_binary(chunk, (struct mtr_binary*) expr); break;
+    case MTR_EXPR_PRIMARY: write_primary(chunk, (struct mtr_primary*) expr); break;
+    case MTR_EXPR_LITERAL: write_literal(chunk, (struct mtr_literal*) expr); break;
+    case MTR_EXPR_ARRAY_LITERAL: write_array_literal(chunk, (struct mtr_array_literal*) expr, array_layout_of((struct mtr_array_literal*) expr), NULL); break;
+    case MTR_EXPR_MAP_LITERAL: write_map_literal(chunk, (struct mtr_map_literal*) expr); break;
+    case MTR_EXPR_UNARY:   write_unary(chunk, (struct mtr_unary*) expr); break;
+    case MTR_EXPR_GROUPING: write_expr(chunk, ((struct mtr_grouping*) expr)->expression); break;
+    case MTR_EXPR_CALL: write_call(chunk, (struct mtr_call*) expr, false); break;
+    case MTR_EXPR_CAST: write_cast(chunk, (struct mtr_cast*) expr); break;
+    case MTR_EXPR_ACCESS: write_access(chunk, (struct mtr_access*) expr); break;
+    case MTR_EXPR_SUBSCRIPT: write_subscript(chunk, (struct mtr_access*) expr); break;
     }
-}
 
-static void write(struct mtr_chunk* chunk, struct mtr_stmt* stmt);
+    // whatever the operands were, they are a single value now
+    layout->count = base;
+    push_slot(kind_of(expr));
+}
 
 static void write_variable(struct mtr_chunk* chunk, struct mtr_variable* var) {
     u8 nil_op;
@@ -376,8 +1050,19 @@ static void write_variable(struct mtr_chunk* chunk, struct mtr_variable* var) {
 
     if (NULL == var->value) {
         mtr_write_chunk(chunk, nil_op);
+        if (nil_op == MTR_OP_EMPTY_ARRAY) {
+            const struct mtr_array_type* a = (const struct mtr_array_type*) var->symbol.type;
+            mtr_write_chunk(chunk, (u8) array_layout_of_type(a->element));
+        } else if (nil_op == MTR_OP_EMPTY_MAP) {
+            const struct mtr_map_type* m = (const struct mtr_map_type*) var->symbol.type;
+            mtr_write_chunk(chunk, (u8) kind_of_type(m->key));
+            mtr_write_chunk(chunk, (u8) kind_of_type(m->value));
+        }
+        if (nil_op != MTR_OP_NIL) {
+            add_allocation_map(chunk);
+        }
     } else {
-        write_expr(chunk, var->value);
+        write_converted(chunk, var->value, var->symbol.type);
     }
 }
 
@@ -388,12 +1073,41 @@ static void write_block(struct mtr_chunk* chunk, struct mtr_block* stmt) {
     }
 
     mtr_write_chunk(chunk, MTR_OP_POP_V);
-    write_u16(chunk, stmt->var_count);
+    mtr_write_u16(chunk, stmt->var_count);
+}
+
+// Int comparisons are fused with the conditional jump that follows them.
+// Writes whatever the jump needs on the stack and returns the jump op code to use.
+static u8 write_condition(struct mtr_chunk* chunk, struct mtr_expr* condition) {
+    if (condition->type == MTR_EXPR_BINARY) {
+        struct mtr_binary* b = (struct mtr_binary*) condition;
+        u8 op = MTR_OP_JMP_Z;
+        switch (b->operator.token.type) {
+        case MTR_TOKEN_LESS:          op = MTR_OP_LESS_I_JMP_Z; break;
+        case MTR_TOKEN_GREATER:       op = MTR_OP_GREATER_I_JMP_Z; break;
+        case MTR_TOKEN_EQUAL:         op = MTR_OP_EQUAL_I_JMP_Z; break;
+        case MTR_TOKEN_LESS_EQUAL:    op = MTR_OP_LESS_EQUAL_I_JMP_Z; break;
+        case MTR_TOKEN_GREATER_EQUAL: op = MTR_OP_GREATER_EQUAL_I_JMP_Z; break;
+        case MTR_TOKEN_BANG_EQUAL:    op = MTR_OP_NOT_EQUAL_I_JMP_Z; break;
+        default:
+            break;
+        }
+
+        if (op != MTR_OP_JMP_Z && b->operator.type->type == MTR_DATA_INT) {
+            write_operands(chunk, b);
+            return op;
+        }
+    }
+
+    write_expr(chunk, condition);
+    return MTR_OP_JMP_Z;
 }
 
 static void write_if(struct mtr_chunk* chunk, struct mtr_if* stmt) {
-    write_expr(chunk, stmt->condition);
-    u16 offset = write_jump(chunk, MTR_OP_JMP_Z);
+    const u32 base = layout->count;
+    u8 jump = write_condition(chunk, stmt->condition);
+    u16 offset = write_jump(chunk, jump);
+    layout->count = base;
 
     write(chunk, stmt->then);
 
@@ -408,33 +1122,84 @@ static void write_if(struct mtr_chunk* chunk, struct mtr_if* stmt) {
 }
 
 static void write_while(struct mtr_chunk* chunk, struct mtr_while* stmt) {
-    write_expr(chunk, stmt->condition);
-    u16 offset = write_jump(chunk, MTR_OP_JMP_Z);
+    const u32 base = layout->count;
+    u8 jump = write_condition(chunk, stmt->condition);
+    u16 offset = write_jump(chunk, jump);
+    layout->count = base;
 
     write(chunk, stmt->body);
 
-    write_expr(chunk, stmt->condition); // we need to write the condition again because it was popped
+    write_condition(chunk, stmt->condition); // we need to write the condition again because it was popped
     write_loop(chunk, offset);
 
     patch_jump(chunk, offset);
 }
 
+// local := local +- local and local := local +- constant get their own op codes
+static bool write_local_arithmetic(struct mtr_chunk* chunk, struct mtr_assignment* stmt) {
+    if (!is_local(stmt->right) || stmt->expression->type != MTR_EXPR_BINARY) {
+        return false;
+    }
+
+    struct mtr_binary* b = (struct mtr_binary*) stmt->expression;
+    enum mtr_token_type op = b->operator.token.type;
+    if ((op != MTR_TOKEN_PLUS && op != MTR_TOKEN_MINUS) || b->operator.type->type != MTR_DATA_INT) {
+        return false;
+    }
+
+    u16 dst = local_index(stmt->right);
+
+    if (is_local(b->left) && is_local(b->right)) {
+        mtr_write_chunk(chunk, op == MTR_TOKEN_PLUS ? MTR_OP_LOCAL_ADD_I : MTR_OP_LOCAL_SUB_I);
+        mtr_write_u16(chunk, dst);
+        mtr_write_u16(chunk, local_index(b->left));
+        mtr_write_u16(chunk, local_index(b->right));
+        return true;
+    }
+
+    struct mtr_expr* constant = NULL;
+    if (is_local(b->left) && local_index(b->left) == dst && is_int_literal(b->right)) {
+        constant = b->right;
+    } else if (op == MTR_TOKEN_PLUS && is_local(b->right) && local_index(b->right) == dst && is_int_literal(b->left)) {
+        constant = b->left;
+    }
+
+    if (NULL == constant) {
+        return false;
+    }
+
+    i64 value = mtr_token_to_int(((struct mtr_literal*) constant)->literal);
+    value = op == MTR_TOKEN_PLUS ? value : -value;
+    if (value < INT16_MIN || value > INT16_MAX) {
+        return false;
+    }
+
+    mtr_write_chunk(chunk, MTR_OP_LOCAL_INC_I);
+    mtr_write_u16(chunk, dst);
+    mtr_write_u16(chunk, (u16) (i16) value);
+    return true;
+}
+
 static void write_assignment(struct mtr_chunk* chunk, struct mtr_assignment* stmt) {
-    write_expr(chunk, stmt->expression);
+    if (write_local_arithmetic(chunk, stmt)) {
+        return;
+    }
+
+    write_converted(chunk, stmt->expression, type_of(stmt->right));
 
     switch (stmt->right->type) {
     case MTR_EXPR_PRIMARY: {
         struct mtr_primary* p = (struct mtr_primary*) stmt->right;
         u8 op = p->symbol.upvalue ? MTR_OP_UPVALUE_SET : MTR_OP_SET;
         mtr_write_chunk(chunk, op);
-        write_u16(chunk, p->symbol.index);
+        mtr_write_u16(chunk, p->symbol.index);
         return;
     }
     case MTR_EXPR_SUBSCRIPT: {
         struct mtr_access* s = (struct mtr_access*) stmt->right;
         write_expr(chunk, s->object);
         write_expr(chunk, s->element);
-        mtr_write_chunk(chunk, MTR_OP_INDEX_SET);
+        mtr_write_chunk(chunk, index_op(s->object, MTR_OP_INDEX_SET_ARRAY, MTR_OP_INDEX_SET_MAP, MTR_OP_INDEX_SET));
         return;
     }
     case MTR_EXPR_ACCESS: {
@@ -442,7 +1207,7 @@ static void write_assignment(struct mtr_chunk* chunk, struct mtr_assignment* stm
         write_expr(chunk, s->object);
         struct mtr_primary* p = (struct mtr_primary*) s->element;
         mtr_write_chunk(chunk, MTR_OP_STRUCT_SET);
-        write_u16(chunk, p->symbol.index);
+        mtr_write_u16(chunk, p->symbol.index);
         return;
     }
 
@@ -452,9 +1217,21 @@ static void write_assignment(struct mtr_chunk* chunk, struct mtr_assignment* stm
     MTR_ASSERT(false, "Invalid expr type.");
 }
 
+static struct mtr_expr* ungroup(struct mtr_expr* expr) {
+    while (expr->type == MTR_EXPR_GROUPING) {
+        expr = ((struct mtr_grouping*) expr)->expression;
+    }
+    return expr;
+}
+
 static void write_return(struct mtr_chunk* chunk, struct mtr_return* stmt) {
-    if (stmt->expr) {
-        write_expr(chunk, stmt->expr);
+    // a call whose result is returned as it is doesn't need a frame of its own
+    if (stmt->expr && ungroup(stmt->expr)->type == MTR_EXPR_CALL && !needs_box(stmt->expr, layout->return_type)) {
+        if (write_call(chunk, (struct mtr_call*) ungroup(stmt->expr), true)) {
+            return;
+        }
+    } else if (stmt->expr) {
+        write_converted(chunk, stmt->expr, layout->return_type);
     } else {
         mtr_write_chunk(chunk, MTR_OP_NIL);
     }
@@ -467,71 +1244,139 @@ static void write_call_stmt(struct mtr_chunk* chunk, struct mtr_call_stmt* call)
     mtr_write_chunk(chunk, MTR_OP_POP);
 }
 
+static bool ends_with_return(struct mtr_stmt* body) {
+    if (body->type == MTR_STMT_BLOCK || body->type == MTR_STMT_SCOPE) {
+        struct mtr_block* block = (struct mtr_block*) body;
+        return block->size > 0 && block->statements[block->size - 1]->type == MTR_STMT_RETURN;
+    }
+    return body->type == MTR_STMT_RETURN;
+}
+
 static void write_function(struct mtr_chunk* chunk, struct mtr_function_decl* fn) {
+    struct frame_layout* enclosing = layout;
+    struct frame_layout frame = { NULL, 0, 0, mtr_get_underlying_type(fn->symbol.type) };
+    layout = &frame;
+    const struct mtr_function_decl* enclosing_fn = compiling;
+    compiling = fn;
+    chunk->arity = fn->argc;
+    for (u8 i = 0; i < fn->argc; ++i) {
+        push_slot(kind_of_type(fn->argv[i].symbol.type));
+    }
+
     write(chunk, fn->body);
+
+    // the engine does not bounds check ip, every chunk has to end in a return
+    if (!ends_with_return(fn->body)) {
+        mtr_write_chunk(chunk, MTR_OP_NIL);
+        mtr_write_chunk(chunk, MTR_OP_RETURN);
+    }
+
+    free(frame.types);
+    layout = enclosing;
+    compiling = enclosing_fn;
+
+#ifdef MTR_DUMP_SSA
+    MTR_LOG("%.*s:", (int) fn->symbol.token.length, fn->symbol.token.start);
+#endif
+    mtr_optimize_ssa(chunk);
+    mtr_optimize_chunk(chunk);
+    mtr_find_max_depth(chunk);
 }
 
 static void write_closure(struct mtr_chunk* chunk, struct mtr_closure_decl* c) {
     struct mtr_chunk closure_chunk = mtr_new_chunk();
     write_function(&closure_chunk, c->function);
 
-    struct mtr_closure* closure = mtr_new_closure(closure_chunk, NULL, c->count);
+    struct mtr_function* body = mtr_new_function(closure_chunk);
 
     mtr_write_chunk(chunk, MTR_OP_CLOSURE);
-    write_u64(chunk, mtr_reinterpret_cast(u64, closure));
+    mtr_write_u16(chunk, mtr_add_constant(chunk, MTR_OBJ(body), MTR_VAL_OBJ));
+    mtr_write_chunk(chunk, (u8) c->count);
 
     for (u16 i = 0; i < c->count; ++i) {
         struct mtr_upvalue_symbol s = c->upvalues[i];
-        write_u16(chunk, (u16)s.index);
+        mtr_write_u16(chunk, (u16)s.index);
         mtr_write_chunk(chunk, s.local);
     }
+    for (u16 i = 0; i < c->count; ++i) {
+        mtr_write_chunk(chunk, (u8) kind_of_type(c->upvalues[i].type));
+    }
+    add_allocation_map(chunk);
 }
 
 static void write(struct mtr_chunk* chunk, struct mtr_stmt* stmt) {
+    const u32 base = layout->count;
+
     switch (stmt->type)
     {
-    case MTR_STMT_VAR:   write_variable(chunk, (struct mtr_variable*) stmt); return;
+    case MTR_STMT_VAR:   write_variable(chunk, (struct mtr_variable*) stmt); break;
 
-    case MTR_STMT_IF:    write_if(chunk, (struct mtr_if*) stmt); return;
-    case MTR_STMT_WHILE: write_while(chunk, (struct mtr_while*) stmt); return;
+    case MTR_STMT_IF:    write_if(chunk, (struct mtr_if*) stmt); break;
+    case MTR_STMT_WHILE: write_while(chunk, (struct mtr_while*) stmt); break;
 
     // scopes are just for validation purposes
     case MTR_STMT_SCOPE:
     case MTR_STMT_BLOCK:
-        write_block(chunk, (struct mtr_block*) stmt); return;
+        write_block(chunk, (struct mtr_block*) stmt); break;
 
-    case MTR_STMT_ASSIGNMENT: write_assignment(chunk, (struct mtr_assignment*) stmt); return;
-    case MTR_STMT_RETURN: write_return(chunk, (struct mtr_return*) stmt); return;
-    case MTR_STMT_CALL: write_call_stmt(chunk, (struct mtr_call_stmt*) stmt); return;
-    case MTR_STMT_CLOSURE: write_closure(chunk, (struct mtr_closure_decl*) stmt); return;
+    case MTR_STMT_ASSIGNMENT: write_assignment(chunk, (struct mtr_assignment*) stmt); break;
+    case MTR_STMT_RETURN: write_return(chunk, (struct mtr_return*) stmt); break;
+    case MTR_STMT_CALL: write_call_stmt(chunk, (struct mtr_call_stmt*) stmt); break;
+    case MTR_STMT_CLOSURE: write_closure(chunk, (struct mtr_closure_decl*) stmt); break;
 
     case MTR_STMT_UNION:
     case MTR_STMT_STRUCT:
     case MTR_STMT_NATIVE_FN:
     case MTR_STMT_FN:
-        return;
+        break;
+
+    }
 
+    // only declarations outlive their statement
+    layout->count = base;
+    if (stmt->type == MTR_STMT_VAR) {
+        push_slot(kind_of_type(((struct mtr_variable*) stmt)->symbol.type));
+    } else if (stmt->type == MTR_STMT_CLOSURE) {
+        push_slot(MTR_VAL_OBJ);
     }
 }
 
+#ifndef MTR_REGISTER_VM
 static void write_struct(struct mtr_chunk* chunk, struct mtr_struct_decl* s) {
+    struct frame_layout frame = { NULL, 0, 0, NULL };
+    layout = &frame;
     for (u8 i = 0; i < s->argc; ++i) {
         struct mtr_variable* v = s->members[i];
-        write_variable(chunk, v);
+        write(chunk, (struct mtr_stmt*) v);
     }
-    mtr_write_chunk(chunk, MTR_OP_CONSTRUCTOR);
-    mtr_write_chunk(chunk, s->argc);
+    write_constructor(chunk, s);
     mtr_write_chunk(chunk, MTR_OP_RETURN);
+
+    free(frame.types);
+    layout = NULL;
+
+    mtr_optimize_chunk(chunk);
+    mtr_find_max_depth(chunk);
 }
+#endif
+
+#ifdef MTR_REGISTER_VM
+    #define WRITE_FUNCTION(chunk, fn) mtr_write_register_function(chunk, fn)
+    #define WRITE_STRUCT(chunk, s) mtr_write_register_struct(chunk, s)
+#else
+    #define WRITE_FUNCTION(chunk, fn) (write_function(chunk, fn), true)
+    #define WRITE_STRUCT(chunk, s) (write_struct(chunk, s), true)
+#endif
 
 // as every function has its own chunk we could probably paralellize this pretty easily
-static void write_bytecode(struct mtr_stmt* stmt, struct mtr_package* package) {
+static bool write_bytecode(struct mtr_stmt* stmt, struct mtr_package* package) {
+    bool ok = true;
     switch (stmt->type)
     {
     case MTR_STMT_FN: {
         struct mtr_function_decl* fn = (struct mtr_function_decl*) stmt;
         struct mtr_chunk chunk = mtr_new_chunk();
-        write_function(&chunk, fn);
+        ok = WRITE_FUNCTION(&chunk, fn);
         struct mtr_function* f = mtr_new_function(chunk);
         mtr_package_insert_function(package, (struct mtr_object*) f, fn->symbol);
         break;
@@ -539,7 +1384,7 @@ static void write_bytecode(struct mtr_stmt* stmt, struct mtr_package* package) {
     case MTR_STMT_STRUCT: {
         struct mtr_struct_decl* sd = (struct mtr_struct_decl*) stmt;
         struct mtr_chunk chunk = mtr_new_chunk();
-        write_struct(&chunk, sd);
+        ok = WRITE_STRUCT(&chunk, sd);
         struct mtr_function* constructor = mtr_new_function(chunk);
         mtr_package_insert_function(package, (struct mtr_object*) constructor, sd->symbol);
         break;
@@ -547,8 +1392,12 @@ static void write_bytecode(struct mtr_stmt* stmt, struct mtr_package* package) {
     default:
         break;
     }
+    return ok;
 }
 
+#undef WRITE_STRUCT
+#undef WRITE_FUNCTION
+
 enum mtr_exit_code mtr_compile(const char* source, struct mtr_package* package) {
     enum mtr_exit_code ec = MTR_OK;
 
@@ -572,9 +1421,21 @@ enum mtr_exit_code mtr_compile(const char* source, struct mtr_package* package)
     mtr_load_package(package, &ast);
 
     struct mtr_block* block = (struct mtr_block*) ast.head;
+    globals = block;
+    inlinable = calloc(block->size, sizeof(u8));
+#ifdef MTR_REPORT_INLINING
+    source_code = source;
+#endif
     for (size_t i = 0; i < block->size; ++i) {
         struct mtr_stmt* s = block->statements[i];
-        write_bytecode(s, package);
+        all_ok = write_bytecode(s, package) && all_ok;
+    }
+    globals = NULL;
+    free(inlinable);
+    inlinable = NULL;
+
+    if (!all_ok) {
+        ec = MTR_COMPILER_ERROR;
     }
 
 ret:
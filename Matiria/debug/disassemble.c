@@ -4,9 +4,54 @@
 #include "core/log.h"
 #include "runtime/object.h"
 #include "runtime/value.h"
+#include "runtime/vector.h"
 
-u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
-    MTR_PRINT("%04d ", offset);
+static const char* value_type_to_str(u8 type) {
+    switch (type) {
+    case MTR_VAL_INT:   return "int";
+    case MTR_VAL_FLOAT: return "float";
+    case MTR_VAL_OBJ:   return "obj";
+    }
+    return "?";
+}
+
+static const char* layout_to_str(u8 layout) {
+    switch (layout) {
+    case MTR_ARRAY_VALUES: return "values";
+    case MTR_ARRAY_INTS:   return "int";
+    case MTR_ARRAY_FLOATS: return "float";
+    case MTR_ARRAY_BOOLS:  return "bool";
+    }
+    return "?";
+}
+
+static void disassemble_constant(const struct mtr_chunk* chunk, u16 index) {
+    mtr_value constant = chunk->constants[index];
+    if (chunk->constant_types[index] == MTR_VAL_INT) {
+        MTR_LOG("[%u] -> %li", index, MTR_AS_INT(constant));
+    } else if (chunk->constant_types[index] == MTR_VAL_FLOAT) {
+        MTR_LOG("[%u] -> %.2f", index, MTR_AS_FLOAT(constant));
+    } else {
+        MTR_LOG("[%u] -> %s", index, mtr_obj_type_to_str(MTR_AS_OBJ(constant)));
+    }
+}
+
+// finishes the line of a call with the slots that hold objects while it runs
+static void disassemble_stack_map(const struct mtr_chunk* chunk, const u8* next) {
+    const struct mtr_stack_map* map = mtr_find_stack_map(chunk, (u32) (next - chunk->bytecode));
+    if (NULL != map) {
+        MTR_PRINT(" objects:");
+        for (u32 i = 0; i < map->count; ++i) {
+            if (MTR_STACK_MAP_HAS_OBJECT(map, i)) {
+                MTR_PRINT(" %u", i);
+            }
+        }
+    }
+    MTR_PRINT("\n");
+}
+
+u8* mtr_disassemble_instruction(const struct mtr_chunk* chunk, u8* instruction) {
+    MTR_PRINT("%04d ", (u32) (instruction - chunk->bytecode));
 #define READ(type) *((type*)instruction); instruction += sizeof(type)
 
     switch (*instruction++)
@@ -14,15 +59,23 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
     case MTR_OP_RETURN:
         MTR_LOG("RETURN");
         break;
-    case MTR_OP_INT: {
-        i64 constant = READ(i64);
-        MTR_LOG("INT -> %li", constant);
+    case MTR_OP_CONSTANT: {
+        u8 index = READ(u8);
+        MTR_PRINT("CONST ");
+        disassemble_constant(chunk, index);
+        break;
+    }
+
+    case MTR_OP_CONSTANT_LONG: {
+        u16 index = READ(u16);
+        MTR_PRINT("CONST ");
+        disassemble_constant(chunk, index);
         break;
     }
 
-    case MTR_OP_FLOAT: {
-        f64 constant = READ(f64);
-        MTR_LOG("FLOAT -> %.2f", constant);
+    case MTR_OP_SMALL_INT: {
+        i16 value = READ(i16);
+        MTR_LOG("INT -> %i", value);
         break;
     }
 
@@ -37,34 +90,39 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
     }
 
     case MTR_OP_STRING_LITERAL: {
-        const char* s = READ(const char*);
-        u32 l = READ(u32);
-        MTR_LOG("STR %.*s", l, s);
+        u16 index = READ(u16);
+        const struct mtr_string* s = (const struct mtr_string*) MTR_AS_OBJ(chunk->constants[index]);
+        MTR_LOG("STR [%u] %.*s", index, (int) s->length, s->s);
         break;
     }
 
     case MTR_OP_ARRAY_LITERAL: {
         u8 count = READ(u8);
-        MTR_LOG("ARR (%u)", count);
+        u8 layout = READ(u8);
+        MTR_LOG("ARR (%u) %s", count, layout_to_str(layout));
         break;
     }
 
     case MTR_OP_MAP_LITERAL: {
         u8 count = READ(u8);
-        MTR_LOG("MAP (%u)", count);
+        u8 key = READ(u8);
+        u8 value = READ(u8);
+        MTR_LOG("MAP (%u) %s: %s", count, value_type_to_str(key), value_type_to_str(value));
         break;
     }
 
     case MTR_OP_CONSTRUCTOR: {
         u8 count = READ(u8);
+        instruction += count; // member types
         MTR_LOG("CON (%u)", count);
         break;
     }
 
     case MTR_OP_CLOSURE: {
-        void* p = READ(void*);
-        u16 count = READ(u16);
-        MTR_LOG("CLOSURE");
+        u16 index = READ(u16);
+        u8 count = READ(u8);
+        instruction += count * 4; // captures and upvalue types
+        MTR_LOG("CLOSURE [%u] (%u upvalues)", index, count);
         break;
     }
 
@@ -78,12 +136,41 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
     }
 
     case MTR_OP_EMPTY_ARRAY: {
-        MTR_LOG("aNEW");
+        u8 layout = READ(u8);
+        MTR_LOG("aNEW %s", layout_to_str(layout));
         break;
     }
 
     case MTR_OP_EMPTY_MAP: {
-        MTR_LOG("mNEW");
+        u8 key = READ(u8);
+        u8 value = READ(u8);
+        MTR_LOG("mNEW %s: %s", value_type_to_str(key), value_type_to_str(value));
+        break;
+    }
+
+    case MTR_OP_FRAME_ARRAY_LITERAL: {
+        u8 count = READ(u8);
+        u8 layout = READ(u8);
+        MTR_LOG("fARR (%u) %s", count, layout_to_str(layout));
+        break;
+    }
+
+    case MTR_OP_FRAME_CONSTRUCTOR: {
+        u8 count = READ(u8);
+        instruction += count;
+        MTR_LOG("fCON (%u)", count);
+        break;
+    }
+
+    case MTR_OP_FRAME_EMPTY_ARRAY: {
+        u8 layout = READ(u8);
+        MTR_LOG("faNEW %s", layout_to_str(layout));
+        break;
+    }
+
+    case MTR_OP_BOX: {
+        u8 type = READ(u8);
+        MTR_LOG("BOX %s", value_type_to_str(type));
         break;
     }
 
@@ -119,14 +206,32 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
     case MTR_OP_MUL_F: MTR_LOG("fMUL"); break;
     case MTR_OP_DIV_F: MTR_LOG("fDIV"); break;
 
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F: {
+        static const char* const operators[] = { "ADD", "SUB", "MUL", "DIV" };
+        u8 op = READ(u8);
+        u8 arrays = READ(u8);
+        MTR_LOG("%sa%s %s %s", *(instruction - 3) == MTR_OP_ELEMENTWISE_F ? "f" : "", operators[op & 3],
+            arrays & MTR_ELEMENTWISE_LEFT ? "[]" : "x", arrays & MTR_ELEMENTWISE_RIGHT ? "[]" : "x");
+        break;
+    }
+
     case MTR_OP_EQUAL_I: MTR_LOG("EQU"); break;
     case MTR_OP_LESS_I: MTR_LOG("LSS"); break;
     case MTR_OP_GREATER_I: MTR_LOG("GTR"); break;
 
+    case MTR_OP_LESS_EQUAL_I: MTR_LOG("LEQ"); break;
+    case MTR_OP_GREATER_EQUAL_I: MTR_LOG("GEQ"); break;
+    case MTR_OP_NOT_EQUAL_I: MTR_LOG("NEQ"); break;
+
     case MTR_OP_EQUAL_F: MTR_LOG("fEQU"); break;
     case MTR_OP_LESS_F: MTR_LOG("fLSS"); break;
     case MTR_OP_GREATER_F: MTR_LOG("fGTR"); break;
 
+    case MTR_OP_LESS_EQUAL_F: MTR_LOG("fLEQ"); break;
+    case MTR_OP_GREATER_EQUAL_F: MTR_LOG("fGEQ"); break;
+    case MTR_OP_NOT_EQUAL_F: MTR_LOG("fNEQ"); break;
+
     case MTR_OP_GET: {
         u16 index = READ(u16);
         MTR_LOG("GET at %u", index);
@@ -139,6 +244,36 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
         break;
     }
 
+    case MTR_OP_GET_GET: {
+        u16 a = READ(u16);
+        u16 b = READ(u16);
+        MTR_LOG("GET2 at %u %u", a, b);
+        break;
+    }
+
+    case MTR_OP_LOCAL_ADD_I:
+    case MTR_OP_LOCAL_SUB_I: {
+        const char* name = *(instruction - 1) == MTR_OP_LOCAL_ADD_I ? "lADD" : "lSUB";
+        u16 dst = READ(u16);
+        u16 a = READ(u16);
+        u16 b = READ(u16);
+        MTR_LOG("%s %u <- %u %u", name, dst, a, b);
+        break;
+    }
+
+    case MTR_OP_SET_GET: {
+        u16 index = READ(u16);
+        MTR_LOG("SETGET at %u", index);
+        break;
+    }
+
+    case MTR_OP_LOCAL_INC_I: {
+        u16 dst = READ(u16);
+        i16 value = READ(i16);
+        MTR_LOG("lINC %u by %i", dst, value);
+        break;
+    }
+
     case MTR_OP_UPVALUE_GET: {
         u16 index = READ(u16);
         MTR_LOG("uGET at %u", index);
@@ -167,6 +302,41 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
         break;
     }
 
+    case MTR_OP_INDEX_GET_ARRAY: {
+        MTR_LOG("aGET");
+        break;
+    }
+
+    case MTR_OP_INDEX_GET_MAP: {
+        MTR_LOG("mGET");
+        break;
+    }
+
+    case MTR_OP_INDEX_SET_ARRAY: {
+        MTR_LOG("aSET");
+        break;
+    }
+
+    case MTR_OP_INDEX_SET_MAP: {
+        MTR_LOG("mSET");
+        break;
+    }
+
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED: {
+        MTR_LOG("uaGET");
+        break;
+    }
+
+    case MTR_OP_INDEX_SET_ARRAY_UNCHECKED: {
+        MTR_LOG("uaSET");
+        break;
+    }
+
+    case MTR_OP_CHECK_BOUNDS: {
+        MTR_LOG("BOUNDS");
+        break;
+    }
+
     case MTR_OP_STRUCT_GET: {
         u16 index = READ(u16);
         MTR_LOG("sGET at %u", index);
@@ -191,6 +361,25 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
         break;
     }
 
+    case MTR_OP_JMP_NZ: {
+        i16 to = READ(i16);
+        MTR_LOG("NZJMP %i", to);
+        break;
+    }
+
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z: {
+        static const char* const names[] = { "LSS", "GTR", "EQU", "LEQ", "GEQ", "NEQ" };
+        const char* name = names[*(instruction - 1) - MTR_OP_LESS_I_JMP_Z];
+        i16 to = READ(i16);
+        MTR_LOG("%s ZJMP %i", name, to);
+        break;
+    }
+
     case MTR_OP_POP: {
         MTR_LOG("POP");
         break;
@@ -202,9 +391,29 @@ u8* mtr_disassemble_instruction(u8* instruction, u32 offset) {
         break;
     }
 
-    case MTR_OP_CALL: {
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE:
+    case MTR_OP_TAIL_CALL: {
+        static const char* const names[] = { "CALL", "fCALL", "cCALL", "nCALL" };
+        const char* name = instruction[-1] == MTR_OP_TAIL_CALL ? "tCALL" : names[instruction[-1] - MTR_OP_CALL];
+        u8 argc = READ(u8);
+        MTR_PRINT("%s (%u)", name, argc);
+        disassemble_stack_map(chunk, instruction);
+        break;
+    }
+
+    case MTR_OP_CALL_GLOBAL:
+    case MTR_OP_CALL_GLOBAL_NATIVE:
+    case MTR_OP_TAIL_CALL_GLOBAL: {
+        const char* name = instruction[-1] == MTR_OP_CALL_GLOBAL ? "gCALL"
+            : instruction[-1] == MTR_OP_CALL_GLOBAL_NATIVE ? "gnCALL"
+            : "gtCALL";
+        u16 index = READ(u16);
         u8 argc = READ(u8);
-        MTR_LOG("CALL (%u)", argc);
+        MTR_PRINT("%s [%u] (%u)", name, index, argc);
+        disassemble_stack_map(chunk, instruction);
         break;
     }
 
@@ -223,7 +432,7 @@ void mtr_disassemble(struct mtr_chunk chunk, const char* name) {
     MTR_LOG("====== %s =======", name);
     u8* instruction = chunk.bytecode;
     while (instruction != chunk.bytecode + chunk.size) {
-        instruction = mtr_disassemble_instruction(instruction, instruction - chunk.bytecode);
+        instruction = mtr_disassemble_instruction(&chunk, instruction);
     }
     MTR_LOG("\n");
 }
@@ -231,11 +440,18 @@ void mtr_disassemble(struct mtr_chunk chunk, const char* name) {
 void mtr_dump_stack(mtr_value* stack, mtr_value* top) {
     MTR_PRINT("[");
     while(stack < top) {
-        switch (stack->type) {
-        case MTR_VAL_INT: MTR_PRINT("%li,", stack->integer); break;
-        case MTR_VAL_FLOAT: MTR_PRINT("%f,", stack->floating); break;
-        case MTR_VAL_OBJ: MTR_PRINT("%s,", mtr_obj_type_to_str(stack->object)); break;
+#ifdef MTR_UNTAGGED_VALUES
+        // the stack maps of the frames say which words are objects
+        MTR_PRINT("%016lx,", MTR_BITS(*stack));
+#else
+        if (MTR_IS_INT(*stack)) {
+            MTR_PRINT("%li,", MTR_AS_INT(*stack));
+        } else if (MTR_IS_FLOAT(*stack)) {
+            MTR_PRINT("%f,", MTR_AS_FLOAT(*stack));
+        } else {
+            MTR_PRINT("%s,", mtr_obj_type_to_str(MTR_AS_OBJ(*stack)));
         }
+#endif
         stack++;
     }
     MTR_LOG("]");
@@ -262,5 +478,6 @@ const char* mtr_obj_type_to_str(struct mtr_object* obj) {
     case MTR_OBJ_MAP:       return "<map>";
     case MTR_OBJ_STRING:    return "<string>";
     case MTR_OBJ_CLOSURE:   return "<closure>";
+    case MTR_OBJ_BOX:       return "<box>";
     }
 }
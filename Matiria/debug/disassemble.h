@@ -6,7 +6,7 @@
 #include "bytecode.h"
 
 void mtr_disassemble(struct mtr_chunk chunk, const char* name);
-u8* mtr_disassemble_instruction(u8* instruction, u32 offset);
+u8* mtr_disassemble_instruction(const struct mtr_chunk* chunk, u8* instruction);
 
 void mtr_dump_stack(mtr_value* stack, mtr_value* top);
 void mtr_dump_chunk(struct mtr_chunk* chunk);
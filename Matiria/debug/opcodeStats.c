@@ -0,0 +1,267 @@
+#include "opcodeStats.h"
+
+#include "bytecode.h"
+#include "registerBytecode.h"
+
+#include "core/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_CAPACITY 1024
+
+void mtr_init_opcode_stats(struct mtr_opcode_stats* stats) {
+    stats->executed = 0;
+    stats->window = 0;
+    stats->depth = 0;
+    stats->size = 0;
+    stats->capacity = INITIAL_CAPACITY;
+    stats->ngrams = calloc(INITIAL_CAPACITY, sizeof(struct mtr_ngram));
+}
+
+void mtr_delete_opcode_stats(struct mtr_opcode_stats* stats) {
+    free(stats->ngrams);
+    stats->ngrams = NULL;
+    stats->size = 0;
+    stats->capacity = 0;
+}
+
+static struct mtr_ngram* find_entry(struct mtr_ngram* ngrams, size_t capacity, u64 key) {
+    size_t index = (key * 0x9E3779B97F4A7C15ull >> 32) & (capacity - 1);
+    for (;;) {
+        struct mtr_ngram* entry = ngrams + index;
+        // a key is never 0, the length is at least 1
+        if (entry->key == key || entry->key == 0) {
+            return entry;
+        }
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void grow(struct mtr_opcode_stats* stats) {
+    size_t capacity = stats->capacity * 2;
+    struct mtr_ngram* ngrams = calloc(capacity, sizeof(struct mtr_ngram));
+    for (size_t i = 0; i < stats->capacity; ++i) {
+        struct mtr_ngram* old = stats->ngrams + i;
+        if (old->key != 0) {
+            *find_entry(ngrams, capacity, old->key) = *old;
+        }
+    }
+    free(stats->ngrams);
+    stats->ngrams = ngrams;
+    stats->capacity = capacity;
+}
+
+void mtr_record_opcode(struct mtr_opcode_stats* stats, u8 op) {
+    stats->executed++;
+    stats->window = (stats->window << 8) | op;
+    stats->depth += stats->depth < MTR_MAX_NGRAM;
+
+    for (u32 n = 1; n <= stats->depth; ++n) {
+        if (stats->size * 4 >= stats->capacity * 3) {
+            grow(stats);
+        }
+
+        u32 ops = n == 4 ? stats->window : stats->window & ((1u << (8 * n)) - 1);
+        u64 key = ((u64) n << 32) | ops;
+        struct mtr_ngram* entry = find_entry(stats->ngrams, stats->capacity, key);
+        if (entry->key == 0) {
+            entry->key = key;
+            stats->size++;
+        }
+        entry->count++;
+    }
+}
+
+static int compare_count(const void* l, const void* r) {
+    const struct mtr_ngram* a = l;
+    const struct mtr_ngram* b = r;
+    return (a->count < b->count) - (a->count > b->count);
+}
+
+void mtr_print_opcode_stats(const struct mtr_opcode_stats* stats, u32 top) {
+    MTR_LOG_INFO("Executed %llu instructions.", (unsigned long long) stats->executed);
+
+    struct mtr_ngram* sorted = malloc(sizeof(struct mtr_ngram) * (stats->size + 1));
+
+    for (u32 n = 1; n <= MTR_MAX_NGRAM; ++n) {
+        size_t count = 0;
+        for (size_t i = 0; i < stats->capacity; ++i) {
+            struct mtr_ngram e = stats->ngrams[i];
+            if (e.key >> 32 == n) {
+                sorted[count++] = e;
+            }
+        }
+
+        qsort(sorted, count, sizeof(struct mtr_ngram), compare_count);
+
+        MTR_LOG(MTR_BOLD_DARK(MTR_WHITE) "%u-grams:" MTR_RESET, n);
+        for (size_t i = 0; i < count && i < top; ++i) {
+            struct mtr_ngram e = sorted[i];
+            f64 share = stats->executed ? 100.0 * (f64) e.count / (f64) stats->executed : 0.0;
+            MTR_PRINT("  %12llu %6.2f%%  ", (unsigned long long) e.count, share);
+            for (i32 j = n - 1; j >= 0; --j) {
+                u8 op = (e.key >> (8 * j)) & 0xFF;
+                MTR_PRINT(" %s", mtr_op_code_to_str(op));
+            }
+            MTR_PRINT("\n");
+        }
+    }
+
+    free(sorted);
+}
+
+#ifdef MTR_REGISTER_VM
+
+static const char* const names[] = {
+    [MTR_REG_OP_ENTER] = "ENTER",
+    [MTR_REG_OP_MOVE] = "MOVE",
+    [MTR_REG_OP_CONSTANT] = "CONSTANT",
+    [MTR_REG_OP_SMALL_INT] = "SMALL_INT",
+    [MTR_REG_OP_FALSE] = "FALSE",
+    [MTR_REG_OP_TRUE] = "TRUE",
+    [MTR_REG_OP_NIL] = "NIL",
+    [MTR_REG_OP_STRING_LITERAL] = "STRING_LITERAL",
+    [MTR_REG_OP_ARRAY_LITERAL] = "ARRAY_LITERAL",
+    [MTR_REG_OP_MAP_LITERAL] = "MAP_LITERAL",
+    [MTR_REG_OP_CONSTRUCTOR] = "CONSTRUCTOR",
+    [MTR_REG_OP_CLOSURE] = "CLOSURE",
+    [MTR_REG_OP_EMPTY_ARRAY] = "EMPTY_ARRAY",
+    [MTR_REG_OP_EMPTY_MAP] = "EMPTY_MAP",
+    [MTR_REG_OP_NOT] = "NOT",
+    [MTR_REG_OP_NEGATE_I] = "NEGATE_I",
+    [MTR_REG_OP_NEGATE_F] = "NEGATE_F",
+    [MTR_REG_OP_ADD_I] = "ADD_I",
+    [MTR_REG_OP_SUB_I] = "SUB_I",
+    [MTR_REG_OP_MUL_I] = "MUL_I",
+    [MTR_REG_OP_DIV_I] = "DIV_I",
+    [MTR_REG_OP_ADD_F] = "ADD_F",
+    [MTR_REG_OP_SUB_F] = "SUB_F",
+    [MTR_REG_OP_MUL_F] = "MUL_F",
+    [MTR_REG_OP_DIV_F] = "DIV_F",
+    [MTR_REG_OP_ELEMENTWISE_I] = "ELEMENTWISE_I",
+    [MTR_REG_OP_ELEMENTWISE_F] = "ELEMENTWISE_F",
+    [MTR_REG_OP_LESS_I] = "LESS_I",
+    [MTR_REG_OP_GREATER_I] = "GREATER_I",
+    [MTR_REG_OP_EQUAL_I] = "EQUAL_I",
+    [MTR_REG_OP_LESS_F] = "LESS_F",
+    [MTR_REG_OP_GREATER_F] = "GREATER_F",
+    [MTR_REG_OP_EQUAL_F] = "EQUAL_F",
+    [MTR_REG_OP_GLOBAL_GET] = "GLOBAL_GET",
+    [MTR_REG_OP_UPVALUE_GET] = "UPVALUE_GET",
+    [MTR_REG_OP_UPVALUE_SET] = "UPVALUE_SET",
+    [MTR_REG_OP_INDEX_GET] = "INDEX_GET",
+    [MTR_REG_OP_INDEX_SET] = "INDEX_SET",
+    [MTR_REG_OP_STRUCT_GET] = "STRUCT_GET",
+    [MTR_REG_OP_STRUCT_SET] = "STRUCT_SET",
+    [MTR_REG_OP_JMP] = "JMP",
+    [MTR_REG_OP_JMP_Z] = "JMP_Z",
+    [MTR_REG_OP_JMP_NZ] = "JMP_NZ",
+    [MTR_REG_OP_CALL] = "CALL",
+    [MTR_REG_OP_TAIL_CALL] = "TAIL_CALL",
+    [MTR_REG_OP_INT_CAST] = "INT_CAST",
+    [MTR_REG_OP_FLOAT_CAST] = "FLOAT_CAST",
+    [MTR_REG_OP_RETURN] = "RETURN",
+};
+
+#else
+
+static const char* const names[] = {
+    [MTR_OP_CONSTANT] = "CONSTANT",
+    [MTR_OP_CONSTANT_LONG] = "CONSTANT_LONG",
+    [MTR_OP_SMALL_INT] = "SMALL_INT",
+    [MTR_OP_FALSE] = "FALSE",
+    [MTR_OP_TRUE] = "TRUE",
+    [MTR_OP_STRING_LITERAL] = "STRING_LITERAL",
+    [MTR_OP_ARRAY_LITERAL] = "ARRAY_LITERAL",
+    [MTR_OP_MAP_LITERAL] = "MAP_LITERAL",
+    [MTR_OP_CONSTRUCTOR] = "CONSTRUCTOR",
+    [MTR_OP_CLOSURE] = "CLOSURE",
+    [MTR_OP_NIL] = "NIL",
+    [MTR_OP_EMPTY_STRING] = "EMPTY_STRING",
+    [MTR_OP_EMPTY_ARRAY] = "EMPTY_ARRAY",
+    [MTR_OP_EMPTY_MAP] = "EMPTY_MAP",
+    [MTR_OP_FRAME_ARRAY_LITERAL] = "FRAME_ARRAY_LITERAL",
+    [MTR_OP_FRAME_CONSTRUCTOR] = "FRAME_CONSTRUCTOR",
+    [MTR_OP_FRAME_EMPTY_ARRAY] = "FRAME_EMPTY_ARRAY",
+    [MTR_OP_BOX] = "BOX",
+    [MTR_OP_OR] = "OR",
+    [MTR_OP_AND] = "AND",
+    [MTR_OP_NOT] = "NOT",
+    [MTR_OP_NEGATE_I] = "NEGATE_I",
+    [MTR_OP_NEGATE_F] = "NEGATE_F",
+    [MTR_OP_ADD_I] = "ADD_I",
+    [MTR_OP_SUB_I] = "SUB_I",
+    [MTR_OP_MUL_I] = "MUL_I",
+    [MTR_OP_DIV_I] = "DIV_I",
+    [MTR_OP_ADD_F] = "ADD_F",
+    [MTR_OP_SUB_F] = "SUB_F",
+    [MTR_OP_MUL_F] = "MUL_F",
+    [MTR_OP_DIV_F] = "DIV_F",
+    [MTR_OP_ELEMENTWISE_I] = "ELEMENTWISE_I",
+    [MTR_OP_ELEMENTWISE_F] = "ELEMENTWISE_F",
+    [MTR_OP_LESS_I] = "LESS_I",
+    [MTR_OP_GREATER_I] = "GREATER_I",
+    [MTR_OP_EQUAL_I] = "EQUAL_I",
+    [MTR_OP_LESS_EQUAL_I] = "LESS_EQUAL_I",
+    [MTR_OP_GREATER_EQUAL_I] = "GREATER_EQUAL_I",
+    [MTR_OP_NOT_EQUAL_I] = "NOT_EQUAL_I",
+    [MTR_OP_LESS_F] = "LESS_F",
+    [MTR_OP_GREATER_F] = "GREATER_F",
+    [MTR_OP_EQUAL_F] = "EQUAL_F",
+    [MTR_OP_LESS_EQUAL_F] = "LESS_EQUAL_F",
+    [MTR_OP_GREATER_EQUAL_F] = "GREATER_EQUAL_F",
+    [MTR_OP_NOT_EQUAL_F] = "NOT_EQUAL_F",
+    [MTR_OP_GET] = "GET",
+    [MTR_OP_SET] = "SET",
+    [MTR_OP_GET_GET] = "GET_GET",
+    [MTR_OP_LOCAL_ADD_I] = "LOCAL_ADD_I",
+    [MTR_OP_LOCAL_SUB_I] = "LOCAL_SUB_I",
+    [MTR_OP_LOCAL_INC_I] = "LOCAL_INC_I",
+    [MTR_OP_SET_GET] = "SET_GET",
+    [MTR_OP_GLOBAL_GET] = "GLOBAL_GET",
+    [MTR_OP_UPVALUE_GET] = "UPVALUE_GET",
+    [MTR_OP_UPVALUE_SET] = "UPVALUE_SET",
+    [MTR_OP_INDEX_GET] = "INDEX_GET",
+    [MTR_OP_INDEX_SET] = "INDEX_SET",
+    [MTR_OP_INDEX_GET_ARRAY] = "INDEX_GET_ARRAY",
+    [MTR_OP_INDEX_GET_MAP] = "INDEX_GET_MAP",
+    [MTR_OP_INDEX_SET_ARRAY] = "INDEX_SET_ARRAY",
+    [MTR_OP_INDEX_SET_MAP] = "INDEX_SET_MAP",
+    [MTR_OP_INDEX_GET_ARRAY_UNCHECKED] = "INDEX_GET_ARRAY_UNCHECKED",
+    [MTR_OP_INDEX_SET_ARRAY_UNCHECKED] = "INDEX_SET_ARRAY_UNCHECKED",
+    [MTR_OP_CHECK_BOUNDS] = "CHECK_BOUNDS",
+    [MTR_OP_STRUCT_GET] = "STRUCT_GET",
+    [MTR_OP_STRUCT_SET] = "STRUCT_SET",
+    [MTR_OP_JMP] = "JMP",
+    [MTR_OP_JMP_Z] = "JMP_Z",
+    [MTR_OP_JMP_NZ] = "JMP_NZ",
+    [MTR_OP_LESS_I_JMP_Z] = "LESS_I_JMP_Z",
+    [MTR_OP_GREATER_I_JMP_Z] = "GREATER_I_JMP_Z",
+    [MTR_OP_EQUAL_I_JMP_Z] = "EQUAL_I_JMP_Z",
+    [MTR_OP_LESS_EQUAL_I_JMP_Z] = "LESS_EQUAL_I_JMP_Z",
+    [MTR_OP_GREATER_EQUAL_I_JMP_Z] = "GREATER_EQUAL_I_JMP_Z",
+    [MTR_OP_NOT_EQUAL_I_JMP_Z] = "NOT_EQUAL_I_JMP_Z",
+    [MTR_OP_POP] = "POP",
+    [MTR_OP_POP_V] = "POP_V",
+    [MTR_OP_CALL] = "CALL",
+    [MTR_OP_CALL_FUNCTION] = "CALL_FUNCTION",
+    [MTR_OP_CALL_CLOSURE] = "CALL_CLOSURE",
+    [MTR_OP_CALL_NATIVE] = "CALL_NATIVE",
+    [MTR_OP_CALL_GLOBAL] = "CALL_GLOBAL",
+    [MTR_OP_CALL_GLOBAL_NATIVE] = "CALL_GLOBAL_NATIVE",
+    [MTR_OP_TAIL_CALL] = "TAIL_CALL",
+    [MTR_OP_TAIL_CALL_GLOBAL] = "TAIL_CALL_GLOBAL",
+    [MTR_OP_INT_CAST] = "INT_CAST",
+    [MTR_OP_FLOAT_CAST] = "FLOAT_CAST",
+    [MTR_OP_RETURN] = "RETURN",
+};
+
+#endif
+
+const char* mtr_op_code_to_str(u8 op) {
+    if (op >= sizeof(names) / sizeof(names[0]) || NULL == names[op]) {
+        return "???";
+    }
+    return names[op];
+}
@@ -0,0 +1,37 @@
+#ifndef MTR_OPCODE_STATS_H
+#define MTR_OPCODE_STATS_H
+
+#include "core/types.h"
+
+// Counts every executed op code and every run of up to MTR_MAX_NGRAM consecutive op codes.
+// The engines feed it when built with MTR_INSTRUCTION_STATS (make stats=on) and print the
+// most frequent sequences when the program ends, which is what the fused op codes are picked from.
+
+#define MTR_MAX_NGRAM 4
+
+struct mtr_ngram {
+    u64 key;   // length in the upper half, op codes in the lower one (oldest first)
+    u64 count;
+};
+
+struct mtr_opcode_stats {
+    u64 executed;
+    u32 window;  // last op codes executed, the newest one in the lowest byte
+    u32 depth;   // how many op codes the window holds
+    struct mtr_ngram* ngrams;
+    size_t size;
+    size_t capacity;
+};
+
+void mtr_init_opcode_stats(struct mtr_opcode_stats* stats);
+void mtr_delete_opcode_stats(struct mtr_opcode_stats* stats);
+
+void mtr_record_opcode(struct mtr_opcode_stats* stats, u8 op);
+
+// Prints the 'top' most frequent n-grams of every length.
+// Calls, returns and jumps don't reset the window so sequences are the ones actually executed.
+void mtr_print_opcode_stats(const struct mtr_opcode_stats* stats, u32 top);
+
+const char* mtr_op_code_to_str(u8 op);
+
+#endif
@@ -0,0 +1,662 @@
+// mmap and MAP_ANONYMOUS are hidden by -std=c17 otherwise
+#define _DEFAULT_SOURCE
+
+#include "jit.h"
+
+#ifdef MTR_JIT_ENABLED
+
+#include "x64.h"
+#include "trace.h"
+
+#include "runtime/engine.h"
+#include "runtime/object.h"
+
+#include "core/log.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+u32 mtr_jit_threshold = MTR_JIT_THRESHOLD;
+
+// The machine code keeps these in callee saved registers for the whole function:
+//   rbx  engine
+//   r12  frame
+//   r13  frame->slots
+//   r14  engine->stack_top, written back before anything in C runs
+// Nothing else lives in registers across instructions.
+
+#define ENGINE RBX
+#define FRAME  R12
+#define SLOTS  R13
+#define TOP    R14
+
+// Offsets from r14 of the value n places below the top of the stack
+#define VALUE(n) (-((i32) (n) + 1) * VALUE_SIZE)
+#define VALUE_PAYLOAD(n) (VALUE(n) + PAYLOAD)
+
+// Values are always moved as two qwords. A 16 byte load of a value that was just written
+// in halves can't be forwarded from the store buffer and stalls.
+static void copy_value(struct assembler* a, u8 dst, i32 dst_disp, u8 src, i32 src_disp) {
+    load(a, RCX, src, src_disp);
+    load(a, RDX, src, src_disp + 8);
+    store(a, dst, dst_disp, RCX);
+    store(a, dst, dst_disp + 8, RDX);
+}
+
+static void push_value(struct assembler* a, u8 base, i32 disp) {
+    copy_value(a, TOP, 0, base, disp);
+    add_imm(a, TOP, VALUE_SIZE);
+}
+
+static void push_int(struct assembler* a, i64 value) {
+    set_type(a, TOP, 0, MTR_VAL_INT);
+    move_imm(a, RAX, (u64) value);
+    store(a, TOP, PAYLOAD, RAX);
+    add_imm(a, TOP, VALUE_SIZE);
+}
+
+static void drop(struct assembler* a, u32 count) {
+    add_imm(a, TOP, -((i32) count * VALUE_SIZE));
+}
+
+// setcc al, then the Int in al replaces the value at base + disp
+static void store_flag(struct assembler* a, enum condition cc, u8 base, i32 disp) {
+    byte(a, 0x0F); byte(a, 0x90 + cc); byte(a, 0xC0);  // setcc al
+    byte(a, 0x0F); byte(a, 0xB6); byte(a, 0xC0);       // movzx eax, al
+    store(a, base, disp + PAYLOAD, RAX);
+    set_type(a, base, disp, MTR_VAL_INT);
+}
+
+// Everything that isn't inlined: write the stack top back, run the instruction in C
+// and leave with whatever it returns unless it is MTR_JIT_NEXT.
+static void step(struct assembler* a, const u8* ip) {
+    store(a, ENGINE, (i32) offsetof(struct mtr_engine, stack_top), TOP);
+    move(a, RDI, ENGINE);
+    move(a, RSI, FRAME);
+    move_imm(a, RDX, (u64) (uintptr_t) ip);
+    call(a, (u64) (uintptr_t) &mtr_jit_step);
+    load(a, TOP, ENGINE, (i32) offsetof(struct mtr_engine, stack_top));
+    byte(a, 0x85); byte(a, 0xC0);                  // test eax, eax
+    const size_t at = jcc_forward(a, CC_NE);
+    patch(a, at, a->exit);
+}
+
+static void prologue(struct assembler* a) {
+    // five pushes and the return address keep rsp 16 byte aligned for the calls into C
+    byte(a, 0x53);                                 // push rbx
+    byte(a, 0x41); byte(a, 0x54);                  // push r12
+    byte(a, 0x41); byte(a, 0x55);                  // push r13
+    byte(a, 0x41); byte(a, 0x56);                  // push r14
+    byte(a, 0x41); byte(a, 0x57);                  // push r15
+    move(a, ENGINE, RDI);
+    move(a, FRAME, RSI);
+    load(a, SLOTS, FRAME, (i32) offsetof(struct mtr_call_frame, slots));
+    load(a, TOP, ENGINE, (i32) offsetof(struct mtr_engine, stack_top));
+    byte(a, 0xFF); byte(a, 0xE2);                  // jmp rdx
+
+    a->exit = a->size;
+    byte(a, 0x41); byte(a, 0x5F);                  // pop r15
+    byte(a, 0x41); byte(a, 0x5E);                  // pop r14
+    byte(a, 0x41); byte(a, 0x5D);                  // pop r13
+    byte(a, 0x41); byte(a, 0x5C);                  // pop r12
+    byte(a, 0x5B);                                 // pop rbx
+    byte(a, 0xC3);                                 // ret
+}
+
+static void int_arithmetic(struct assembler* a, u8 op) {
+    drop(a, 1);
+    switch (op) {
+    case MTR_OP_ADD_I:
+        load(a, RAX, TOP, PAYLOAD);
+        op_mem(a, true, 0x01, RAX, TOP, VALUE_PAYLOAD(0));      // add [left], rax
+        break;
+    case MTR_OP_SUB_I:
+        load(a, RAX, TOP, PAYLOAD);
+        op_mem(a, true, 0x29, RAX, TOP, VALUE_PAYLOAD(0));      // sub [left], rax
+        break;
+    case MTR_OP_MUL_I:
+        load(a, RAX, TOP, VALUE_PAYLOAD(0));
+        op_0f_mem(a, true, 0xAF, RAX, TOP, PAYLOAD);             // imul rax, [right]
+        store(a, TOP, VALUE_PAYLOAD(0), RAX);
+        break;
+    case MTR_OP_DIV_I:
+        load(a, RAX, TOP, VALUE_PAYLOAD(0));
+        byte(a, 0x48); byte(a, 0x99);                            // cqo
+        op_mem(a, true, 0xF7, 7, TOP, PAYLOAD);                  // idiv qword [right]
+        store(a, TOP, VALUE_PAYLOAD(0), RAX);
+        break;
+    }
+}
+
+static void float_arithmetic(struct assembler* a, u8 op) {
+    static const u8 sse[] = {
+        [MTR_OP_ADD_F - MTR_OP_ADD_F] = 0x58,
+        [MTR_OP_SUB_F - MTR_OP_ADD_F] = 0x5C,
+        [MTR_OP_MUL_F - MTR_OP_ADD_F] = 0x59,
+        [MTR_OP_DIV_F - MTR_OP_ADD_F] = 0x5E
+    };
+    drop(a, 1);
+    sse_mem(a, 0xF2, false, 0x10, XMM0, TOP, VALUE_PAYLOAD(0));          // movsd xmm0, [left]
+    sse_mem(a, 0xF2, false, sse[op - MTR_OP_ADD_F], XMM0, TOP, PAYLOAD); // op xmm0, [right]
+    sse_mem(a, 0xF2, false, 0x11, XMM0, TOP, VALUE_PAYLOAD(0));          // movsd [left], xmm0
+}
+
+static void int_compare(struct assembler* a, enum condition cc) {
+    drop(a, 1);
+    load(a, RAX, TOP, VALUE_PAYLOAD(0));
+    op_mem(a, true, 0x3B, RAX, TOP, PAYLOAD);                // cmp rax, [right]
+    store_flag(a, cc, TOP, VALUE(0));
+}
+
+// ucomisd sets CF, ZF and PF when either side is NaN, so < and <= compare the other way
+// round with 'above' to come out false like they do in C.
+static void float_compare(struct assembler* a, u8 op) {
+    drop(a, 1);
+    const bool swap = op == MTR_OP_LESS_F || op == MTR_OP_LESS_EQUAL_F;
+    const i32 first = swap ? PAYLOAD : VALUE_PAYLOAD(0);
+    const i32 second = swap ? VALUE_PAYLOAD(0) : PAYLOAD;
+    sse_mem(a, 0xF2, false, 0x10, XMM0, TOP, first);         // movsd xmm0, [first]
+    sse_mem(a, 0x66, false, 0x2E, XMM0, TOP, second);        // ucomisd xmm0, [second]
+
+    switch (op) {
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+        store_flag(a, CC_A, TOP, VALUE(0));
+        break;
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+        store_flag(a, CC_AE, TOP, VALUE(0));
+        break;
+    case MTR_OP_EQUAL_F:
+        byte(a, 0x0F); byte(a, 0x90 + CC_NP); byte(a, 0xC1); // setnp cl
+        byte(a, 0x0F); byte(a, 0x90 + CC_E); byte(a, 0xC0);  // sete al
+        byte(a, 0x20); byte(a, 0xC8);                        // and al, cl
+        store_flag(a, CC_NE, TOP, VALUE(0));                 // al != 0
+        break;
+    case MTR_OP_NOT_EQUAL_F:
+        byte(a, 0x0F); byte(a, 0x90 + CC_P); byte(a, 0xC1);  // setp cl
+        byte(a, 0x0F); byte(a, 0x90 + CC_NE); byte(a, 0xC0); // setne al
+        byte(a, 0x08); byte(a, 0xC8);                        // or al, cl
+        store_flag(a, CC_NE, TOP, VALUE(0));
+        break;
+    }
+}
+
+// Runs the trace and returns the machine code of the instruction it left at
+static u8* run_trace(struct mtr_engine* engine, struct mtr_call_frame* frame, struct mtr_trace* trace) {
+    const u8* ip = trace->header;
+    if (trace->state == MTR_TRACE_COMPILED) {
+        u8* exit = mtr_trace_run(trace, engine, frame);
+        if (NULL != exit) {
+            ip = exit;
+        }
+    }
+    const struct mtr_jit_code* code = frame->chunk->jit;
+    return code->memory + code->offsets[ip - frame->chunk->bytecode];
+}
+
+// The back-edge of a loop that was traced before the chunk was compiled goes through its trace
+static void trace_jump(struct assembler* a, struct mtr_trace* trace) {
+    store(a, ENGINE, (i32) offsetof(struct mtr_engine, stack_top), TOP);
+    move(a, RDI, ENGINE);
+    move(a, RSI, FRAME);
+    move_imm(a, RDX, (u64) (uintptr_t) trace);
+    call(a, (u64) (uintptr_t) &run_trace);
+    load(a, TOP, ENGINE, (i32) offsetof(struct mtr_engine, stack_top));
+    byte(a, 0xFF); byte(a, 0xE0);                  // jmp rax
+}
+
+// jcc to the target, or to its trace when it has one
+static void conditional_jump(struct assembler* a, enum condition cc, u32 target, struct mtr_trace* trace) {
+    if (NULL == trace) {
+        jcc_to(a, cc, target);
+        return;
+    }
+    const size_t skip = jcc_forward(a, (enum condition) (cc ^ 1));
+    trace_jump(a, trace);
+    patch(a, skip, a->size);
+}
+
+// The jump is taken when the comparison is false
+static void compare_jump(struct assembler* a, enum condition jump_if, u32 target, struct mtr_trace* trace) {
+    drop(a, 2);
+    load(a, RAX, TOP, PAYLOAD);
+    op_mem(a, true, 0x3B, RAX, TOP, VALUE_SIZE + PAYLOAD);   // cmp rax, [right]
+    conditional_jump(a, jump_if, target, trace);
+}
+
+// rax = the elements of the array n values below the top, rcx = the Int on top and
+// edx = the layout of the array, or off to the slow path when it isn't an array or the index
+// is out of bounds. Nothing is checked without 'slow'.
+static void array_element(struct assembler* a, u32 n, size_t* slow) {
+    load(a, RAX, TOP, VALUE_PAYLOAD(n));
+    if (NULL != slow) {
+        imm_mem(a, false, 7, RAX, (i32) offsetof(struct mtr_object, type), MTR_OBJ_ARRAY);
+        slow[0] = jcc_forward(a, CC_NE);
+    }
+    load(a, RCX, TOP, VALUE_PAYLOAD(0));
+    if (NULL != slow) {
+        op_mem(a, true, 0x3B, RCX, RAX, (i32) offsetof(struct mtr_array, size)); // cmp rcx, [rax + size]
+        slow[1] = jcc_forward(a, CC_AE);
+    }
+    op_mem(a, false, 0x8B, RDX, RAX, (i32) offsetof(struct mtr_array, layout)); // mov edx, [rax + layout]
+    load(a, RAX, RAX, (i32) offsetof(struct mtr_array, elements));
+}
+
+// rax += rcx << shift
+static void scale_index(struct assembler* a, u8 shift) {
+    if (shift != 0) {
+        op_reg(a, true, 0xC1, 4, RCX); byte(a, shift);       // shl rcx, shift
+    }
+    op_reg(a, true, 0x01, RCX, RAX);                         // add rax, rcx
+}
+
+static void index_get(struct assembler* a, const u8* ip) {
+    const bool checked = ip[0] != MTR_OP_INDEX_GET_ARRAY_UNCHECKED;
+    size_t slow[2];
+    array_element(a, 1, checked ? slow : NULL);
+
+    imm_reg(a, 7, RDX, MTR_ARRAY_VALUES);                    // cmp rdx, VALUES
+    const size_t packed = jcc_forward(a, CC_NE);
+    scale_index(a, 4);
+    copy_value(a, TOP, VALUE(1), RAX, 0);
+    const size_t values_done = jmp_forward(a);
+
+    patch(a, packed, a->size);
+    imm_reg(a, 7, RDX, MTR_ARRAY_BOOLS);
+    const size_t bools = jcc_forward(a, CC_E);
+    scale_index(a, 3);
+    load(a, RAX, RAX, 0);
+    store(a, TOP, VALUE_PAYLOAD(1), RAX);
+    op_reg(a, true, 0xFF, 1, RDX);                           // dec rdx, INTS and FLOATS are MTR_VAL_INT + 1 and MTR_VAL_FLOAT + 1
+    store(a, TOP, VALUE(1), RDX);                            // the type and its padding
+    const size_t wide_done = jmp_forward(a);
+
+    patch(a, bools, a->size);
+    scale_index(a, 0);
+    op_0f_mem(a, false, 0xB6, RAX, RAX, 0);                  // movzx eax, byte [rax]
+    store(a, TOP, VALUE_PAYLOAD(1), RAX);
+    set_type(a, TOP, VALUE(1), MTR_VAL_INT);
+
+    patch(a, values_done, a->size);
+    patch(a, wide_done, a->size);
+    drop(a, 1);
+    if (!checked) {
+        return;
+    }
+    const size_t done = jmp_forward(a);
+    patch(a, slow[0], a->size);
+    patch(a, slow[1], a->size);
+    step(a, ip);
+    patch(a, done, a->size);
+}
+
+// Values that don't fit a packed array go to the slow path, which unpacks it, and so do objects,
+// the engine runs the write barrier (runtime/memory.h) for them
+static void index_set(struct assembler* a, const u8* ip) {
+    const bool checked = ip[0] != MTR_OP_INDEX_SET_ARRAY_UNCHECKED;
+    size_t slow[6];
+    array_element(a, 1, checked ? slow : NULL);
+
+    imm_reg(a, 7, RDX, MTR_ARRAY_VALUES);
+    const size_t packed = jcc_forward(a, CC_NE);
+    imm_mem(a, false, 7, TOP, VALUE(2), MTR_VAL_OBJ);
+    slow[5] = jcc_forward(a, CC_E);
+    scale_index(a, 4);
+    copy_value(a, RAX, 0, TOP, VALUE(2));
+    const size_t values_done = jmp_forward(a);
+
+    patch(a, packed, a->size);
+    imm_reg(a, 7, RDX, MTR_ARRAY_BOOLS);
+    const size_t bools = jcc_forward(a, CC_E);
+    op_reg(a, true, 0xFF, 1, RDX);                           // dec rdx
+    op_mem(a, false, 0x39, RDX, TOP, VALUE(2));              // cmp dword [value], edx
+    slow[2] = jcc_forward(a, CC_NE);
+    load(a, RDX, TOP, VALUE_PAYLOAD(2));
+    scale_index(a, 3);
+    store(a, RAX, 0, RDX);
+    const size_t wide_done = jmp_forward(a);
+
+    patch(a, bools, a->size);
+    imm_mem(a, false, 7, TOP, VALUE(2), MTR_VAL_INT);
+    slow[3] = jcc_forward(a, CC_NE);
+    load(a, RDX, TOP, VALUE_PAYLOAD(2));
+    imm_reg(a, 7, RDX, 1);
+    slow[4] = jcc_forward(a, CC_A);
+    scale_index(a, 0);
+    op_mem(a, false, 0x88, RDX, RAX, 0);                     // mov byte [rax], dl
+
+    patch(a, values_done, a->size);
+    patch(a, wide_done, a->size);
+    drop(a, 3);
+    const size_t done = jmp_forward(a);
+    for (u32 i = checked ? 0 : 2; i < 6; ++i) {
+        patch(a, slow[i], a->size);
+    }
+    step(a, ip);
+    patch(a, done, a->size);
+}
+
+static void ret(struct assembler* a) {
+    copy_value(a, SLOTS, 0, TOP, VALUE(0));
+    op_mem(a, true, 0x8D, RAX, SLOTS, VALUE_SIZE);           // lea rax, [slots + 1]
+    store(a, ENGINE, (i32) offsetof(struct mtr_engine, stack_top), RAX);
+    op_mem(a, false, 0xFF, 1, ENGINE, (i32) offsetof(struct mtr_engine, frame_count)); // dec dword
+    byte(a, 0xB8); dword(a, MTR_JIT_RETURNED);               // mov eax, MTR_JIT_RETURNED
+    const size_t at = jmp_forward(a);
+    patch(a, at, a->exit);
+}
+
+static u16 read_u16(const u8* ip) {
+    u16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+static i16 read_i16(const u8* ip) {
+    i16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+// Numbers are stored inline, objects are stored by the engine, which runs the write barrier
+static void upvalue_set(struct assembler* a, const u8* ip) {
+    imm_mem(a, false, 7, TOP, VALUE(0), MTR_VAL_OBJ);
+    const size_t object = jcc_forward(a, CC_E);
+    load(a, RAX, FRAME, (i32) offsetof(struct mtr_call_frame, upvalues));
+    drop(a, 1);
+    copy_value(a, RAX, SLOT(read_u16(ip + 1)), TOP, 0);
+    const size_t done = jmp_forward(a);
+    patch(a, object, a->size);
+    step(a, ip);
+    patch(a, done, a->size);
+}
+
+static void struct_set(struct assembler* a, const u8* ip) {
+    imm_mem(a, false, 7, TOP, VALUE(1), MTR_VAL_OBJ);
+    const size_t object = jcc_forward(a, CC_E);
+    drop(a, 2);
+    load(a, RAX, TOP, VALUE_SIZE + PAYLOAD);
+    load(a, RAX, RAX, (i32) offsetof(struct mtr_struct, members));
+    copy_value(a, RAX, SLOT((u8) read_u16(ip + 1)), TOP, 0);
+    const size_t done = jmp_forward(a);
+    patch(a, object, a->size);
+    step(a, ip);
+    patch(a, done, a->size);
+}
+
+// The compiled trace of the loop a jump goes back to
+static struct mtr_trace* loop_trace(const struct mtr_chunk* chunk, const u8* ip) {
+    const i16 where = read_i16(ip + 1);
+    return where < 0 ? mtr_find_trace(chunk, ip + mtr_instruction_length(ip) + where) : NULL;
+}
+
+static void write_instruction(struct assembler* a, const struct mtr_chunk* chunk, u8* ip) {
+    const u32 next = (u32) (ip - chunk->bytecode) + mtr_instruction_length(ip);
+    const u8 op = *ip;
+
+    switch (op)
+    {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG: {
+        const u16 index = op == MTR_OP_CONSTANT ? ip[1] : read_u16(ip + 1);
+        move_imm(a, RAX, (u64) (uintptr_t) (chunk->constants + index));
+        push_value(a, RAX, 0);
+        break;
+    }
+
+    case MTR_OP_SMALL_INT: push_int(a, read_i16(ip + 1)); break;
+    case MTR_OP_FALSE:     push_int(a, 0); break;
+    case MTR_OP_TRUE:      push_int(a, 1); break;
+    case MTR_OP_NIL:       push_int(a, 0); break;
+
+    case MTR_OP_BOX:
+        break;
+
+    case MTR_OP_NOT:
+        test_zero(a, TOP, VALUE_PAYLOAD(0));
+        store_flag(a, CC_E, TOP, VALUE(0));
+        break;
+
+    case MTR_OP_OR:
+    case MTR_OP_AND:
+        test_zero(a, TOP, VALUE_PAYLOAD(0));
+        jcc_to(a, op == MTR_OP_OR ? CC_NE : CC_E, next + read_i16(ip + 1));
+        drop(a, 1);
+        break;
+
+    case MTR_OP_NEGATE_I:
+        op_mem(a, true, 0xF7, 3, TOP, VALUE_PAYLOAD(0));      // neg qword
+        break;
+
+    case MTR_OP_NEGATE_F:
+        op_0f_mem(a, true, 0xBA, 7, TOP, VALUE_PAYLOAD(0));   // btc qword, 63
+        byte(a, 63);
+        break;
+
+    case MTR_OP_ADD_I:
+    case MTR_OP_SUB_I:
+    case MTR_OP_MUL_I:
+    case MTR_OP_DIV_I:
+        int_arithmetic(a, op);
+        break;
+
+    case MTR_OP_ADD_F:
+    case MTR_OP_SUB_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_DIV_F:
+        float_arithmetic(a, op);
+        break;
+
+    case MTR_OP_LESS_I:          int_compare(a, CC_L); break;
+    case MTR_OP_GREATER_I:       int_compare(a, CC_G); break;
+    case MTR_OP_EQUAL_I:         int_compare(a, CC_E); break;
+    case MTR_OP_LESS_EQUAL_I:    int_compare(a, CC_LE); break;
+    case MTR_OP_GREATER_EQUAL_I: int_compare(a, CC_GE); break;
+    case MTR_OP_NOT_EQUAL_I:     int_compare(a, CC_NE); break;
+
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+        float_compare(a, op);
+        break;
+
+    case MTR_OP_GET:
+        push_value(a, SLOTS, SLOT(read_u16(ip + 1)));
+        break;
+
+    case MTR_OP_SET:
+        drop(a, 1);
+        copy_value(a, SLOTS, SLOT(read_u16(ip + 1)), TOP, 0);
+        break;
+
+    case MTR_OP_GET_GET:
+        copy_value(a, TOP, 0, SLOTS, SLOT(read_u16(ip + 1)));
+        copy_value(a, TOP, VALUE_SIZE, SLOTS, SLOT(read_u16(ip + 3)));
+        add_imm(a, TOP, 2 * VALUE_SIZE);
+        break;
+
+    case MTR_OP_LOCAL_ADD_I:
+    case MTR_OP_LOCAL_SUB_I: {
+        const u16 dst = read_u16(ip + 1);
+        load(a, RAX, SLOTS, SLOT_PAYLOAD(read_u16(ip + 3)));
+        op_mem(a, true, op == MTR_OP_LOCAL_ADD_I ? 0x03 : 0x2B, RAX, SLOTS, SLOT_PAYLOAD(read_u16(ip + 5)));
+        store(a, SLOTS, SLOT_PAYLOAD(dst), RAX);
+        set_type(a, SLOTS, SLOT(dst), MTR_VAL_INT);
+        break;
+    }
+
+    case MTR_OP_LOCAL_INC_I: {
+        const u16 dst = read_u16(ip + 1);
+        imm_mem(a, true, 0, SLOTS, SLOT_PAYLOAD(dst), read_i16(ip + 3));
+        set_type(a, SLOTS, SLOT(dst), MTR_VAL_INT);
+        break;
+    }
+
+    case MTR_OP_SET_GET:
+        copy_value(a, SLOTS, SLOT(read_u16(ip + 1)), TOP, VALUE(0));
+        break;
+
+    case MTR_OP_GLOBAL_GET:
+        load(a, RAX, ENGINE, (i32) offsetof(struct mtr_engine, globals));
+        load(a, RAX, RAX, (i32) (read_u16(ip + 1) * sizeof(struct mtr_object*)));
+        store(a, TOP, PAYLOAD, RAX);
+        set_type(a, TOP, 0, MTR_VAL_OBJ);
+        add_imm(a, TOP, VALUE_SIZE);
+        break;
+
+    case MTR_OP_UPVALUE_GET:
+        load(a, RAX, FRAME, (i32) offsetof(struct mtr_call_frame, upvalues));
+        push_value(a, RAX, SLOT(read_u16(ip + 1)));
+        break;
+
+    case MTR_OP_UPVALUE_SET:
+        upvalue_set(a, ip);
+        break;
+
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+        index_get(a, ip);
+        break;
+
+    case MTR_OP_INDEX_SET:
+    case MTR_OP_INDEX_SET_ARRAY:
+    case MTR_OP_INDEX_SET_ARRAY_UNCHECKED:
+        index_set(a, ip);
+        break;
+
+    case MTR_OP_STRUCT_GET:
+        load(a, RAX, TOP, VALUE_PAYLOAD(0));
+        load(a, RAX, RAX, (i32) offsetof(struct mtr_struct, members));
+        copy_value(a, TOP, VALUE(0), RAX, SLOT((u8) read_u16(ip + 1)));
+        break;
+
+    case MTR_OP_STRUCT_SET:
+        struct_set(a, ip);
+        break;
+
+    case MTR_OP_JMP:
+        if (NULL != loop_trace(chunk, ip)) {
+            trace_jump(a, loop_trace(chunk, ip));
+        } else {
+            jmp_to(a, next + read_i16(ip + 1));
+        }
+        break;
+
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ:
+        drop(a, 1);
+        test_zero(a, TOP, PAYLOAD);
+        conditional_jump(a, op == MTR_OP_JMP_Z ? CC_E : CC_NE, next + read_i16(ip + 1), loop_trace(chunk, ip));
+        break;
+
+    case MTR_OP_LESS_I_JMP_Z:          compare_jump(a, CC_GE, next + read_i16(ip + 1), loop_trace(chunk, ip)); break;
+    case MTR_OP_GREATER_I_JMP_Z:       compare_jump(a, CC_LE, next + read_i16(ip + 1), loop_trace(chunk, ip)); break;
+    case MTR_OP_EQUAL_I_JMP_Z:         compare_jump(a, CC_NE, next + read_i16(ip + 1), loop_trace(chunk, ip)); break;
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:    compare_jump(a, CC_G, next + read_i16(ip + 1), loop_trace(chunk, ip)); break;
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z: compare_jump(a, CC_L, next + read_i16(ip + 1), loop_trace(chunk, ip)); break;
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:     compare_jump(a, CC_E, next + read_i16(ip + 1), loop_trace(chunk, ip)); break;
+
+    case MTR_OP_POP:
+        drop(a, 1);
+        break;
+
+    case MTR_OP_POP_V:
+        drop(a, read_u16(ip + 1));
+        break;
+
+    case MTR_OP_INT_CAST:
+        sse_mem(a, 0xF2, true, 0x2C, RAX, TOP, VALUE_PAYLOAD(0));   // cvttsd2si rax, [top]
+        store(a, TOP, VALUE_PAYLOAD(0), RAX);
+        set_type(a, TOP, VALUE(0), MTR_VAL_INT);
+        break;
+
+    case MTR_OP_FLOAT_CAST:
+        sse_mem(a, 0xF2, true, 0x2A, XMM0, TOP, VALUE_PAYLOAD(0));  // cvtsi2sd xmm0, [top]
+        sse_mem(a, 0xF2, false, 0x11, XMM0, TOP, VALUE_PAYLOAD(0));
+        set_type(a, TOP, VALUE(0), MTR_VAL_FLOAT);
+        break;
+
+    case MTR_OP_RETURN:
+        ret(a);
+        break;
+
+    default:
+        step(a, ip);
+        break;
+    }
+}
+
+struct mtr_jit_code* mtr_jit_compile(const struct mtr_chunk* chunk) {
+    struct assembler a = { 0 };
+    u32* offsets = malloc(sizeof(u32) * chunk->size);
+    for (size_t i = 0; i < chunk->size; ++i) {
+        offsets[i] = UINT32_MAX;
+    }
+
+    prologue(&a);
+    for (size_t offset = 0; offset < chunk->size; offset += mtr_instruction_length(chunk->bytecode + offset)) {
+        offsets[offset] = (u32) a.size;
+        write_instruction(&a, chunk, chunk->bytecode + offset);
+    }
+
+    for (u32 i = 0; i < a.fixup_count; ++i) {
+        MTR_ASSERT(offsets[a.fixups[i].target] != UINT32_MAX, "Jump into the middle of an instruction.");
+        patch(&a, a.fixups[i].at, offsets[a.fixups[i].target]);
+    }
+    free(a.fixups);
+
+    u8* memory = mtr_jit_map(&a);
+    free(a.code);
+    if (NULL == memory) {
+        free(offsets);
+        return NULL;
+    }
+
+    struct mtr_jit_code* code = malloc(sizeof(*code));
+    code->memory = memory;
+    code->size = a.size;
+    code->offsets = offsets;
+    return code;
+}
+
+void mtr_jit_free(struct mtr_jit_code* code) {
+    if (NULL == code) {
+        return;
+    }
+    mtr_jit_unmap(code->memory, code->size);
+    free(code->offsets);
+    free(code);
+}
+
+u8* mtr_jit_map(const struct assembler* a) {
+    void* memory = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        MTR_LOG_WARN("Could not map %zu bytes for machine code.", a->size);
+        return NULL;
+    }
+    memcpy(memory, a->code, a->size);
+    mprotect(memory, a->size, PROT_READ | PROT_EXEC);
+    return memory;
+}
+
+void mtr_jit_unmap(u8* memory, size_t size) {
+    munmap(memory, size);
+}
+
+typedef enum mtr_jit_status (*entry_point)(struct mtr_engine* engine, struct mtr_call_frame* frame, const u8* target);
+
+enum mtr_jit_status mtr_jit_run(const struct mtr_jit_code* code, struct mtr_engine* engine, struct mtr_call_frame* frame, const u8* ip) {
+    // the machine code starts with the prologue, which jumps to the instruction at ip
+    entry_point entry;
+    memcpy(&entry, &code->memory, sizeof(entry));
+    return entry(engine, frame, code->memory + code->offsets[ip - frame->chunk->bytecode]);
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef MTR_JIT_H
+#define MTR_JIT_H
+
+#include "bytecode.h"
+
+#include "core/types.h"
+
+// A baseline compiler from stack bytecode to x86-64, built with -DMTR_JIT (make jit=on).
+// Every instruction becomes a fixed template of machine code. The values stay where the
+// interpreter keeps them, locals in the frame's slots and temporaries on the engine's stack,
+// so the machine code and the interpreter can hand a frame to each other between any two
+// instructions. Int and Float arithmetic, comparisons, jumps, locals and array accesses are
+// inlined, everything else calls back into the engine (mtr_jit_step in runtime/engine.c).
+//
+// The engine compiles a chunk once the interpreter ran mtr_jit_threshold calls or loop
+// iterations of it. Loops are given to the trace compiler first (trace.h), only the iterations
+// of loops it gave up on count, and the back-edges of loops it traced run their traces.
+// On other architectures MTR_JIT_ENABLED stays undefined and the interpreter runs everything.
+
+#ifndef MTR_JIT_THRESHOLD
+#   define MTR_JIT_THRESHOLD 1000
+#endif
+
+// Calls made from machine code recurse on the C stack (mtr_jit_step), past this many of them
+// running at once the interpreter runs the callees and everything they call, without recursing
+#ifndef MTR_JIT_MAX_NESTING
+#   define MTR_JIT_MAX_NESTING 256
+#endif
+
+struct mtr_engine;
+struct mtr_call_frame;
+
+// Read when chunks get hot, 0 leaves everything to the interpreter
+extern u32 mtr_jit_threshold;
+
+enum mtr_jit_status {
+    MTR_JIT_NEXT,        // only from mtr_jit_step, the machine code carries on
+    MTR_JIT_RETURNED,    // the frame returned and left its result on the caller's stack
+    MTR_JIT_TAIL_CALLED, // the frame runs another chunk now, from its first instruction
+    MTR_JIT_FAILED       // runtime error
+};
+
+struct mtr_jit_code {
+    u8* memory;
+    size_t size;
+    u32* offsets; // where the machine code of the instruction at each bytecode offset starts
+};
+
+// NULL when the code can't be mapped, the chunk is left to the interpreter then
+struct mtr_jit_code* mtr_jit_compile(const struct mtr_chunk* chunk);
+void mtr_jit_free(struct mtr_jit_code* code);
+
+// Run the frame from ip, an instruction of frame->chunk, until it returns or tail calls
+enum mtr_jit_status mtr_jit_run(const struct mtr_jit_code* code, struct mtr_engine* engine, struct mtr_call_frame* frame, const u8* ip);
+
+// Run the instruction at ip for the machine code, which has written the stack top back to the engine
+enum mtr_jit_status mtr_jit_step(struct mtr_engine* engine, struct mtr_call_frame* frame, u8* ip);
+
+#endif
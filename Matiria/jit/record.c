@@ -0,0 +1,383 @@
+#include "record.h"
+
+#ifdef MTR_JIT_ENABLED
+
+#include "runtime/object.h"
+
+#include "core/macros.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static mtr_value peek(struct mtr_engine* engine, size_t distance) {
+    return engine->stack_top[-1 - (ptrdiff_t) distance];
+}
+
+static mtr_value pop(struct mtr_engine* engine) {
+    return *(--engine->stack_top);
+}
+
+static void push(struct mtr_engine* engine, mtr_value value) {
+    *engine->stack_top++ = value;
+}
+
+static u16 read_u16(const u8* ip) {
+    u16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+static i16 read_i16(const u8* ip) {
+    i16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+static void append(struct mtr_recording* r, struct mtr_trace_step step) {
+    if (r->count == r->capacity) {
+        r->capacity = r->capacity ? r->capacity * 2 : 64;
+        r->steps = realloc(r->steps, sizeof(struct mtr_trace_step) * r->capacity);
+    }
+    r->steps[r->count++] = step;
+}
+
+// The locals around the loop keep their type, the trace compiler relies on it
+static bool keeps_type(const struct mtr_recording* r, u16 index, mtr_value value) {
+    return index >= r->depth || r->types[index] == MTR_TYPE_OF(value);
+}
+
+static bool in_bounds(const struct mtr_array* array, mtr_value key) {
+    const i64 i = MTR_AS_INT(key);
+    return mtr_reinterpret_cast(size_t, i) < array->size;
+}
+
+#define BINARY(op, as, make)                                                    \
+    do {                                                                        \
+        const mtr_value right = pop(engine);                                    \
+        const mtr_value left = pop(engine);                                     \
+        push(engine, make(as(left) op as(right)));                              \
+    } while (false)
+
+bool mtr_record_trace(struct mtr_recording* r, struct mtr_engine* engine, struct mtr_call_frame* frame, u8** at) {
+    const struct mtr_chunk* chunk = frame->chunk;
+    u8* const header = *at;
+    u8* ip = header;
+
+    r->count = 0;
+    r->left = false;
+    r->depth = (u32) (engine->stack_top - frame->slots);
+    r->types = malloc(sizeof(enum mtr_value_type) * (r->depth + 1));
+    for (u32 i = 0; i < r->depth; ++i) {
+        r->types[i] = MTR_TYPE_OF(frame->slots[i]);
+    }
+
+    while (r->count < MTR_MAX_TRACE_STEPS) {
+        u8* next = ip + mtr_instruction_length(ip);
+        struct mtr_trace_step step = { .ip = ip, .op = *ip };
+
+        // conditional jumps decide before they pop, a backward jump anywhere but to the
+        // header is another loop and ends the recording with the operands still there
+        i32 jump = 0;
+        switch (step.op)
+        {
+        case MTR_OP_JMP:
+            step.taken = true;
+            jump = read_i16(ip + 1);
+            break;
+        case MTR_OP_JMP_Z:
+        case MTR_OP_JMP_NZ:
+            step.taken = (MTR_AS_INT(peek(engine, 0)) == 0) == (step.op == MTR_OP_JMP_Z);
+            jump = step.taken ? read_i16(ip + 1) : 0;
+            break;
+        case MTR_OP_LESS_I_JMP_Z:
+        case MTR_OP_GREATER_I_JMP_Z:
+        case MTR_OP_EQUAL_I_JMP_Z:
+        case MTR_OP_LESS_EQUAL_I_JMP_Z:
+        case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+        case MTR_OP_NOT_EQUAL_I_JMP_Z: {
+            const i64 left = MTR_AS_INT(peek(engine, 1));
+            const i64 right = MTR_AS_INT(peek(engine, 0));
+            bool holds = false;
+            switch (step.op) {
+            case MTR_OP_LESS_I_JMP_Z:          holds = left < right; break;
+            case MTR_OP_GREATER_I_JMP_Z:       holds = left > right; break;
+            case MTR_OP_EQUAL_I_JMP_Z:         holds = left == right; break;
+            case MTR_OP_LESS_EQUAL_I_JMP_Z:    holds = left <= right; break;
+            case MTR_OP_GREATER_EQUAL_I_JMP_Z: holds = left >= right; break;
+            case MTR_OP_NOT_EQUAL_I_JMP_Z:     holds = left != right; break;
+            }
+            step.taken = !holds;
+            jump = step.taken ? read_i16(ip + 1) : 0;
+            break;
+        }
+        default:
+            break;
+        }
+
+        if (jump < 0 && next + jump != header) {
+            r->left = next + jump < header;
+            goto stop;
+        }
+
+        switch (step.op)
+        {
+        case MTR_OP_CONSTANT:
+            push(engine, chunk->constants[ip[1]]);
+            break;
+
+        case MTR_OP_CONSTANT_LONG:
+            push(engine, chunk->constants[read_u16(ip + 1)]);
+            break;
+
+        case MTR_OP_SMALL_INT: push(engine, MTR_INT(read_i16(ip + 1))); break;
+        case MTR_OP_FALSE:     push(engine, MTR_INT(0)); break;
+        case MTR_OP_TRUE:      push(engine, MTR_INT(1)); break;
+        case MTR_OP_NIL:       push(engine, MTR_NIL); break;
+
+        case MTR_OP_BOX:
+            break;
+
+        case MTR_OP_OR:
+        case MTR_OP_AND:
+            step.taken = (MTR_AS_INT(peek(engine, 0)) != 0) == (step.op == MTR_OP_OR);
+            if (step.taken) {
+                next += read_i16(ip + 1);
+            } else {
+                pop(engine);
+            }
+            break;
+
+        case MTR_OP_NOT:
+            engine->stack_top[-1] = MTR_INT(!MTR_AS_INT(engine->stack_top[-1]));
+            break;
+
+        case MTR_OP_NEGATE_I:
+            engine->stack_top[-1] = MTR_INT(-MTR_AS_INT(engine->stack_top[-1]));
+            break;
+
+        case MTR_OP_NEGATE_F:
+            engine->stack_top[-1] = MTR_FLOAT(-MTR_AS_FLOAT(engine->stack_top[-1]));
+            break;
+
+        case MTR_OP_ADD_I: BINARY(+, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_SUB_I: BINARY(-, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_MUL_I: BINARY(*, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_DIV_I:
+            // the divisions that trap are the interpreter's to run
+            if (MTR_AS_INT(peek(engine, 0)) == 0 || (MTR_AS_INT(peek(engine, 0)) == -1 && MTR_AS_INT(peek(engine, 1)) == INT64_MIN)) {
+                goto stop;
+            }
+            BINARY(/, MTR_AS_INT, MTR_INT);
+            break;
+
+        case MTR_OP_ADD_F: BINARY(+, MTR_AS_FLOAT, MTR_FLOAT); break;
+        case MTR_OP_SUB_F: BINARY(-, MTR_AS_FLOAT, MTR_FLOAT); break;
+        case MTR_OP_MUL_F: BINARY(*, MTR_AS_FLOAT, MTR_FLOAT); break;
+        case MTR_OP_DIV_F: BINARY(/, MTR_AS_FLOAT, MTR_FLOAT); break;
+
+        case MTR_OP_LESS_I:          BINARY(<, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_GREATER_I:       BINARY(>, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_EQUAL_I:         BINARY(==, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_LESS_EQUAL_I:    BINARY(<=, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_GREATER_EQUAL_I: BINARY(>=, MTR_AS_INT, MTR_INT); break;
+        case MTR_OP_NOT_EQUAL_I:     BINARY(!=, MTR_AS_INT, MTR_INT); break;
+
+        case MTR_OP_LESS_F:          BINARY(<, MTR_AS_FLOAT, MTR_INT); break;
+        case MTR_OP_GREATER_F:       BINARY(>, MTR_AS_FLOAT, MTR_INT); break;
+        case MTR_OP_EQUAL_F:         BINARY(==, MTR_AS_FLOAT, MTR_INT); break;
+        case MTR_OP_LESS_EQUAL_F:    BINARY(<=, MTR_AS_FLOAT, MTR_INT); break;
+        case MTR_OP_GREATER_EQUAL_F: BINARY(>=, MTR_AS_FLOAT, MTR_INT); break;
+        case MTR_OP_NOT_EQUAL_F:     BINARY(!=, MTR_AS_FLOAT, MTR_INT); break;
+
+        case MTR_OP_GET:
+            push(engine, frame->slots[read_u16(ip + 1)]);
+            break;
+
+        case MTR_OP_SET: {
+            const u16 index = read_u16(ip + 1);
+            if (!keeps_type(r, index, peek(engine, 0))) {
+                goto stop;
+            }
+            frame->slots[index] = pop(engine);
+            break;
+        }
+
+        case MTR_OP_GET_GET:
+            push(engine, frame->slots[read_u16(ip + 1)]);
+            push(engine, frame->slots[read_u16(ip + 3)]);
+            break;
+
+        case MTR_OP_LOCAL_ADD_I:
+        case MTR_OP_LOCAL_SUB_I: {
+            const u16 dst = read_u16(ip + 1);
+            const i64 a = MTR_AS_INT(frame->slots[read_u16(ip + 3)]);
+            const i64 b = MTR_AS_INT(frame->slots[read_u16(ip + 5)]);
+            const mtr_value result = MTR_INT(step.op == MTR_OP_LOCAL_ADD_I ? a + b : a - b);
+            if (!keeps_type(r, dst, result)) {
+                goto stop;
+            }
+            frame->slots[dst] = result;
+            break;
+        }
+
+        case MTR_OP_LOCAL_INC_I: {
+            const u16 dst = read_u16(ip + 1);
+            const mtr_value result = MTR_INT(MTR_AS_INT(frame->slots[dst]) + read_i16(ip + 3));
+            if (!keeps_type(r, dst, result)) {
+                goto stop;
+            }
+            frame->slots[dst] = result;
+            break;
+        }
+
+        case MTR_OP_SET_GET: {
+            const u16 index = read_u16(ip + 1);
+            if (!keeps_type(r, index, peek(engine, 0))) {
+                goto stop;
+            }
+            frame->slots[index] = peek(engine, 0);
+            break;
+        }
+
+        case MTR_OP_GLOBAL_GET:
+            push(engine, MTR_OBJ(engine->globals[read_u16(ip + 1)]));
+            break;
+
+        case MTR_OP_UPVALUE_GET: {
+            const mtr_value value = frame->upvalues[read_u16(ip + 1)];
+            step.type = MTR_TYPE_OF(value);
+            push(engine, value);
+            break;
+        }
+
+        // stores of objects need the write barrier (runtime/memory.h), traces only store numbers
+        case MTR_OP_UPVALUE_SET:
+            if (MTR_IS_OBJ(peek(engine, 0))) {
+                goto stop;
+            }
+            frame->upvalues[read_u16(ip + 1)] = pop(engine);
+            break;
+
+        case MTR_OP_INDEX_GET:
+        case MTR_OP_INDEX_GET_ARRAY:
+        case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+        case MTR_OP_INDEX_GET_MAP: {
+            struct mtr_object* object = MTR_AS_OBJ(peek(engine, 1));
+            const mtr_value key = peek(engine, 0);
+            mtr_value value;
+            if (object->type == MTR_OBJ_ARRAY && in_bounds((struct mtr_array*) object, key)) {
+                value = mtr_array_get((struct mtr_array*) object, (size_t) MTR_AS_INT(key));
+                step.layout = (u8) ((struct mtr_array*) object)->layout;
+            } else if (object->type == MTR_OBJ_MAP) {
+                value = mtr_map_get((struct mtr_map*) object, key);
+            } else {
+                goto stop;
+            }
+            step.object = (u8) object->type;
+            step.type = MTR_TYPE_OF(value);
+            engine->stack_top -= 2;
+            push(engine, value);
+            break;
+        }
+
+        case MTR_OP_INDEX_SET:
+        case MTR_OP_INDEX_SET_ARRAY:
+        case MTR_OP_INDEX_SET_ARRAY_UNCHECKED:
+        case MTR_OP_INDEX_SET_MAP: {
+            struct mtr_object* object = MTR_AS_OBJ(peek(engine, 1));
+            const mtr_value key = peek(engine, 0);
+            const mtr_value value = peek(engine, 2);
+            if (MTR_IS_OBJ(key) || MTR_IS_OBJ(value)) {
+                goto stop;
+            }
+            // an array that has to be unpacked changes layout under the trace
+            if (object->type == MTR_OBJ_ARRAY && in_bounds((struct mtr_array*) object, key)
+                    && mtr_array_holds((struct mtr_array*) object, value)) {
+                mtr_array_set((struct mtr_array*) object, (size_t) MTR_AS_INT(key), value);
+                step.layout = (u8) ((struct mtr_array*) object)->layout;
+            } else if (object->type == MTR_OBJ_MAP) {
+                mtr_map_insert((struct mtr_map*) object, key, value);
+            } else {
+                goto stop;
+            }
+            step.object = (u8) object->type;
+            engine->stack_top -= 3;
+            break;
+        }
+
+        case MTR_OP_STRUCT_GET: {
+            const struct mtr_struct* s = (const struct mtr_struct*) MTR_AS_OBJ(pop(engine));
+            const mtr_value value = s->members[(u8) read_u16(ip + 1)];
+            step.type = MTR_TYPE_OF(value);
+            push(engine, value);
+            break;
+        }
+
+        case MTR_OP_STRUCT_SET: {
+            if (MTR_IS_OBJ(peek(engine, 1))) {
+                goto stop;
+            }
+            struct mtr_struct* s = (struct mtr_struct*) MTR_AS_OBJ(pop(engine));
+            s->members[(u8) read_u16(ip + 1)] = pop(engine);
+            break;
+        }
+
+        case MTR_OP_JMP:
+            break;
+
+        case MTR_OP_JMP_Z:
+        case MTR_OP_JMP_NZ:
+            pop(engine);
+            break;
+
+        case MTR_OP_LESS_I_JMP_Z:
+        case MTR_OP_GREATER_I_JMP_Z:
+        case MTR_OP_EQUAL_I_JMP_Z:
+        case MTR_OP_LESS_EQUAL_I_JMP_Z:
+        case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+        case MTR_OP_NOT_EQUAL_I_JMP_Z:
+            engine->stack_top -= 2;
+            break;
+
+        case MTR_OP_POP:
+            pop(engine);
+            break;
+
+        case MTR_OP_POP_V:
+            engine->stack_top -= read_u16(ip + 1);
+            break;
+
+        case MTR_OP_INT_CAST:
+            engine->stack_top[-1] = MTR_INT((i64) MTR_AS_FLOAT(engine->stack_top[-1]));
+            break;
+
+        case MTR_OP_FLOAT_CAST:
+            engine->stack_top[-1] = MTR_FLOAT((f64) MTR_AS_INT(engine->stack_top[-1]));
+            break;
+
+        default:
+            goto stop;
+        }
+
+        append(r, step);
+        ip = next + jump;
+        if (ip == header) {
+            *at = ip;
+            return true;
+        }
+    }
+
+stop:
+    *at = ip;
+    return false;
+}
+
+#undef BINARY
+
+void mtr_free_recording(struct mtr_recording* r) {
+    free(r->steps);
+    free(r->types);
+    *r = (struct mtr_recording) { 0 };
+}
+
+#endif
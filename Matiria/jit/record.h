@@ -0,0 +1,42 @@
+#ifndef MTR_RECORD_H
+#define MTR_RECORD_H
+
+#include "bytecode.h"
+
+#include "runtime/engine.h"
+
+#include "core/types.h"
+
+// The trace recorder (trace.h). It runs one iteration of a hot loop itself, instruction by
+// instruction, and writes down what the trace compiler can't read from the bytecode: which way
+// every branch went and the types of what came out of memory.
+
+// Longer loop bodies are left to the method compiler
+#define MTR_MAX_TRACE_STEPS 512
+
+struct mtr_trace_step {
+    u8* ip;
+    u8 op;
+    u8 object;  // enum mtr_object_t the INDEX ops found, the trace is specialized on it
+    u8 layout;  // enum mtr_array_layout of the arrays they found, likewise
+    u8 type;    // enum mtr_value_type of the value INDEX_GET, STRUCT_GET and UPVALUE_GET loaded
+    bool taken; // conditional jumps, OR and AND
+};
+
+struct mtr_recording {
+    struct mtr_trace_step* steps;
+    u32 count;
+    u32 capacity;
+    u32 depth;                  // values of the frame at the header, the slots of the locals around the loop
+    enum mtr_value_type* types; // of those values, they keep them for the whole iteration
+    bool left;                  // the iteration left the loop for an outer one, the loop can still be traced
+};
+
+// Runs the loop from the header at *ip until its back-edge jumps to the header again and returns true.
+// Returns false at the first instruction a trace can't hold, before running it, or when a local around
+// the loop is given a value of another type. Either way the frame is left between two instructions and
+// *ip is where the interpreter carries on.
+bool mtr_record_trace(struct mtr_recording* recording, struct mtr_engine* engine, struct mtr_call_frame* frame, u8** ip);
+void mtr_free_recording(struct mtr_recording* recording);
+
+#endif
@@ -0,0 +1,1383 @@
+#include "trace.h"
+
+#ifdef MTR_JIT_ENABLED
+
+#include "record.h"
+#include "x64.h"
+
+#include "runtime/engine.h"
+#include "runtime/object.h"
+
+#include "core/log.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+u32 mtr_trace_threshold = MTR_TRACE_THRESHOLD;
+
+// The compiled trace keeps these for the whole loop:
+//   rbx  engine
+//   r12  frame
+//   r13  frame->slots
+//   r14  the stack top at the header, which the trace never moves (the exits write it)
+// rax, rdx, xmm0 and xmm1 are scratch inside one instruction. The others hold the locals
+// the loop uses most and the temporaries of the expressions in between.
+
+#define ENGINE RBX
+#define FRAME  R12
+#define SLOTS  R13
+#define TOP    R14
+
+static const u8 registers[] = { RCX, RSI, RDI, R8, R9, R10, R11, R15, RBP };
+
+#define REGISTER_COUNT ((u32) sizeof(registers))
+#define FIRST_XMM 2
+#define XMM_COUNT 16
+
+// Left to temporaries when the locals are given registers
+#define SPARE_REGISTERS 4
+#define SPARE_XMMS 4
+
+enum place {
+    IMMEDIATE,
+    GPR,
+    XMM,
+    MEMORY     // a local around the loop that has no register, at its slot
+};
+
+// A value of the frame as the compiled code has it at some point of the iteration
+struct operand {
+    enum place place;
+    enum mtr_value_type type;
+    u8 reg;
+    u16 slot;
+    u64 bits;
+};
+
+// Where a guard goes when it fails: the values above the locals around the loop at that
+// point, which the exit writes to the stack, and the instruction the interpreter runs next
+struct exit {
+    size_t at;
+    u8* ip;
+    struct operand* stack;
+    u32 count;
+};
+
+// A local around the loop
+struct local {
+    enum place place;  // GPR or XMM when it lives in a register, MEMORY otherwise
+    u8 reg;
+    bool used;         // its type is checked before the trace runs
+    bool written;      // its register is written back at every exit
+    u32 weight;
+};
+
+struct compiler {
+    struct assembler a;                 // its fixups are the reads of Float constants
+    const struct mtr_recording* r;
+    const struct mtr_chunk* chunk;
+    struct local* locals;               // r->depth of them
+    struct operand* stack;              // the values above them
+    u32 count;
+    u32 capacity;
+    u8 uses[16];                        // operands and locals in each general purpose register
+    u8 xmm_uses[XMM_COUNT];
+    struct exit* exits;
+    u32 exit_count;
+    u32 exit_capacity;
+    u64* pool;                          // Float constants, placed after the code
+    u32 pool_count;
+    u32 pool_capacity;
+    bool failed;                        // ran out of registers
+};
+
+static bool is_float(enum mtr_value_type type) {
+    return type == MTR_VAL_FLOAT;
+}
+
+static bool fits_i32(u64 bits) {
+    return (i64) bits == (i64) (i32) bits;
+}
+
+static u16 read_u16(const u8* ip) {
+    u16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+static i16 read_i16(const u8* ip) {
+    i16 value;
+    memcpy(&value, ip, sizeof(value));
+    return value;
+}
+
+// Registers
+
+static u8 uses(const struct compiler* c, struct operand o) {
+    return o.place == GPR ? c->uses[o.reg] : o.place == XMM ? c->xmm_uses[o.reg] : 0;
+}
+
+static void hold(struct compiler* c, struct operand o) {
+    if (o.place == GPR) {
+        ++c->uses[o.reg];
+    } else if (o.place == XMM) {
+        ++c->xmm_uses[o.reg];
+    }
+}
+
+static void release(struct compiler* c, struct operand o) {
+    if (o.place == GPR) {
+        --c->uses[o.reg];
+    } else if (o.place == XMM) {
+        --c->xmm_uses[o.reg];
+    }
+}
+
+static u8 new_register(struct compiler* c) {
+    for (u32 i = 0; i < REGISTER_COUNT; ++i) {
+        if (c->uses[registers[i]] == 0) {
+            c->uses[registers[i]] = 1;
+            return registers[i];
+        }
+    }
+    c->failed = true;
+    return RAX;
+}
+
+static u8 new_xmm(struct compiler* c) {
+    for (u8 x = FIRST_XMM; x < XMM_COUNT; ++x) {
+        if (c->xmm_uses[x] == 0) {
+            c->xmm_uses[x] = 1;
+            return x;
+        }
+    }
+    c->failed = true;
+    return XMM0;
+}
+
+static struct operand new_operand(struct compiler* c, enum mtr_value_type type) {
+    struct operand o = { .place = is_float(type) ? XMM : GPR, .type = type };
+    o.reg = o.place == XMM ? new_xmm(c) : new_register(c);
+    return o;
+}
+
+// The virtual stack
+
+static void push(struct compiler* c, struct operand o) {
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 16;
+        c->stack = realloc(c->stack, sizeof(struct operand) * c->capacity);
+    }
+    c->stack[c->count++] = o;
+}
+
+static struct operand pop(struct compiler* c) {
+    return c->stack[--c->count];
+}
+
+static struct operand* peek(struct compiler* c, u32 distance) {
+    return c->stack + c->count - 1 - distance;
+}
+
+static struct operand immediate(enum mtr_value_type type, u64 bits) {
+    return (struct operand) { .place = IMMEDIATE, .type = type, .bits = bits };
+}
+
+// Moves
+
+// op xmm, [rip + Float constant]
+static void sse_pool(struct compiler* c, u8 prefix, u8 op, u8 xmm, u64 bits) {
+    u32 index = 0;
+    while (index < c->pool_count && c->pool[index] != bits) {
+        ++index;
+    }
+    if (index == c->pool_count) {
+        if (c->pool_count == c->pool_capacity) {
+            c->pool_capacity = c->pool_capacity ? c->pool_capacity * 2 : 8;
+            c->pool = realloc(c->pool, sizeof(u64) * c->pool_capacity);
+        }
+        c->pool[c->pool_count++] = bits;
+    }
+
+    byte(&c->a, prefix);
+    rex(&c->a, false, xmm, 0);
+    byte(&c->a, 0x0F);
+    byte(&c->a, op);
+    byte(&c->a, 0x05 | ((xmm & 7) << 3));
+    rel32_later(&c->a, index);
+}
+
+// op xmm, o where o is a Float anywhere but in a general purpose register
+static void sse(struct compiler* c, u8 prefix, u8 op, u8 xmm, struct operand o) {
+    switch (o.place) {
+    case XMM:       sse_reg(&c->a, prefix, false, op, xmm, o.reg); break;
+    case MEMORY:    sse_mem(&c->a, prefix, false, op, xmm, SLOTS, SLOT_PAYLOAD(o.slot)); break;
+    case IMMEDIATE: sse_pool(c, prefix, op, xmm, o.bits); break;
+    default:        break;
+    }
+}
+
+// The value of o into reg, an xmm register for Floats and a general purpose one otherwise
+static void load_to(struct compiler* c, u8 reg, struct operand o) {
+    struct assembler* a = &c->a;
+    if (is_float(o.type)) {
+        if (o.place != XMM || o.reg != reg) {
+            if (o.place == XMM) {
+                op_0f_reg(a, false, 0x28, reg, o.reg);              // movaps
+            } else {
+                sse(c, 0xF2, 0x10, reg, o);                          // movsd
+            }
+        }
+        return;
+    }
+
+    switch (o.place) {
+    case GPR:
+        if (o.reg != reg) {
+            move(a, reg, o.reg);
+        }
+        break;
+    case MEMORY:
+        load(a, reg, SLOTS, SLOT_PAYLOAD(o.slot));
+        break;
+    case IMMEDIATE:
+        if (fits_i32(o.bits)) {
+            op_reg(a, true, 0xC7, 0, reg);                           // mov reg, imm32
+            dword(a, (u32) o.bits);
+        } else {
+            move_imm(a, reg, o.bits);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// The payload of o at base + disp, rdx is used on the way
+static void store_payload(struct compiler* c, u8 base, i32 disp, struct operand o) {
+    struct assembler* a = &c->a;
+    switch (o.place) {
+    case GPR:
+        store(a, base, disp, o.reg);
+        break;
+    case XMM:
+        sse_mem(a, 0xF2, false, 0x11, o.reg, base, disp);            // movsd
+        break;
+    case IMMEDIATE:
+        if (fits_i32(o.bits)) {
+            op_mem(a, true, 0xC7, 0, base, disp);
+            dword(a, (u32) o.bits);
+        } else {
+            move_imm(a, RDX, o.bits);
+            store(a, base, disp, RDX);
+        }
+        break;
+    case MEMORY:
+        load(a, RDX, SLOTS, SLOT_PAYLOAD(o.slot));
+        store(a, base, disp, RDX);
+        break;
+    }
+}
+
+// The whole value, type and payload
+static void store_value(struct compiler* c, u8 base, i32 disp, struct operand o) {
+    set_type(&c->a, base, disp, o.type);
+    store_payload(c, base, disp + PAYLOAD, o);
+}
+
+// Objects are addressed through a register
+static void to_register(struct compiler* c, struct operand* o) {
+    if (o->place != GPR) {
+        const u8 reg = new_register(c);
+        load_to(c, reg, *o);
+        o->place = GPR;
+        o->reg = reg;
+    }
+}
+
+// Locals
+
+static bool aliases(const struct local* l, u16 slot, struct operand o) {
+    if (l->place == MEMORY) {
+        return o.place == MEMORY && o.slot == slot;
+    }
+    return o.place == l->place && o.reg == l->reg;
+}
+
+static struct operand local(struct compiler* c, u16 slot) {
+    if (slot >= c->r->depth) {
+        const struct operand o = c->stack[slot - c->r->depth];
+        hold(c, o);
+        return o;
+    }
+
+    const struct local* l = c->locals + slot;
+    const struct operand o = { .place = l->place, .type = c->r->types[slot], .reg = l->reg, .slot = slot };
+    hold(c, o);
+    return o;
+}
+
+static void set_local(struct compiler* c, u16 slot, struct operand value) {
+    if (slot >= c->r->depth) {
+        struct operand* o = c->stack + slot - c->r->depth;
+        release(c, *o);
+        *o = value;
+        return;
+    }
+
+    struct local* l = c->locals + slot;
+    if (l->place != MEMORY && aliases(l, slot, value)) {
+        // computed in place
+        l->written = true;
+        release(c, value);
+        return;
+    }
+
+    // what was read from the local before keeps the old value
+    for (u32 i = 0; i < c->count; ++i) {
+        struct operand* o = c->stack + i;
+        if (aliases(l, slot, *o)) {
+            const struct operand copy = new_operand(c, o->type);
+            load_to(c, copy.reg, *o);
+            release(c, *o);
+            *o = copy;
+        }
+    }
+
+    if (l->place == MEMORY) {
+        store_payload(c, SLOTS, SLOT_PAYLOAD(slot), value);
+    } else {
+        load_to(c, l->reg, value);
+        l->written = true;
+    }
+    release(c, value);
+}
+
+// Whether the result of an instruction on o can be computed in o's register because the
+// next instruction stores it to the local that register belongs to
+static bool in_place(const struct compiler* c, i32 target, struct operand o) {
+    if (target < 0 || uses(c, o) != 2) {
+        return false;
+    }
+    if ((u32) target < c->r->depth) {
+        return aliases(c->locals + target, (u16) target, o) && o.place != MEMORY;
+    }
+
+    const u32 index = (u32) target - c->r->depth;
+    return index < c->count && c->stack[index].place == o.place && c->stack[index].reg == o.reg;
+}
+
+// A register for the result of an instruction on o, which is o's own when nothing else reads it.
+// With copy the register holds o's value.
+static struct operand result_register(struct compiler* c, struct operand o, i32 target, bool copy) {
+    if (in_place(c, target, o) || uses(c, o) == 1) {
+        return o;
+    }
+    const struct operand result = new_operand(c, o.type);
+    if (copy) {
+        load_to(c, result.reg, o);
+    }
+    release(c, o);
+    return result;
+}
+
+// Guards
+
+static void guard(struct compiler* c, enum condition cc, u8* ip) {
+    if (c->exit_count == c->exit_capacity) {
+        c->exit_capacity = c->exit_capacity ? c->exit_capacity * 2 : 16;
+        c->exits = realloc(c->exits, sizeof(struct exit) * c->exit_capacity);
+    }
+
+    struct exit* e = c->exits + c->exit_count++;
+    e->at = jcc_forward(&c->a, cc);
+    e->ip = ip;
+    e->count = c->count;
+    e->stack = malloc(sizeof(struct operand) * (c->count + 1));
+    memcpy(e->stack, c->stack, sizeof(struct operand) * c->count);
+}
+
+// Sets ZF when the Int o is 0
+static void test(struct compiler* c, struct operand o) {
+    if (o.place == GPR) {
+        op_reg(&c->a, true, 0x85, o.reg, o.reg);                     // test reg, reg
+    } else {
+        test_zero(&c->a, SLOTS, SLOT_PAYLOAD(o.slot));
+    }
+}
+
+static void check_object(struct compiler* c, u8 reg, enum mtr_object_t type, u8* ip) {
+    imm_mem(&c->a, false, 7, reg, (i32) offsetof(struct mtr_object, type), type);
+    guard(c, CC_NE, ip);
+}
+
+static void check_type(struct compiler* c, u8 base, i32 disp, enum mtr_value_type type, u8* ip) {
+    imm_mem(&c->a, false, 7, base, disp, type);
+    guard(c, CC_NE, ip);
+}
+
+// Arithmetic
+
+enum alu { ALU_ADD, ALU_SUB, ALU_MUL, ALU_CMP };
+
+static void alu(struct compiler* c, enum alu op, u8 dst, struct operand o) {
+    static const u8 opcodes[] = { 0x03, 0x2B, 0xAF, 0x3B };
+    static const u8 extensions[] = { 0, 5, 0, 7 };
+    struct assembler* a = &c->a;
+
+    if (o.place == IMMEDIATE && fits_i32(o.bits)) {
+        if (op == ALU_MUL) {
+            op_reg(a, true, 0x69, dst, dst);                         // imul dst, dst, imm32
+            dword(a, (u32) o.bits);
+        } else {
+            imm_reg(a, extensions[op], dst, (i32) o.bits);
+        }
+        return;
+    }
+
+    if (o.place == IMMEDIATE) {
+        move_imm(a, RDX, o.bits);
+        o.place = GPR;
+        o.reg = RDX;
+    }
+
+    if (o.place == GPR) {
+        if (op == ALU_MUL) {
+            op_0f_reg(a, true, opcodes[op], dst, o.reg);
+        } else {
+            op_reg(a, true, opcodes[op], dst, o.reg);
+        }
+    } else if (op == ALU_MUL) {
+        op_0f_mem(a, true, opcodes[op], dst, SLOTS, SLOT_PAYLOAD(o.slot));
+    } else {
+        op_mem(a, true, opcodes[op], dst, SLOTS, SLOT_PAYLOAD(o.slot));
+    }
+}
+
+static void int_binary(struct compiler* c, u8 op, i32 target) {
+    struct operand right = pop(c);
+    struct operand left = pop(c);
+
+    if (op == MTR_OP_DIV_I) {
+        // idiv takes no immediate and wants the dividend in rdx:rax
+        if (right.place == IMMEDIATE) {
+            right = result_register(c, right, -1, true);
+        }
+        load_to(c, RAX, left);
+        byte(&c->a, 0x48); byte(&c->a, 0x99);                        // cqo
+        if (right.place == GPR) {
+            op_reg(&c->a, true, 0xF7, 7, right.reg);
+        } else {
+            op_mem(&c->a, true, 0xF7, 7, SLOTS, SLOT_PAYLOAD(right.slot));
+        }
+        const struct operand result = result_register(c, left, target, false);
+        load_to(c, result.reg, (struct operand) { .place = GPR, .type = MTR_VAL_INT, .reg = RAX });
+        release(c, right);
+        push(c, result);
+        return;
+    }
+
+    static const enum alu alus[] = {
+        [MTR_OP_ADD_I - MTR_OP_ADD_I] = ALU_ADD,
+        [MTR_OP_SUB_I - MTR_OP_ADD_I] = ALU_SUB,
+        [MTR_OP_MUL_I - MTR_OP_ADD_I] = ALU_MUL
+    };
+    const struct operand result = result_register(c, left, target, true);
+    alu(c, alus[op - MTR_OP_ADD_I], result.reg, right);
+    release(c, right);
+    push(c, result);
+}
+
+// idiv faults where the interpreter doesn't, the recorder stopped on these divisors and so does the trace
+static void check_divisor(struct compiler* c, u8* ip) {
+    const struct operand divisor = *peek(c, 0);
+    if (divisor.place == IMMEDIATE) {
+        if (divisor.bits == 0 || divisor.bits == (u64) -1) {
+            c->failed = true;
+        }
+        return;
+    }
+
+    for (i32 bad = 0; bad >= -1; --bad) {
+        if (divisor.place == GPR) {
+            imm_reg(&c->a, 7, divisor.reg, bad);
+        } else {
+            imm_mem(&c->a, true, 7, SLOTS, SLOT_PAYLOAD(divisor.slot), bad);
+        }
+        guard(c, CC_E, ip);
+    }
+}
+
+static void float_binary(struct compiler* c, u8 op, i32 target) {
+    static const u8 opcodes[] = {
+        [MTR_OP_ADD_F - MTR_OP_ADD_F] = 0x58,
+        [MTR_OP_SUB_F - MTR_OP_ADD_F] = 0x5C,
+        [MTR_OP_MUL_F - MTR_OP_ADD_F] = 0x59,
+        [MTR_OP_DIV_F - MTR_OP_ADD_F] = 0x5E
+    };
+    const struct operand right = pop(c);
+    const struct operand result = result_register(c, pop(c), target, true);
+    sse(c, 0xF2, opcodes[op - MTR_OP_ADD_F], result.reg, right);
+    release(c, right);
+    push(c, result);
+}
+
+// The Int in al onto the stack
+static void push_flag(struct compiler* c) {
+    byte(&c->a, 0x0F); byte(&c->a, 0xB6); byte(&c->a, 0xC0);      // movzx eax, al
+    const struct operand flag = new_operand(c, MTR_VAL_INT);
+    load_to(c, flag.reg, (struct operand) { .place = GPR, .type = MTR_VAL_INT, .reg = RAX });
+    push(c, flag);
+}
+
+static void set_al(struct compiler* c, enum condition cc) {
+    byte(&c->a, 0x0F); byte(&c->a, 0x90 + cc); byte(&c->a, 0xC0);
+}
+
+// cmp of the two Ints on top, popped
+static void int_compare(struct compiler* c) {
+    const struct operand right = pop(c);
+    const struct operand left = pop(c);
+    u8 reg = left.reg;
+    if (left.place != GPR) {
+        load_to(c, RAX, left);
+        reg = RAX;
+    }
+    alu(c, ALU_CMP, reg, right);
+    release(c, right);
+    release(c, left);
+}
+
+// ucomisd sets CF, ZF and PF when either side is NaN, so < and <= compare the other way
+// round with 'above' to come out false like they do in C
+static void float_compare(struct compiler* c, u8 op) {
+    const struct operand right = pop(c);
+    const struct operand left = pop(c);
+    const bool swap = op == MTR_OP_LESS_F || op == MTR_OP_LESS_EQUAL_F;
+    const struct operand first = swap ? right : left;
+    const struct operand second = swap ? left : right;
+
+    u8 reg = first.reg;
+    if (first.place != XMM) {
+        load_to(c, XMM0, first);
+        reg = XMM0;
+    }
+    sse(c, 0x66, 0x2E, reg, second);                                 // ucomisd
+    release(c, right);
+    release(c, left);
+
+    struct assembler* a = &c->a;
+    switch (op) {
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+        set_al(c, CC_A);
+        break;
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+        set_al(c, CC_AE);
+        break;
+    case MTR_OP_EQUAL_F:
+        byte(a, 0x0F); byte(a, 0x90 + CC_NP); byte(a, 0xC2);        // setnp dl
+        set_al(c, CC_E);
+        byte(a, 0x20); byte(a, 0xD0);                                // and al, dl
+        break;
+    case MTR_OP_NOT_EQUAL_F:
+        byte(a, 0x0F); byte(a, 0x90 + CC_P); byte(a, 0xC2);         // setp dl
+        set_al(c, CC_NE);
+        byte(a, 0x08); byte(a, 0xD0);                                // or al, dl
+        break;
+    }
+    push_flag(c);
+}
+
+// Calls into C
+
+static bool caller_saved(u8 reg) {
+    return reg != RBP && reg != R15;
+}
+
+// Stores the registers that hold values below rsp before a call into C, or loads them back after it
+static void spill(struct compiler* c, bool back) {
+    struct assembler* a = &c->a;
+    u32 count = 0;
+    for (u32 i = 0; i < REGISTER_COUNT; ++i) {
+        count += c->uses[registers[i]] != 0 && caller_saved(registers[i]);
+    }
+    for (u8 x = FIRST_XMM; x < XMM_COUNT; ++x) {
+        count += c->xmm_uses[x] != 0;
+    }
+
+    const i32 size = (i32) ((count * 8 + 15) & ~15u);
+    if (!back && size != 0) {
+        imm_reg(a, 5, RSP, size);                                    // sub rsp, size
+    }
+
+    i32 disp = 0;
+    for (u32 i = 0; i < REGISTER_COUNT; ++i) {
+        const u8 reg = registers[i];
+        if (c->uses[reg] != 0 && caller_saved(reg)) {
+            if (back) {
+                load(a, reg, RSP, disp);
+            } else {
+                store(a, RSP, disp, reg);
+            }
+            disp += 8;
+        }
+    }
+    for (u8 x = FIRST_XMM; x < XMM_COUNT; ++x) {
+        if (c->xmm_uses[x] != 0) {
+            sse_mem(a, 0xF2, false, back ? 0x10 : 0x11, x, RSP, disp);
+            disp += 8;
+        }
+    }
+
+    if (back && size != 0) {
+        imm_reg(a, 0, RSP, size);                                    // add rsp, size
+    }
+}
+
+// The map is in args[0] and the key in args[1], the value is left in args[0]
+static void map_get(mtr_value* args) {
+    args[0] = mtr_map_get((struct mtr_map*) MTR_AS_OBJ(args[0]), args[1]);
+}
+
+// args holds the value, the map and the key
+static void map_set(mtr_value* args) {
+    mtr_map_insert((struct mtr_map*) MTR_AS_OBJ(args[1]), args[2], args[0]);
+}
+
+// Calls the function with the values on top of the stack written out above it
+static i32 call_with_stack(struct compiler* c, u32 values, void (*function)(mtr_value*)) {
+    const i32 args = SLOT(c->count);
+    for (u32 i = 0; i < values; ++i) {
+        store_value(c, TOP, args + SLOT(i), *peek(c, values - 1 - i));
+    }
+    spill(c, false);
+    op_mem(&c->a, true, 0x8D, RDI, TOP, args);                       // lea rdi, [top + args]
+    call(&c->a, (u64) (uintptr_t) function);
+    spill(c, true);
+    return args;
+}
+
+// Indexing
+
+// log2 of the bytes of an element
+static u8 element_shift(u8 layout) {
+    switch (layout) {
+    case MTR_ARRAY_INTS:
+    case MTR_ARRAY_FLOATS: return 3;
+    case MTR_ARRAY_BOOLS:  return 0;
+    default:               return 4;
+    }
+}
+
+// rax + the returned displacement is the element of the array at peek(1) for the key on top.
+// The layout the recording saw is always guarded, the unchecked op codes leave out the rest.
+static i32 array_element(struct compiler* c, const struct mtr_trace_step* s) {
+    struct assembler* a = &c->a;
+    const bool checked = s->op != MTR_OP_INDEX_GET_ARRAY_UNCHECKED && s->op != MTR_OP_INDEX_SET_ARRAY_UNCHECKED;
+    struct operand* array = peek(c, 1);
+    to_register(c, array);
+    if (checked) {
+        check_object(c, array->reg, MTR_OBJ_ARRAY, s->ip);
+    }
+    imm_mem(a, false, 7, array->reg, (i32) offsetof(struct mtr_array, layout), s->layout);
+    guard(c, CC_NE, s->ip);
+
+    const u8 shift = element_shift(s->layout);
+    const struct operand key = *peek(c, 0);
+    const i32 size = (i32) offsetof(struct mtr_array, size);
+    const i32 elements = (i32) offsetof(struct mtr_array, elements);
+    if (key.place == IMMEDIATE && key.bits < (1u << 26)) {
+        if (checked) {
+            imm_mem(a, true, 7, array->reg, size, (i32) key.bits);  // cmp qword [size], key
+            guard(c, CC_BE, s->ip);
+        }
+        load(a, RAX, array->reg, elements);
+        return (i32) (key.bits << shift);
+    }
+
+    load_to(c, RDX, key);
+    if (checked) {
+        op_mem(a, true, 0x3B, RDX, array->reg, size);               // cmp rdx, [size]
+        guard(c, CC_AE, s->ip);
+    }
+    load(a, RAX, array->reg, elements);
+    if (shift != 0) {
+        op_reg(a, true, 0xC1, 4, RDX); byte(a, shift);              // shl rdx, shift
+    }
+    op_reg(a, true, 0x01, RDX, RAX);                                 // add rax, rdx
+    return 0;
+}
+
+// An Int or Float at base + disp, Objects too
+static void load_payload(struct compiler* c, u8 base, i32 disp, enum mtr_value_type type) {
+    const struct operand value = new_operand(c, type);
+    if (value.place == XMM) {
+        sse_mem(&c->a, 0xF2, false, 0x10, value.reg, base, disp);
+    } else {
+        load(&c->a, value.reg, base, disp);
+    }
+    push(c, value);
+}
+
+static void load_element(struct compiler* c, u8 base, i32 disp, enum mtr_value_type type) {
+    load_payload(c, base, disp + PAYLOAD, type);
+}
+
+static void index_get(struct compiler* c, const struct mtr_trace_step* s) {
+    if (s->object == MTR_OBJ_ARRAY) {
+        const i32 disp = array_element(c, s);
+        if (s->layout == MTR_ARRAY_VALUES) {
+            check_type(c, RAX, disp, s->type, s->ip);
+        }
+        release(c, pop(c));
+        release(c, pop(c));
+        if (s->layout == MTR_ARRAY_VALUES) {
+            load_element(c, RAX, disp, s->type);
+        } else if (s->layout == MTR_ARRAY_BOOLS) {
+            const struct operand value = new_operand(c, MTR_VAL_INT);
+            op_0f_mem(&c->a, false, 0xB6, value.reg, RAX, disp);     // movzx reg, byte [rax + disp]
+            push(c, value);
+        } else {
+            // packed Ints and Floats are what the layout says
+            load_payload(c, RAX, disp, s->type);
+        }
+        return;
+    }
+
+    struct operand* map = peek(c, 1);
+    to_register(c, map);
+    check_object(c, map->reg, MTR_OBJ_MAP, s->ip);
+    const i32 args = call_with_stack(c, 2, map_get);
+    // a missing key gives nil, which the interpreter has to see
+    check_type(c, TOP, args, s->type, s->ip);
+    release(c, pop(c));
+    release(c, pop(c));
+    load_element(c, TOP, args, s->type);
+}
+
+// The recording only goes on with values the layout holds, the type of every value in a
+// trace is fixed, so only Bools can still not fit
+static void index_set(struct compiler* c, const struct mtr_trace_step* s) {
+    if (s->object == MTR_OBJ_ARRAY) {
+        const i32 disp = array_element(c, s);
+        const struct operand value = *peek(c, 2);
+        if (s->layout == MTR_ARRAY_VALUES) {
+            store_value(c, RAX, disp, value);
+        } else if (s->layout == MTR_ARRAY_BOOLS) {
+            load_to(c, RDX, value);
+            imm_reg(&c->a, 7, RDX, 1);
+            guard(c, CC_A, s->ip);
+            op_mem(&c->a, false, 0x88, RDX, RAX, disp);              // mov byte [rax + disp], dl
+        } else {
+            store_payload(c, RAX, disp, value);
+        }
+    } else {
+        struct operand* map = peek(c, 1);
+        to_register(c, map);
+        check_object(c, map->reg, MTR_OBJ_MAP, s->ip);
+        call_with_stack(c, 3, map_set);
+    }
+    for (u32 i = 0; i < 3; ++i) {
+        release(c, pop(c));
+    }
+}
+
+// Instructions
+
+// The slot the next instruction stores the result of this one to, -1 when it doesn't
+static i32 store_target(const struct mtr_trace_step* next) {
+    if (next && (next->op == MTR_OP_SET || next->op == MTR_OP_SET_GET)) {
+        return read_u16(next->ip + 1);
+    }
+    return -1;
+}
+
+static enum condition int_condition(u8 op) {
+    switch (op) {
+    case MTR_OP_LESS_I_JMP_Z:          return CC_L;
+    case MTR_OP_GREATER_I_JMP_Z:       return CC_G;
+    case MTR_OP_EQUAL_I_JMP_Z:         return CC_E;
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:    return CC_LE;
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z: return CC_GE;
+    default:                           return CC_NE;
+    }
+}
+
+static void write_step(struct compiler* c, const struct mtr_trace_step* s, const struct mtr_trace_step* next_step) {
+    struct assembler* a = &c->a;
+    u8* const ip = s->ip;
+    u8* const next = ip + mtr_instruction_length(ip);
+    const u8 op = s->op;
+
+    switch (op)
+    {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG: {
+        const mtr_value value = c->chunk->constants[op == MTR_OP_CONSTANT ? ip[1] : read_u16(ip + 1)];
+        push(c, immediate(MTR_TYPE_OF(value), MTR_BITS(value)));
+        break;
+    }
+
+    case MTR_OP_SMALL_INT: push(c, immediate(MTR_VAL_INT, (u64) (i64) read_i16(ip + 1))); break;
+    case MTR_OP_FALSE:     push(c, immediate(MTR_VAL_INT, 0)); break;
+    case MTR_OP_TRUE:      push(c, immediate(MTR_VAL_INT, 1)); break;
+    case MTR_OP_NIL:       push(c, immediate(MTR_VAL_INT, 0)); break;
+
+    case MTR_OP_BOX:
+        break;
+
+    case MTR_OP_OR:
+    case MTR_OP_AND: {
+        // taken keeps the value and jumps, the other way pops it and goes on
+        const struct operand value = *peek(c, 0);
+        const bool truthy = (op == MTR_OP_OR) == s->taken;
+        if (value.place != IMMEDIATE) {
+            test(c, value);
+            if (s->taken) {
+                --c->count;
+                guard(c, truthy ? CC_E : CC_NE, next);
+                ++c->count;
+            } else {
+                guard(c, truthy ? CC_E : CC_NE, next + read_i16(ip + 1));
+            }
+        }
+        if (!s->taken) {
+            release(c, pop(c));
+        }
+        break;
+    }
+
+    case MTR_OP_NOT: {
+        const struct operand value = pop(c);
+        if (value.place == IMMEDIATE) {
+            push(c, immediate(MTR_VAL_INT, value.bits == 0));
+            break;
+        }
+        test(c, value);
+        release(c, value);
+        set_al(c, CC_E);
+        push_flag(c);
+        break;
+    }
+
+    case MTR_OP_NEGATE_I: {
+        const struct operand value = result_register(c, pop(c), -1, true);
+        op_reg(a, true, 0xF7, 3, value.reg);                          // neg
+        push(c, value);
+        break;
+    }
+
+    case MTR_OP_NEGATE_F: {
+        const struct operand value = result_register(c, pop(c), -1, true);
+        sse_pool(c, 0x66, 0x57, value.reg, 0x8000000000000000ull);    // xorpd with the sign bit
+        push(c, value);
+        break;
+    }
+
+    case MTR_OP_DIV_I:
+        check_divisor(c, ip);
+        int_binary(c, op, store_target(next_step));
+        break;
+
+    case MTR_OP_ADD_I:
+    case MTR_OP_SUB_I:
+    case MTR_OP_MUL_I:
+        int_binary(c, op, store_target(next_step));
+        break;
+
+    case MTR_OP_ADD_F:
+    case MTR_OP_SUB_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_DIV_F:
+        float_binary(c, op, store_target(next_step));
+        break;
+
+    case MTR_OP_LESS_I:          int_compare(c); set_al(c, CC_L); push_flag(c); break;
+    case MTR_OP_GREATER_I:       int_compare(c); set_al(c, CC_G); push_flag(c); break;
+    case MTR_OP_EQUAL_I:         int_compare(c); set_al(c, CC_E); push_flag(c); break;
+    case MTR_OP_LESS_EQUAL_I:    int_compare(c); set_al(c, CC_LE); push_flag(c); break;
+    case MTR_OP_GREATER_EQUAL_I: int_compare(c); set_al(c, CC_GE); push_flag(c); break;
+    case MTR_OP_NOT_EQUAL_I:     int_compare(c); set_al(c, CC_NE); push_flag(c); break;
+
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+        float_compare(c, op);
+        break;
+
+    case MTR_OP_GET:
+        push(c, local(c, read_u16(ip + 1)));
+        break;
+
+    case MTR_OP_SET:
+        set_local(c, read_u16(ip + 1), pop(c));
+        break;
+
+    case MTR_OP_GET_GET:
+        push(c, local(c, read_u16(ip + 1)));
+        push(c, local(c, read_u16(ip + 3)));
+        break;
+
+    case MTR_OP_LOCAL_ADD_I:
+    case MTR_OP_LOCAL_SUB_I: {
+        const u16 dst = read_u16(ip + 1);
+        push(c, local(c, read_u16(ip + 3)));
+        push(c, local(c, read_u16(ip + 5)));
+        int_binary(c, op == MTR_OP_LOCAL_ADD_I ? MTR_OP_ADD_I : MTR_OP_SUB_I, dst);
+        set_local(c, dst, pop(c));
+        break;
+    }
+
+    case MTR_OP_LOCAL_INC_I: {
+        const u16 dst = read_u16(ip + 1);
+        push(c, local(c, dst));
+        push(c, immediate(MTR_VAL_INT, (u64) (i64) read_i16(ip + 3)));
+        int_binary(c, MTR_OP_ADD_I, dst);
+        set_local(c, dst, pop(c));
+        break;
+    }
+
+    case MTR_OP_SET_GET: {
+        const struct operand value = *peek(c, 0);
+        hold(c, value);
+        set_local(c, read_u16(ip + 1), value);
+        break;
+    }
+
+    case MTR_OP_GLOBAL_GET: {
+        const struct operand global = new_operand(c, MTR_VAL_OBJ);
+        load(a, global.reg, ENGINE, (i32) offsetof(struct mtr_engine, globals));
+        load(a, global.reg, global.reg, (i32) (read_u16(ip + 1) * sizeof(struct mtr_object*)));
+        push(c, global);
+        break;
+    }
+
+    case MTR_OP_UPVALUE_GET: {
+        const u16 index = read_u16(ip + 1);
+        load(a, RAX, FRAME, (i32) offsetof(struct mtr_call_frame, upvalues));
+        check_type(c, RAX, SLOT(index), s->type, ip);
+        load_element(c, RAX, SLOT(index), s->type);
+        break;
+    }
+
+    case MTR_OP_UPVALUE_SET: {
+        const struct operand value = pop(c);
+        load(a, RAX, FRAME, (i32) offsetof(struct mtr_call_frame, upvalues));
+        store_value(c, RAX, SLOT(read_u16(ip + 1)), value);
+        release(c, value);
+        break;
+    }
+
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_MAP:
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+        index_get(c, s);
+        break;
+
+    case MTR_OP_INDEX_SET:
+    case MTR_OP_INDEX_SET_ARRAY:
+    case MTR_OP_INDEX_SET_MAP:
+    case MTR_OP_INDEX_SET_ARRAY_UNCHECKED:
+        index_set(c, s);
+        break;
+
+    case MTR_OP_STRUCT_GET: {
+        const i32 member = SLOT((u8) read_u16(ip + 1));
+        struct operand* object = peek(c, 0);
+        to_register(c, object);
+        load(a, RAX, object->reg, (i32) offsetof(struct mtr_struct, members));
+        check_type(c, RAX, member, s->type, ip);
+        release(c, pop(c));
+        load_element(c, RAX, member, s->type);
+        break;
+    }
+
+    case MTR_OP_STRUCT_SET: {
+        struct operand* object = peek(c, 0);
+        to_register(c, object);
+        load(a, RAX, object->reg, (i32) offsetof(struct mtr_struct, members));
+        store_value(c, RAX, SLOT((u8) read_u16(ip + 1)), *peek(c, 1));
+        release(c, pop(c));
+        release(c, pop(c));
+        break;
+    }
+
+    case MTR_OP_JMP:
+        break;
+
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ: {
+        const struct operand value = pop(c);
+        if (value.place != IMMEDIATE) {
+            test(c, value);
+            // JMP_Z jumps on ZF, it leaves when the way it went doesn't hold anymore
+            const bool on_zero = (op == MTR_OP_JMP_Z) == s->taken;
+            guard(c, on_zero ? CC_NE : CC_E, s->taken ? next : next + read_i16(ip + 1));
+        }
+        release(c, value);
+        break;
+    }
+
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z: {
+        // these jump when the comparison is false, conditions invert with the lowest bit
+        const enum condition holds = int_condition(op);
+        int_compare(c);
+        if (s->taken) {
+            guard(c, holds, next);
+        } else {
+            guard(c, holds ^ 1, next + read_i16(ip + 1));
+        }
+        break;
+    }
+
+    case MTR_OP_POP:
+        release(c, pop(c));
+        break;
+
+    case MTR_OP_POP_V:
+        for (u16 i = read_u16(ip + 1); i > 0; --i) {
+            release(c, pop(c));
+        }
+        break;
+
+    case MTR_OP_INT_CAST: {
+        const struct operand value = pop(c);
+        if (value.place == IMMEDIATE) {
+            f64 f;
+            memcpy(&f, &value.bits, sizeof(f));
+            push(c, immediate(MTR_VAL_INT, (u64) (i64) f));
+            break;
+        }
+        const struct operand result = new_operand(c, MTR_VAL_INT);
+        if (value.place == XMM) {
+            sse_reg(a, 0xF2, true, 0x2C, result.reg, value.reg);      // cvttsd2si
+        } else {
+            sse_mem(a, 0xF2, true, 0x2C, result.reg, SLOTS, SLOT_PAYLOAD(value.slot));
+        }
+        release(c, value);
+        push(c, result);
+        break;
+    }
+
+    case MTR_OP_FLOAT_CAST: {
+        const struct operand value = pop(c);
+        if (value.place == IMMEDIATE) {
+            const f64 f = (f64) (i64) value.bits;
+            u64 bits;
+            memcpy(&bits, &f, sizeof(bits));
+            push(c, immediate(MTR_VAL_FLOAT, bits));
+            break;
+        }
+        const struct operand result = new_operand(c, MTR_VAL_FLOAT);
+        if (value.place == GPR) {
+            sse_reg(a, 0xF2, true, 0x2A, result.reg, value.reg);      // cvtsi2sd
+        } else {
+            sse_mem(a, 0xF2, true, 0x2A, result.reg, SLOTS, SLOT_PAYLOAD(value.slot));
+        }
+        release(c, value);
+        push(c, result);
+        break;
+    }
+
+    default:
+        MTR_ASSERT(false, "The recorder let an instruction through the compiler can't write.");
+        c->failed = true;
+        break;
+    }
+}
+
+// The locals the loop touches most get registers for the whole trace
+static void allocate_locals(struct compiler* c) {
+    const struct mtr_recording* r = c->r;
+    for (u32 i = 0; i < r->count; ++i) {
+        const struct mtr_trace_step* s = r->steps + i;
+        u16 slots[3];
+        u32 n = 0;
+        switch (s->op) {
+        case MTR_OP_GET:
+        case MTR_OP_SET:
+        case MTR_OP_SET_GET:
+        case MTR_OP_LOCAL_INC_I:
+            slots[n++] = read_u16(s->ip + 1);
+            break;
+        case MTR_OP_GET_GET:
+            slots[n++] = read_u16(s->ip + 1);
+            slots[n++] = read_u16(s->ip + 3);
+            break;
+        case MTR_OP_LOCAL_ADD_I:
+        case MTR_OP_LOCAL_SUB_I:
+            slots[n++] = read_u16(s->ip + 1);
+            slots[n++] = read_u16(s->ip + 3);
+            slots[n++] = read_u16(s->ip + 5);
+            break;
+        default:
+            break;
+        }
+        for (u32 j = 0; j < n; ++j) {
+            if (slots[j] < r->depth) {
+                c->locals[slots[j]].used = true;
+                ++c->locals[slots[j]].weight;
+            }
+        }
+    }
+
+    u32 gprs = 0;
+    u32 xmms = 0;
+    for (;;) {
+        struct local* best = NULL;
+        for (u32 i = 0; i < r->depth; ++i) {
+            struct local* l = c->locals + i;
+            const bool room = is_float(r->types[i]) ? xmms < XMM_COUNT - FIRST_XMM - SPARE_XMMS : gprs < REGISTER_COUNT - SPARE_REGISTERS;
+            if (l->place == MEMORY && l->weight != 0 && room && (NULL == best || l->weight > best->weight)) {
+                best = l;
+            }
+        }
+        if (NULL == best) {
+            break;
+        }
+
+        if (is_float(r->types[best - c->locals])) {
+            best->place = XMM;
+            best->reg = new_xmm(c);
+            ++xmms;
+        } else {
+            best->place = GPR;
+            best->reg = new_register(c);
+            ++gprs;
+        }
+    }
+}
+
+static void free_compiler(struct compiler* c) {
+    for (u32 i = 0; i < c->exit_count; ++i) {
+        free(c->exits[i].stack);
+    }
+    free(c->exits);
+    free(c->stack);
+    free(c->locals);
+    free(c->pool);
+    free(c->a.fixups);
+    free(c->a.code);
+}
+
+static void compile(struct mtr_trace* trace, const struct mtr_recording* r, const struct mtr_chunk* chunk) {
+    struct compiler c = { .r = r, .chunk = chunk };
+    struct assembler* a = &c.a;
+    c.locals = calloc(r->depth + 1, sizeof(struct local));
+    for (u32 i = 0; i < r->depth; ++i) {
+        c.locals[i].place = MEMORY;
+    }
+    allocate_locals(&c);
+
+    // callee saved registers, six pushes and the return address leave rsp 8 bytes off
+    byte(a, 0x53);                                                   // push rbx
+    byte(a, 0x55);                                                   // push rbp
+    byte(a, 0x41); byte(a, 0x54);                                    // push r12
+    byte(a, 0x41); byte(a, 0x55);                                    // push r13
+    byte(a, 0x41); byte(a, 0x56);                                    // push r14
+    byte(a, 0x41); byte(a, 0x57);                                    // push r15
+    imm_reg(a, 5, RSP, 8);                                           // sub rsp, 8
+    move(a, ENGINE, RDI);
+    move(a, FRAME, RSI);
+    load(a, SLOTS, FRAME, (i32) offsetof(struct mtr_call_frame, slots));
+    load(a, TOP, ENGINE, (i32) offsetof(struct mtr_engine, stack_top));
+
+    // the locals must have the types they had when the loop was recorded
+    size_t* mismatches = malloc(sizeof(size_t) * (r->depth + 1));
+    u32 mismatch_count = 0;
+    for (u32 i = 0; i < r->depth; ++i) {
+        if (c.locals[i].used) {
+            imm_mem(a, false, 7, SLOTS, SLOT(i), r->types[i]);
+            mismatches[mismatch_count++] = jcc_forward(a, CC_NE);
+        }
+    }
+    for (u32 i = 0; i < r->depth; ++i) {
+        if (c.locals[i].place != MEMORY) {
+            load_to(&c, c.locals[i].reg, (struct operand) { .place = MEMORY, .type = r->types[i], .slot = (u16) i });
+        }
+    }
+
+    const size_t loop = a->size;
+    move_imm(a, RAX, (u64) (uintptr_t) &trace->iterations);
+    op_mem(a, true, 0xFF, 0, RAX, 0);                                // inc qword [rax]
+    for (u32 i = 0; i < r->count; ++i) {
+        write_step(&c, r->steps + i, i + 1 < r->count ? r->steps + i + 1 : NULL);
+    }
+    if (c.count != 0) {
+        c.failed = true;
+    }
+    patch(a, jmp_forward(a), loop);
+
+    // exits write the values above the locals out and leave rax = ip, rdx = stack top for the tail
+    size_t* tail_jumps = malloc(sizeof(size_t) * (c.exit_count + 1));
+    for (u32 i = 0; i < c.exit_count; ++i) {
+        const struct exit* e = c.exits + i;
+        patch(a, e->at, a->size);
+        for (u32 k = 0; k < e->count; ++k) {
+            store_value(&c, TOP, SLOT(k), e->stack[k]);
+        }
+        op_mem(a, true, 0x8D, RDX, TOP, SLOT(e->count));           // lea rdx, [top + count]
+        move_imm(a, RAX, (u64) (uintptr_t) e->ip);
+        tail_jumps[i] = jmp_forward(a);
+    }
+
+    for (u32 i = 0; i < c.exit_count; ++i) {
+        patch(a, tail_jumps[i], a->size);
+    }
+    for (u32 i = 0; i < r->depth; ++i) {
+        if (c.locals[i].written) {
+            store_payload(&c, SLOTS, SLOT_PAYLOAD(i), (struct operand) { .place = c.locals[i].place, .type = r->types[i], .reg = c.locals[i].reg });
+        }
+    }
+    store(a, ENGINE, (i32) offsetof(struct mtr_engine, stack_top), RDX);
+
+    const size_t epilogue = a->size;
+    imm_reg(a, 0, RSP, 8);                                           // add rsp, 8
+    byte(a, 0x41); byte(a, 0x5F);                                    // pop r15
+    byte(a, 0x41); byte(a, 0x5E);                                    // pop r14
+    byte(a, 0x41); byte(a, 0x5D);                                    // pop r13
+    byte(a, 0x41); byte(a, 0x5C);                                    // pop r12
+    byte(a, 0x5D);                                                   // pop rbp
+    byte(a, 0x5B);                                                   // pop rbx
+    byte(a, 0xC3);                                                   // ret
+
+    for (u32 i = 0; i < mismatch_count; ++i) {
+        patch(a, mismatches[i], a->size);
+    }
+    byte(a, 0x31); byte(a, 0xC0);                                    // xor eax, eax
+    patch(a, jmp_forward(a), epilogue);
+
+    while (a->size % 8 != 0) {
+        byte(a, 0xCC);
+    }
+    const size_t pool = a->size;
+    for (u32 i = 0; i < c.pool_count; ++i) {
+        qword(a, c.pool[i]);
+    }
+    for (u32 i = 0; i < a->fixup_count; ++i) {
+        patch(a, a->fixups[i].at, pool + a->fixups[i].target * sizeof(u64));
+    }
+
+    free(mismatches);
+    free(tail_jumps);
+
+    trace->state = MTR_TRACE_FAILED;
+    if (!c.failed) {
+        trace->memory = mtr_jit_map(a);
+        trace->size = a->size;
+        if (NULL != trace->memory) {
+            trace->state = MTR_TRACE_COMPILED;
+        }
+    }
+    free_compiler(&c);
+}
+
+static struct mtr_trace* find(const struct mtr_chunk* chunk, const u8* header) {
+    for (struct mtr_trace* trace = chunk->traces; NULL != trace; trace = trace->next) {
+        if (trace->header == header) {
+            return trace;
+        }
+    }
+    return NULL;
+}
+
+u8* mtr_trace_loop(struct mtr_engine* engine, struct mtr_call_frame* frame, u8* header) {
+    if (0 == mtr_trace_threshold) {
+        return NULL;
+    }
+
+    // frames only hold const chunks, the traces are the only thing written to
+    struct mtr_chunk* chunk = (struct mtr_chunk*) frame->chunk;
+    struct mtr_trace* trace = find(chunk, header);
+    if (NULL == trace) {
+        trace = calloc(1, sizeof(struct mtr_trace));
+        trace->header = header;
+        trace->next = chunk->traces;
+        chunk->traces = trace;
+    }
+
+    switch (trace->state) {
+    case MTR_TRACE_COUNTING: {
+        if (++trace->hotness < mtr_trace_threshold) {
+            return header;
+        }
+        trace->hotness = 0;
+
+        struct mtr_recording recording = { 0 };
+        u8* ip = header;
+        if (mtr_record_trace(&recording, engine, frame, &ip)) {
+            compile(trace, &recording, chunk);
+        } else if (recording.left) {
+            // it was the loop's last iteration, the next one is recorded
+            trace->hotness = mtr_trace_threshold - 1;
+        } else if (++trace->attempts >= MTR_TRACE_ATTEMPTS) {
+            trace->state = MTR_TRACE_FAILED;
+        }
+        mtr_free_recording(&recording);
+
+        if (trace->state != MTR_TRACE_COMPILED || ip != header) {
+            return ip;
+        }
+        // the recorder ran an iteration and stopped at the header, the trace takes over from there
+    }
+    /* fall through */
+    case MTR_TRACE_COMPILED:
+        return mtr_trace_run(trace, engine, frame);
+    case MTR_TRACE_FAILED:
+        return NULL;
+    }
+    return NULL;
+}
+
+struct mtr_trace* mtr_find_trace(const struct mtr_chunk* chunk, const u8* header) {
+    struct mtr_trace* trace = find(chunk, header);
+    return NULL != trace && trace->state == MTR_TRACE_COMPILED ? trace : NULL;
+}
+
+typedef u8* (*trace_entry)(struct mtr_engine* engine, struct mtr_call_frame* frame);
+
+u8* mtr_trace_run(struct mtr_trace* trace, struct mtr_engine* engine, struct mtr_call_frame* frame) {
+    trace_entry entry;
+    memcpy(&entry, &trace->memory, sizeof(entry));
+    u8* ip = entry(engine, frame);
+    if (NULL == ip) {
+        trace->state = MTR_TRACE_FAILED;
+        return NULL;
+    }
+
+    if (++trace->entries == MTR_TRACE_WINDOW) {
+        if (trace->iterations < 2 * MTR_TRACE_WINDOW) {
+            mtr_jit_unmap(trace->memory, trace->size);
+            trace->memory = NULL;
+            trace->state = ++trace->attempts >= MTR_TRACE_ATTEMPTS ? MTR_TRACE_FAILED : MTR_TRACE_COUNTING;
+        }
+        trace->entries = 0;
+        trace->iterations = 0;
+    }
+    return ip;
+}
+
+void mtr_trace_free(struct mtr_trace* traces) {
+    while (NULL != traces) {
+        struct mtr_trace* next = traces->next;
+        if (NULL != traces->memory) {
+            mtr_jit_unmap(traces->memory, traces->size);
+        }
+        free(traces);
+        traces = next;
+    }
+}
+
+#endif
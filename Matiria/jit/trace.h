@@ -0,0 +1,71 @@
+#ifndef MTR_TRACE_H
+#define MTR_TRACE_H
+
+#include "bytecode.h"
+
+#include "core/types.h"
+
+// Traces of hot loops, part of jit=on. Every backward jump the interpreter takes counts for the
+// loop it lands in. After mtr_trace_threshold iterations one iteration is recorded (record.h): the
+// instructions on the path it took, the direction of every branch and the types of the values and
+// objects it loaded. The recording is compiled to a native loop body that keeps the loop's locals
+// in registers. Guards check that the following iterations take the same path and see the same
+// types, when one doesn't the trace writes the locals back and leaves to the interpreter at the
+// instruction where they differed.
+//
+// Loops that call functions or do anything but arithmetic, locals, arrays, maps and struct members
+// can't be traced and are left to the method compiler (jit.h), which also runs the compiled traces
+// of the chunks it compiles.
+
+#ifndef MTR_TRACE_THRESHOLD
+#   define MTR_TRACE_THRESHOLD 100
+#endif
+
+// Recordings that can stop before the back-edge, a call on a branch that's rarely taken,
+// before the loop is given up on. Traces that keep leaving in their first iteration, because
+// the loop took another path after it was recorded, are recorded again and count too.
+#define MTR_TRACE_ATTEMPTS 3
+
+// Runs of a compiled trace between two checks of how long they last
+#define MTR_TRACE_WINDOW 64
+
+struct mtr_engine;
+struct mtr_call_frame;
+
+// Read at every back-edge, 0 leaves all loops to the method compiler
+extern u32 mtr_trace_threshold;
+
+enum mtr_trace_state {
+    MTR_TRACE_COUNTING,
+    MTR_TRACE_COMPILED,
+    MTR_TRACE_FAILED
+};
+
+struct mtr_trace {
+    struct mtr_trace* next;  // of the same chunk
+    const u8* header;        // the first instruction of the loop body, where the back-edge lands
+    enum mtr_trace_state state;
+    u32 hotness;
+    u32 attempts;
+    u32 entries;             // runs in this window
+    u64 iterations;          // counted by the trace itself
+    u8* memory;
+    size_t size;
+};
+
+// Called by the interpreter for every backward jump it takes, header is where it landed.
+// Returns where the interpreter carries on, which is header unless the trace ran, or NULL
+// when the loop can't be traced and is the method compiler's.
+u8* mtr_trace_loop(struct mtr_engine* engine, struct mtr_call_frame* frame, u8* header);
+
+// The compiled trace of the loop at header, NULL if there is none
+struct mtr_trace* mtr_find_trace(const struct mtr_chunk* chunk, const u8* header);
+
+// Runs a compiled trace with the frame at its header and returns the instruction it left at.
+// Returns NULL when the locals don't have the types the trace was recorded with, it fails from then on.
+u8* mtr_trace_run(struct mtr_trace* trace, struct mtr_engine* engine, struct mtr_call_frame* frame);
+
+// Frees the whole list
+void mtr_trace_free(struct mtr_trace* traces);
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef MTR_X64_H
+#define MTR_X64_H
+
+#include "runtime/value.h"
+
+#include "core/types.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The x86-64 encoder shared by the method compiler (jit.c) and the trace compiler (trace.c).
+// Only what the two of them emit is here, every memory operand is [base + disp32].
+
+#define VALUE_SIZE ((i32) sizeof(mtr_value))
+#define PAYLOAD ((i32) offsetof(mtr_value, integer))
+
+#define SLOT(index) ((i32) (index) * VALUE_SIZE)
+#define SLOT_PAYLOAD(index) (SLOT(index) + PAYLOAD)
+
+enum reg {
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define XMM0 0
+#define XMM1 1
+
+enum condition {
+    CC_B  = 0x2,
+    CC_AE = 0x3,
+    CC_E  = 0x4,
+    CC_NE = 0x5,
+    CC_BE = 0x6,
+    CC_A  = 0x7,
+    CC_P  = 0xA,
+    CC_NP = 0xB,
+    CC_L  = 0xC,
+    CC_GE = 0xD,
+    CC_LE = 0xE,
+    CC_G  = 0xF
+};
+
+// A jump whose destination isn't written yet: an instruction of the chunk for the method
+// compiler, an exit stub for the trace compiler
+struct fixup {
+    size_t at;     // of the rel32
+    u32 target;
+};
+
+struct assembler {
+    u8* code;
+    size_t size;
+    size_t capacity;
+    struct fixup* fixups;
+    u32 fixup_count;
+    u32 fixup_capacity;
+    size_t exit;   // pops the saved registers and returns eax
+};
+
+static inline void byte(struct assembler* a, u8 b) {
+    if (a->size == a->capacity) {
+        a->capacity = a->capacity ? a->capacity * 2 : 256;
+        a->code = realloc(a->code, a->capacity);
+    }
+    a->code[a->size++] = b;
+}
+
+static inline void dword(struct assembler* a, u32 d) {
+    for (u32 i = 0; i < 4; ++i) {
+        byte(a, (u8) (d >> (8 * i)));
+    }
+}
+
+static inline void qword(struct assembler* a, u64 q) {
+    dword(a, (u32) q);
+    dword(a, (u32) (q >> 32));
+}
+
+static inline void patch(struct assembler* a, size_t at, size_t to) {
+    const i32 rel = (i32) ((i64) to - (i64) (at + 4));
+    memcpy(a->code + at, &rel, sizeof(rel));
+}
+
+static inline void rex(struct assembler* a, bool w, u8 reg, u8 base) {
+    const u8 prefix = 0x40 | (w << 3) | (((reg >> 3) & 1) << 2) | ((base >> 3) & 1);
+    if (prefix != 0x40) {
+        byte(a, prefix);
+    }
+}
+
+// ModRM for [base + disp32]
+static inline void mem(struct assembler* a, u8 reg, u8 base, i32 disp) {
+    byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP) {
+        byte(a, 0x24);
+    }
+    dword(a, (u32) disp);
+}
+
+static inline void op_mem(struct assembler* a, bool w, u8 op, u8 reg, u8 base, i32 disp) {
+    rex(a, w, reg, base);
+    byte(a, op);
+    mem(a, reg, base, disp);
+}
+
+static inline void op_0f_mem(struct assembler* a, bool w, u8 op, u8 reg, u8 base, i32 disp) {
+    rex(a, w, reg, base);
+    byte(a, 0x0F);
+    byte(a, op);
+    mem(a, reg, base, disp);
+}
+
+static inline void op_reg(struct assembler* a, bool w, u8 op, u8 reg, u8 rm) {
+    rex(a, w, reg, rm);
+    byte(a, op);
+    byte(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static inline void op_0f_reg(struct assembler* a, bool w, u8 op, u8 reg, u8 rm) {
+    rex(a, w, reg, rm);
+    byte(a, 0x0F);
+    byte(a, op);
+    byte(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static inline void sse_reg(struct assembler* a, u8 prefix, bool w, u8 op, u8 xmm, u8 rm) {
+    byte(a, prefix);
+    op_0f_reg(a, w, op, xmm, rm);
+}
+
+static inline void sse_mem(struct assembler* a, u8 prefix, bool w, u8 op, u8 xmm, u8 base, i32 disp) {
+    byte(a, prefix);
+    op_0f_mem(a, w, op, xmm, base, disp);
+}
+
+static inline void load(struct assembler* a, u8 reg, u8 base, i32 disp) {
+    op_mem(a, true, 0x8B, reg, base, disp);
+}
+
+static inline void store(struct assembler* a, u8 base, i32 disp, u8 reg) {
+    op_mem(a, true, 0x89, reg, base, disp);
+}
+
+static inline void move(struct assembler* a, u8 dst, u8 src) {
+    op_reg(a, true, 0x89, src, dst);
+}
+
+static inline void move_imm(struct assembler* a, u8 reg, u64 imm) {
+    rex(a, true, 0, reg);
+    byte(a, 0xB8 + (reg & 7));
+    qword(a, imm);
+}
+
+// 81 /ext with a 32 bit immediate on a register or on a dword or qword in memory
+static inline void imm_reg(struct assembler* a, u8 ext, u8 reg, i32 imm) {
+    op_reg(a, true, 0x81, ext, reg);
+    dword(a, (u32) imm);
+}
+
+static inline void imm_mem(struct assembler* a, bool w, u8 ext, u8 base, i32 disp, i32 imm) {
+    op_mem(a, w, 0x81, ext, base, disp);
+    dword(a, (u32) imm);
+}
+
+static inline void add_imm(struct assembler* a, u8 reg, i32 imm) {
+    if (imm != 0) {
+        imm_reg(a, 0, reg, imm);
+    }
+}
+
+static inline void call(struct assembler* a, u64 address) {
+    move_imm(a, RAX, address);
+    byte(a, 0xFF); byte(a, 0xD0);                      // call rax
+}
+
+// mov qword [base + disp], type, which clears the padding too
+static inline void set_type(struct assembler* a, u8 base, i32 disp, enum mtr_value_type type) {
+    op_mem(a, true, 0xC7, 0, base, disp);
+    dword(a, (u32) type);
+}
+
+static inline size_t jump_here(struct assembler* a, u8 opcode_prefix, u8 op) {
+    if (opcode_prefix) {
+        byte(a, opcode_prefix);
+    }
+    byte(a, op);
+    const size_t at = a->size;
+    dword(a, 0);
+    return at;
+}
+
+// rel32 jumps inside one template, patched with patch(a, at, a->size)
+static inline size_t jcc_forward(struct assembler* a, enum condition cc) {
+    return jump_here(a, 0x0F, 0x80 + cc);
+}
+
+static inline size_t jmp_forward(struct assembler* a) {
+    return jump_here(a, 0, 0xE9);
+}
+
+// A rel32 to fill in once the target has an address
+static inline void rel32_later(struct assembler* a, u32 target) {
+    if (a->fixup_count == a->fixup_capacity) {
+        a->fixup_capacity = a->fixup_capacity ? a->fixup_capacity * 2 : 16;
+        a->fixups = realloc(a->fixups, sizeof(struct fixup) * a->fixup_capacity);
+    }
+    a->fixups[a->fixup_count++] = (struct fixup) { .at = a->size, .target = target };
+    dword(a, 0);
+}
+
+static inline void jump_later(struct assembler* a, u8 opcode_prefix, u8 op, u32 target) {
+    if (opcode_prefix) {
+        byte(a, opcode_prefix);
+    }
+    byte(a, op);
+    rel32_later(a, target);
+}
+
+static inline void jcc_to(struct assembler* a, enum condition cc, u32 target) {
+    jump_later(a, 0x0F, 0x80 + cc, target);
+}
+
+static inline void jmp_to(struct assembler* a, u32 target) {
+    jump_later(a, 0, 0xE9, target);
+}
+
+// cmp qword [base + disp], 0
+static inline void test_zero(struct assembler* a, u8 base, i32 disp) {
+    op_mem(a, true, 0x83, 7, base, disp);
+    byte(a, 0);
+}
+
+// Copies the code into fresh executable memory, NULL when it can't be mapped
+u8* mtr_jit_map(const struct assembler* a);
+void mtr_jit_unmap(u8* memory, size_t size);
+
+#endif
@@ -25,11 +25,17 @@ enum mtr_exit_code mtr_launch(const char* path) {
     }
 
     mtr_add_io(&package);
+    mtr_add_array(&package);
+    mtr_add_fail(&package);
 
     struct mtr_engine* engine = malloc(sizeof(*engine));
     i32 result = mtr_execute(engine, &package);
     free(engine);
 
+    if (result != 0) {
+        ec = MTR_RUNTIME_ERROR;
+    }
+
 end:
     mtr_delete_package(&package);
     free(source);
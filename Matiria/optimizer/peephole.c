@@ -0,0 +1,703 @@
+#include "peephole.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The chunk is decoded into one entry per instruction. Jumps are kept as the index of the
+// instruction they land on so instructions can be removed and rewritten freely, and the
+// offsets are only computed again when the chunk is written back.
+
+struct instruction {
+    const u8* code;  // either points into the original chunk or to 'patched'
+    u32 length;
+    i32 target;      // index of the instruction a jump lands on, -1 for anything that is not a jump
+    u32 targeted;    // how many live jumps land on this instruction
+    bool removed;
+    u8 patched[3];   // big enough for the longest op code this pass writes
+};
+
+struct program {
+    struct mtr_chunk* chunk; // folded constants go in its constant table
+    struct instruction* code;
+    i32 count;
+};
+
+// jumps that pop what they test
+static bool is_conditional(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ:
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_jump(u8 op) {
+    return op == MTR_OP_JMP || op == MTR_OP_OR || op == MTR_OP_AND || is_conditional(op);
+}
+
+// the conditional jump that jumps exactly when 'op' falls through
+static u8 invert(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_JMP_Z:                 return MTR_OP_JMP_NZ;
+    case MTR_OP_JMP_NZ:                return MTR_OP_JMP_Z;
+    case MTR_OP_LESS_I_JMP_Z:          return MTR_OP_GREATER_EQUAL_I_JMP_Z;
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z: return MTR_OP_LESS_I_JMP_Z;
+    case MTR_OP_GREATER_I_JMP_Z:       return MTR_OP_LESS_EQUAL_I_JMP_Z;
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:    return MTR_OP_GREATER_I_JMP_Z;
+    case MTR_OP_EQUAL_I_JMP_Z:         return MTR_OP_NOT_EQUAL_I_JMP_Z;
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:     return MTR_OP_EQUAL_I_JMP_Z;
+    default:
+        return op;
+    }
+}
+
+// how many values an instruction pops and pushes. Only knows the op codes a condition can be made of.
+static bool stack_effect(const struct instruction* in, u32* pops, u32* pushes) {
+    *pops = 0;
+    *pushes = 1;
+    switch (in->code[0])
+    {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG:
+    case MTR_OP_SMALL_INT:
+    case MTR_OP_FALSE:
+    case MTR_OP_TRUE:
+    case MTR_OP_NIL:
+    case MTR_OP_STRING_LITERAL:
+    case MTR_OP_EMPTY_STRING:
+    case MTR_OP_EMPTY_ARRAY:
+    case MTR_OP_FRAME_EMPTY_ARRAY:
+    case MTR_OP_EMPTY_MAP:
+    case MTR_OP_GET:
+    case MTR_OP_GLOBAL_GET:
+    case MTR_OP_UPVALUE_GET:
+        return true;
+
+    case MTR_OP_GET_GET:
+        *pushes = 2;
+        return true;
+
+    case MTR_OP_NOT:
+    case MTR_OP_NEGATE_I:
+    case MTR_OP_NEGATE_F:
+    case MTR_OP_INT_CAST:
+    case MTR_OP_FLOAT_CAST:
+    case MTR_OP_STRUCT_GET:
+        *pops = 1;
+        return true;
+
+    case MTR_OP_ADD_I:
+    case MTR_OP_SUB_I:
+    case MTR_OP_MUL_I:
+    case MTR_OP_DIV_I:
+    case MTR_OP_ADD_F:
+    case MTR_OP_SUB_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_DIV_F:
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F:
+    case MTR_OP_LESS_I:
+    case MTR_OP_GREATER_I:
+    case MTR_OP_EQUAL_I:
+    case MTR_OP_LESS_EQUAL_I:
+    case MTR_OP_GREATER_EQUAL_I:
+    case MTR_OP_NOT_EQUAL_I:
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_MAP:
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+        *pops = 2;
+        return true;
+
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE:
+        *pops = in->code[1] + 1u;
+        return true;
+
+    case MTR_OP_CALL_GLOBAL:
+    case MTR_OP_CALL_GLOBAL_NATIVE:
+        *pops = in->code[3];
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static u16 read_u16(const struct instruction* in) {
+    u16 value;
+    memcpy(&value, in->code + 1, sizeof(value));
+    return value;
+}
+
+// the index of the constant table entry a CONSTANT or CONSTANT_LONG pushes
+static bool constant(const struct instruction* in, u16* index) {
+    switch (in->code[0])
+    {
+    case MTR_OP_CONSTANT:      *index = in->code[1]; return true;
+    case MTR_OP_CONSTANT_LONG: *index = read_u16(in); return true;
+    default:
+        return false;
+    }
+}
+
+// SMALL_INT, TRUE, FALSE and Int constants all push an Int
+static bool int_constant(const struct program* p, const struct instruction* in, i64* value) {
+    u16 c;
+    switch (in->code[0])
+    {
+    case MTR_OP_SMALL_INT: *value = (i16) read_u16(in); return true;
+    case MTR_OP_TRUE:      *value = 1; return true;
+    case MTR_OP_FALSE:     *value = 0; return true;
+    default:
+        if (constant(in, &c) && p->chunk->constant_types[c] == MTR_VAL_INT) {
+            *value = MTR_AS_INT(p->chunk->constants[c]);
+            return true;
+        }
+        return false;
+    }
+}
+
+static bool float_constant(const struct program* p, const struct instruction* in, f64* value) {
+    u16 c;
+    if (constant(in, &c) && p->chunk->constant_types[c] == MTR_VAL_FLOAT) {
+        *value = MTR_AS_FLOAT(p->chunk->constants[c]);
+        return true;
+    }
+    return false;
+}
+
+static void rewrite_op(struct instruction* in, u8 op) {
+    in->patched[0] = op;
+    in->code = in->patched;
+    in->length = 1;
+    in->target = -1;
+}
+
+static void rewrite_u16(struct instruction* in, u8 op, u16 operand) {
+    rewrite_op(in, op);
+    memcpy(in->patched + 1, &operand, sizeof(operand));
+    in->length += 2;
+}
+
+static void rewrite_jump(struct instruction* in, u8 op, i32 target) {
+    rewrite_u16(in, op, 0xFFFFu); // the offset is written when the chunk is encoded again
+    in->target = target;
+}
+
+static void rewrite_constant(struct program* p, struct instruction* in, mtr_value value, enum mtr_value_type type) {
+    if (type == MTR_VAL_INT && MTR_AS_INT(value) >= INT16_MIN && MTR_AS_INT(value) <= INT16_MAX) {
+        rewrite_u16(in, MTR_OP_SMALL_INT, (u16) (i16) MTR_AS_INT(value));
+        return;
+    }
+
+    u16 index = mtr_add_constant(p->chunk, value, type);
+    if (index <= UINT8_MAX) {
+        rewrite_op(in, MTR_OP_CONSTANT);
+        in->patched[1] = (u8) index;
+        in->length += 1;
+    } else {
+        rewrite_u16(in, MTR_OP_CONSTANT_LONG, index);
+    }
+}
+
+static void rewrite_bool(struct instruction* in, bool value) {
+    rewrite_op(in, value ? MTR_OP_TRUE : MTR_OP_FALSE);
+}
+
+static i32 next_live(const struct program* p, i32 i) {
+    while (i < p->count && p->code[i].removed) {
+        ++i;
+    }
+    return i;
+}
+
+static i32 prev_live(const struct program* p, i32 i) {
+    do {
+        --i;
+    } while (i >= 0 && p->code[i].removed);
+    return i;
+}
+
+// jumps to removed instructions land on the next live one
+static void count_targets(struct program* p) {
+    for (i32 i = 0; i < p->count; ++i) {
+        p->code[i].targeted = 0;
+    }
+
+    for (i32 i = 0; i < p->count; ++i) {
+        struct instruction* in = p->code + i;
+        if (in->removed || in->target < 0) {
+            continue;
+        }
+
+        in->target = next_live(p, in->target);
+        if (in->target < p->count) {
+            p->code[in->target].targeted++;
+        }
+    }
+}
+
+static bool decode(const struct mtr_chunk* chunk, struct program* p) {
+    i32* index_of = malloc(sizeof(i32) * (chunk->size + 1));
+    for (size_t i = 0; i <= chunk->size; ++i) {
+        index_of[i] = -1;
+    }
+
+    p->count = 0;
+    for (size_t offset = 0; offset < chunk->size; offset += mtr_instruction_length(chunk->bytecode + offset)) {
+        index_of[offset] = p->count++;
+    }
+    index_of[chunk->size] = p->count;
+
+    p->code = malloc(sizeof(struct instruction) * (p->count + 1));
+
+    bool ok = true;
+    i32 i = 0;
+    for (size_t offset = 0; offset < chunk->size; ++i) {
+        struct instruction* in = p->code + i;
+        in->code = chunk->bytecode + offset;
+        in->length = mtr_instruction_length(in->code);
+        in->target = -1;
+        in->targeted = 0;
+        in->removed = false;
+
+        offset += in->length;
+
+        if (is_jump(in->code[0])) {
+            i16 where;
+            memcpy(&where, in->code + 1, sizeof(where));
+            i64 to = (i64) offset + where;
+            if (to < 0 || to > (i64) chunk->size || index_of[to] < 0) {
+                ok = false;
+                break;
+            }
+            in->target = index_of[to];
+        }
+    }
+
+    free(index_of);
+    return ok;
+}
+
+// Calls and allocations keep their stack map where they move to, the maps of removed ones are
+// dropped. Maps and instructions are both in bytecode order so one walk over the program pairs them up.
+static void move_stack_maps(struct mtr_chunk* chunk, const struct program* p, const u32* offsets) {
+    u32 kept = 0;
+    u32 next = 0;
+    for (i32 i = 0; i < p->count && next < chunk->stack_map_count; ++i) {
+        const struct instruction* in = p->code + i;
+        if (in->code == in->patched || !MTR_HAS_STACK_MAP(in->code[0])) {
+            continue;
+        }
+
+        struct mtr_stack_map map = chunk->stack_maps[next];
+        if (map.offset != (u32) (in->code - chunk->bytecode) + in->length) {
+            continue;
+        }
+        next++;
+
+        if (in->removed) {
+            free(map.objects);
+            continue;
+        }
+
+        map.offset = offsets[i] + in->length;
+        chunk->stack_maps[kept++] = map;
+    }
+
+    for (; next < chunk->stack_map_count; ++next) {
+        free(chunk->stack_maps[next].objects);
+    }
+    chunk->stack_map_count = kept;
+}
+
+static bool encode(struct mtr_chunk* chunk, const struct program* p) {
+    // removed instructions take no space so they get the offset of the next live one
+    u32* offsets = malloc(sizeof(u32) * (p->count + 1));
+    u32 size = 0;
+    for (i32 i = 0; i < p->count; ++i) {
+        offsets[i] = size;
+        size += p->code[i].removed ? 0 : p->code[i].length;
+    }
+    offsets[p->count] = size;
+
+    u8* bytecode = malloc(size + 1);
+    bool ok = true;
+    for (i32 i = 0; i < p->count; ++i) {
+        const struct instruction* in = p->code + i;
+        if (in->removed) {
+            continue;
+        }
+
+        u8* out = bytecode + offsets[i];
+        memcpy(out, in->code, in->length);
+
+        if (in->target >= 0) {
+            i64 where = (i64) offsets[in->target] - (offsets[i] + 3);
+            if (where < INT16_MIN || where > INT16_MAX) {
+                ok = false;
+                break;
+            }
+            i16 jump = (i16) where;
+            memcpy(out + 1, &jump, sizeof(jump));
+        }
+    }
+
+    if (ok) {
+        move_stack_maps(chunk, p, offsets);
+        memcpy(chunk->bytecode, bytecode, size);
+        chunk->size = size;
+    }
+
+    free(bytecode);
+    free(offsets);
+    return ok;
+}
+
+static bool fold_int(struct program* p, struct instruction* first, u8 op, i64 l, i64 r) {
+    // wrap around like the engine does instead of overflowing
+    const u64 a = (u64) l;
+    const u64 b = (u64) r;
+    switch (op)
+    {
+    case MTR_OP_ADD_I: rewrite_constant(p, first, MTR_INT((i64) (a + b)), MTR_VAL_INT); return true;
+    case MTR_OP_SUB_I: rewrite_constant(p, first, MTR_INT((i64) (a - b)), MTR_VAL_INT); return true;
+    case MTR_OP_MUL_I: rewrite_constant(p, first, MTR_INT((i64) (a * b)), MTR_VAL_INT); return true;
+    case MTR_OP_DIV_I:
+        // leave the runtime behaviour of a division by zero alone
+        if (r == 0 || (l == INT64_MIN && r == -1)) {
+            return false;
+        }
+        rewrite_constant(p, first, MTR_INT(l / r), MTR_VAL_INT);
+        return true;
+
+    case MTR_OP_LESS_I:          rewrite_bool(first, l < r); return true;
+    case MTR_OP_GREATER_I:       rewrite_bool(first, l > r); return true;
+    case MTR_OP_EQUAL_I:         rewrite_bool(first, l == r); return true;
+    case MTR_OP_LESS_EQUAL_I:    rewrite_bool(first, l <= r); return true;
+    case MTR_OP_GREATER_EQUAL_I: rewrite_bool(first, l >= r); return true;
+    case MTR_OP_NOT_EQUAL_I:     rewrite_bool(first, l != r); return true;
+    default:
+        return false;
+    }
+}
+
+static bool fold_float(struct program* p, struct instruction* first, u8 op, f64 l, f64 r) {
+    switch (op)
+    {
+    case MTR_OP_ADD_F: rewrite_constant(p, first, MTR_FLOAT(l + r), MTR_VAL_FLOAT); return true;
+    case MTR_OP_SUB_F: rewrite_constant(p, first, MTR_FLOAT(l - r), MTR_VAL_FLOAT); return true;
+    case MTR_OP_MUL_F: rewrite_constant(p, first, MTR_FLOAT(l * r), MTR_VAL_FLOAT); return true;
+    case MTR_OP_DIV_F: rewrite_constant(p, first, MTR_FLOAT(l / r), MTR_VAL_FLOAT); return true;
+    default:
+        return false;
+    }
+}
+
+// whether the fused compare and jump 'op' falls through for l and r
+static bool int_jump_falls_through(u8 op, i64 l, i64 r) {
+    switch (op)
+    {
+    case MTR_OP_LESS_I_JMP_Z:          return l < r;
+    case MTR_OP_GREATER_I_JMP_Z:       return l > r;
+    case MTR_OP_EQUAL_I_JMP_Z:         return l == r;
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:    return l <= r;
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z: return l >= r;
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:     return l != r;
+    default:
+        return true;
+    }
+}
+
+// Constant operands followed by the op that uses them.
+// 'second' and 'third' are NULL when they are not there or something jumps to them.
+static bool fold_constants(struct program* p, struct instruction* first, struct instruction* second, struct instruction* third) {
+    if (NULL == second) {
+        return false;
+    }
+
+    const u8 op = second->code[0];
+    i64 l;
+    if (int_constant(p, first, &l)) {
+        if (op == MTR_OP_NEGATE_I && first->code[0] != MTR_OP_TRUE && first->code[0] != MTR_OP_FALSE) {
+            rewrite_constant(p, first, MTR_INT((i64) (0 - (u64) l)), MTR_VAL_INT);
+            second->removed = true;
+            return true;
+        }
+
+        if (op == MTR_OP_NOT) {
+            rewrite_bool(first, !l);
+            second->removed = true;
+            return true;
+        }
+
+        if (op == MTR_OP_JMP_Z || op == MTR_OP_JMP_NZ) {
+            const bool jumps = (op == MTR_OP_JMP_Z) == (l == 0);
+            if (jumps) {
+                rewrite_jump(first, MTR_OP_JMP, second->target);
+            } else {
+                first->removed = true;
+            }
+            second->removed = true;
+            return true;
+        }
+
+        i64 r;
+        if (NULL != third && int_constant(p, second, &r)) {
+            const u8 third_op = third->code[0];
+            if (is_conditional(third_op) && third_op != MTR_OP_JMP_Z && third_op != MTR_OP_JMP_NZ) {
+                if (int_jump_falls_through(third_op, l, r)) {
+                    first->removed = true;
+                } else {
+                    rewrite_jump(first, MTR_OP_JMP, third->target);
+                }
+                second->removed = true;
+                third->removed = true;
+                return true;
+            }
+
+            if (fold_int(p, first, third_op, l, r)) {
+                second->removed = true;
+                third->removed = true;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    f64 f;
+    if (float_constant(p, first, &f)) {
+        if (op == MTR_OP_NEGATE_F) {
+            rewrite_constant(p, first, MTR_FLOAT(-f), MTR_VAL_FLOAT);
+            second->removed = true;
+            return true;
+        }
+
+        f64 g;
+        if (NULL != third && float_constant(p, second, &g) && fold_float(p, first, third->code[0], f, g)) {
+            second->removed = true;
+            third->removed = true;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// a jump to an unconditional jump goes straight to where that one goes
+static bool thread_jump(struct program* p, i32 i) {
+    struct instruction* in = p->code + i;
+    bool changed = false;
+    for (i32 steps = 0; steps < p->count && in->target < p->count; ++steps) {
+        const struct instruction* to = p->code + in->target;
+        if (to->code[0] != MTR_OP_JMP || in->target == i || to->target == in->target) {
+            break;
+        }
+        in->target = next_live(p, to->target);
+        changed = true;
+    }
+    return changed;
+}
+
+// Nothing can reach what comes after an unconditional jump or a return until something jumps there
+static bool remove_dead_code(struct program* p, i32 i) {
+    bool changed = false;
+    for (i32 j = next_live(p, i + 1); j < p->count && p->code[j].targeted == 0; j = next_live(p, j + 1)) {
+        p->code[j].removed = true;
+        changed = true;
+    }
+    return changed;
+}
+
+// write_while leaves loops as
+//     top: condition; jump if false -> end; body; condition; JMP -> top jump; end:
+// so every iteration runs a JMP and then the conditional jump. The JMP becomes the
+// inverted conditional jump straight to the body, which only leaves the top copy of the
+// condition to run once on the way in.
+static bool rotate_loop(struct program* p, i32 i) {
+    struct instruction* in = p->code + i;
+    const i32 t = in->target;
+    if (t >= p->count || !is_conditional(p->code[t].code[0])) {
+        return false;
+    }
+
+    if (p->code[t].target != next_live(p, i + 1)) {
+        return false;
+    }
+
+    rewrite_jump(in, invert(p->code[t].code[0]), next_live(p, t + 1));
+    return true;
+}
+
+static bool self_contained(const struct program* p, i32 from, i32 to, u32 needed) {
+    u32 depth = 0;
+    for (i32 i = from; i < to; i = next_live(p, i + 1)) {
+        u32 pops, pushes;
+        if (!stack_effect(p->code + i, &pops, &pushes) || pops > depth) {
+            return false;
+        }
+        depth = depth - pops + pushes;
+    }
+    return depth == needed;
+}
+
+// After a loop was rotated the top copy of the condition only decides whether to enter
+// the loop, which is what the bottom copy does too. The top copy is replaced with a jump
+// to the bottom one.
+static bool remove_duplicated_condition(struct program* p, i32 t) {
+    struct instruction* top_jump = p->code + t;
+    if (top_jump->targeted != 0) {
+        return false;
+    }
+
+    const i32 end = top_jump->target;
+    const i32 bottom_jump = prev_live(p, end);
+    if (bottom_jump <= t) {
+        return false;
+    }
+
+    const struct instruction* bottom = p->code + bottom_jump;
+    if (bottom->code[0] != invert(top_jump->code[0]) || bottom->target != next_live(p, t + 1)) {
+        return false;
+    }
+
+    const u32 needed = top_jump->code[0] == MTR_OP_JMP_Z || top_jump->code[0] == MTR_OP_JMP_NZ ? 1 : 2;
+
+    i32 top_start = t;
+    i32 bottom_start = bottom_jump;
+    while (true) {
+        const i32 previous_top = prev_live(p, top_start);
+        const i32 previous_bottom = prev_live(p, bottom_start);
+        if (previous_top < 0 || previous_bottom <= t) {
+            return false;
+        }
+
+        // only the first instruction of the top copy survives, nothing may jump in the middle of it
+        if (top_start != t && p->code[top_start].targeted != 0) {
+            return false;
+        }
+
+        const struct instruction* a = p->code + previous_top;
+        const struct instruction* b = p->code + previous_bottom;
+        if (a->length != b->length || is_jump(a->code[0]) || 0 != memcmp(a->code, b->code, a->length)) {
+            return false;
+        }
+
+        top_start = previous_top;
+        bottom_start = previous_bottom;
+
+        if (self_contained(p, top_start, t, needed)) {
+            break;
+        }
+    }
+
+    for (i32 i = next_live(p, top_start + 1); i <= t; i = next_live(p, i + 1)) {
+        p->code[i].removed = true;
+    }
+    rewrite_jump(p->code + top_start, MTR_OP_JMP, bottom_start);
+    return true;
+}
+
+static bool simplify(struct program* p, i32 i) {
+    struct instruction* in = p->code + i;
+
+    // the instructions that follow can only be rewritten if nothing jumps to them
+    const i32 j = next_live(p, i + 1);
+    struct instruction* second = j < p->count && p->code[j].targeted == 0 ? p->code + j : NULL;
+    const i32 k = NULL != second ? next_live(p, j + 1) : p->count;
+    struct instruction* third = k < p->count && p->code[k].targeted == 0 ? p->code + k : NULL;
+
+    const u8 op = in->code[0];
+    switch (op)
+    {
+    case MTR_OP_POP_V: {
+        const u16 count = read_u16(in);
+        if (count == 0) {
+            in->removed = true;
+            return true;
+        }
+        if (NULL != second && second->code[0] == MTR_OP_POP_V && count + read_u16(second) <= UINT16_MAX) {
+            rewrite_u16(in, MTR_OP_POP_V, count + read_u16(second));
+            second->removed = true;
+            return true;
+        }
+        return false;
+    }
+
+    case MTR_OP_SET: {
+        if (NULL != second && second->code[0] == MTR_OP_GET && read_u16(in) == read_u16(second)) {
+            rewrite_u16(in, MTR_OP_SET_GET, read_u16(in));
+            second->removed = true;
+            return true;
+        }
+        return false;
+    }
+
+    case MTR_OP_JMP: {
+        if (in->target == j) {
+            in->removed = true;
+            return true;
+        }
+        return thread_jump(p, i) || remove_dead_code(p, i) || rotate_loop(p, i);
+    }
+
+    case MTR_OP_RETURN:
+    case MTR_OP_TAIL_CALL:
+    case MTR_OP_TAIL_CALL_GLOBAL:
+        return remove_dead_code(p, i);
+
+    default:
+        break;
+    }
+
+    if (is_jump(op)) {
+        return thread_jump(p, i) || (is_conditional(op) && remove_duplicated_condition(p, i));
+    }
+
+    return fold_constants(p, in, second, third);
+}
+
+void mtr_optimize_chunk(struct mtr_chunk* chunk) {
+    struct program p;
+    p.chunk = chunk;
+    if (!decode(chunk, &p)) {
+        free(p.code);
+        return;
+    }
+
+    count_targets(&p);
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i32 i = next_live(&p, 0); i < p.count; i = next_live(&p, i + 1)) {
+            if (simplify(&p, i)) {
+                // targets have to be right for every rewrite, recount them straight away
+                count_targets(&p);
+                changed = true;
+            }
+        }
+    }
+
+    encode(chunk, &p);
+    free(p.code);
+}
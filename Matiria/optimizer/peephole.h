@@ -0,0 +1,12 @@
+#ifndef MTR_PEEPHOLE_H
+#define MTR_PEEPHOLE_H
+
+#include "bytecode.h"
+
+// Rewrites a finished stack bytecode chunk in place, removing the redundant sequences the
+// single pass compiler leaves behind (empty pops, stores followed by loads of the same slot,
+// jumps to jumps, dead code, the condition write_while duplicates at the bottom of every loop)
+// and folding Int and Float constant arithmetic. Jump offsets are recomputed at the end.
+void mtr_optimize_chunk(struct mtr_chunk* chunk);
+
+#endif
@@ -0,0 +1,2791 @@
+#include "ssa.h"
+
+#include "debug/opcodeStats.h"
+
+#include "core/log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// The chunk is decoded into one entry per instruction like the peephole pass does (peephole.c).
+// Building the SSA form simulates the stack of every block: what an instruction pops are the
+// operands of the value it computes and the frame positions a block reads before writing them
+// are looked up in its predecessors, with a phi where they disagree (Braun et al., "Simple and
+// Efficient Construction of Static Single Assignment Form").
+//
+// The passes never move values between frame positions. What they change is written down next
+// to the instructions: removed ones, replaced ones (a constant instead of the expression that
+// computed it) and code that runs before or after one. Encoding the chunk again puts it all
+// together and moves the slots of locals up to make room for the temporaries.
+
+// op codes of the values no instruction computes, past the last real one
+enum {
+    SSA_PHI = 0xF0,
+    SSA_PARAM,
+    SSA_COPY,   // what SET stores, apart from the stored value so a store can die on its own
+};
+
+enum kind {
+    KIND_NONE,  // instructions that don't compute anything, jumps and stores
+    KIND_INT,
+    KIND_FLOAT,
+    KIND_OBJ,
+    KIND_ANY    // the op code doesn't tell
+};
+
+enum lattice {
+    LATTICE_UNKNOWN,   // nothing reached it yet
+    LATTICE_CONSTANT,
+    LATTICE_VARYING
+};
+
+enum patch {
+    PATCH_NONE,
+    PATCH_CONSTANT,    // pushes a constant or loads a slot the original read, it can be copied anywhere
+    PATCH_OTHER
+};
+
+// Temporaries are written with these slot indices and moved right after the parameters when
+// the chunk is encoded again
+#define MAX_TEMPS 64
+#define TEMP_SLOT(t) ((u16) (UINT16_MAX - (t)))
+#define IS_TEMP_SLOT(slot) ((slot) > UINT16_MAX - MAX_TEMPS)
+
+struct list {
+    i32* items;
+    u32 count;
+    u32 capacity;
+};
+
+static void append(struct list* list, i32 item) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+        list->items = realloc(list->items, sizeof(i32) * list->capacity);
+    }
+    list->items[list->count++] = item;
+}
+
+struct bytes {
+    u8* data;
+    u32 size;
+    u32 capacity;
+};
+
+static void write_bytes(struct bytes* bytes, const u8* data, u32 size) {
+    if (bytes->size + size > bytes->capacity) {
+        bytes->capacity = bytes->size + size + 16;
+        bytes->data = realloc(bytes->data, bytes->capacity);
+    }
+    memcpy(bytes->data + bytes->size, data, size);
+    bytes->size += size;
+}
+
+struct constant {
+    enum mtr_value_type type; // MTR_VAL_INT or MTR_VAL_FLOAT
+    union {
+        i64 i;
+        f64 f;
+    };
+};
+
+struct value {
+    u8 op;
+    u8 kind;
+    u8 lattice;
+    bool pure;       // only depends on its operands and can't fail, it can be computed anywhere they are
+    bool live;
+    i32 block;
+    i32 at;          // instruction that computes it, -1 for phis, parameters and the constant of LOCAL_INC_I
+    u32 args;        // the operands are args[args .. args + argc), for phis one for every predecessor
+    u32 argc;
+    i32 forward;     // the value a trivial phi was replaced with, -1 otherwise
+    i32 number;      // value number, the first value CSE found to compute the same thing
+    i32 temp;        // slot that keeps it for the expressions that reuse it, -1 for none
+    struct constant constant;
+};
+
+struct instruction {
+    const u8* code;      // either points into the original chunk or to 'patched'
+    u32 length;
+    u32 offset;          // in the chunk it was decoded from
+    i32 target;          // index of the instruction a jump lands on, -1 for anything that is not a jump
+    i32 block;
+    i32 value;           // what it computes or stores, -1 for nothing
+    i32 pushes[2];       // values it leaves on the stack, -1 for none
+    i32 from;            // see operands_from
+    bool consumed;       // a later instruction took what it pushed as an operand
+    bool removed;
+    bool checked_before; // its bounds check moved to the preheader, the checked copy of the loop keeps it
+    i32 copy;            // version of the loop it is copied in, -1 for none
+    u8 patch;
+    u8 patched[8];
+    struct bytes before; // runs before it, jumps to it included
+    struct bytes after;  // runs after it when it doesn't jump
+};
+
+struct block {
+    i32 first;
+    i32 last;
+    i32 next;            // block it falls through to, -1 if it doesn't
+    i32 jump;            // block it jumps to, -1 if it doesn't
+    struct list preds;
+    bool* incoming;      // for every predecessor, whether constant propagation found a path over that edge
+    i32 depth;           // frame positions in use when it starts, -1 when no path reaches it
+    i32* defs;           // value of every frame position, the ones it ends with once it is filled
+    struct list values;  // made while it was filled, in order
+    struct list incomplete; // position and phi of the positions read before every predecessor was filled
+    bool filled;
+    bool sealed;
+    bool executable;
+    i32 idom;
+    i32 order;           // in reverse post order
+};
+
+struct loop {
+    i32 header;
+    i32 preheader;       // the only block outside it that goes to the header, -1 when there isn't one
+    bool* body;          // by block
+    u32 size;
+};
+
+// a loop whose bounds checks moved to the preheader is encoded twice, the checks jump to the
+// second copy when they fail and it checks every access like the original did
+struct version {
+    i32 first;           // instructions of the loop, the copy goes right after the last one
+    i32 last;
+    struct list jumps;   // JMP_Z of the checks: instruction, 1 for its 'before' bytes or 0 for 'after' and offset
+    u32 shift;           // from an instruction to its copy, once the chunk is encoded
+};
+
+// a position of the stack while a block is simulated
+struct entry {
+    i32 at;              // instruction that pushed it, -1 when it was there when the block started
+    i32 from;            // first instruction of the pure expression that computed it, -1 if there isn't one
+    u8 half;             // 1 and 2 for the values of a GET_GET, they can only be taken apart together
+};
+
+struct ssa {
+    struct mtr_chunk* chunk;
+    struct instruction* code;
+    i32 count;
+    struct block* blocks;
+    i32 block_count;
+    i32* rpo;
+    i32 rpo_count;
+    struct value* values;
+    u32 value_count;
+    u32 value_capacity;
+    i32* args;
+    u32 arg_count;
+    u32 arg_capacity;
+    struct loop* loops;
+    u32 loop_count;
+    struct version* versions;
+    u32 version_count;
+    struct entry* entries;
+    u32 max_depth;
+    u32 temps;
+    bool ok;
+    struct mtr_ssa_stats stats;
+};
+
+static u16 read_u16(const u8* code) {
+    u16 value;
+    memcpy(&value, code, sizeof(value));
+    return value;
+}
+
+static void write_u16(u8* code, u16 value) {
+    memcpy(code, &value, sizeof(value));
+}
+
+// jumps that pop what they test
+static bool is_conditional(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_JMP_Z:
+    case MTR_OP_JMP_NZ:
+    case MTR_OP_LESS_I_JMP_Z:
+    case MTR_OP_GREATER_I_JMP_Z:
+    case MTR_OP_EQUAL_I_JMP_Z:
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z:
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_jump(u8 op) {
+    return op == MTR_OP_JMP || op == MTR_OP_OR || op == MTR_OP_AND || is_conditional(op);
+}
+
+static bool ends_block(u8 op) {
+    return is_jump(op) || op == MTR_OP_RETURN || op == MTR_OP_TAIL_CALL || op == MTR_OP_TAIL_CALL_GLOBAL;
+}
+
+// Computes its result from its operands alone, without allocating, reading memory or failing.
+// DIV_I is only pure when it can't divide by zero, which the caller checks.
+static bool is_pure(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG:
+    case MTR_OP_SMALL_INT:
+    case MTR_OP_FALSE:
+    case MTR_OP_TRUE:
+    case MTR_OP_NIL:
+    case MTR_OP_GLOBAL_GET:
+    case MTR_OP_NOT:
+    case MTR_OP_NEGATE_I:
+    case MTR_OP_NEGATE_F:
+    case MTR_OP_INT_CAST:
+    case MTR_OP_FLOAT_CAST:
+    case MTR_OP_ADD_I:
+    case MTR_OP_SUB_I:
+    case MTR_OP_MUL_I:
+    case MTR_OP_ADD_F:
+    case MTR_OP_SUB_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_DIV_F:
+    case MTR_OP_LESS_I:
+    case MTR_OP_GREATER_I:
+    case MTR_OP_EQUAL_I:
+    case MTR_OP_LESS_EQUAL_I:
+    case MTR_OP_GREATER_EQUAL_I:
+    case MTR_OP_NOT_EQUAL_I:
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_commutative(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_ADD_I:
+    case MTR_OP_MUL_I:
+    case MTR_OP_EQUAL_I:
+    case MTR_OP_NOT_EQUAL_I:
+    case MTR_OP_ADD_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// what the validator said the value of an instruction is, through the op code the compiler picked
+static u8 kind_of(const struct mtr_chunk* chunk, const u8* code) {
+    switch (code[0])
+    {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG: {
+        const u16 index = code[0] == MTR_OP_CONSTANT ? code[1] : read_u16(code + 1);
+        switch (chunk->constant_types[index]) {
+        case MTR_VAL_INT:   return KIND_INT;
+        case MTR_VAL_FLOAT: return KIND_FLOAT;
+        default:            return KIND_OBJ;
+        }
+    }
+
+    case MTR_OP_SMALL_INT:
+    case MTR_OP_FALSE:
+    case MTR_OP_TRUE:
+    case MTR_OP_NOT:
+    case MTR_OP_NEGATE_I:
+    case MTR_OP_INT_CAST:
+    case MTR_OP_ADD_I:
+    case MTR_OP_SUB_I:
+    case MTR_OP_MUL_I:
+    case MTR_OP_DIV_I:
+    case MTR_OP_LESS_I:
+    case MTR_OP_GREATER_I:
+    case MTR_OP_EQUAL_I:
+    case MTR_OP_LESS_EQUAL_I:
+    case MTR_OP_GREATER_EQUAL_I:
+    case MTR_OP_NOT_EQUAL_I:
+    case MTR_OP_LESS_F:
+    case MTR_OP_GREATER_F:
+    case MTR_OP_EQUAL_F:
+    case MTR_OP_LESS_EQUAL_F:
+    case MTR_OP_GREATER_EQUAL_F:
+    case MTR_OP_NOT_EQUAL_F:
+        return KIND_INT;
+
+    case MTR_OP_NEGATE_F:
+    case MTR_OP_FLOAT_CAST:
+    case MTR_OP_ADD_F:
+    case MTR_OP_SUB_F:
+    case MTR_OP_MUL_F:
+    case MTR_OP_DIV_F:
+        return KIND_FLOAT;
+
+    case MTR_OP_STRING_LITERAL:
+    case MTR_OP_ARRAY_LITERAL:
+    case MTR_OP_FRAME_ARRAY_LITERAL:
+    case MTR_OP_MAP_LITERAL:
+    case MTR_OP_CONSTRUCTOR:
+    case MTR_OP_FRAME_CONSTRUCTOR:
+    case MTR_OP_CLOSURE:
+    case MTR_OP_EMPTY_STRING:
+    case MTR_OP_EMPTY_ARRAY:
+    case MTR_OP_FRAME_EMPTY_ARRAY:
+    case MTR_OP_EMPTY_MAP:
+    case MTR_OP_BOX:
+    case MTR_OP_GLOBAL_GET:
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F:
+        return KIND_OBJ;
+
+    case MTR_OP_NIL:
+    case MTR_OP_UPVALUE_GET:
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_MAP:
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+    case MTR_OP_STRUCT_GET:
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE:
+    case MTR_OP_CALL_GLOBAL:
+    case MTR_OP_CALL_GLOBAL_NATIVE:
+        return KIND_ANY;
+
+    default:
+        return KIND_NONE;
+    }
+}
+
+// Decoding
+
+static bool decode(struct ssa* s) {
+    const struct mtr_chunk* chunk = s->chunk;
+    i32* index_of = malloc(sizeof(i32) * (chunk->size + 1));
+    for (size_t i = 0; i <= chunk->size; ++i) {
+        index_of[i] = -1;
+    }
+
+    s->count = 0;
+    for (size_t offset = 0; offset < chunk->size; offset += mtr_instruction_length(chunk->bytecode + offset)) {
+        index_of[offset] = s->count++;
+    }
+
+    s->code = calloc(s->count + 1, sizeof(struct instruction));
+
+    bool ok = s->count > 0;
+    i32 i = 0;
+    for (size_t offset = 0; offset < chunk->size; ++i) {
+        struct instruction* in = s->code + i;
+        in->code = chunk->bytecode + offset;
+        in->length = mtr_instruction_length(in->code);
+        in->offset = (u32) offset;
+        in->target = -1;
+        in->block = -1;
+        in->value = -1;
+        in->pushes[0] = -1;
+        in->pushes[1] = -1;
+        in->from = -1;
+        in->copy = -1;
+
+        offset += in->length;
+
+        if (is_jump(in->code[0])) {
+            i16 where;
+            memcpy(&where, in->code + 1, sizeof(where));
+            i64 to = (i64) offset + where;
+            // a jump past the last instruction has nowhere to land
+            if (to < 0 || to >= (i64) chunk->size || index_of[to] < 0) {
+                ok = false;
+                break;
+            }
+            in->target = index_of[to];
+            // the temporaries are made before the first instruction, nothing may jump back to it
+            ok = ok && in->target != 0;
+        }
+    }
+
+    free(index_of);
+    return ok;
+}
+
+// Blocks
+
+static bool find_blocks(struct ssa* s) {
+    bool* leader = calloc(s->count + 1, sizeof(bool));
+    leader[0] = true;
+    for (i32 i = 0; i < s->count; ++i) {
+        const struct instruction* in = s->code + i;
+        if (in->target >= 0) {
+            leader[in->target] = true;
+        }
+        if (ends_block(in->code[0])) {
+            leader[i + 1] = true;
+        }
+    }
+
+    s->block_count = 0;
+    for (i32 i = 0; i < s->count; ++i) {
+        s->block_count += leader[i];
+    }
+    s->blocks = calloc(s->block_count, sizeof(struct block));
+
+    i32 b = -1;
+    for (i32 i = 0; i < s->count; ++i) {
+        if (leader[i]) {
+            s->blocks[++b].first = i;
+        }
+        s->blocks[b].last = i;
+        s->code[i].block = b;
+    }
+    free(leader);
+
+    for (b = 0; b < s->block_count; ++b) {
+        struct block* block = s->blocks + b;
+        const struct instruction* last = s->code + block->last;
+        const u8 op = last->code[0];
+        block->next = -1;
+        block->jump = last->target >= 0 ? s->code[last->target].block : -1;
+        block->depth = -1;
+        block->idom = -1;
+        block->order = -1;
+        if (op != MTR_OP_JMP && op != MTR_OP_RETURN && op != MTR_OP_TAIL_CALL && op != MTR_OP_TAIL_CALL_GLOBAL) {
+            // running off the end of the chunk is only fine where nothing goes
+            block->next = b + 1 < s->block_count ? b + 1 : -2;
+        }
+    }
+    return true;
+}
+
+static bool reach(struct ssa* s, i32* work, u32* count, i32 b, i32 depth) {
+    if (b < 0) {
+        return false;
+    }
+
+    struct block* block = s->blocks + b;
+    if (block->depth < 0) {
+        block->depth = depth;
+        work[(*count)++] = b;
+        return true;
+    }
+    return block->depth == depth;
+}
+
+// the frame positions in use where every block starts, a block reached with two depths is refused
+static bool find_depths(struct ssa* s) {
+    i32* work = malloc(sizeof(i32) * s->block_count);
+    u32 count = 0;
+    bool ok = reach(s, work, &count, 0, s->chunk->arity);
+
+    while (ok && count > 0) {
+        const i32 b = work[--count];
+        const struct block* block = s->blocks + b;
+        u32 depth = (u32) block->depth;
+        u32 before = depth;
+
+        for (i32 i = block->first; i <= block->last && ok; ++i) {
+            u32 pops, pushes;
+            if (!mtr_stack_effect(s->code[i].code, &pops, &pushes) || pops > depth) {
+                ok = false;
+                break;
+            }
+            before = depth;
+            depth = depth - pops + pushes;
+            s->max_depth = depth > s->max_depth ? depth : s->max_depth;
+            s->max_depth = before > s->max_depth ? before : s->max_depth;
+        }
+
+        if (!ok) {
+            break;
+        }
+
+        const u8 op = s->code[block->last].code[0];
+        if (block->jump >= 0) {
+            // AND and OR leave what they tested on the stack when they jump
+            ok = reach(s, work, &count, block->jump, (op == MTR_OP_AND || op == MTR_OP_OR) ? (i32) before : (i32) depth);
+        }
+        if (ok && block->next != -1) {
+            ok = reach(s, work, &count, block->next, (i32) depth);
+        }
+    }
+
+    free(work);
+    return ok && s->max_depth + MAX_TEMPS < UINT16_MAX - MAX_TEMPS;
+}
+
+static void add_edge(struct ssa* s, i32 from, i32 to) {
+    if (to >= 0) {
+        append(&s->blocks[to].preds, from);
+    }
+}
+
+// reverse post order of the blocks a path reaches, which visits a block after the ones that dominate it
+static void order_blocks(struct ssa* s) {
+    for (i32 b = 0; b < s->block_count; ++b) {
+        struct block* block = s->blocks + b;
+        if (block->depth >= 0) {
+            add_edge(s, b, block->next);
+            add_edge(s, b, block->jump);
+        }
+    }
+
+    for (i32 b = 0; b < s->block_count; ++b) {
+        struct block* block = s->blocks + b;
+        block->incoming = calloc(block->preds.count + 1, sizeof(bool));
+    }
+
+    bool* seen = calloc(s->block_count, sizeof(bool));
+    i32* stack = malloc(sizeof(i32) * s->block_count);
+    u8* state = calloc(s->block_count, sizeof(u8));
+    i32* post = malloc(sizeof(i32) * s->block_count);
+    i32 post_count = 0;
+    i32 top = 0;
+    stack[top++] = 0;
+    seen[0] = true;
+
+    while (top > 0) {
+        const i32 b = stack[top - 1];
+        const struct block* block = s->blocks + b;
+        const i32 succ = state[b] == 0 ? block->next : state[b] == 1 ? block->jump : -1;
+        if (state[b] < 2) {
+            state[b]++;
+            if (succ >= 0 && !seen[succ]) {
+                seen[succ] = true;
+                stack[top++] = succ;
+            }
+            continue;
+        }
+        post[post_count++] = b;
+        top--;
+    }
+
+    s->rpo = malloc(sizeof(i32) * (post_count + 1));
+    s->rpo_count = post_count;
+    for (i32 k = 0; k < post_count; ++k) {
+        s->rpo[k] = post[post_count - 1 - k];
+        s->blocks[s->rpo[k]].order = k;
+    }
+
+    free(post);
+    free(state);
+    free(stack);
+    free(seen);
+}
+
+static i32 intersect(const struct ssa* s, i32 a, i32 b) {
+    while (a != b) {
+        while (s->blocks[a].order > s->blocks[b].order) {
+            a = s->blocks[a].idom;
+        }
+        while (s->blocks[b].order > s->blocks[a].order) {
+            b = s->blocks[b].idom;
+        }
+    }
+    return a;
+}
+
+// Cooper, Harvey and Kennedy, "A Simple, Fast Dominance Algorithm"
+static void find_dominators(struct ssa* s) {
+    s->blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i32 k = 1; k < s->rpo_count; ++k) {
+            struct block* block = s->blocks + s->rpo[k];
+            i32 idom = -1;
+            for (u32 p = 0; p < block->preds.count; ++p) {
+                const i32 pred = block->preds.items[p];
+                if (s->blocks[pred].idom < 0) {
+                    continue;
+                }
+                idom = idom < 0 ? pred : intersect(s, pred, idom);
+            }
+            if (idom != block->idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool dominates(const struct ssa* s, i32 a, i32 b) {
+    for (;;) {
+        if (a == b) {
+            return true;
+        }
+        if (b <= 0) {
+            return false;
+        }
+        b = s->blocks[b].idom;
+    }
+}
+
+// every edge to a block that dominates where it comes from closes a loop
+static void find_loops(struct ssa* s) {
+    i32* work = malloc(sizeof(i32) * s->block_count);
+    for (i32 k = 0; k < s->rpo_count; ++k) {
+        const i32 b = s->rpo[k];
+        const struct block* block = s->blocks + b;
+        const i32 succs[2] = { block->next, block->jump };
+        for (u32 e = 0; e < 2; ++e) {
+            const i32 header = succs[e];
+            if (header < 0 || !dominates(s, header, b)) {
+                continue;
+            }
+
+            struct loop* loop = NULL;
+            for (u32 l = 0; l < s->loop_count; ++l) {
+                if (s->loops[l].header == header) {
+                    loop = s->loops + l;
+                }
+            }
+            if (NULL == loop) {
+                s->loops = realloc(s->loops, sizeof(struct loop) * (s->loop_count + 1));
+                loop = s->loops + s->loop_count++;
+                loop->header = header;
+                loop->body = calloc(s->block_count, sizeof(bool));
+                loop->body[header] = true;
+                loop->size = 1;
+            }
+
+            u32 count = 0;
+            if (!loop->body[b]) {
+                loop->body[b] = true;
+                loop->size++;
+                work[count++] = b;
+            }
+            while (count > 0) {
+                const struct block* inside = s->blocks + work[--count];
+                for (u32 p = 0; p < inside->preds.count; ++p) {
+                    const i32 pred = inside->preds.items[p];
+                    if (!loop->body[pred]) {
+                        loop->body[pred] = true;
+                        loop->size++;
+                        work[count++] = pred;
+                    }
+                }
+            }
+        }
+    }
+    free(work);
+
+    for (u32 l = 0; l < s->loop_count; ++l) {
+        struct loop* loop = s->loops + l;
+        const struct block* header = s->blocks + loop->header;
+        loop->preheader = -1;
+        for (u32 p = 0; p < header->preds.count; ++p) {
+            const i32 pred = header->preds.items[p];
+            if (loop->body[pred]) {
+                continue;
+            }
+            const struct block* outside = s->blocks + pred;
+            const bool only_successor = (outside->next == loop->header && outside->jump < 0)
+                || (outside->jump == loop->header && outside->next < 0);
+            loop->preheader = loop->preheader == -1 && only_successor ? pred : -2;
+        }
+        loop->preheader = loop->preheader < 0 ? -1 : loop->preheader;
+    }
+
+    // outer loops first, so expressions move as far out as they can
+    for (u32 l = 1; l < s->loop_count; ++l) {
+        struct loop loop = s->loops[l];
+        u32 k = l;
+        for (; k > 0 && s->loops[k - 1].size < loop.size; --k) {
+            s->loops[k] = s->loops[k - 1];
+        }
+        s->loops[k] = loop;
+    }
+}
+
+// Construction
+
+static i32 new_value(struct ssa* s, u8 op, u8 kind, i32 block, i32 at, u32 argc) {
+    if (s->value_count == s->value_capacity) {
+        s->value_capacity = s->value_capacity == 0 ? 64 : s->value_capacity * 2;
+        s->values = realloc(s->values, sizeof(struct value) * s->value_capacity);
+    }
+    while (s->arg_count + argc > s->arg_capacity) {
+        s->arg_capacity = s->arg_capacity == 0 ? 128 : s->arg_capacity * 2;
+        s->args = realloc(s->args, sizeof(i32) * s->arg_capacity);
+    }
+
+    const i32 id = (i32) s->value_count++;
+    struct value* v = s->values + id;
+    v->op = op;
+    v->kind = kind;
+    v->pure = false;
+    v->live = false;
+    v->block = block;
+    v->at = at;
+    v->args = s->arg_count;
+    v->argc = argc;
+    v->forward = -1;
+    v->number = -1;
+    v->temp = -1;
+    v->lattice = op == SSA_PHI || op == SSA_COPY ? LATTICE_UNKNOWN : LATTICE_VARYING;
+    v->constant.type = MTR_VAL_INT;
+    v->constant.i = 0;
+    for (u32 k = 0; k < argc; ++k) {
+        s->args[s->arg_count++] = -1;
+    }
+
+    append(&s->blocks[block].values, id);
+    return id;
+}
+
+static i32 resolve(const struct ssa* s, i32 v) {
+    while (v >= 0 && s->values[v].forward >= 0) {
+        v = s->values[v].forward;
+    }
+    return v;
+}
+
+static i32 arg(const struct ssa* s, const struct value* v, u32 k) {
+    return resolve(s, s->args[v->args + k]);
+}
+
+static i32 read_position(struct ssa* s, i32 b, u32 position);
+
+static void add_phi_operands(struct ssa* s, i32 phi, u32 position) {
+    const struct block* block = s->blocks + s->values[phi].block;
+    for (u32 k = 0; k < block->preds.count; ++k) {
+        const i32 value = read_position(s, block->preds.items[k], position);
+        s->args[s->values[phi].args + k] = value;
+    }
+}
+
+static i32 read_position(struct ssa* s, i32 b, u32 position) {
+    struct block* block = s->blocks + b;
+    if (block->defs[position] >= 0) {
+        return resolve(s, block->defs[position]);
+    }
+
+    i32 v;
+    if (!block->sealed) {
+        v = new_value(s, SSA_PHI, KIND_ANY, b, -1, block->preds.count);
+        append(&block->incomplete, (i32) position);
+        append(&block->incomplete, v);
+    } else if (block->preds.count == 1) {
+        v = read_position(s, block->preds.items[0], position);
+    } else if (block->preds.count == 0) {
+        // only the parameters are there when the function starts
+        s->ok = false;
+        v = new_value(s, SSA_PARAM, KIND_ANY, b, -1, 0);
+    } else {
+        v = new_value(s, SSA_PHI, KIND_ANY, b, -1, block->preds.count);
+        block->defs[position] = v;
+        add_phi_operands(s, v, position);
+    }
+    block->defs[position] = v;
+    return v;
+}
+
+static void seal(struct ssa* s, i32 b) {
+    struct block* block = s->blocks + b;
+    block->sealed = true;
+    for (u32 k = 0; k < block->incomplete.count; k += 2) {
+        add_phi_operands(s, block->incomplete.items[k + 1], (u32) block->incomplete.items[k]);
+    }
+}
+
+static bool can_seal(const struct ssa* s, i32 b) {
+    const struct block* block = s->blocks + b;
+    for (u32 p = 0; p < block->preds.count; ++p) {
+        if (!s->blocks[block->preds.items[p]].filled) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool is_constant_op(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_CONSTANT:
+    case MTR_OP_CONSTANT_LONG:
+    case MTR_OP_SMALL_INT:
+    case MTR_OP_FALSE:
+    case MTR_OP_TRUE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void set_constant(struct ssa* s, i32 v, const u8* code) {
+    struct value* value = s->values + v;
+    const struct mtr_chunk* chunk = s->chunk;
+    switch (code[0])
+    {
+    case MTR_OP_SMALL_INT: value->constant.i = (i16) read_u16(code + 1); break;
+    case MTR_OP_TRUE:      value->constant.i = 1; break;
+    case MTR_OP_FALSE:     value->constant.i = 0; break;
+    default: {
+        const u16 index = code[0] == MTR_OP_CONSTANT ? code[1] : read_u16(code + 1);
+        if (chunk->constant_types[index] == MTR_VAL_INT) {
+            value->constant.i = MTR_AS_INT(chunk->constants[index]);
+        } else if (chunk->constant_types[index] == MTR_VAL_FLOAT) {
+            value->constant.type = MTR_VAL_FLOAT;
+            value->constant.f = MTR_AS_FLOAT(chunk->constants[index]);
+        } else {
+            return;
+        }
+        break;
+    }
+    }
+    value->lattice = LATTICE_CONSTANT;
+}
+
+static bool is_constant(const struct ssa* s, i32 v, i64* i) {
+    const struct value* value = s->values + v;
+    if (value->lattice != LATTICE_CONSTANT || value->constant.type != MTR_VAL_INT) {
+        return false;
+    }
+    *i = value->constant.i;
+    return true;
+}
+
+// The operands an instruction pops can be taken out of the bytecode with it when they were
+// pushed by pure expressions that follow each other right up to it. Returns where the first
+// one starts, the instruction itself when it has no operands and -1 when they can't.
+static i32 operands_from(const struct entry* e, u32 n, i32 at) {
+    if (n == 0) {
+        return at;
+    }
+
+    for (u32 k = 0; k < n; ++k) {
+        if (e[k].from < 0) {
+            return -1;
+        }
+        if (k == 0) {
+            if (e[0].half == 2) {
+                return -1;
+            }
+            continue;
+        }
+        const bool pair = e[k].half == 2 && e[k - 1].half == 1 && e[k].at == e[k - 1].at;
+        if (!pair && (e[k].half != 0 || e[k - 1].half == 1 || e[k].from != e[k - 1].at + 1)) {
+            return -1;
+        }
+    }
+
+    if (e[n - 1].half == 1 || e[n - 1].at != at - 1) {
+        return -1;
+    }
+    return e[0].from;
+}
+
+static void push(struct ssa* s, i32 b, u32* depth, i32 value, i32 at, i32 from, u8 half) {
+    s->blocks[b].defs[*depth] = value;
+    s->entries[*depth] = (struct entry) { at, from, half };
+    (*depth)++;
+}
+
+// a value computed from the 'pops' values on top of the stack
+static i32 node(struct ssa* s, i32 b, i32 i, u32 depth, u32 pops) {
+    const struct instruction* in = s->code + i;
+    const u8 op = in->code[0];
+    const i32 v = new_value(s, op, kind_of(s->chunk, in->code), b, i, pops);
+    for (u32 k = 0; k < pops; ++k) {
+        const i32 operand = read_position(s, b, depth - pops + k);
+        s->args[s->values[v].args + k] = operand;
+    }
+
+    struct value* value = s->values + v;
+    value->pure = is_pure(op);
+    i64 divisor;
+    if (op == MTR_OP_DIV_I && is_constant(s, s->args[value->args + 1], &divisor)) {
+        value->pure = divisor != 0 && divisor != -1;
+    }
+    if (value->pure && pops > 0) {
+        value->lattice = LATTICE_UNKNOWN;
+    }
+    if (is_constant_op(op)) {
+        set_constant(s, v, in->code);
+    }
+    return v;
+}
+
+static void fill(struct ssa* s, i32 b) {
+    struct block* block = s->blocks + b;
+    u32 depth = (u32) block->depth;
+    for (u32 k = 0; k < depth; ++k) {
+        s->entries[k] = (struct entry) { -1, -1, 0 };
+    }
+
+    for (i32 i = block->first; i <= block->last && s->ok; ++i) {
+        struct instruction* in = s->code + i;
+        const u8 op = in->code[0];
+        u32 pops, pushes;
+        mtr_stack_effect(in->code, &pops, &pushes);
+
+        in->from = operands_from(s->entries + depth - pops, pops, i);
+        if (op != MTR_OP_POP && op != MTR_OP_POP_V) {
+            for (u32 k = depth - pops; k < depth; ++k) {
+                if (s->entries[k].at >= 0) {
+                    s->code[s->entries[k].at].consumed = true;
+                }
+            }
+        }
+
+        switch (op)
+        {
+        case MTR_OP_GET: {
+            const u16 slot = read_u16(in->code + 1);
+            if (slot >= depth) {
+                s->ok = false;
+                break;
+            }
+            in->pushes[0] = read_position(s, b, slot);
+            push(s, b, &depth, in->pushes[0], i, i, 0);
+            break;
+        }
+
+        case MTR_OP_GET_GET: {
+            const u16 first = read_u16(in->code + 1);
+            const u16 second = read_u16(in->code + 3);
+            if (first >= depth || second >= depth) {
+                s->ok = false;
+                break;
+            }
+            in->pushes[0] = read_position(s, b, first);
+            in->pushes[1] = read_position(s, b, second);
+            push(s, b, &depth, in->pushes[0], i, i, 1);
+            push(s, b, &depth, in->pushes[1], i, i, 2);
+            break;
+        }
+
+        case MTR_OP_SET:
+        case MTR_OP_SET_GET: {
+            const u16 slot = read_u16(in->code + 1);
+            if (slot >= depth - 1) {
+                s->ok = false;
+                break;
+            }
+            const i32 stored = read_position(s, b, depth - 1);
+            in->value = new_value(s, SSA_COPY, s->values[stored].kind, b, i, 1);
+            s->args[s->values[in->value].args] = stored;
+            block->defs[slot] = in->value;
+            depth -= 1;
+            if (op == MTR_OP_SET_GET) {
+                in->pushes[0] = in->value;
+                push(s, b, &depth, in->value, i, -1, 0);
+            }
+            break;
+        }
+
+        case MTR_OP_LOCAL_ADD_I:
+        case MTR_OP_LOCAL_SUB_I:
+        case MTR_OP_LOCAL_INC_I: {
+            const u16 dst = read_u16(in->code + 1);
+            const u16 a = op == MTR_OP_LOCAL_INC_I ? dst : read_u16(in->code + 3);
+            if (dst >= depth || a >= depth || (op != MTR_OP_LOCAL_INC_I && read_u16(in->code + 5) >= depth)) {
+                s->ok = false;
+                break;
+            }
+
+            i32 right;
+            if (op == MTR_OP_LOCAL_INC_I) {
+                right = new_value(s, MTR_OP_SMALL_INT, KIND_INT, b, -1, 0);
+                s->values[right].pure = true;
+                set_constant(s, right, (const u8[]) { MTR_OP_SMALL_INT, in->code[3], in->code[4] });
+            } else {
+                right = read_position(s, b, read_u16(in->code + 5));
+            }
+            const i32 left = read_position(s, b, a);
+
+            in->value = new_value(s, op == MTR_OP_LOCAL_SUB_I ? MTR_OP_SUB_I : MTR_OP_ADD_I, KIND_INT, b, i, 2);
+            struct value* value = s->values + in->value;
+            value->pure = true;
+            value->lattice = LATTICE_UNKNOWN;
+            s->args[value->args] = left;
+            s->args[value->args + 1] = right;
+            block->defs[dst] = in->value;
+            break;
+        }
+
+        case MTR_OP_CLOSURE: {
+            const u8 count = in->code[3];
+            u32 locals = 0;
+            for (u8 k = 0; k < count; ++k) {
+                locals += in->code[4 + 3 * k + 2] != 0;
+            }
+            in->value = new_value(s, op, KIND_OBJ, b, i, locals);
+            u32 n = 0;
+            for (u8 k = 0; k < count && s->ok; ++k) {
+                const u8* capture = in->code + 4 + 3 * k;
+                if (capture[2] == 0) {
+                    continue;
+                }
+                const u16 slot = read_u16(capture);
+                if (slot >= depth) {
+                    s->ok = false;
+                    break;
+                }
+                const i32 captured = read_position(s, b, slot);
+                s->args[s->values[in->value].args + n++] = captured;
+            }
+            in->pushes[0] = in->value;
+            push(s, b, &depth, in->value, i, -1, 0);
+            break;
+        }
+
+        case MTR_OP_POP:
+        case MTR_OP_POP_V:
+            depth -= pops;
+            break;
+
+        default: {
+            in->value = node(s, b, i, depth, pops);
+            depth -= pops;
+            if (pushes == 1) {
+                const struct value* value = s->values + in->value;
+                in->pushes[0] = in->value;
+                push(s, b, &depth, in->value, i, value->pure && in->from >= 0 ? in->from : -1, 0);
+            }
+            break;
+        }
+        }
+    }
+}
+
+// a phi whose operands are all the same value or itself is that value
+static void remove_trivial_phis(struct ssa* s) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (u32 v = 0; v < s->value_count; ++v) {
+            struct value* phi = s->values + v;
+            if (phi->op != SSA_PHI || phi->forward >= 0) {
+                continue;
+            }
+
+            i32 same = -1;
+            bool trivial = true;
+            for (u32 k = 0; k < phi->argc; ++k) {
+                const i32 a = arg(s, phi, k);
+                if (a == (i32) v || a == same) {
+                    continue;
+                }
+                if (same >= 0) {
+                    trivial = false;
+                    break;
+                }
+                same = a;
+            }
+
+            if (trivial && same >= 0) {
+                phi->forward = same;
+                changed = true;
+            }
+        }
+    }
+
+    for (u32 k = 0; k < s->arg_count; ++k) {
+        s->args[k] = resolve(s, s->args[k]);
+    }
+}
+
+static bool build(struct ssa* s) {
+    if (!decode(s) || !find_blocks(s) || !find_depths(s)) {
+        return false;
+    }
+
+    order_blocks(s);
+    find_dominators(s);
+    find_loops(s);
+
+    s->entries = malloc(sizeof(struct entry) * (s->max_depth + 1));
+    for (i32 b = 0; b < s->block_count; ++b) {
+        struct block* block = s->blocks + b;
+        block->defs = malloc(sizeof(i32) * (s->max_depth + 1));
+        for (u32 p = 0; p <= s->max_depth; ++p) {
+            block->defs[p] = -1;
+        }
+    }
+
+    s->ok = true;
+    struct block* entry = s->blocks;
+    entry->sealed = true;
+    for (u8 p = 0; p < s->chunk->arity; ++p) {
+        entry->defs[p] = new_value(s, SSA_PARAM, KIND_ANY, 0, -1, 0);
+        s->values[entry->defs[p]].constant.i = p;
+    }
+
+    for (i32 k = 0; k < s->rpo_count && s->ok; ++k) {
+        const i32 b = s->rpo[k];
+        struct block* block = s->blocks + b;
+        if (!block->sealed && can_seal(s, b)) {
+            seal(s, b);
+        }
+
+        fill(s, b);
+        block->filled = true;
+
+        const i32 succs[2] = { block->next, block->jump };
+        for (u32 e = 0; e < 2; ++e) {
+            if (succs[e] >= 0 && !s->blocks[succs[e]].sealed && can_seal(s, succs[e])) {
+                seal(s, succs[e]);
+            }
+        }
+    }
+
+    if (s->ok) {
+        remove_trivial_phis(s);
+    }
+    return s->ok;
+}
+
+// Rewriting
+
+static bool removable(const struct ssa* s, i32 from, i32 to) {
+    if (from < 0) {
+        return false;
+    }
+    for (i32 j = from; j <= to; ++j) {
+        if (s->code[j].before.size > 0 || s->code[j].after.size > 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static u32 live_count(const struct ssa* s, i32 from, i32 to) {
+    u32 count = 0;
+    for (i32 j = from; j <= to; ++j) {
+        count += !s->code[j].removed;
+    }
+    return count;
+}
+
+static u32 remove_range(struct ssa* s, i32 from, i32 to) {
+    u32 count = 0;
+    for (i32 j = from; j <= to; ++j) {
+        count += !s->code[j].removed;
+        s->code[j].removed = true;
+    }
+    return count;
+}
+
+static void patch_op(struct instruction* in, u8 op, enum patch patch) {
+    in->patched[0] = op;
+    in->code = in->patched;
+    in->length = 1;
+    in->patch = patch;
+    if (op != MTR_OP_JMP) {
+        in->target = -1;
+    }
+}
+
+static void patch_u16(struct instruction* in, u8 op, u16 operand, enum patch patch) {
+    patch_op(in, op, patch);
+    write_u16(in->patched + 1, operand);
+    in->length = 3;
+}
+
+// Writes the instruction that pushes c at 'out', returns its length
+static u32 write_constant(struct mtr_chunk* chunk, u8* out, struct constant c) {
+    if (c.type == MTR_VAL_INT && c.i >= INT16_MIN && c.i <= INT16_MAX) {
+        out[0] = MTR_OP_SMALL_INT;
+        write_u16(out + 1, (u16) (i16) c.i);
+        return 3;
+    }
+
+    const u16 index = c.type == MTR_VAL_INT
+        ? mtr_add_constant(chunk, MTR_INT(c.i), MTR_VAL_INT)
+        : mtr_add_constant(chunk, MTR_FLOAT(c.f), MTR_VAL_FLOAT);
+    if (index <= UINT8_MAX) {
+        out[0] = MTR_OP_CONSTANT;
+        out[1] = (u8) index;
+        return 2;
+    }
+    out[0] = MTR_OP_CONSTANT_LONG;
+    write_u16(out + 1, index);
+    return 3;
+}
+
+static void patch_constant(struct ssa* s, struct instruction* in, struct constant c) {
+    in->length = write_constant(s->chunk, in->patched, c);
+    in->code = in->patched;
+    in->patch = PATCH_CONSTANT;
+    in->target = -1;
+}
+
+// The value an instruction computes and pushes, -1 for loads, stores and anything that doesn't
+static i32 computed(const struct ssa* s, const struct instruction* in) {
+    if (in->value < 0 || in->pushes[0] < 0) {
+        return -1;
+    }
+    const i32 v = resolve(s, in->value);
+    const struct value* value = s->values + v;
+    return v == resolve(s, in->pushes[0]) && value->at >= 0 && value->op != SSA_COPY && s->code + value->at == in ? v : -1;
+}
+
+// Constant folding and propagation
+//
+// Wegman and Zadeck's sparse conditional constant propagation, run round robin over the blocks
+// until nothing changes: values start unknown and only go down to a constant and then to
+// varying, and a block is only looked at once an edge that constant branches can take reaches it.
+
+static bool same_constant(struct constant a, struct constant b) {
+    if (a.type != b.type) {
+        return false;
+    }
+    if (a.type == MTR_VAL_INT) {
+        return a.i == b.i;
+    }
+    u64 x, y;
+    memcpy(&x, &a.f, sizeof(x));
+    memcpy(&y, &b.f, sizeof(y));
+    return x == y;
+}
+
+static bool lower_to(struct value* v, u8 lattice, struct constant c) {
+    if (v->lattice == LATTICE_VARYING || lattice == LATTICE_UNKNOWN) {
+        return false;
+    }
+    if (lattice == LATTICE_CONSTANT && v->lattice == LATTICE_CONSTANT) {
+        if (same_constant(c, v->constant)) {
+            return false;
+        }
+        lattice = LATTICE_VARYING;
+    }
+    v->lattice = lattice;
+    v->constant = c;
+    return true;
+}
+
+#define INT_RESULT(value)   (out->type = MTR_VAL_INT, out->i = (value), true)
+#define FLOAT_RESULT(value) (out->type = MTR_VAL_FLOAT, out->f = (value), true)
+
+// Same results as the engine, Int arithmetic wraps around
+static bool fold(u8 op, const struct constant* a, const struct constant* b, struct constant* out) {
+    const bool ints = a->type == MTR_VAL_INT && (NULL == b || b->type == MTR_VAL_INT);
+    const bool floats = a->type == MTR_VAL_FLOAT && (NULL == b || b->type == MTR_VAL_FLOAT);
+    switch (op)
+    {
+    case MTR_OP_NOT:        return ints && INT_RESULT(!a->i);
+    case MTR_OP_NEGATE_I:   return ints && INT_RESULT((i64) (0 - (u64) a->i));
+    case MTR_OP_NEGATE_F:   return floats && FLOAT_RESULT(-a->f);
+    case MTR_OP_FLOAT_CAST: return ints && FLOAT_RESULT((f64) a->i);
+    case MTR_OP_INT_CAST:
+        // out of range is undefined in C, leave it to the engine
+        return floats && a->f > -9223372036854775808.0 && a->f < 9223372036854775808.0 && INT_RESULT((i64) a->f);
+    default:
+        break;
+    }
+
+    if (NULL == b) {
+        return false;
+    }
+
+    const u64 l = (u64) a->i;
+    const u64 r = (u64) b->i;
+    switch (op)
+    {
+    case MTR_OP_ADD_I: return ints && INT_RESULT((i64) (l + r));
+    case MTR_OP_SUB_I: return ints && INT_RESULT((i64) (l - r));
+    case MTR_OP_MUL_I: return ints && INT_RESULT((i64) (l * r));
+    case MTR_OP_DIV_I:
+        return ints && b->i != 0 && !(a->i == INT64_MIN && b->i == -1) && INT_RESULT(a->i / b->i);
+
+    case MTR_OP_LESS_I:          return ints && INT_RESULT(a->i < b->i);
+    case MTR_OP_GREATER_I:       return ints && INT_RESULT(a->i > b->i);
+    case MTR_OP_EQUAL_I:         return ints && INT_RESULT(a->i == b->i);
+    case MTR_OP_LESS_EQUAL_I:    return ints && INT_RESULT(a->i <= b->i);
+    case MTR_OP_GREATER_EQUAL_I: return ints && INT_RESULT(a->i >= b->i);
+    case MTR_OP_NOT_EQUAL_I:     return ints && INT_RESULT(a->i != b->i);
+
+    case MTR_OP_ADD_F: return floats && FLOAT_RESULT(a->f + b->f);
+    case MTR_OP_SUB_F: return floats && FLOAT_RESULT(a->f - b->f);
+    case MTR_OP_MUL_F: return floats && FLOAT_RESULT(a->f * b->f);
+    case MTR_OP_DIV_F: return floats && FLOAT_RESULT(a->f / b->f);
+
+    case MTR_OP_LESS_F:          return floats && INT_RESULT(a->f < b->f);
+    case MTR_OP_GREATER_F:       return floats && INT_RESULT(a->f > b->f);
+    case MTR_OP_EQUAL_F:         return floats && INT_RESULT(a->f == b->f);
+    case MTR_OP_LESS_EQUAL_F:    return floats && INT_RESULT(a->f <= b->f);
+    case MTR_OP_GREATER_EQUAL_F: return floats && INT_RESULT(a->f >= b->f);
+    case MTR_OP_NOT_EQUAL_F:     return floats && INT_RESULT(a->f != b->f);
+    default:
+        return false;
+    }
+}
+
+#undef FLOAT_RESULT
+#undef INT_RESULT
+
+static bool evaluate(struct ssa* s, i32 id) {
+    struct value* v = s->values + id;
+    if (v->forward >= 0 || v->lattice == LATTICE_VARYING) {
+        return false;
+    }
+
+    u8 lattice = LATTICE_UNKNOWN;
+    struct constant c = v->constant;
+    switch (v->op)
+    {
+    case SSA_PHI: {
+        const struct block* block = s->blocks + v->block;
+        for (u32 k = 0; k < v->argc && lattice != LATTICE_VARYING; ++k) {
+            const struct value* a = s->values + arg(s, v, k);
+            if (!block->incoming[k] || a->lattice == LATTICE_UNKNOWN) {
+                continue;
+            }
+            if (a->lattice == LATTICE_VARYING || (lattice == LATTICE_CONSTANT && !same_constant(c, a->constant))) {
+                lattice = LATTICE_VARYING;
+            } else {
+                lattice = LATTICE_CONSTANT;
+                c = a->constant;
+            }
+        }
+        break;
+    }
+
+    case SSA_COPY: {
+        const struct value* a = s->values + arg(s, v, 0);
+        lattice = a->lattice;
+        c = a->constant;
+        break;
+    }
+
+    default: {
+        if (!v->pure || v->argc == 0) {
+            return false;
+        }
+        const struct value* a = s->values + arg(s, v, 0);
+        const struct value* b = v->argc > 1 ? s->values + arg(s, v, 1) : NULL;
+        if (a->lattice == LATTICE_UNKNOWN || (b && b->lattice == LATTICE_UNKNOWN)) {
+            return false;
+        }
+        if (a->lattice == LATTICE_VARYING || (b && b->lattice == LATTICE_VARYING)) {
+            lattice = LATTICE_VARYING;
+        } else {
+            lattice = fold(v->op, &a->constant, b ? &b->constant : NULL, &c) ? LATTICE_CONSTANT : LATTICE_VARYING;
+        }
+        break;
+    }
+    }
+
+    return lower_to(v, lattice, c);
+}
+
+// 1 when the branch ending a block jumps, 0 when it falls through, -1 when it can do both and -2
+// while its condition is unknown
+static i32 direction(const struct ssa* s, const struct instruction* in) {
+    const u8 op = in->code[0];
+    const struct value* branch = s->values + resolve(s, in->value);
+    const struct value* a = s->values + arg(s, branch, 0);
+    const struct value* b = branch->argc > 1 ? s->values + arg(s, branch, 1) : NULL;
+    if (a->lattice == LATTICE_UNKNOWN || (b && b->lattice == LATTICE_UNKNOWN)) {
+        return -2;
+    }
+    if (a->lattice == LATTICE_VARYING || (b && b->lattice == LATTICE_VARYING)) {
+        return -1;
+    }
+
+    struct constant c;
+    switch (op)
+    {
+    case MTR_OP_JMP_Z:
+    case MTR_OP_AND:
+        return a->constant.type == MTR_VAL_INT ? a->constant.i == 0 : -1;
+    case MTR_OP_JMP_NZ:
+    case MTR_OP_OR:
+        return a->constant.type == MTR_VAL_INT ? a->constant.i != 0 : -1;
+    case MTR_OP_LESS_I_JMP_Z:          return fold(MTR_OP_LESS_I, &a->constant, &b->constant, &c) ? !c.i : -1;
+    case MTR_OP_GREATER_I_JMP_Z:       return fold(MTR_OP_GREATER_I, &a->constant, &b->constant, &c) ? !c.i : -1;
+    case MTR_OP_EQUAL_I_JMP_Z:         return fold(MTR_OP_EQUAL_I, &a->constant, &b->constant, &c) ? !c.i : -1;
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:    return fold(MTR_OP_LESS_EQUAL_I, &a->constant, &b->constant, &c) ? !c.i : -1;
+    case MTR_OP_GREATER_EQUAL_I_JMP_Z: return fold(MTR_OP_GREATER_EQUAL_I, &a->constant, &b->constant, &c) ? !c.i : -1;
+    case MTR_OP_NOT_EQUAL_I_JMP_Z:     return fold(MTR_OP_NOT_EQUAL_I, &a->constant, &b->constant, &c) ? !c.i : -1;
+    default:
+        return -1;
+    }
+}
+
+static bool mark_edge(struct ssa* s, i32 from, i32 to) {
+    struct block* block = s->blocks + to;
+    bool changed = false;
+    for (u32 p = 0; p < block->preds.count; ++p) {
+        if (block->preds.items[p] == from && !block->incoming[p]) {
+            block->incoming[p] = true;
+            changed = true;
+        }
+    }
+    block->executable = block->executable || changed;
+    return changed;
+}
+
+static bool follow_edges(struct ssa* s, i32 b) {
+    const struct block* block = s->blocks + b;
+    const struct instruction* last = s->code + block->last;
+    const u8 op = last->code[0];
+    if (!is_conditional(op) && op != MTR_OP_AND && op != MTR_OP_OR) {
+        return (block->jump >= 0 && mark_edge(s, b, block->jump)) | (block->next >= 0 && mark_edge(s, b, block->next));
+    }
+
+    const i32 d = direction(s, last);
+    bool changed = false;
+    if (d == 1 || d == -1) {
+        changed = mark_edge(s, b, block->jump) || changed;
+    }
+    if (d == 0 || d == -1) {
+        changed = mark_edge(s, b, block->next) || changed;
+    }
+    return changed;
+}
+
+// pops what a branch that is gone doesn't test any more, or the expressions that pushed it
+static u32 drop_operands(struct ssa* s, i32 i, u32 count, struct bytes* pops) {
+    struct instruction* in = s->code + i;
+    if (removable(s, in->from, i - 1)) {
+        return remove_range(s, in->from, i - 1);
+    }
+    const u8 pop[3] = { MTR_OP_POP_V, (u8) count, 0 };
+    write_bytes(pops, pop, sizeof(pop));
+    return 0;
+}
+
+static void fold_branch(struct ssa* s, i32 b) {
+    const struct block* block = s->blocks + b;
+    struct instruction* in = s->code + block->last;
+    const u8 op = in->code[0];
+    if (in->removed || (!is_conditional(op) && op != MTR_OP_AND && op != MTR_OP_OR)) {
+        return;
+    }
+
+    const i32 d = direction(s, in);
+    if (d != 0 && d != 1) {
+        return;
+    }
+
+    if (op == MTR_OP_AND || op == MTR_OP_OR) {
+        // what they tested stays on the stack when they jump
+        if (d == 1) {
+            patch_u16(in, MTR_OP_JMP, 0xFFFFu, PATCH_OTHER);
+            return;
+        }
+    }
+
+    struct bytes pops = { 0 };
+    const u32 count = op == MTR_OP_JMP_Z || op == MTR_OP_JMP_NZ || op == MTR_OP_AND || op == MTR_OP_OR ? 1 : 2;
+    s->stats.folded += drop_operands(s, block->last, count, &pops);
+    if (d == 1) {
+        patch_u16(in, MTR_OP_JMP, 0xFFFFu, PATCH_OTHER);
+        if (pops.size > 0) {
+            write_bytes(&in->before, pops.data, pops.size);
+        }
+    } else if (pops.size > 0) {
+        memcpy(in->patched, pops.data, pops.size);
+        in->code = in->patched;
+        in->length = pops.size;
+        in->patch = PATCH_OTHER;
+        in->target = -1;
+    } else {
+        s->stats.folded += remove_range(s, block->last, block->last);
+    }
+    free(pops.data);
+}
+
+static void fold_constants(struct ssa* s) {
+    s->blocks[0].executable = true;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (i32 k = 0; k < s->rpo_count; ++k) {
+            const i32 b = s->rpo[k];
+            const struct block* block = s->blocks + b;
+            if (!block->executable) {
+                continue;
+            }
+            for (u32 v = 0; v < block->values.count; ++v) {
+                changed = evaluate(s, block->values.items[v]) || changed;
+            }
+            changed = follow_edges(s, b) || changed;
+        }
+    }
+
+    for (i32 k = 0; k < s->rpo_count; ++k) {
+        const i32 b = s->rpo[k];
+        const struct block* block = s->blocks + b;
+        if (!block->executable) {
+            s->stats.folded += remove_range(s, block->first, block->last);
+            continue;
+        }
+
+        // outer expressions first, they take the ones they are made of with them
+        for (i32 i = block->last; i >= block->first; --i) {
+            struct instruction* in = s->code + i;
+            if (in->removed || in->patch != PATCH_NONE || in->pushes[0] < 0) {
+                continue;
+            }
+
+            const u8 op = in->code[0];
+            const struct value* first = s->values + resolve(s, in->pushes[0]);
+            if (op == MTR_OP_GET) {
+                if (first->lattice == LATTICE_CONSTANT) {
+                    patch_constant(s, in, first->constant);
+                }
+                continue;
+            }
+
+            if (op == MTR_OP_GET_GET) {
+                const struct value* second = s->values + resolve(s, in->pushes[1]);
+                if (first->lattice == LATTICE_CONSTANT && second->lattice == LATTICE_CONSTANT) {
+                    u32 length = write_constant(s->chunk, in->patched, first->constant);
+                    length += write_constant(s->chunk, in->patched + length, second->constant);
+                    in->code = in->patched;
+                    in->length = length;
+                    in->patch = PATCH_CONSTANT;
+                }
+                continue;
+            }
+
+            const i32 v = computed(s, in);
+            if (v < 0 || first->lattice != LATTICE_CONSTANT || first->argc == 0 || !first->pure) {
+                continue;
+            }
+            if (in->from >= 0 && in->from < i && removable(s, in->from, i)) {
+                s->stats.folded += remove_range(s, in->from, i - 1);
+                patch_constant(s, in, first->constant);
+            }
+        }
+
+        fold_branch(s, b);
+    }
+}
+
+// Dead code elimination
+//
+// Everything that has an effect is live, and so is what it uses. Stores nothing live reads are
+// removed with the pure expression they store, and a pure expression pushed for a local that
+// nothing reads is replaced with a cheaper value of the same type.
+
+static void mark_live(struct ssa* s) {
+    struct list work = { 0 };
+    for (u32 v = 0; v < s->value_count; ++v) {
+        struct value* value = s->values + v;
+        const bool effect = value->op != SSA_PHI && value->op != SSA_COPY && value->op != SSA_PARAM && !value->pure;
+        if (value->forward < 0 && effect && value->at >= 0 && !s->code[value->at].removed) {
+            value->live = true;
+            append(&work, (i32) v);
+        }
+    }
+
+    while (work.count > 0) {
+        const struct value* value = s->values + work.items[--work.count];
+        for (u32 k = 0; k < value->argc; ++k) {
+            const i32 a = arg(s, value, k);
+            if (a >= 0 && !s->values[a].live) {
+                s->values[a].live = true;
+                append(&work, a);
+            }
+        }
+    }
+    free(work.items);
+}
+
+static void eliminate_dead_code(struct ssa* s) {
+    mark_live(s);
+
+    for (i32 b = 0; b < s->block_count; ++b) {
+        const struct block* block = s->blocks + b;
+        if (block->depth < 0) {
+            s->stats.dead += remove_range(s, block->first, block->last);
+            continue;
+        }
+
+        for (i32 i = block->last; i >= block->first; --i) {
+            struct instruction* in = s->code + i;
+            if (in->removed || in->patch != PATCH_NONE) {
+                continue;
+            }
+
+            const u8 op = in->code[0];
+            if (op == MTR_OP_SET) {
+                if (s->values[resolve(s, in->value)].live) {
+                    continue;
+                }
+                if (removable(s, in->from, i)) {
+                    s->stats.dead += remove_range(s, in->from, i);
+                } else {
+                    patch_op(in, MTR_OP_POP, PATCH_OTHER);
+                }
+                continue;
+            }
+
+            if (op == MTR_OP_LOCAL_ADD_I || op == MTR_OP_LOCAL_SUB_I || op == MTR_OP_LOCAL_INC_I) {
+                if (!s->values[resolve(s, in->value)].live) {
+                    s->stats.dead += remove_range(s, i, i);
+                }
+                continue;
+            }
+
+            const i32 v = computed(s, in);
+            if (v < 0 || in->consumed || s->values[v].live || !s->values[v].pure || in->from < 0) {
+                continue;
+            }
+            const u8 kind = s->values[v].kind;
+            if ((kind == KIND_INT || kind == KIND_FLOAT) && removable(s, in->from, i) && live_count(s, in->from, i) > 1) {
+                s->stats.dead += remove_range(s, in->from, i - 1);
+                struct constant zero = { .type = kind == KIND_INT ? MTR_VAL_INT : MTR_VAL_FLOAT };
+                if (kind == KIND_INT) {
+                    zero.i = 0;
+                } else {
+                    zero.f = 0.0;
+                }
+                patch_constant(s, in, zero);
+            }
+        }
+    }
+}
+
+// Common subexpression elimination
+//
+// Values are numbered walking the dominator tree: a pure value gets the number of an equal one
+// (same op code, operands with the same numbers) that dominates it. When both are expressions
+// the bytecode pushes, the first one keeps its result in a temporary and the second one becomes
+// a load of it.
+
+struct numbered {
+    u64 a;
+    u64 b;
+    i32 value;
+    i32 next;
+    u8 op;
+};
+
+struct numbers {
+    i32* heads;
+    u32 mask;
+    struct numbered* entries;
+    u32 count;
+    u32 capacity;
+};
+
+static u32 hash_key(u8 op, u64 a, u64 b) {
+    const u64 h = (a * 0x9E3779B97F4A7C15ull) ^ (b + 0x632BE59BD9B4E019ull) ^ (op * 0x94D049BB133111EBull);
+    return (u32) (h ^ (h >> 29));
+}
+
+static i32 lookup(const struct numbers* table, u8 op, u64 a, u64 b) {
+    for (i32 e = table->heads[hash_key(op, a, b) & table->mask]; e >= 0; e = table->entries[e].next) {
+        const struct numbered* entry = table->entries + e;
+        if (entry->op == op && entry->a == a && entry->b == b) {
+            return entry->value;
+        }
+    }
+    return -1;
+}
+
+static void insert(struct numbers* table, u8 op, u64 a, u64 b, i32 value) {
+    if (table->count == table->capacity) {
+        table->capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        table->entries = realloc(table->entries, sizeof(struct numbered) * table->capacity);
+    }
+    const u32 bucket = hash_key(op, a, b) & table->mask;
+    table->entries[table->count] = (struct numbered) { a, b, value, table->heads[bucket], op };
+    table->heads[bucket] = (i32) table->count++;
+}
+
+// entries are only ever taken off the end, in the order they went in
+static void truncate(struct numbers* table, u32 count) {
+    while (table->count > count) {
+        const struct numbered* entry = table->entries + --table->count;
+        table->heads[hash_key(entry->op, entry->a, entry->b) & table->mask] = entry->next;
+    }
+}
+
+// the instruction that computes and pushes a value, -1 if no instruction does
+static i32 root_of(const struct ssa* s, i32 v) {
+    const struct value* value = s->values + v;
+    if (value->at < 0 || computed(s, s->code + value->at) != v) {
+        return -1;
+    }
+    return value->at;
+}
+
+static bool reusable(const struct ssa* s, i32 v) {
+    const struct value* value = s->values + v;
+    return value->pure && value->argc > 0 && (value->kind == KIND_INT || value->kind == KIND_FLOAT);
+}
+
+static u16 temp_of(struct ssa* s, i32 v) {
+    struct value* value = s->values + v;
+    if (value->temp < 0) {
+        value->temp = (i32) s->temps++;
+        struct instruction* root = s->code + value->at;
+        u8 keep[6] = { MTR_OP_SET, 0, 0, MTR_OP_GET, 0, 0 };
+        write_u16(keep + 1, TEMP_SLOT(value->temp));
+        write_u16(keep + 4, TEMP_SLOT(value->temp));
+        write_bytes(&root->after, keep, sizeof(keep));
+    }
+    return TEMP_SLOT(value->temp);
+}
+
+// replaces the expression that pushes v with a load of what 'same' left in its temporary
+static void reuse(struct ssa* s, i32 v, i32 same) {
+    const i32 root = root_of(s, v);
+    const i32 first = root_of(s, same);
+    if (root < 0 || first < 0 || s->code[first].removed || s->temps == MAX_TEMPS) {
+        return;
+    }
+
+    struct instruction* in = s->code + root;
+    if (in->removed || in->patch != PATCH_NONE || in->from < 0 || !removable(s, in->from, root)) {
+        return;
+    }
+    if (live_count(s, in->from, root) < 2) {
+        return;
+    }
+
+    const u16 temp = temp_of(s, same);
+    s->stats.common += remove_range(s, in->from, root - 1);
+    patch_u16(in, MTR_OP_GET, temp, PATCH_OTHER);
+}
+
+static void number_block(struct ssa* s, struct numbers* table, struct numbers* constants, i32 b, const struct list* children) {
+    const u32 scope = table->count;
+    const struct block* block = s->blocks + b;
+    struct list reused = { 0 };
+
+    for (u32 k = 0; k < block->values.count; ++k) {
+        const i32 v = block->values.items[k];
+        struct value* value = s->values + v;
+        if (value->forward >= 0) {
+            continue;
+        }
+
+        if (value->lattice == LATTICE_CONSTANT && value->argc == 0) {
+            u64 bits;
+            memcpy(&bits, &value->constant.i, sizeof(bits));
+            const i32 same = lookup(constants, MTR_OP_CONSTANT, value->constant.type, bits);
+            value->number = same >= 0 ? same : v;
+            if (same < 0) {
+                insert(constants, MTR_OP_CONSTANT, value->constant.type, bits, v);
+            }
+            continue;
+        }
+
+        if (value->op == SSA_COPY) {
+            const i32 copied = arg(s, value, 0);
+            value->number = s->values[copied].number >= 0 ? s->values[copied].number : copied;
+            continue;
+        }
+
+        if (!value->pure || value->argc == 0) {
+            value->number = v;
+            continue;
+        }
+
+        u64 a = (u64) s->values[arg(s, value, 0)].number;
+        u64 c = value->argc > 1 ? (u64) s->values[arg(s, value, 1)].number : UINT64_MAX;
+        if ((i64) a < 0 || (value->argc > 1 && (i64) c < 0)) {
+            value->number = v;
+            continue;
+        }
+        if (is_commutative(value->op) && c < a) {
+            const u64 t = a;
+            a = c;
+            c = t;
+        }
+
+        const i32 same = lookup(table, value->op, a, c);
+        value->number = same >= 0 ? s->values[same].number : v;
+        if (same >= 0 && reusable(s, v) && root_of(s, same) >= 0) {
+            append(&reused, v);
+            append(&reused, same);
+        } else if (root_of(s, v) >= 0 || same < 0) {
+            // a later equal value reuses the last one that is pushed
+            insert(table, value->op, a, c, v);
+        }
+    }
+
+    // outer expressions first, an inner one that is reused too goes with them
+    for (u32 k = reused.count; k > 0; k -= 2) {
+        reuse(s, reused.items[k - 2], reused.items[k - 1]);
+    }
+    free(reused.items);
+
+    for (u32 k = 0; k < children[b].count; ++k) {
+        number_block(s, table, constants, children[b].items[k], children);
+    }
+    truncate(table, scope);
+}
+
+static void eliminate_common_subexpressions(struct ssa* s) {
+    for (u32 v = 0; v < s->value_count; ++v) {
+        const struct value* value = s->values + v;
+        if (value->op == SSA_PHI || value->op == SSA_PARAM) {
+            s->values[v].number = (i32) v;
+        }
+    }
+
+    struct list* children = calloc(s->block_count, sizeof(struct list));
+    for (i32 k = 1; k < s->rpo_count; ++k) {
+        const i32 b = s->rpo[k];
+        if (s->blocks[b].executable && s->blocks[b].idom >= 0) {
+            append(children + s->blocks[b].idom, b);
+        }
+    }
+
+    struct numbers table = { 0 };
+    struct numbers constants = { 0 };
+    const u32 buckets = 256;
+    table.heads = malloc(sizeof(i32) * buckets);
+    constants.heads = malloc(sizeof(i32) * buckets);
+    table.mask = constants.mask = buckets - 1;
+    for (u32 k = 0; k < buckets; ++k) {
+        table.heads[k] = constants.heads[k] = -1;
+    }
+
+    number_block(s, &table, &constants, 0, children);
+
+    free(table.heads);
+    free(table.entries);
+    free(constants.heads);
+    free(constants.entries);
+    for (i32 b = 0; b < s->block_count; ++b) {
+        free(children[b].items);
+    }
+    free(children);
+}
+
+// Loop invariant code motion
+//
+// A pure expression inside a loop whose loads all read values that come from outside it gives
+// the same result on every iteration. It is copied to the end of the preheader, the only block
+// that goes into the loop from outside, with a store to a temporary, and the loop loads it.
+
+static bool loads_from_outside(const struct ssa* s, const struct loop* loop, const struct instruction* in, u16 slot, i32 value) {
+    const struct block* preheader = s->blocks + loop->preheader;
+    const u32 depth = (u32) s->blocks[loop->header].depth;
+    (void) in;
+    value = resolve(s, value);
+    if (loop->body[s->values[value].block] || slot >= depth) {
+        return false;
+    }
+    // the slot has to hold the same value where the copy runs
+    return resolve(s, preheader->defs[slot]) == value;
+}
+
+static bool invariant(const struct ssa* s, const struct loop* loop, i32 from, i32 to) {
+    for (i32 j = from; j <= to; ++j) {
+        const struct instruction* in = s->code + j;
+        if (in->removed || in->patch == PATCH_CONSTANT) {
+            continue;
+        }
+        if (in->patch != PATCH_NONE) {
+            return false;
+        }
+
+        switch (in->code[0])
+        {
+        case MTR_OP_GET:
+            if (!loads_from_outside(s, loop, in, read_u16(in->code + 1), in->pushes[0])) {
+                return false;
+            }
+            break;
+        case MTR_OP_GET_GET:
+            if (!loads_from_outside(s, loop, in, read_u16(in->code + 1), in->pushes[0])
+                || !loads_from_outside(s, loop, in, read_u16(in->code + 3), in->pushes[1])) {
+                return false;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+static void hoist(struct ssa* s, const struct loop* loop, i32 root) {
+    struct instruction* in = s->code + root;
+    struct block* preheader = s->blocks + loop->preheader;
+    struct instruction* last = s->code + preheader->last;
+
+    // the copy goes where the preheader ends: before its jump, or after its last instruction when it falls through
+    struct bytes* out = last->code[0] == MTR_OP_JMP && !last->removed ? &last->before : &last->after;
+
+    const u16 temp = TEMP_SLOT(s->temps++);
+    for (i32 j = in->from; j <= root; ++j) {
+        if (!s->code[j].removed) {
+            write_bytes(out, s->code[j].code, s->code[j].length);
+        }
+    }
+    u8 store[3] = { MTR_OP_SET, 0, 0 };
+    write_u16(store + 1, temp);
+    write_bytes(out, store, sizeof(store));
+
+    s->stats.hoisted += remove_range(s, in->from, root - 1);
+    patch_u16(in, MTR_OP_GET, temp, PATCH_OTHER);
+}
+
+static void move_loop_invariants(struct ssa* s) {
+    for (u32 l = 0; l < s->loop_count; ++l) {
+        const struct loop* loop = s->loops + l;
+        if (loop->preheader < 0 || !s->blocks[loop->preheader].executable) {
+            continue;
+        }
+
+        for (i32 b = 0; b < s->block_count; ++b) {
+            const struct block* block = s->blocks + b;
+            if (!loop->body[b] || !block->executable) {
+                continue;
+            }
+
+            for (i32 i = block->last; i >= block->first && s->temps < MAX_TEMPS; --i) {
+                struct instruction* in = s->code + i;
+                const i32 v = computed(s, in);
+                if (v < 0 || in->removed || in->patch != PATCH_NONE || !reusable(s, v) || in->from < 0) {
+                    continue;
+                }
+                if (!removable(s, in->from, i) || live_count(s, in->from, i) < 2 || !invariant(s, loop, in->from, i)) {
+                    continue;
+                }
+                hoist(s, loop, i);
+            }
+        }
+    }
+}
+
+// Bounds check elimination
+//
+// An array keeps the size it was made with, so an index shown to stay inside it needs no check.
+// The indices looked at are constants and the induction variables of loops: a phi of the header
+// that starts with what the preheader gives it, goes up by a constant on every iteration and is
+// kept below a bound by the condition of the loop. When the start, the bound and the size of
+// the array, from the literals it can come from, are all known the accesses are in bounds.
+// Otherwise loops that count one by one and only leave through their condition check the whole
+// range once in the preheader with CHECK_BOUNDS. When the range doesn't fit the preheader runs
+// a copy of the loop that checks every access instead, so the iterations before the one that
+// goes out of bounds still run.
+
+struct induction {
+    i32 phi;
+    i32 first;       // what it starts with, from the preheader
+    i32 end;         // the loop runs while the phi is below it
+    bool inclusive;  // or while it is not above it, only for constant ends
+    bool unit;       // every iteration adds 1
+};
+
+// phis of the same block with the same operands, the header can have one for the local and
+// another for the copy of it the condition is computed from
+static bool same_phi(const struct ssa* s, i32 a, i32 b) {
+    if (a == b) {
+        return true;
+    }
+    const struct value* x = s->values + a;
+    const struct value* y = s->values + b;
+    if (x->op != SSA_PHI || y->op != SSA_PHI || x->block != y->block || x->argc != y->argc) {
+        return false;
+    }
+    for (u32 k = 0; k < x->argc; ++k) {
+        if (arg(s, x, k) != arg(s, y, k)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// how much v adds to the phi, -1 when it isn't the phi plus a constant
+static i64 step_of(const struct ssa* s, i32 phi, i32 v) {
+    while (v >= 0 && s->values[v].op == SSA_COPY) {
+        v = arg(s, s->values + v, 0);
+    }
+    if (v < 0 || s->values[v].op != MTR_OP_ADD_I) {
+        return -1;
+    }
+    const struct value* add = s->values + v;
+    i64 c;
+    for (u32 k = 0; k < 2; ++k) {
+        if (same_phi(s, arg(s, add, k), phi) && is_constant(s, arg(s, add, 1 - k), &c) && c >= 0 && c <= INT32_MAX) {
+            return c;
+        }
+    }
+    return -1;
+}
+
+static bool find_induction(const struct ssa* s, const struct loop* loop, struct induction* iv) {
+    const struct block* header = s->blocks + loop->header;
+    if (header->next < 0 || header->jump < 0 || !loop->body[header->next] || loop->body[header->jump]) {
+        return false;
+    }
+    const struct instruction* in = s->code + header->last;
+    if (in->removed || in->patch != PATCH_NONE || in->value < 0) {
+        return false;
+    }
+
+    const struct value* branch = s->values + resolve(s, in->value);
+    iv->inclusive = false;
+    switch (in->code[0])
+    {
+    case MTR_OP_LESS_EQUAL_I_JMP_Z:
+        iv->inclusive = true;
+        // fallthrough
+    case MTR_OP_LESS_I_JMP_Z:
+        iv->phi = arg(s, branch, 0);
+        iv->end = arg(s, branch, 1);
+        break;
+    case MTR_OP_GREATER_I_JMP_Z:
+        iv->phi = arg(s, branch, 1);
+        iv->end = arg(s, branch, 0);
+        break;
+    default:
+        return false;
+    }
+
+    i64 end;
+    if (iv->phi < 0 || iv->end < 0 || s->values[iv->phi].op != SSA_PHI || s->values[iv->phi].block != loop->header) {
+        return false;
+    }
+    if (!is_constant(s, iv->end, &end) && (iv->inclusive || loop->body[s->values[iv->end].block])) {
+        return false;
+    }
+    if (iv->inclusive && end == INT64_MAX) {
+        return false;
+    }
+
+    const struct value* phi = s->values + iv->phi;
+    iv->first = -1;
+    iv->unit = true;
+    for (u32 p = 0; p < header->preds.count; ++p) {
+        const i32 pred = header->preds.items[p];
+        const i32 a = arg(s, phi, p);
+        if (pred == loop->preheader) {
+            iv->first = a;
+            continue;
+        }
+        // added after the condition let it in, so it can't go past the end
+        const i64 step = step_of(s, iv->phi, a);
+        if (step < 0 || !dominates(s, header->next, s->values[resolve(s, a)].block)) {
+            return false;
+        }
+        iv->unit = iv->unit && step == 1;
+    }
+    return iv->first >= 0;
+}
+
+// the smallest size of the arrays a value can hold when they all come from literals, -1 otherwise
+static i64 array_size(const struct ssa* s, i32 array, bool* seen) {
+    memset(seen, 0, sizeof(bool) * s->value_count);
+    struct list work = { 0 };
+    append(&work, array);
+    seen[array] = true;
+
+    i64 size = INT64_MAX;
+    while (work.count > 0 && size >= 0) {
+        const struct value* value = s->values + work.items[--work.count];
+        switch (value->op)
+        {
+        case MTR_OP_ARRAY_LITERAL:
+            size = size < s->code[value->at].code[1] ? size : s->code[value->at].code[1];
+            break;
+        case MTR_OP_EMPTY_ARRAY:
+            size = 0;
+            break;
+        case SSA_COPY:
+        case SSA_PHI:
+            for (u32 k = 0; k < value->argc && size >= 0; ++k) {
+                const i32 a = arg(s, value, k);
+                if (a < 0) {
+                    size = -1;
+                } else if (!seen[a]) {
+                    seen[a] = true;
+                    append(&work, a);
+                }
+            }
+            break;
+        default:
+            size = -1;
+            break;
+        }
+    }
+    free(work.items);
+    return size;
+}
+
+// whether every iteration that gets past the condition comes back to the header
+static bool leaves_through_header(const struct ssa* s, const struct loop* loop) {
+    for (i32 b = 0; b < s->block_count; ++b) {
+        const struct block* block = s->blocks + b;
+        if (!loop->body[b] || b == loop->header || !block->executable) {
+            continue;
+        }
+        if ((block->next < 0 && block->jump < 0) || (block->next >= 0 && !loop->body[block->next])
+            || (block->jump >= 0 && !loop->body[block->jump])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool runs_every_iteration(const struct ssa* s, const struct loop* loop, i32 b) {
+    const struct block* header = s->blocks + loop->header;
+    for (u32 p = 0; p < header->preds.count; ++p) {
+        const i32 latch = header->preds.items[p];
+        if (loop->body[latch] && !dominates(s, b, latch)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// a local that holds v where the preheader ends, -1 if none does
+static i32 slot_of(const struct ssa* s, const struct loop* loop, i32 v) {
+    const struct block* preheader = s->blocks + loop->preheader;
+    const i32 depth = s->blocks[s->blocks[loop->header].next].depth;
+    for (i32 slot = 0; slot < depth; ++slot) {
+        if (resolve(s, preheader->defs[slot]) == v) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// writes the load of v, or of its constant plus 'add', returns its length or 0 when it can't
+static u32 write_load(struct ssa* s, const struct loop* loop, u8* out, i32 v, i64 add) {
+    struct constant c = s->values[v].constant;
+    if (s->values[v].lattice == LATTICE_CONSTANT && c.type == MTR_VAL_INT) {
+        c.i += add;
+        return write_constant(s->chunk, out, c);
+    }
+    const i32 slot = slot_of(s, loop, v);
+    if (slot < 0 || add != 0) {
+        return 0;
+    }
+    out[0] = MTR_OP_GET;
+    write_u16(out + 1, (u16) slot);
+    return 3;
+}
+
+// the version the checks in the preheader jump to, -1 when the loop can't be copied: its
+// instructions have to be in one piece that ends with the jump back and copies can't overlap
+static i32 version_of(struct ssa* s, const struct loop* loop) {
+    const i32 header = s->blocks[loop->header].first;
+    for (u32 v = 0; v < s->version_count; ++v) {
+        if (s->versions[v].first == header) {
+            return (i32) v;
+        }
+    }
+
+    i32 last = header;
+    for (i32 b = 0; b < s->block_count; ++b) {
+        if (loop->body[b]) {
+            if (s->blocks[b].first < header) {
+                return -1;
+            }
+            last = s->blocks[b].last > last ? s->blocks[b].last : last;
+        }
+    }
+    const struct instruction* end = s->code + last;
+    const struct instruction* before = s->code + s->blocks[loop->preheader].last;
+    if (end->removed || end->code[0] != MTR_OP_JMP || is_conditional(before->code[0]) || before->copy >= 0) {
+        return -1;
+    }
+    for (i32 i = header; i <= last; ++i) {
+        const struct instruction* in = s->code + i;
+        if ((in->block >= 0 && !loop->body[in->block]) || in->copy >= 0) {
+            return -1;
+        }
+    }
+
+    s->versions = realloc(s->versions, sizeof(struct version) * (s->version_count + 1));
+    s->versions[s->version_count] = (struct version) { .first = header, .last = last };
+    for (i32 i = header; i <= last; ++i) {
+        s->code[i].copy = (i32) s->version_count;
+    }
+    return (i32) s->version_count++;
+}
+
+// CHECK_BOUNDS in the preheader for the range of the induction variable over the array
+static bool check_before(struct ssa* s, const struct loop* loop, const struct induction* iv, i32 array) {
+    const i32 slot = slot_of(s, loop, array);
+    if (slot < 0 || loop->body[s->values[array].block]) {
+        return false;
+    }
+
+    u8 check[3 + 3 + 3 + 1 + 3] = { MTR_OP_GET };
+    write_u16(check + 1, (u16) slot);
+    u32 size = 3;
+    u32 length = write_load(s, loop, check + size, iv->first, 0);
+    if (length == 0) {
+        return false;
+    }
+    size += length;
+    length = write_load(s, loop, check + size, iv->end, iv->inclusive);
+    if (length == 0) {
+        return false;
+    }
+    size += length;
+    check[size++] = MTR_OP_CHECK_BOUNDS;
+    // lands on the copy, encoding sets where that is
+    check[size] = MTR_OP_JMP_Z;
+    size += 3;
+
+    const i32 v = version_of(s, loop);
+    if (v < 0) {
+        return false;
+    }
+    const i32 p = s->blocks[loop->preheader].last;
+    struct instruction* last = s->code + p;
+    const bool before = last->code[0] == MTR_OP_JMP && !last->removed;
+    struct bytes* out = before ? &last->before : &last->after;
+    struct list* jumps = &s->versions[v].jumps;
+    append(jumps, p);
+    append(jumps, before);
+    append(jumps, (i32) (out->size + size - 3));
+    write_bytes(out, check, size);
+    return true;
+}
+
+static void uncheck(struct ssa* s, struct instruction* in) {
+    patch_op(in, in->code[0] == MTR_OP_INDEX_GET_ARRAY ? MTR_OP_INDEX_GET_ARRAY_UNCHECKED : MTR_OP_INDEX_SET_ARRAY_UNCHECKED, PATCH_OTHER);
+    s->stats.unchecked++;
+}
+
+// the array and index of an access that still checks them, false for anything else
+static bool array_access(const struct ssa* s, const struct instruction* in, i32* array, i32* index) {
+    if (in->removed || in->patch != PATCH_NONE || in->value < 0
+        || (in->code[0] != MTR_OP_INDEX_GET_ARRAY && in->code[0] != MTR_OP_INDEX_SET_ARRAY)) {
+        return false;
+    }
+    // the value is popped before the array
+    const u32 k = in->code[0] == MTR_OP_INDEX_SET_ARRAY;
+    const struct value* access = s->values + resolve(s, in->value);
+    *array = arg(s, access, k);
+    *index = arg(s, access, k + 1);
+    return *array >= 0 && *index >= 0;
+}
+
+static void check_loop(struct ssa* s, const struct loop* loop, bool* seen) {
+    struct induction iv;
+    if (!find_induction(s, loop, &iv)) {
+        return;
+    }
+
+    i64 first = -1;
+    i64 end = 0;
+    const bool known = is_constant(s, iv.first, &first) && first >= 0 && is_constant(s, iv.end, &end);
+    end += known && iv.inclusive;
+    const bool can_check = iv.unit && leaves_through_header(s, loop);
+
+    struct list checked = { 0 };  // arrays the preheader checks already
+    const i32 body = s->blocks[loop->header].next;
+    for (i32 b = 0; b < s->block_count; ++b) {
+        const struct block* block = s->blocks + b;
+        if (!loop->body[b] || !block->executable || !dominates(s, body, b)) {
+            continue;
+        }
+
+        for (i32 i = block->first; i <= block->last; ++i) {
+            struct instruction* in = s->code + i;
+            i32 array;
+            i32 index;
+            if (!array_access(s, in, &array, &index) || !same_phi(s, index, iv.phi)) {
+                continue;
+            }
+
+            if (known && end <= array_size(s, array, seen)) {
+                uncheck(s, in);
+                continue;
+            }
+            if (!can_check || !runs_every_iteration(s, loop, b)) {
+                continue;
+            }
+            bool done = false;
+            for (u32 c = 0; c < checked.count; ++c) {
+                done = done || checked.items[c] == array;
+            }
+            if (done || check_before(s, loop, &iv, array)) {
+                if (!done) {
+                    append(&checked, array);
+                }
+                uncheck(s, in);
+                in->checked_before = true;
+            }
+        }
+    }
+    free(checked.items);
+}
+
+static void eliminate_bounds_checks(struct ssa* s) {
+    bool* seen = malloc(sizeof(bool) * s->value_count);
+
+    for (i32 i = 0; i < s->count; ++i) {
+        struct instruction* in = s->code + i;
+        i32 array;
+        i32 index;
+        i64 k;
+        if (in->block >= 0 && s->blocks[in->block].executable && array_access(s, in, &array, &index)
+            && is_constant(s, index, &k) && k >= 0 && k < array_size(s, array, seen)) {
+            uncheck(s, in);
+        }
+    }
+
+    // inner loops first, a loop that encloses a copied one can't be copied itself
+    i32* order = malloc(sizeof(i32) * (s->loop_count + 1));
+    for (u32 l = 0; l < s->loop_count; ++l) {
+        u32 k = l;
+        for (; k > 0 && s->loops[order[k - 1]].size > s->loops[l].size; --k) {
+            order[k] = order[k - 1];
+        }
+        order[k] = (i32) l;
+    }
+    for (u32 l = 0; l < s->loop_count; ++l) {
+        const struct loop* loop = s->loops + order[l];
+        if (loop->preheader >= 0 && s->blocks[loop->preheader].executable) {
+            check_loop(s, loop, seen);
+        }
+    }
+    free(order);
+    free(seen);
+}
+
+// Escape analysis
+//
+// An object escapes its frame when something can still reach it after the frame returned:
+// it is returned, stored in another object, captured by a closure or passed to a function.
+// Objects that are only kept in locals, read and written through and passed to natives
+// (runtime/object.h) are made in the frame storage of the engine instead of the heap.
+
+static u8 frame_op(u8 op) {
+    switch (op)
+    {
+    case MTR_OP_ARRAY_LITERAL: return MTR_OP_FRAME_ARRAY_LITERAL;
+    case MTR_OP_CONSTRUCTOR:   return MTR_OP_FRAME_CONSTRUCTOR;
+    case MTR_OP_EMPTY_ARRAY:   return MTR_OP_FRAME_EMPTY_ARRAY;
+    default:                   return op;
+    }
+}
+
+// whether 'user' keeping its k-th operand, the object, lets it escape
+static bool lets_escape(const struct value* user, u32 k) {
+    switch (user->op)
+    {
+    case SSA_COPY:
+    case SSA_PHI:
+    case MTR_OP_CALL_GLOBAL_NATIVE:
+    case MTR_OP_ELEMENTWISE_I:
+    case MTR_OP_ELEMENTWISE_F:
+        return false;
+
+    case MTR_OP_STRUCT_GET:
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_MAP:
+        return k != 0;
+
+    // the value is popped before the object
+    case MTR_OP_STRUCT_SET:
+    case MTR_OP_INDEX_SET:
+    case MTR_OP_INDEX_SET_ARRAY:
+    case MTR_OP_INDEX_SET_MAP:
+        return k != 1;
+
+    default:
+        return true;
+    }
+}
+
+// follows the object through the locals and phis it is kept in
+static bool escapes(const struct ssa* s, const struct list* users, i32 object, bool* seen) {
+    struct list work = { 0 };
+    append(&work, object);
+    seen[object] = true;
+
+    bool escaped = false;
+    while (work.count > 0 && !escaped) {
+        const struct list* uses = users + work.items[--work.count];
+        for (u32 u = 0; u < uses->count && !escaped; u += 2) {
+            const i32 user = uses->items[u];
+            escaped = lets_escape(s->values + user, (u32) uses->items[u + 1]);
+            if (!escaped && !seen[user] && (s->values[user].op == SSA_COPY || s->values[user].op == SSA_PHI)) {
+                seen[user] = true;
+                append(&work, user);
+            }
+        }
+    }
+    free(work.items);
+    return escaped;
+}
+
+static void keep_in_frame(struct ssa* s) {
+    // every use of a value, as the user and which of its operands it is
+    struct list* users = calloc(s->value_count, sizeof(struct list));
+    for (u32 v = 0; v < s->value_count; ++v) {
+        const struct value* value = s->values + v;
+        if (value->forward >= 0 || (value->at >= 0 && s->code[value->at].removed)) {
+            continue;
+        }
+        for (u32 k = 0; k < value->argc; ++k) {
+            const i32 a = arg(s, value, k);
+            if (a >= 0) {
+                append(users + a, (i32) v);
+                append(users + a, (i32) k);
+            }
+        }
+    }
+
+    bool* seen = malloc(sizeof(bool) * s->value_count);
+    for (u32 v = 0; v < s->value_count; ++v) {
+        const struct value* value = s->values + v;
+        if (value->at < 0 || frame_op(value->op) == value->op) {
+            continue;
+        }
+        struct instruction* in = s->code + value->at;
+        if (in->removed || in->patch != PATCH_NONE || in->code[0] != value->op) {
+            continue;
+        }
+
+        memset(seen, 0, sizeof(bool) * s->value_count);
+        if (!escapes(s, users, (i32) v, seen)) {
+            memcpy(in->patched, in->code, in->length);
+            in->patched[0] = frame_op(value->op);
+            in->code = in->patched;
+            in->patch = PATCH_OTHER;
+            s->stats.local++;
+        }
+    }
+
+    free(seen);
+    for (u32 v = 0; v < s->value_count; ++v) {
+        free(users[v].items);
+    }
+    free(users);
+}
+
+// Encoding
+
+static u16 move_slot(const struct ssa* s, u16 slot) {
+    if (IS_TEMP_SLOT(slot)) {
+        return (u16) (s->chunk->arity + (UINT16_MAX - slot));
+    }
+    return slot >= s->chunk->arity ? (u16) (slot + s->temps) : slot;
+}
+
+static void move_operand(const struct ssa* s, u8* operand) {
+    write_u16(operand, move_slot(s, read_u16(operand)));
+}
+
+// copies instructions to 'out' with the slots they use moved
+static void emit(const struct ssa* s, u8* out, const u8* code, u32 size) {
+    // most instructions get nothing put before or after them, those buffers are still NULL
+    if (size > 0) {
+        memcpy(out, code, size);
+    }
+    for (u32 offset = 0; offset < size; offset += mtr_instruction_length(out + offset)) {
+        u8* in = out + offset;
+        switch (in[0])
+        {
+        case MTR_OP_LOCAL_ADD_I:
+        case MTR_OP_LOCAL_SUB_I:
+            move_operand(s, in + 5);
+            // fallthrough
+        case MTR_OP_GET_GET:
+            move_operand(s, in + 3);
+            // fallthrough
+        case MTR_OP_GET:
+        case MTR_OP_SET:
+        case MTR_OP_SET_GET:
+        case MTR_OP_LOCAL_INC_I:
+            move_operand(s, in + 1);
+            break;
+        case MTR_OP_CLOSURE:
+            for (u8 k = 0; k < in[3]; ++k) {
+                if (in[4 + 3 * k + 2] != 0) {
+                    move_operand(s, in + 4 + 3 * k);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+// the temporaries go between the parameters and the locals, none of them holds an object
+static void move_stack_map(const struct ssa* s, struct mtr_stack_map* map) {
+    const u32 count = map->count + s->temps;
+    u64* objects = calloc(count / 64 + 1, sizeof(u64));
+    for (u32 slot = 0; slot < map->count; ++slot) {
+        if (MTR_STACK_MAP_HAS_OBJECT(map, slot)) {
+            const u32 moved = slot < s->chunk->arity ? slot : slot + s->temps;
+            objects[moved / 64] |= (u64) 1 << (moved % 64);
+        }
+    }
+    free(map->objects);
+    map->objects = objects;
+    map->count = count;
+}
+
+// writes instruction i, or its copy in the checked version of its loop
+static bool emit_instruction(const struct ssa* s, u8* bytecode, const u32* starts, const u32* at, i32 i, const struct version* copy) {
+    const struct instruction* in = s->code + i;
+    const u32 shift = copy != NULL ? copy->shift : 0;
+    emit(s, bytecode + starts[i] + shift, in->before.data, in->before.size);
+    bool ok = true;
+    if (!in->removed) {
+        u8* out = bytecode + at[i] + shift;
+        emit(s, out, in->code, in->length);
+        if (copy != NULL && in->checked_before) {
+            out[0] = s->chunk->bytecode[in->offset];
+        }
+        if (in->target >= 0) {
+            const bool inside = copy != NULL && in->target >= copy->first && in->target <= copy->last;
+            const i64 where = (i64) starts[in->target] + (inside ? shift : 0) - (at[i] + shift + 3);
+            ok = where >= INT16_MIN && where <= INT16_MAX;
+            write_u16(out + 1, (u16) (i16) where);
+        }
+    }
+    emit(s, bytecode + at[i] + shift + (in->removed ? 0 : in->length), in->after.data, in->after.size);
+    return ok;
+}
+
+static bool encode(struct ssa* s) {
+    struct mtr_chunk* chunk = s->chunk;
+
+    // where the code before every instruction starts (jumps land there) and where its own starts
+    u32* starts = malloc(sizeof(u32) * (s->count + 1));
+    u32* at = malloc(sizeof(u32) * (s->count + 1));
+    u32 size = s->temps;
+    for (i32 i = 0; i < s->count; ++i) {
+        const struct instruction* in = s->code + i;
+        starts[i] = size;
+        size += in->before.size;
+        at[i] = size;
+        size += (in->removed ? 0 : in->length) + in->after.size;
+        if (in->copy >= 0 && s->versions[in->copy].last == i) {
+            struct version* version = s->versions + in->copy;
+            version->shift = size - starts[version->first];
+            size += version->shift;
+        }
+    }
+
+    u8* bytecode = malloc(size + 1);
+    // every temporary starts as an Int, they are only read where a store dominates the load
+    memset(bytecode, MTR_OP_FALSE, s->temps);
+
+    bool ok = true;
+    for (i32 i = 0; i < s->count && ok; ++i) {
+        ok = emit_instruction(s, bytecode, starts, at, i, NULL);
+        const struct version* version = s->code[i].copy >= 0 ? s->versions + s->code[i].copy : NULL;
+        if (version != NULL && version->last == i) {
+            for (i32 j = version->first; j <= version->last && ok; ++j) {
+                ok = emit_instruction(s, bytecode, starts, at, j, version);
+            }
+        }
+    }
+
+    // the checks that fail run the copy
+    for (u32 v = 0; v < s->version_count && ok; ++v) {
+        const struct version* version = s->versions + v;
+        for (u32 k = 0; k < version->jumps.count; k += 3) {
+            const i32 i = version->jumps.items[k];
+            const struct instruction* in = s->code + i;
+            const u32 from = (version->jumps.items[k + 1] ? starts[i] : at[i] + (in->removed ? 0 : in->length)) + (u32) version->jumps.items[k + 2];
+            const i64 where = (i64) starts[version->first] + version->shift - (from + 3);
+            ok = ok && where >= INT16_MIN && where <= INT16_MAX;
+            write_u16(bytecode + from + 1, (u16) (i16) where);
+        }
+    }
+
+    if (ok) {
+        // calls and allocations keep their stack map where they move to, the maps of removed ones are
+        // dropped and the copies of loops get their own
+        const u32 capacity = 2 * chunk->stack_map_count + 1;
+        struct mtr_stack_map* maps = malloc(sizeof(struct mtr_stack_map) * capacity);
+        u32 kept = 0;
+        u32 next = 0;
+        u32 copied = 0;
+        for (i32 i = 0; i < s->count; ++i) {
+            const struct instruction* in = s->code + i;
+            const struct version* version = in->copy >= 0 ? s->versions + in->copy : NULL;
+            if (version != NULL && version->first == i) {
+                copied = kept;
+            }
+
+            if (next < chunk->stack_map_count && MTR_HAS_STACK_MAP(s->chunk->bytecode[in->offset])
+                && chunk->stack_maps[next].offset == in->offset + mtr_instruction_length(chunk->bytecode + in->offset)) {
+                struct mtr_stack_map map = chunk->stack_maps[next++];
+                if (in->removed) {
+                    free(map.objects);
+                } else {
+                    map.offset = at[i] + in->length;
+                    if (s->temps > 0) {
+                        move_stack_map(s, &map);
+                    }
+                    maps[kept++] = map;
+                }
+            }
+
+            if (version != NULL && version->last == i) {
+                for (u32 m = copied, end = kept; m < end; ++m) {
+                    struct mtr_stack_map map = maps[m];
+                    map.offset += version->shift;
+                    map.objects = malloc(sizeof(u64) * (map.count / 64 + 1));
+                    memcpy(map.objects, maps[m].objects, sizeof(u64) * (map.count / 64 + 1));
+                    maps[kept++] = map;
+                }
+            }
+        }
+        for (; next < chunk->stack_map_count; ++next) {
+            free(chunk->stack_maps[next].objects);
+        }
+        free(chunk->stack_maps);
+        chunk->stack_maps = maps;
+        chunk->stack_map_count = kept;
+        chunk->stack_map_capacity = capacity;
+
+        free(chunk->bytecode);
+        chunk->bytecode = bytecode;
+        chunk->size = size;
+        chunk->capacity = size + 1;
+    } else {
+        free(bytecode);
+    }
+
+    free(at);
+    free(starts);
+    return ok;
+}
+
+#ifdef MTR_DUMP_SSA
+
+static const char* op_name(u8 op) {
+    switch (op)
+    {
+    case SSA_PHI:   return "PHI";
+    case SSA_PARAM: return "PARAM";
+    case SSA_COPY:  return "COPY";
+    default:        return mtr_op_code_to_str(op);
+    }
+}
+
+static void dump(const struct ssa* s) {
+    static const char* const kinds[] = { "", "Int", "Float", "Object", "Any" };
+    for (i32 k = 0; k < s->rpo_count; ++k) {
+        const i32 b = s->rpo[k];
+        const struct block* block = s->blocks + b;
+        MTR_PRINT("b%d (depth %d", b, block->depth);
+        if (block->preds.count > 0) {
+            MTR_PRINT(", from");
+            for (u32 p = 0; p < block->preds.count; ++p) {
+                MTR_PRINT(" b%d", block->preds.items[p]);
+            }
+        }
+        for (u32 l = 0; l < s->loop_count; ++l) {
+            if (s->loops[l].header == b) {
+                MTR_PRINT(", loop of %u blocks", s->loops[l].size);
+            }
+        }
+        MTR_LOG(")%s", block->executable ? ":" : ": never runs");
+
+        // phis are made when something reads them, they go first
+        for (u32 n = 0; n < 2 * block->values.count; ++n) {
+            const i32 v = block->values.items[n % block->values.count];
+            const struct value* value = s->values + v;
+            if (value->forward >= 0 || (value->op == SSA_PHI) != (n < block->values.count)) {
+                continue;
+            }
+
+            MTR_PRINT("    ");
+            if (value->kind != KIND_NONE) {
+                MTR_PRINT("v%d = ", v);
+            }
+            MTR_PRINT("%s", op_name(value->op));
+            if (value->op == SSA_PARAM) {
+                MTR_PRINT(" %d", (i32) value->constant.i);
+            }
+            for (u32 a = 0; a < value->argc; ++a) {
+                MTR_PRINT(" v%d", arg(s, value, a));
+            }
+            if (value->kind != KIND_NONE) {
+                MTR_PRINT("    %s", kinds[value->kind]);
+            }
+            if (value->lattice == LATTICE_CONSTANT) {
+                if (value->constant.type == MTR_VAL_INT) {
+                    MTR_PRINT(" = %lld", (long long) value->constant.i);
+                } else {
+                    MTR_PRINT(" = %g", value->constant.f);
+                }
+            }
+            if (value->number >= 0 && value->number != v) {
+                MTR_PRINT(" same as v%d", value->number);
+            }
+            if (!value->live && value->kind != KIND_NONE) {
+                MTR_PRINT(" unused");
+            }
+            MTR_PRINT("\n");
+        }
+    }
+    MTR_LOG("folded %u, dead %u, common %u, hoisted %u, unchecked %u, kept in the frame %u",
+        s->stats.folded, s->stats.dead, s->stats.common, s->stats.hoisted, s->stats.unchecked, s->stats.local);
+}
+
+#endif
+
+static void delete_ssa(struct ssa* s) {
+    for (i32 i = 0; i < s->count; ++i) {
+        free(s->code[i].before.data);
+        free(s->code[i].after.data);
+    }
+    for (i32 b = 0; b < s->block_count; ++b) {
+        struct block* block = s->blocks + b;
+        free(block->preds.items);
+        free(block->incoming);
+        free(block->defs);
+        free(block->values.items);
+        free(block->incomplete.items);
+    }
+    for (u32 l = 0; l < s->loop_count; ++l) {
+        free(s->loops[l].body);
+    }
+    for (u32 v = 0; v < s->version_count; ++v) {
+        free(s->versions[v].jumps.items);
+    }
+    free(s->versions);
+    free(s->loops);
+    free(s->entries);
+    free(s->args);
+    free(s->values);
+    free(s->rpo);
+    free(s->blocks);
+    free(s->code);
+}
+
+struct mtr_ssa_stats mtr_optimize_ssa(struct mtr_chunk* chunk) {
+    struct ssa s;
+    memset(&s, 0, sizeof(s));
+    s.chunk = chunk;
+
+    if (build(&s)) {
+        fold_constants(&s);
+        eliminate_dead_code(&s);
+        eliminate_common_subexpressions(&s);
+        move_loop_invariants(&s);
+        eliminate_bounds_checks(&s);
+        keep_in_frame(&s);
+#ifdef MTR_DUMP_SSA
+        dump(&s);
+#endif
+        if (!encode(&s)) {
+            memset(&s.stats, 0, sizeof(s.stats));
+        }
+    }
+
+    struct mtr_ssa_stats stats = s.stats;
+    delete_ssa(&s);
+    return stats;
+}
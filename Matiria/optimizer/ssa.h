@@ -0,0 +1,40 @@
+#ifndef MTR_SSA_H
+#define MTR_SSA_H
+
+#include "bytecode.h"
+
+// The optimizing middle-end. write_function's stack bytecode already carries the validator's
+// types in its op codes (ADD_I, ADD_F, INDEX_GET_ARRAY...), so the chunk is lifted into SSA
+// form over basic blocks: every frame position, locals and temporaries alike, is a variable
+// and every instruction that computes something is a value. These passes run over it:
+//
+//   constant folding and propagation   Ints and Floats known at compile time, branches on them
+//                                      and the blocks no path reaches any more
+//   dead code elimination              stores nothing reads and pure expressions nothing uses
+//   common subexpression elimination   pure expressions computed again where an equal one
+//                                      dominates them, they reuse its result
+//   loop invariant code motion         pure expressions whose operands don't change in a loop
+//                                      are computed once before it
+//   bounds check elimination           indices that loop conditions keep inside arrays of a
+//                                      known size, or that one check before the loop covers
+//   escape analysis                    arrays and structs that never leave the function are
+//                                      made in the frame storage of the engine, not the heap
+//
+// and their results are written back into the chunk, which keeps the frame layout of the
+// compiler. Results that are reused live in new slots right after the parameters.
+// Chunks it can't make sense of are left alone.
+
+struct mtr_ssa_stats {
+    u32 folded;     // instructions each pass removed
+    u32 dead;
+    u32 common;
+    u32 hoisted;    // taken out of loops, one load of the result stays behind for every expression
+    u32 unchecked;  // array accesses that don't check the index any more
+    u32 local;      // objects made in the frame storage
+};
+
+// Runs before mtr_optimize_chunk, which cleans up after it. With MTR_DUMP_SSA (make ssa=dump)
+// it prints the IR and the statistics of every chunk.
+struct mtr_ssa_stats mtr_optimize_ssa(struct mtr_chunk* chunk);
+
+#endif
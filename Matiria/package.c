@@ -120,4 +120,9 @@ void mtr_delete_package(struct mtr_package* package) {
     free(package->objects);
     package->objects = NULL;
     mtr_delete_symbol_table(&package->symbols);
+
+#ifdef MTR_NAN_BOXING
+    // the constant tables and whatever ran in the engine may still point at boxed Ints
+    mtr_free_int_boxes();
+#endif
 }
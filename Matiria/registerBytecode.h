@@ -0,0 +1,86 @@
+#ifndef MTR_REGISTER_BYTECODE_H
+#define MTR_REGISTER_BYTECODE_H
+
+// Instruction set of the register engine (built with MTR_REGISTER_VM).
+// It is written into a regular struct mtr_chunk.
+//
+// Registers are u8 operands indexing the current frame. Locals live in the register given
+// by their symbol index and temporaries are allocated above them. Jumps take an i16 offset
+// relative to the end of the instruction.
+//
+// Calls: the callee sits in register 'f' and its arguments in f+1 .. f+argc.
+// The callee's register 0 is the caller's f+1 and the return value is written to f.
+
+enum mtr_reg_op_code {
+    MTR_REG_OP_ENTER,           // ENTER u16                reserve the frame's registers
+
+    MTR_REG_OP_MOVE,            // MOVE dst src
+
+    MTR_REG_OP_CONSTANT,        // CONSTANT dst u16          constants[u16]
+    MTR_REG_OP_SMALL_INT,       // SMALL_INT dst i16
+
+    MTR_REG_OP_FALSE,           // FALSE dst
+    MTR_REG_OP_TRUE,            // TRUE dst
+    MTR_REG_OP_NIL,             // NIL dst
+
+    MTR_REG_OP_STRING_LITERAL,  // STRING_LITERAL dst u16    copy of the string constants[u16]
+    MTR_REG_OP_ARRAY_LITERAL,   // ARRAY_LITERAL dst first count
+    MTR_REG_OP_MAP_LITERAL,     // MAP_LITERAL dst first count     key/value pairs from first
+    MTR_REG_OP_CONSTRUCTOR,     // CONSTRUCTOR dst first count
+    MTR_REG_OP_CLOSURE,         // CLOSURE dst u16 u8 (u16 index, u8 local)*  body is the function constants[u16]
+
+    MTR_REG_OP_EMPTY_ARRAY,     // EMPTY_ARRAY dst
+    MTR_REG_OP_EMPTY_MAP,       // EMPTY_MAP dst
+
+    MTR_REG_OP_NOT,             // NOT dst src
+    MTR_REG_OP_NEGATE_I,        // NEGATE_I dst src
+    MTR_REG_OP_NEGATE_F,        // NEGATE_F dst src
+
+    MTR_REG_OP_ADD_I,           // ADD_I dst a b
+    MTR_REG_OP_SUB_I,
+    MTR_REG_OP_MUL_I,
+    MTR_REG_OP_DIV_I,
+
+    MTR_REG_OP_ADD_F,
+    MTR_REG_OP_SUB_F,
+    MTR_REG_OP_MUL_F,
+    MTR_REG_OP_DIV_F,
+
+    // ELEMENTWISE_I dst a b u8   enum mtr_elementwise (runtime/vector.h), over [Int] arrays or an
+    // array and an Int. The values tell which side is the array.
+    MTR_REG_OP_ELEMENTWISE_I,
+    MTR_REG_OP_ELEMENTWISE_F,
+
+    MTR_REG_OP_LESS_I,
+    MTR_REG_OP_GREATER_I,
+    MTR_REG_OP_EQUAL_I,
+
+    MTR_REG_OP_LESS_F,
+    MTR_REG_OP_GREATER_F,
+    MTR_REG_OP_EQUAL_F,
+
+    MTR_REG_OP_GLOBAL_GET,      // GLOBAL_GET dst u16
+
+    MTR_REG_OP_UPVALUE_GET,     // UPVALUE_GET dst u16
+    MTR_REG_OP_UPVALUE_SET,     // UPVALUE_SET u16 src
+
+    MTR_REG_OP_INDEX_GET,       // INDEX_GET dst object key
+    MTR_REG_OP_INDEX_SET,       // INDEX_SET object key src
+
+    MTR_REG_OP_STRUCT_GET,      // STRUCT_GET dst object u8
+    MTR_REG_OP_STRUCT_SET,      // STRUCT_SET object u8 src
+
+    MTR_REG_OP_JMP,             // JMP i16
+    MTR_REG_OP_JMP_Z,           // JMP_Z src i16
+    MTR_REG_OP_JMP_NZ,          // JMP_NZ src i16
+
+    MTR_REG_OP_CALL,            // CALL f argc
+    MTR_REG_OP_TAIL_CALL,       // TAIL_CALL f argc     return f(...) in the current frame
+
+    MTR_REG_OP_INT_CAST,        // INT_CAST dst src
+    MTR_REG_OP_FLOAT_CAST,      // FLOAT_CAST dst src
+
+    MTR_REG_OP_RETURN           // RETURN src
+};
+
+#endif
@@ -0,0 +1,749 @@
+#include "registerCompiler.h"
+
+#include "AST/symbol.h"
+#include "bytecode.h"
+#include "registerBytecode.h"
+
+#include "runtime/object.h"
+#include "runtime/vector.h"
+
+#include "core/log.h"
+#include "core/macros.h"
+
+#define MTR_MAX_REGISTERS 256
+
+struct registers {
+    struct mtr_chunk* chunk;
+    u16 locals; // registers taken by the locals in scope
+    u16 top;    // first free register
+    u16 max;
+    bool overflow;
+};
+
+static void init_registers(struct registers* r, struct mtr_chunk* chunk, u16 locals) {
+    r->chunk = chunk;
+    r->locals = locals;
+    r->top = locals;
+    r->max = locals;
+    r->overflow = false;
+}
+
+static u8 alloc_register(struct registers* r) {
+    if (r->top == MTR_MAX_REGISTERS) {
+        if (!r->overflow) {
+            MTR_LOG_ERROR("Function needs more than %d registers.", MTR_MAX_REGISTERS);
+        }
+        r->overflow = true;
+        return 0;
+    }
+
+    u8 reg = (u8) r->top++;
+    r->max = r->top > r->max ? r->top : r->max;
+    return reg;
+}
+
+static void declare_local(struct registers* r, size_t index) {
+    // locals are numbered in declaration order, so the new one is always the highest in scope
+    r->locals = (u16) index + 1;
+    r->top = r->locals;
+    r->max = r->top > r->max ? r->top : r->max;
+}
+
+// dst < 0 means the result can go in any register
+static u8 target(struct registers* r, i32 dst) {
+    return dst < 0 ? alloc_register(r) : (u8) dst;
+}
+
+static void write_op(struct registers* r, u8 op) {
+    mtr_write_chunk(r->chunk, op);
+}
+
+static void write_reg(struct registers* r, u8 reg) {
+    mtr_write_chunk(r->chunk, reg);
+}
+
+// returns the location of the jump offset relative to the chunk
+static size_t write_jump(struct registers* r, u8 op, i32 condition) {
+    write_op(r, op);
+    if (condition >= 0) {
+        write_reg(r, (u8) condition);
+    }
+    mtr_write_u16(r->chunk, (u16) 0xFFFFu);
+    return r->chunk->size - 2;
+}
+
+static void patch_jump(struct registers* r, size_t offset) {
+    i16 where = r->chunk->size - offset - 2;
+    i16* to_patch = (i16*)(r->chunk->bytecode + offset);
+    *to_patch = where;
+}
+
+static void write_loop(struct registers* r, u8 op, i32 condition, size_t to) {
+    write_op(r, op);
+    if (condition >= 0) {
+        write_reg(r, (u8) condition);
+    }
+    i16 where = to - r->chunk->size - 2;
+    mtr_write_u16(r->chunk, mtr_reinterpret_cast(u16, where));
+}
+
+static u8 write_expr(struct registers* r, struct mtr_expr* expr, i32 dst);
+
+static u8 write_primary(struct registers* r, struct mtr_primary* expr, i32 dst) {
+    if (expr->symbol.is_global) {
+        u8 res = target(r, dst);
+        write_op(r, MTR_REG_OP_GLOBAL_GET);
+        write_reg(r, res);
+        mtr_write_u16(r->chunk, (u16) expr->symbol.index);
+        return res;
+    }
+
+    if (expr->symbol.upvalue) {
+        u8 res = target(r, dst);
+        write_op(r, MTR_REG_OP_UPVALUE_GET);
+        write_reg(r, res);
+        mtr_write_u16(r->chunk, (u16) expr->symbol.index);
+        return res;
+    }
+
+    // locals already live in a register
+    u8 local = (u8) expr->symbol.index;
+    if (dst < 0 || dst == local) {
+        return local;
+    }
+
+    write_op(r, MTR_REG_OP_MOVE);
+    write_reg(r, (u8) dst);
+    write_reg(r, local);
+    return (u8) dst;
+}
+
+static u8 write_literal(struct registers* r, struct mtr_literal* expr, i32 dst) {
+    u8 res = target(r, dst);
+
+    switch (expr->literal.type)
+    {
+    case MTR_TOKEN_INT_LITERAL: {
+        i64 value = mtr_token_to_int(expr->literal);
+        if (value >= INT16_MIN && value <= INT16_MAX) {
+            write_op(r, MTR_REG_OP_SMALL_INT);
+            write_reg(r, res);
+            mtr_write_u16(r->chunk, (u16) (i16) value);
+        } else {
+            write_op(r, MTR_REG_OP_CONSTANT);
+            write_reg(r, res);
+            mtr_write_u16(r->chunk, mtr_add_constant(r->chunk, MTR_INT(value), MTR_VAL_INT));
+        }
+        break;
+    }
+
+    case MTR_TOKEN_FLOAT_LITERAL: {
+        write_op(r, MTR_REG_OP_CONSTANT);
+        write_reg(r, res);
+        mtr_write_u16(r->chunk, mtr_add_constant(r->chunk, MTR_FLOAT(mtr_token_to_float(expr->literal)), MTR_VAL_FLOAT));
+        break;
+    }
+
+    case MTR_TOKEN_STRING_LITERAL: {
+        const char* string_start = expr->literal.start+1; // skip opening "
+        u16 index = mtr_add_string_constant(r->chunk, string_start, expr->literal.length - 2); // skip closing "
+        write_op(r, MTR_REG_OP_STRING_LITERAL);
+        write_reg(r, res);
+        mtr_write_u16(r->chunk, index);
+        break;
+    }
+
+    case MTR_TOKEN_TRUE: {
+        write_op(r, MTR_REG_OP_TRUE);
+        write_reg(r, res);
+        break;
+    }
+
+    case MTR_TOKEN_FALSE: {
+        write_op(r, MTR_REG_OP_FALSE);
+        write_reg(r, res);
+        break;
+    }
+    default:
+        MTR_LOG_WARN("Invalid type");
+        break;
+    }
+
+    return res;
+}
+
+static u8 write_array_literal(struct registers* r, struct mtr_array_literal* array, i32 dst) {
+    u16 saved = r->top;
+    u8 first = (u8) r->top;
+    for (u8 i = 0; i < array->count; ++i) {
+        u8 reg = alloc_register(r);
+        write_expr(r, array->expressions[i], reg);
+    }
+    r->top = saved;
+
+    u8 res = target(r, dst);
+    write_op(r, MTR_REG_OP_ARRAY_LITERAL);
+    write_reg(r, res);
+    write_reg(r, first);
+    write_reg(r, array->count);
+    return res;
+}
+
+static u8 write_map_literal(struct registers* r, struct mtr_map_literal* map, i32 dst) {
+    u16 saved = r->top;
+    u8 first = (u8) r->top;
+    for (u8 i = 0; i < map->count; ++i) {
+        struct mtr_map_entry e = map->entries[i];
+        u8 key = alloc_register(r);
+        write_expr(r, e.key, key);
+        u8 value = alloc_register(r);
+        write_expr(r, e.value, value);
+    }
+    r->top = saved;
+
+    u8 res = target(r, dst);
+    write_op(r, MTR_REG_OP_MAP_LITERAL);
+    write_reg(r, res);
+    write_reg(r, first);
+    write_reg(r, map->count);
+    return res;
+}
+
+static u8 write_logical(struct registers* r, struct mtr_binary* expr, i32 dst, u8 jump) {
+    // Use a fresh register, writing the left side straight into dst would clobber it
+    // if the right side reads the same local.
+    u8 res = alloc_register(r);
+    write_expr(r, expr->left, res);
+    size_t offset = write_jump(r, jump, res);
+    write_expr(r, expr->right, res);
+    patch_jump(r, offset);
+
+    if (dst < 0) {
+        return res;
+    }
+
+    write_op(r, MTR_REG_OP_MOVE);
+    write_reg(r, (u8) dst);
+    write_reg(r, res);
+    return (u8) dst;
+}
+
+static u8 write_binary(struct registers* r, struct mtr_binary* expr, i32 dst) {
+    // handle && and || as they are short circuited
+    if (expr->operator.token.type == MTR_TOKEN_AND) {
+        return write_logical(r, expr, dst, MTR_REG_OP_JMP_Z);
+    } else if (expr->operator.token.type == MTR_TOKEN_OR) {
+        return write_logical(r, expr, dst, MTR_REG_OP_JMP_NZ);
+    }
+
+    u16 saved = r->top;
+    u8 left = write_expr(r, expr->left, -1);
+    u8 right = write_expr(r, expr->right, -1);
+    r->top = saved;
+
+    u8 res = target(r, dst);
+
+    const enum mtr_token_type op = expr->operator.token.type;
+    const bool arithmetic = op == MTR_TOKEN_PLUS || op == MTR_TOKEN_MINUS || op == MTR_TOKEN_STAR || op == MTR_TOKEN_SLASH;
+    if (arithmetic && expr->operator.type->type == MTR_DATA_ARRAY) {
+        const struct mtr_type* element = ((const struct mtr_array_type*) expr->operator.type)->element;
+        write_op(r, element->type == MTR_DATA_INT ? MTR_REG_OP_ELEMENTWISE_I : MTR_REG_OP_ELEMENTWISE_F);
+        write_reg(r, res);
+        write_reg(r, left);
+        write_reg(r, right);
+        mtr_write_chunk(r->chunk, op == MTR_TOKEN_PLUS ? MTR_ELEMENTWISE_ADD
+            : op == MTR_TOKEN_MINUS ? MTR_ELEMENTWISE_SUB
+            : op == MTR_TOKEN_STAR ? MTR_ELEMENTWISE_MUL
+            : MTR_ELEMENTWISE_DIV);
+        return res;
+    }
+
+#define BINARY_OP(op)                                             \
+    do {                                                          \
+        if (expr->operator.type->type == MTR_DATA_INT) {           \
+            write_op(r, MTR_REG_OP_ ## op ## _I);                 \
+        } else if (expr->operator.type->type == MTR_DATA_FLOAT) {  \
+            write_op(r, MTR_REG_OP_ ## op ## _F);                 \
+        } else {                                                  \
+            MTR_LOG_WARN("Invalid data type.");                   \
+        }                                                         \
+        write_reg(r, res);                                        \
+        write_reg(r, left);                                       \
+        write_reg(r, right);                                      \
+    } while (false)
+
+#define NEGATE()                                                  \
+    do {                                                          \
+        write_op(r, MTR_REG_OP_NOT);                              \
+        write_reg(r, res);                                        \
+        write_reg(r, res);                                        \
+    } while (false)
+
+    switch (expr->operator.token.type)
+    {
+    case MTR_TOKEN_PLUS:
+        BINARY_OP(ADD);
+        break;
+
+    case MTR_TOKEN_MINUS:
+        BINARY_OP(SUB);
+        break;
+
+    case MTR_TOKEN_STAR:
+        BINARY_OP(MUL);
+        break;
+
+    case MTR_TOKEN_SLASH:
+        BINARY_OP(DIV);
+        break;
+
+    case MTR_TOKEN_LESS:
+        BINARY_OP(LESS);
+        break;
+
+    case MTR_TOKEN_LESS_EQUAL:
+        BINARY_OP(GREATER);
+        NEGATE();
+        break;
+
+    case MTR_TOKEN_GREATER:
+        BINARY_OP(GREATER);
+        break;
+
+    case MTR_TOKEN_GREATER_EQUAL:
+        BINARY_OP(LESS);
+        NEGATE();
+        break;
+
+    case MTR_TOKEN_EQUAL:
+        BINARY_OP(EQUAL);
+        break;
+
+    case MTR_TOKEN_BANG_EQUAL:
+        BINARY_OP(EQUAL);
+        NEGATE();
+        break;
+
+    default:
+        break;
+    }
+
+#undef NEGATE
+#undef BINARY_OP
+
+    return res;
+}
+
+static u8 write_unary(struct registers* r, struct mtr_unary* unary, i32 dst) {
+    u16 saved = r->top;
+    u8 right = write_expr(r, unary->right, -1);
+    r->top = saved;
+
+    u8 res = target(r, dst);
+
+    switch (unary->operator.token.type)
+    {
+    case MTR_TOKEN_BANG:
+        write_op(r, MTR_REG_OP_NOT);
+        break;
+    case MTR_TOKEN_MINUS:
+        if (unary->operator.type->type == MTR_DATA_INT) {
+            write_op(r, MTR_REG_OP_NEGATE_I);
+        } else {
+            write_op(r, MTR_REG_OP_NEGATE_F);
+        }
+        break;
+    default:
+        break;
+    }
+
+    write_reg(r, res);
+    write_reg(r, right);
+    return res;
+}
+
+// the callee and its arguments have to be in consecutive registers above everything that is live
+static u8 write_invoke(struct registers* r, struct mtr_call* call, u8 op) {
+    u8 callee = alloc_register(r);
+    write_expr(r, call->callable, callee);
+
+    for (u8 i = 0; i < call->argc; ++i) {
+        u8 arg = alloc_register(r);
+        write_expr(r, call->argv[i], arg);
+    }
+
+    write_op(r, op);
+    write_reg(r, callee);
+    write_reg(r, call->argc);
+    return callee;
+}
+
+static u8 write_call(struct registers* r, struct mtr_call* call, i32 dst) {
+    u16 saved = r->top;
+    u8 callee = write_invoke(r, call, MTR_REG_OP_CALL);
+
+    if (dst < 0) {
+        r->top = callee + 1;
+        return callee;
+    }
+
+    r->top = saved;
+    if (dst != callee) {
+        write_op(r, MTR_REG_OP_MOVE);
+        write_reg(r, (u8) dst);
+        write_reg(r, callee);
+    }
+    return (u8) dst;
+}
+
+static u8 write_cast(struct registers* r, struct mtr_cast* cast, i32 dst) {
+    u16 saved = r->top;
+    u8 right = write_expr(r, cast->right, -1);
+    r->top = saved;
+
+    u8 res = target(r, dst);
+
+    switch (cast->to.type) {
+    case MTR_DATA_FLOAT: {
+        write_op(r, MTR_REG_OP_FLOAT_CAST);
+        break;
+    }
+
+    case MTR_DATA_INT: {
+        write_op(r, MTR_REG_OP_INT_CAST);
+        break;
+    }
+
+    default:
+        write_op(r, MTR_REG_OP_MOVE);
+        break;
+    }
+
+    write_reg(r, res);
+    write_reg(r, right);
+    return res;
+}
+
+static u8 write_subscript(struct registers* r, struct mtr_access* expr, i32 dst) {
+    u16 saved = r->top;
+    u8 object = write_expr(r, expr->object, -1);
+    u8 key = write_expr(r, expr->element, -1);
+    r->top = saved;
+
+    u8 res = target(r, dst);
+    write_op(r, MTR_REG_OP_INDEX_GET);
+    write_reg(r, res);
+    write_reg(r, object);
+    write_reg(r, key);
+    return res;
+}
+
+static u8 write_access(struct registers* r, struct mtr_access* expr, i32 dst) {
+    u16 saved = r->top;
+    u8 object = write_expr(r, expr->object, -1);
+    r->top = saved;
+
+    struct mtr_primary* p = (struct mtr_primary*) expr->element;
+    u8 res = target(r, dst);
+    write_op(r, MTR_REG_OP_STRUCT_GET);
+    write_reg(r, res);
+    write_reg(r, object);
+    write_reg(r, (u8) p->symbol.index);
+    return res;
+}
+
+static u8 write_expr(struct registers* r, struct mtr_expr* expr, i32 dst) {
+    switch (expr->type)
+    {
+    case MTR_EXPR_BINARY:  return write_binary(r, (struct mtr_binary*) expr, dst);
+    case MTR_EXPR_PRIMARY: return write_primary(r, (struct mtr_primary*) expr, dst);
+    case MTR_EXPR_LITERAL: return write_literal(r, (struct mtr_literal*) expr, dst);
+    case MTR_EXPR_ARRAY_LITERAL: return write_array_literal(r, (struct mtr_array_literal*) expr, dst);
+    case MTR_EXPR_MAP_LITERAL: return write_map_literal(r, (struct mtr_map_literal*) expr, dst);
+    case MTR_EXPR_UNARY:   return write_unary(r, (struct mtr_unary*) expr, dst);
+    case MTR_EXPR_GROUPING: return write_expr(r, ((struct mtr_grouping*) expr)->expression, dst);
+    case MTR_EXPR_CALL: return write_call(r, (struct mtr_call*) expr, dst);
+    case MTR_EXPR_CAST: return write_cast(r, (struct mtr_cast*) expr, dst);
+    case MTR_EXPR_ACCESS: return write_access(r, (struct mtr_access*) expr, dst);
+    case MTR_EXPR_SUBSCRIPT: return write_subscript(r, (struct mtr_access*) expr, dst);
+    }
+    return target(r, dst);
+}
+
+static void write(struct registers* r, struct mtr_stmt* stmt);
+
+static void write_variable(struct registers* r, struct mtr_variable* var) {
+    u8 reg = (u8) var->symbol.index;
+    declare_local(r, var->symbol.index);
+
+    if (NULL != var->value) {
+        write_expr(r, var->value, reg);
+        return;
+    }
+
+    u8 nil_op;
+    switch (var->symbol.type->type) {
+    case MTR_DATA_ARRAY: {
+        nil_op = MTR_REG_OP_EMPTY_ARRAY;
+        break;
+    }
+
+    case MTR_DATA_MAP: {
+        nil_op = MTR_REG_OP_EMPTY_MAP;
+        break;
+    }
+
+    case MTR_DATA_STRING: {
+        MTR_ASSERT(false, "Think about this");
+        nil_op = MTR_REG_OP_NIL;
+        break;
+    }
+
+    default: {
+        nil_op = MTR_REG_OP_NIL;
+        break;
+    }
+    }
+
+    write_op(r, nil_op);
+    write_reg(r, reg);
+}
+
+static void write_block(struct registers* r, struct mtr_block* stmt) {
+    u16 locals = r->locals;
+
+    for (size_t i = 0; i < stmt->size; ++i) {
+        struct mtr_stmt* s = stmt->statements[i];
+        write(r, s);
+        r->top = r->locals;
+    }
+
+    // no need to pop anything, the registers of the block's locals are simply reused
+    r->locals = locals;
+    r->top = locals;
+}
+
+static void write_if(struct registers* r, struct mtr_if* stmt) {
+    u8 condition = write_expr(r, stmt->condition, -1);
+    r->top = r->locals;
+    size_t offset = write_jump(r, MTR_REG_OP_JMP_Z, condition);
+
+    write(r, stmt->then);
+    r->top = r->locals;
+
+    if (stmt->otherwise) {
+        size_t otherwise = write_jump(r, MTR_REG_OP_JMP, -1);
+        patch_jump(r, offset);
+        write(r, stmt->otherwise);
+        r->top = r->locals;
+        patch_jump(r, otherwise);
+    } else {
+        patch_jump(r, offset);
+    }
+}
+
+static void write_while(struct registers* r, struct mtr_while* stmt) {
+    // the condition is tested at the bottom so every iteration only runs one jump
+    size_t to_condition = write_jump(r, MTR_REG_OP_JMP, -1);
+    size_t body = r->chunk->size;
+
+    u16 locals = r->locals;
+    write(r, stmt->body);
+    r->locals = locals;
+    r->top = locals;
+
+    patch_jump(r, to_condition);
+    u8 condition = write_expr(r, stmt->condition, -1);
+    write_loop(r, MTR_REG_OP_JMP_NZ, condition, body);
+    r->top = r->locals;
+}
+
+static void write_assignment(struct registers* r, struct mtr_assignment* stmt) {
+    switch (stmt->right->type) {
+    case MTR_EXPR_PRIMARY: {
+        struct mtr_primary* p = (struct mtr_primary*) stmt->right;
+        if (!p->symbol.upvalue) {
+            write_expr(r, stmt->expression, (u8) p->symbol.index);
+            return;
+        }
+
+        u8 value = write_expr(r, stmt->expression, -1);
+        write_op(r, MTR_REG_OP_UPVALUE_SET);
+        mtr_write_u16(r->chunk, (u16) p->symbol.index);
+        write_reg(r, value);
+        return;
+    }
+    case MTR_EXPR_SUBSCRIPT: {
+        struct mtr_access* s = (struct mtr_access*) stmt->right;
+        u8 value = write_expr(r, stmt->expression, -1);
+        u8 object = write_expr(r, s->object, -1);
+        u8 key = write_expr(r, s->element, -1);
+        write_op(r, MTR_REG_OP_INDEX_SET);
+        write_reg(r, object);
+        write_reg(r, key);
+        write_reg(r, value);
+        return;
+    }
+    case MTR_EXPR_ACCESS: {
+        struct mtr_access* s = (struct mtr_access*) stmt->right;
+        u8 value = write_expr(r, stmt->expression, -1);
+        u8 object = write_expr(r, s->object, -1);
+        struct mtr_primary* p = (struct mtr_primary*) s->element;
+        write_op(r, MTR_REG_OP_STRUCT_SET);
+        write_reg(r, object);
+        write_reg(r, (u8) p->symbol.index);
+        write_reg(r, value);
+        return;
+    }
+
+    default:
+        break;
+    }
+    MTR_ASSERT(false, "Invalid expr type.");
+}
+
+static void write_return(struct registers* r, struct mtr_return* stmt) {
+    struct mtr_expr* expr = stmt->expr;
+    while (expr && expr->type == MTR_EXPR_GROUPING) {
+        expr = ((struct mtr_grouping*) expr)->expression;
+    }
+
+    // the callee takes over the frame and returns to our caller
+    if (expr && expr->type == MTR_EXPR_CALL) {
+        write_invoke(r, (struct mtr_call*) expr, MTR_REG_OP_TAIL_CALL);
+        return;
+    }
+
+    u8 value;
+    if (stmt->expr) {
+        value = write_expr(r, stmt->expr, -1);
+    } else {
+        value = alloc_register(r);
+        write_op(r, MTR_REG_OP_NIL);
+        write_reg(r, value);
+    }
+
+    write_op(r, MTR_REG_OP_RETURN);
+    write_reg(r, value);
+}
+
+static void write_call_stmt(struct registers* r, struct mtr_call_stmt* call) {
+    write_expr(r, call->call, -1);
+}
+
+static bool write_function(struct mtr_chunk* chunk, struct mtr_function_decl* fn);
+
+static void write_closure(struct registers* r, struct mtr_closure_decl* c) {
+    struct mtr_chunk closure_chunk = mtr_new_chunk();
+    r->overflow = !write_function(&closure_chunk, c->function) || r->overflow;
+
+    struct mtr_function* body = mtr_new_function(closure_chunk);
+
+    u8 reg = (u8) c->function->symbol.index;
+    declare_local(r, c->function->symbol.index);
+
+    write_op(r, MTR_REG_OP_CLOSURE);
+    write_reg(r, reg);
+    mtr_write_u16(r->chunk, mtr_add_constant(r->chunk, MTR_OBJ(body), MTR_VAL_OBJ));
+    mtr_write_chunk(r->chunk, (u8) c->count);
+
+    for (u16 i = 0; i < c->count; ++i) {
+        struct mtr_upvalue_symbol s = c->upvalues[i];
+        mtr_write_u16(r->chunk, (u16) s.index);
+        mtr_write_chunk(r->chunk, s.local);
+    }
+}
+
+static void write(struct registers* r, struct mtr_stmt* stmt) {
+    switch (stmt->type)
+    {
+    case MTR_STMT_VAR:   write_variable(r, (struct mtr_variable*) stmt); return;
+
+    case MTR_STMT_IF:    write_if(r, (struct mtr_if*) stmt); return;
+    case MTR_STMT_WHILE: write_while(r, (struct mtr_while*) stmt); return;
+
+    case MTR_STMT_SCOPE:
+    case MTR_STMT_BLOCK:
+        write_block(r, (struct mtr_block*) stmt); return;
+
+    case MTR_STMT_ASSIGNMENT: write_assignment(r, (struct mtr_assignment*) stmt); return;
+    case MTR_STMT_RETURN: write_return(r, (struct mtr_return*) stmt); return;
+    case MTR_STMT_CALL: write_call_stmt(r, (struct mtr_call_stmt*) stmt); return;
+    case MTR_STMT_CLOSURE: write_closure(r, (struct mtr_closure_decl*) stmt); return;
+
+    case MTR_STMT_UNION:
+    case MTR_STMT_STRUCT:
+    case MTR_STMT_NATIVE_FN:
+    case MTR_STMT_FN:
+        return;
+    }
+}
+
+static bool ends_with_return(struct mtr_stmt* body) {
+    if (body->type == MTR_STMT_BLOCK || body->type == MTR_STMT_SCOPE) {
+        struct mtr_block* block = (struct mtr_block*) body;
+        return block->size > 0 && block->statements[block->size - 1]->type == MTR_STMT_RETURN;
+    }
+    return body->type == MTR_STMT_RETURN;
+}
+
+// The frame size is only known at the end, ENTER's operand is patched then.
+static size_t write_enter(struct registers* r) {
+    write_op(r, MTR_REG_OP_ENTER);
+    mtr_write_u16(r->chunk, 0);
+    return r->chunk->size - 2;
+}
+
+static void patch_enter(struct registers* r, size_t offset) {
+    u16* to_patch = (u16*)(r->chunk->bytecode + offset);
+    *to_patch = r->max;
+}
+
+static bool write_function(struct mtr_chunk* chunk, struct mtr_function_decl* fn) {
+    struct registers r;
+    init_registers(&r, chunk, fn->argc);
+    chunk->arity = fn->argc;
+
+    size_t enter = write_enter(&r);
+
+    write(&r, fn->body);
+
+    // the engine does not bounds check ip, every chunk has to end in a return
+    if (!ends_with_return(fn->body)) {
+        u8 nil = alloc_register(&r);
+        write_op(&r, MTR_REG_OP_NIL);
+        write_reg(&r, nil);
+        write_op(&r, MTR_REG_OP_RETURN);
+        write_reg(&r, nil);
+    }
+
+    patch_enter(&r, enter);
+    return !r.overflow;
+}
+
+bool mtr_write_register_function(struct mtr_chunk* chunk, struct mtr_function_decl* fn) {
+    return write_function(chunk, fn);
+}
+
+bool mtr_write_register_struct(struct mtr_chunk* chunk, struct mtr_struct_decl* s) {
+    struct registers r;
+    init_registers(&r, chunk, 0);
+
+    size_t enter = write_enter(&r);
+
+    for (u8 i = 0; i < s->argc; ++i) {
+        struct mtr_variable* v = s->members[i];
+        write_variable(&r, v);
+    }
+
+    u8 res = alloc_register(&r);
+    write_op(&r, MTR_REG_OP_CONSTRUCTOR);
+    write_reg(&r, res);
+    write_reg(&r, 0);
+    write_reg(&r, s->argc);
+    write_op(&r, MTR_REG_OP_RETURN);
+    write_reg(&r, res);
+
+    patch_enter(&r, enter);
+    return !r.overflow;
+}
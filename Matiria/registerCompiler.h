@@ -0,0 +1,14 @@
+#ifndef MTR_REGISTER_COMPILER_H
+#define MTR_REGISTER_COMPILER_H
+
+#include "bytecode.h"
+
+#include "AST/AST.h"
+
+// Code generation for the register engine. See registerBytecode.h.
+// Both return false if a function needs more registers than an instruction can address.
+
+bool mtr_write_register_function(struct mtr_chunk* chunk, struct mtr_function_decl* fn);
+bool mtr_write_register_struct(struct mtr_chunk* chunk, struct mtr_struct_decl* s);
+
+#endif
@@ -0,0 +1,34 @@
+#ifndef MTR_DISPATCH_H
+#define MTR_DISPATCH_H
+
+// Shared by the interpreter loops. They expect an 'ip' pointing at the next op code and,
+// with threaded dispatch, a 'dispatch_table' of label addresses indexed by op code.
+
+// Computed gotos need the labels as values extension. Build with -DMTR_SWITCH_DISPATCH
+// (make dispatch=switch) to force the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MTR_SWITCH_DISPATCH)
+#   define MTR_THREADED_DISPATCH
+#endif
+
+// With -DMTR_INSTRUCTION_STATS (make stats=on) every dispatched op code is recorded in
+// engine->stats, see debug/opcodeStats.h.
+#ifdef MTR_INSTRUCTION_STATS
+#   define COUNT_INSTRUCTION() mtr_record_opcode(&engine->stats, *ip)
+#else
+#   define COUNT_INSTRUCTION() ((void) 0)
+#endif
+
+// Every chunk ends in a return (the compilers guarantee it), so neither dispatch mode
+// needs to check ip against the end of the chunk.
+#ifdef MTR_THREADED_DISPATCH
+#   define DISPATCH_LOOP() DISPATCH();
+#   define CASE(op) L_ ## op
+#   define DISPATCH() goto *dispatch_table[(COUNT_INSTRUCTION(), *ip++)]
+#   define LABEL(op) [op] = &&L_ ## op
+#else
+#   define DISPATCH_LOOP() for (;;) switch ((COUNT_INSTRUCTION(), *ip++))
+#   define CASE(op) case op
+#   define DISPATCH() continue
+#endif
+
+#endif
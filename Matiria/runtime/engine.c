@@ -3,17 +3,21 @@
 #include "bytecode.h"
 #include "object.h"
 #include "value.h"
+#include "vector.h"
 #include "memory.h"
+#include "dispatch.h"
+#include "registerEngine.h"
+
+#include "jit/jit.h"
+#include "jit/trace.h"
 
 #include "debug/disassemble.h"
 
 #include "core/log.h"
 #include "core/macros.h"
 
-struct frame {
-    mtr_value* stack;
-    mtr_value* closed;
-};
+// The stack engine, the register one lives in registerEngine.c
+#ifndef MTR_REGISTER_VM
 
 static mtr_value peek(struct mtr_engine* engine, size_t distance) {
     return *(engine->stack_top - distance - 1);
@@ -33,439 +37,1439 @@ static void push(struct mtr_engine* engine, mtr_value value) {
     *(engine->stack_top++) = value;
 }
 
-static void call(struct mtr_engine* engine, const struct mtr_chunk chunk, u8 argc, mtr_value* closed);
+// A call is only let in when the deepest its frame can get (mtr_find_max_depth) is on the stack
+static bool fits(const struct mtr_engine* engine, const mtr_value* slots, const struct mtr_chunk* chunk) {
+    return (size_t) (engine->stack + MTR_MAX_STACK - slots) >= chunk->max_depth;
+}
+
+static bool push_frame(struct mtr_engine* engine, const struct mtr_chunk* chunk, u8 argc, mtr_value* upvalues) {
+    if (engine->frame_count == MTR_MAX_FRAMES || !fits(engine, engine->stack_top - argc, chunk)) {
+        MTR_LOG_ERROR("Stack overflow (%u nested calls).", engine->frame_count);
+        return false;
+    }
+
+    struct mtr_call_frame* frame = engine->frames + engine->frame_count++;
+    frame->ip = chunk->bytecode;
+    frame->slots = engine->stack_top - argc;
+    frame->upvalues = upvalues;
+    frame->chunk = chunk;
+    frame->storage = engine->storage_top;
+    return true;
+}
+
+// A tail call runs the callee in the caller's frame. The arguments on top of the stack take
+// the place of the caller's slots, which nothing reads after the call.
+static bool reuse_frame(struct mtr_engine* engine, struct mtr_call_frame* frame, const struct mtr_chunk* chunk, u8 argc, mtr_value* upvalues) {
+    if (!fits(engine, frame->slots, chunk)) {
+        MTR_LOG_ERROR("Stack overflow (%u nested calls).", engine->frame_count);
+        return false;
+    }
+
+    // the arguments always sit above the slots, copying forward is safe
+    const mtr_value* args = engine->stack_top - argc;
+    for (u8 i = 0; i < argc; ++i) {
+        frame->slots[i] = args[i];
+    }
+    engine->stack_top = frame->slots + argc;
+    engine->storage_top = frame->storage;
+    frame->ip = chunk->bytecode;
+    frame->upvalues = upvalues;
+    frame->chunk = chunk;
+    return true;
+}
+
+#define BINARY_OP(op, as, make)                                        \
+    do {                                                               \
+        const mtr_value r = pop(engine);                               \
+        const mtr_value l = pop(engine);                               \
+        push(engine, make(as(l) op as(r)));                            \
+    } while (false)
+
+// comparisons always produce an Int, whatever the operands are
+#define COMPARE_OP(op, as) BINARY_OP(op, as, MTR_INT)
 
-#define BINARY_OP(op, t, tag)                                            \
+#define COMPARE_JMP(op)                                                \
     do {                                                               \
         const mtr_value r = pop(engine);                               \
         const mtr_value l = pop(engine);                               \
-        const mtr_value res = { .t = l.t op r.t, .type = tag };            \
-        push(engine, res);                                             \
+        const i16 where = READ(i16);                                   \
+        const i32 offset = where * !(MTR_AS_INT(l) op MTR_AS_INT(r));  \
+        ip += offset;                                                  \
+        BACK_EDGE(offset);                                             \
     } while (false)
 
 #define READ(type) *((type*)ip); ip += sizeof(type)
+#define ALLOCATE(size) mtr_allocate(engine, size)
 #define LINK(obj) mtr_link_obj(engine, (struct mtr_object*) obj)
 
-static void call(struct mtr_engine* engine, const struct mtr_chunk chunk, u8 argc, mtr_value* closed) {
-    struct frame frame;
-    frame.stack = engine->stack_top - argc;
-    frame.closed = closed;
-    register u8* ip = chunk.bytecode;
-    u8* end = chunk.bytecode + chunk.size;
-    while (ip < end) {
-
-        // mtr_dump_stack(frame.stack, engine->stack_top);
-        // mtr_disassemble_instruction(ip, ip - chunk.bytecode);
-
-        switch (*ip++)
-        {
-            case MTR_OP_INT: {
-                const i64 value = READ(i64);
-                const mtr_value constant = MTR_INT(value);
-                push(engine, constant);
-                break;
-            }
+// maps, structs and closures only remember what they hold when values are untagged
+#ifdef MTR_UNTAGGED_VALUES
+#   define SET_TYPE(field, type) field = (enum mtr_value_type) (type)
+#   define SET_TYPES(field, types) field = (types)
+#else
+#   define SET_TYPE(field, type) (void) (type)
+#   define SET_TYPES(field, types) (void) (types)
+#endif
 
-            case MTR_OP_FLOAT: {
-                const f64 value = READ(f64);
-                const mtr_value constant = MTR_FLOAT(value);
-                push(engine, constant);
-                break;
-            }
+// Before an instruction that allocates, 'next' is the instruction after it. Whatever walks the
+// stack while it runs finds the objects of the frame in the stack map there, untagged values
+// leave the frame's ip at it for that.
+#if defined(MTR_UNTAGGED_VALUES)
+#   define SAFEPOINT(next) (frame->ip = (next))
+#elif !defined(NDEBUG)
+#   define SAFEPOINT(next) check_stack_map(frame, (next), engine->stack_top)
+#else
+#   define SAFEPOINT(next) ((void) 0)
+#endif
 
-            case MTR_OP_FALSE: {
-                const mtr_value c = MTR_INT(0);
-                push(engine , c);
-                break;
-            }
+// Rewrite the instruction being run into 'op' and run it again. Quickened instructions stay
+// in the chunk, so the next time only the guard of the specialized form is paid for.
+// Not wrapped in do while, DISPATCH is a continue with dispatch=switch.
+#define QUICKEN(op) { ip[-1] = (op); --ip; DISPATCH(); }
 
-            case MTR_OP_TRUE: {
-                const mtr_value c = MTR_INT(1);
-                push(engine , c);
-                break;
-            }
+#define GUARD(value, obj_type, generic) if (MTR_AS_OBJ(value)->type != (obj_type)) QUICKEN(generic)
 
-            case MTR_OP_STRING_LITERAL: {
-                const char* string = READ(const char*);
-                u32 length = READ(u32);
-                struct mtr_string* s = mtr_new_string(string, length);
-                LINK(s);
-                push(engine, MTR_OBJ(s));
-                break;
-            }
+#if !defined(NDEBUG) && !defined(MTR_UNTAGGED_VALUES)
+#   define CHECK_STACK_MAP() check_stack_map(frame, ip, engine->stack_top)
+#else
+#   define CHECK_STACK_MAP() ((void) 0)
+#endif
 
-            case MTR_OP_ARRAY_LITERAL: {
-                u8 count = READ(u8);
-                struct mtr_array* array = mtr_new_array(count);
-                LINK(array);
-                for (u8 i = 0; i < count; ++i) {
-                    const mtr_value elem = pop(engine);
-                    array->elements[i] = elem;
-                }
+#if !defined(NDEBUG) && !defined(MTR_UNTAGGED_VALUES)
+// Tagged values can check what the compiler wrote down: every object in the frame has to be in the map
+static void check_stack_map(const struct mtr_call_frame* frame, const u8* ip, const mtr_value* top) {
+    const u32 offset = (u32) (ip - frame->chunk->bytecode);
+    const struct mtr_stack_map* map = mtr_find_stack_map(frame->chunk, offset);
+    MTR_ASSERT(map != NULL, "Call or allocation without a stack map.");
+    MTR_ASSERT(map->count == (u32) (top - frame->slots), "Stack map does not match the frame size.");
+    for (u32 i = 0; i < map->count; ++i) {
+        MTR_ASSERT(!MTR_IS_OBJ(frame->slots[i]) || MTR_STACK_MAP_HAS_OBJECT(map, i), "Stack map misses an object.");
+    }
+}
+#endif
 
-                array->size = count;
+// Instruction bodies shared by the interpreter loop and mtr_jit_step
 
-                push(engine, MTR_OBJ(array));
-                break;
-            }
+static void string_literal(struct mtr_engine* engine, const struct mtr_call_frame* frame, u16 index) {
+    const struct mtr_string* constant = (const struct mtr_string*) MTR_AS_OBJ(frame->chunk->constants[index]);
+    struct mtr_string* s = mtr_init_string(ALLOCATE(mtr_string_size(constant->length)), constant->s, constant->length);
+    LINK(s);
+    push(engine, MTR_OBJ(s));
+}
 
-            case MTR_OP_MAP_LITERAL: {
-                struct mtr_map* map = mtr_new_map();
-                LINK(map);
-                u8 count = READ(u8);
+// values taken by an object header in the frame storage, what the object holds comes after it
+#define FRAME_HEADER(type) ((sizeof(type) + sizeof(mtr_value) - 1) / sizeof(mtr_value))
 
-                for (u8 i = 0; i < count; ++i) {
-                    const mtr_value value = pop(engine);
-                    const mtr_value key = pop(engine);
-                    mtr_map_insert(map, key, value);
-                }
+// Objects the escape analysis proved don't outlive their frame are carved out of the frame
+// storage, returning gives it back. They aren't linked, the frame storage owns them. Returns
+// NULL when it is full.
+static mtr_value* frame_storage(struct mtr_engine* engine, size_t size) {
+    if (engine->storage_top + size > engine->storage + MTR_FRAME_STORAGE) {
+        return NULL;
+    }
+    mtr_value* memory = engine->storage_top;
+    engine->storage_top += size;
+    return memory;
+}
 
-                push(engine, MTR_OBJ(map));
-                break;
-            }
+static struct mtr_array* new_array(struct mtr_engine* engine, size_t capacity, u8 layout, bool frame) {
+    const size_t elements = (capacity * mtr_array_element_size(layout) + sizeof(mtr_value) - 1) / sizeof(mtr_value);
+    mtr_value* memory = frame ? frame_storage(engine, FRAME_HEADER(struct mtr_array) + elements) : NULL;
+    if (NULL == memory) {
+        struct mtr_array* array = mtr_init_array(ALLOCATE(sizeof(struct mtr_array)), capacity, (enum mtr_array_layout) layout);
+        LINK(array);
+        return array;
+    }
 
-            case MTR_OP_CONSTRUCTOR: {
-                u8 count = READ(u8);
-                struct mtr_struct* s = mtr_new_struct(count);
-                LINK(s);
-                for (u8 i = 0; i < count; ++i) {
-                    u8 actual_index = count - i - 1;
-                    s->members[actual_index] = pop(engine);
-                }
-                push(engine, MTR_OBJ(s));
-                break;
-            }
+    struct mtr_array* array = (struct mtr_array*) memory;
+    array->obj.type = MTR_OBJ_ARRAY;
+    array->obj.mark = 0;
+    array->obj.next = NULL;
+    array->elements = memory + FRAME_HEADER(struct mtr_array);
+    array->capacity = capacity;
+    array->size = 0;
+    array->layout = (enum mtr_array_layout) layout;
+    return array;
+}
 
-            case MTR_OP_CLOSURE: {
-                struct mtr_closure* c = READ(struct mtr_closure*);
-                LINK(c);
-                u16 count = c->count;
+static void array_literal(struct mtr_engine* engine, u8 count, u8 layout, bool frame) {
+    // [1, x] with x Any may not fit the layout of its first element
+    struct mtr_array probe = { .layout = (enum mtr_array_layout) layout };
+    for (u8 i = 0; i < count && layout != MTR_ARRAY_VALUES; ++i) {
+        if (!mtr_array_holds(&probe, engine->stack_top[-1 - i])) {
+            layout = MTR_ARRAY_VALUES;
+        }
+    }
 
-                c->upvalues = malloc(sizeof(mtr_value) * count);
+    struct mtr_array* array = new_array(engine, count, layout, frame);
+    for (u8 i = 0; i < count; ++i) {
+        const mtr_value elem = pop(engine);
+        mtr_array_set(array, i, elem);
+    }
 
-                for (u16 i = 0; i < count; ++i) {
-                    u16 index = READ(u16);
-                    bool local = READ(bool);
+    array->size = count;
 
-                    if (local) {
-                        c->upvalues[i] = frame.stack[index];
-                    } else {
-                        c->upvalues[i] = frame.closed[index];
-                    }
-                }
+    push(engine, MTR_OBJ(array));
+}
 
-                push(engine, MTR_OBJ(c));
-                break;
-            }
+static void empty_array(struct mtr_engine* engine, u8 layout, bool frame) {
+    struct mtr_array* array_object = new_array(engine, 8, layout, frame);
+    push(engine, MTR_OBJ(array_object));
+}
 
-            case MTR_OP_NIL: {
-                const mtr_value c = MTR_NIL;
-                push(engine, c);
-                break;
-            }
+static void map_literal(struct mtr_engine* engine, u8 count, u8 key_type, u8 value_type) {
+    struct mtr_map* map = mtr_init_map(ALLOCATE(sizeof(struct mtr_map)));
+    LINK(map);
+    SET_TYPE(map->key_type, key_type);
+    SET_TYPE(map->value_type, value_type);
 
-            case MTR_OP_EMPTY_STRING: {
-                // struct mtr_string* string_object = mtr_new_string(NULL, 0);
-                // push(engine, MTR_OBJ(string_object));
-                // break;
-                MTR_ASSERT(false, "Think about this");
-                break;
-            }
+    for (u8 i = 0; i < count; ++i) {
+        const mtr_value value = pop(engine);
+        const mtr_value key = pop(engine);
+        mtr_map_insert(map, key, value);
+    }
 
-            case MTR_OP_EMPTY_ARRAY: {
-                struct mtr_array* array_object = mtr_new_array(8);
-                LINK(array_object);
-                push(engine, MTR_OBJ(array_object));
-                break;
+    push(engine, MTR_OBJ(map));
+}
+
+static struct mtr_struct* new_struct(struct mtr_engine* engine, u8 count, bool frame) {
+    mtr_value* memory = frame ? frame_storage(engine, FRAME_HEADER(struct mtr_struct) + count) : NULL;
+    if (NULL == memory) {
+        struct mtr_struct* s = mtr_init_struct(ALLOCATE(mtr_struct_size(count)), count);
+        LINK(s);
+        return s;
+    }
+
+    struct mtr_struct* s = (struct mtr_struct*) memory;
+    s->obj.type = MTR_OBJ_STRUCT;
+    s->obj.mark = 0;
+    s->obj.next = NULL;
+    s->members = memory + FRAME_HEADER(struct mtr_struct);
+    SET_TYPES(s->types, NULL);
+    s->count = count;
+    return s;
+}
+
+// types are the operands of the instruction, one for each member
+static void construct(struct mtr_engine* engine, u8 count, const u8* types, bool frame) {
+    struct mtr_struct* s = new_struct(engine, count, frame);
+    SET_TYPES(s->types, types);
+    for (u8 i = 0; i < count; ++i) {
+        u8 actual_index = count - i - 1;
+        s->members[actual_index] = pop(engine);
+    }
+    push(engine, MTR_OBJ(s));
+}
+
+// ip points past the op code, returns the ip after the upvalue types
+static u8* closure(struct mtr_engine* engine, const struct mtr_call_frame* frame, u8* ip) {
+    const u16 body_index = READ(u16);
+    const u8 count = READ(u8);
+    const struct mtr_function* body = (const struct mtr_function*) MTR_AS_OBJ(frame->chunk->constants[body_index]);
+    struct mtr_closure* c = mtr_init_closure(ALLOCATE(mtr_closure_size(count)), body, count);
+    LINK(c);
+
+    for (u16 i = 0; i < count; ++i) {
+        u16 index = READ(u16);
+        bool local = READ(bool);
+
+        if (local) {
+            c->upvalues[i] = frame->slots[index];
+        } else {
+            c->upvalues[i] = frame->upvalues[index];
+        }
+    }
+    SET_TYPES(c->types, ip);
+    ip += count;
+
+    push(engine, MTR_OBJ(c));
+    return ip;
+}
+
+static void box(struct mtr_engine* engine, u8 type) {
+#ifdef MTR_UNTAGGED_VALUES
+    // a collection may move what is on the stack
+    void* memory = ALLOCATE(sizeof(struct mtr_box));
+    struct mtr_box* box = mtr_init_box(memory, engine->stack_top[-1], (enum mtr_value_type) type);
+    LINK(box);
+    engine->stack_top[-1] = MTR_OBJ(box);
+#else
+    (void) engine;
+    (void) type;
+#endif
+}
+
+// Accesses out of bounds are runtime errors, the interpreter stops like on a stack overflow
+static bool index_get_array(struct mtr_engine* engine) {
+    const mtr_value key = pop(engine);
+    const struct mtr_array* array = (const struct mtr_array*) MTR_AS_OBJ(pop(engine));
+    const i64 i = MTR_AS_INT(key);
+    const size_t index = mtr_reinterpret_cast(size_t, i);
+    if (index >= array->size) {
+        MTR_LOG_ERROR("Out of bounds: Indexing array of size %zu with index %zu", array->size, index);
+        return false;
+    }
+    push(engine, mtr_array_get(array, index));
+    return true;
+}
+
+static void index_get_map(struct mtr_engine* engine) {
+    const mtr_value key = pop(engine);
+    struct mtr_map* map = (struct mtr_map*) MTR_AS_OBJ(pop(engine));
+    push(engine, mtr_map_get(map, key));
+}
+
+static bool index_set_array(struct mtr_engine* engine) {
+    const mtr_value key = pop(engine);
+    struct mtr_array* array = (struct mtr_array*) MTR_AS_OBJ(pop(engine));
+    const mtr_value val = pop(engine);
+    const i64 i = MTR_AS_INT(key);
+    const size_t index = mtr_reinterpret_cast(size_t, i);
+    if (index >= array->size) {
+        MTR_LOG_ERROR("Out of bounds: Indexing array of size %zu with index %zu", array->size, index);
+        return false;
+    }
+    mtr_array_store(array, index, val);
+    mtr_write_barrier(engine, &array->obj, val);
+    return true;
+}
+
+static void check_bounds(struct mtr_engine* engine) {
+    const i64 n = MTR_AS_INT(pop(engine));
+    const i64 i = MTR_AS_INT(pop(engine));
+    const struct mtr_array* array = (const struct mtr_array*) MTR_AS_OBJ(engine->stack_top[-1]);
+    engine->stack_top[-1] = MTR_INT(i >= n || (i >= 0 && (size_t) n <= array->size));
+}
+
+static void elementwise(struct mtr_engine* engine, u8 op, u8 arrays, enum mtr_array_layout layout) {
+    const mtr_value l = peek(engine, 1);
+    const mtr_value r = peek(engine, 0);
+    size_t size;
+    if (!mtr_elementwise_size(arrays, l, r, &size)) {
+        IMPLEMENT // runtime error;
+        MTR_LOG_ERROR("Element-wise operation between arrays of size %zu and %zu",
+            ((const struct mtr_array*) MTR_AS_OBJ(l))->size, ((const struct mtr_array*) MTR_AS_OBJ(r))->size);
+        exit(-1);
+    }
+
+    struct mtr_array* array = new_array(engine, size > 0 ? size : 8, layout, false);
+    array->size = size;
+    // the allocation may have moved the operands
+    mtr_elementwise(array, (enum mtr_elementwise) op, arrays, peek(engine, 1), peek(engine, 0));
+    engine->stack_top -= 2;
+    push(engine, MTR_OBJ(array));
+}
+
+static void index_set_map(struct mtr_engine* engine) {
+    const mtr_value key = pop(engine);
+    struct mtr_map* map = (struct mtr_map*) MTR_AS_OBJ(pop(engine));
+    const mtr_value val = pop(engine);
+    mtr_map_insert(map, key, val);
+    mtr_write_barrier(engine, &map->obj, key);
+    mtr_write_barrier(engine, &map->obj, val);
+}
+
+static void struct_set(struct mtr_engine* engine, u8 index) {
+    struct mtr_struct* s = (struct mtr_struct*) MTR_AS_OBJ(pop(engine));
+    const mtr_value val = pop(engine);
+    s->members[index] = val;
+    mtr_write_barrier(engine, &s->obj, val);
+}
+
+static void upvalue_set(struct mtr_engine* engine, const struct mtr_call_frame* frame, u16 index) {
+    const mtr_value val = pop(engine);
+    frame->upvalues[index] = val;
+    mtr_write_barrier(engine, &mtr_closure_of(frame->upvalues)->obj, val);
+}
+
+static bool index_get(struct mtr_engine* engine) {
+    const struct mtr_object* object = MTR_AS_OBJ(peek(engine, 1));
+    switch (object->type) {
+    case MTR_OBJ_ARRAY: return index_get_array(engine);
+    case MTR_OBJ_MAP:   index_get_map(engine); break;
+    case MTR_OBJ_STRING: {
+        const struct mtr_string* string = (const struct mtr_string*) object;
+        const i64 i = MTR_AS_INT(peek(engine, 0));
+        const size_t index = mtr_reinterpret_cast(size_t, i);
+        if (index >= string->length) {
+            MTR_LOG_ERROR("Indexing string of size %zu with index %zu", string->length, index);
+            return false;
+        }
+        // need to think whether to malloc a whole new string for a single char or not.
+        // I dont like the idea. I could have a reference to it
+        MTR_LOG_ERROR("String indexing not yet implemented");
+        return false;
+    }
+    default:
+        MTR_ASSERT(false, "Invalid object type");
+        return false;
+    }
+    return true;
+}
+
+static bool index_set(struct mtr_engine* engine) {
+    const struct mtr_object* object = MTR_AS_OBJ(peek(engine, 1));
+    switch (object->type) {
+    case MTR_OBJ_ARRAY: return index_set_array(engine);
+    case MTR_OBJ_MAP:   index_set_map(engine); break;
+    case MTR_OBJ_STRING: {
+        MTR_LOG_ERROR("<String> object does not support item assignment.");
+        return false;
+    }
+    default:
+        MTR_ASSERT(false, "Invalid object type");
+        return false;
+    }
+    return true;
+}
+
+#ifdef MTR_JIT_ENABLED
+
+static bool run(struct mtr_engine* engine);
+
+// Counts a call or a loop iteration of the chunk, which is compiled when it crosses the threshold.
+// Nothing runs as machine code while MTR_JIT_MAX_NESTING calls from machine code are running.
+static bool jit_hot(const struct mtr_engine* engine, const struct mtr_chunk* chunk) {
+    if (engine->jit_nesting == MTR_JIT_MAX_NESTING) {
+        return false;
+    }
+    // frames only hold const chunks, the counter and the code are the only things written to
+    struct mtr_chunk* c = (struct mtr_chunk*) chunk;
+    if (NULL == c->jit && 0 != mtr_jit_threshold && ++c->hotness == mtr_jit_threshold) {
+        c->jit = mtr_jit_compile(c);
+    }
+    return NULL != c->jit;
+}
+
+// Runs the frame on top of the frame stack as machine code from ip until it returns.
+// A tail call to a chunk that isn't compiled is finished by the interpreter.
+static bool run_compiled(struct mtr_engine* engine, const u8* ip) {
+    struct mtr_call_frame* frame = engine->frames + engine->frame_count - 1;
+    for (;;) {
+        switch (mtr_jit_run(frame->chunk->jit, engine, frame, ip)) {
+        case MTR_JIT_RETURNED:
+            engine->storage_top = frame->storage;
+            return true;
+        case MTR_JIT_TAIL_CALLED:
+            if (!jit_hot(engine, frame->chunk)) {
+                return run(engine);
             }
+            ip = frame->ip;
+            break;
+        default:
+            return false;
+        }
+    }
+}
 
-            case MTR_OP_EMPTY_MAP: {
-                struct mtr_map* map = mtr_new_map();
-                LINK(map);
-                push(engine, MTR_OBJ(map));
-                break;
+// With the frame on top hot, the rest of it runs as machine code and the interpreter continues with the caller
+#   define JIT_ENTER()                                                  \
+    do {                                                                \
+        if (jit_hot(engine, frame->chunk)) {                            \
+            if (!run_compiled(engine, ip)) {                            \
+                return false;                                           \
+            }                                                           \
+            if (engine->frame_count < entry) {                          \
+                return true;                                            \
+            }                                                           \
+            frame = engine->frames + engine->frame_count - 1;           \
+            ip = frame->ip;                                             \
+        }                                                               \
+    } while (false)
+
+// loops are the backward jumps, they are traced (jit/trace.h) unless they can't be
+#   define BACK_EDGE(offset)                                            \
+    do {                                                                \
+        if ((offset) < 0) {                                             \
+            u8* const resume = mtr_trace_loop(engine, frame, ip);       \
+            if (NULL == resume) {                                       \
+                JIT_ENTER();                                            \
+            } else {                                                    \
+                ip = resume;                                            \
+            }                                                           \
+        }                                                               \
+    } while (false)
+#else
+#   define JIT_ENTER() ((void) 0)
+#   define BACK_EDGE(offset) ((void) (offset))
+#endif
+
+#ifdef MTR_THREADED_DISPATCH
+// labels as values are a GNU extension
+#   pragma GCC diagnostic push
+#   pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Runs until the frame on top of the frame stack when it was entered returns.
+// Calls between Matiria functions push and pop frames inside this loop and never recurse on the C stack.
+static bool run(struct mtr_engine* engine) {
+#ifdef MTR_THREADED_DISPATCH
+    static const void* const dispatch_table[] = {
+        LABEL(MTR_OP_CONSTANT),
+        LABEL(MTR_OP_CONSTANT_LONG),
+        LABEL(MTR_OP_SMALL_INT),
+        LABEL(MTR_OP_FALSE),
+        LABEL(MTR_OP_TRUE),
+        LABEL(MTR_OP_STRING_LITERAL),
+        LABEL(MTR_OP_ARRAY_LITERAL),
+        LABEL(MTR_OP_MAP_LITERAL),
+        LABEL(MTR_OP_CONSTRUCTOR),
+        LABEL(MTR_OP_CLOSURE),
+        LABEL(MTR_OP_NIL),
+        LABEL(MTR_OP_EMPTY_STRING),
+        LABEL(MTR_OP_EMPTY_ARRAY),
+        LABEL(MTR_OP_EMPTY_MAP),
+        LABEL(MTR_OP_FRAME_ARRAY_LITERAL),
+        LABEL(MTR_OP_FRAME_CONSTRUCTOR),
+        LABEL(MTR_OP_FRAME_EMPTY_ARRAY),
+        LABEL(MTR_OP_BOX),
+        LABEL(MTR_OP_OR),
+        LABEL(MTR_OP_AND),
+        LABEL(MTR_OP_NOT),
+        LABEL(MTR_OP_NEGATE_I),
+        LABEL(MTR_OP_NEGATE_F),
+        LABEL(MTR_OP_ADD_I),
+        LABEL(MTR_OP_SUB_I),
+        LABEL(MTR_OP_MUL_I),
+        LABEL(MTR_OP_DIV_I),
+        LABEL(MTR_OP_ADD_F),
+        LABEL(MTR_OP_SUB_F),
+        LABEL(MTR_OP_MUL_F),
+        LABEL(MTR_OP_DIV_F),
+        LABEL(MTR_OP_ELEMENTWISE_I),
+        LABEL(MTR_OP_ELEMENTWISE_F),
+        LABEL(MTR_OP_LESS_I),
+        LABEL(MTR_OP_GREATER_I),
+        LABEL(MTR_OP_EQUAL_I),
+        LABEL(MTR_OP_LESS_EQUAL_I),
+        LABEL(MTR_OP_GREATER_EQUAL_I),
+        LABEL(MTR_OP_NOT_EQUAL_I),
+        LABEL(MTR_OP_LESS_F),
+        LABEL(MTR_OP_GREATER_F),
+        LABEL(MTR_OP_EQUAL_F),
+        LABEL(MTR_OP_LESS_EQUAL_F),
+        LABEL(MTR_OP_GREATER_EQUAL_F),
+        LABEL(MTR_OP_NOT_EQUAL_F),
+        LABEL(MTR_OP_GET),
+        LABEL(MTR_OP_SET),
+        LABEL(MTR_OP_GET_GET),
+        LABEL(MTR_OP_LOCAL_ADD_I),
+        LABEL(MTR_OP_LOCAL_SUB_I),
+        LABEL(MTR_OP_LOCAL_INC_I),
+        LABEL(MTR_OP_SET_GET),
+        LABEL(MTR_OP_GLOBAL_GET),
+        LABEL(MTR_OP_UPVALUE_GET),
+        LABEL(MTR_OP_UPVALUE_SET),
+        LABEL(MTR_OP_INDEX_GET),
+        LABEL(MTR_OP_INDEX_SET),
+        LABEL(MTR_OP_INDEX_GET_ARRAY),
+        LABEL(MTR_OP_INDEX_GET_MAP),
+        LABEL(MTR_OP_INDEX_SET_ARRAY),
+        LABEL(MTR_OP_INDEX_SET_MAP),
+        LABEL(MTR_OP_INDEX_GET_ARRAY_UNCHECKED),
+        LABEL(MTR_OP_INDEX_SET_ARRAY_UNCHECKED),
+        LABEL(MTR_OP_CHECK_BOUNDS),
+        LABEL(MTR_OP_STRUCT_GET),
+        LABEL(MTR_OP_STRUCT_SET),
+        LABEL(MTR_OP_JMP),
+        LABEL(MTR_OP_JMP_Z),
+        LABEL(MTR_OP_JMP_NZ),
+        LABEL(MTR_OP_LESS_I_JMP_Z),
+        LABEL(MTR_OP_GREATER_I_JMP_Z),
+        LABEL(MTR_OP_EQUAL_I_JMP_Z),
+        LABEL(MTR_OP_LESS_EQUAL_I_JMP_Z),
+        LABEL(MTR_OP_GREATER_EQUAL_I_JMP_Z),
+        LABEL(MTR_OP_NOT_EQUAL_I_JMP_Z),
+        LABEL(MTR_OP_POP),
+        LABEL(MTR_OP_POP_V),
+        LABEL(MTR_OP_CALL),
+        LABEL(MTR_OP_CALL_FUNCTION),
+        LABEL(MTR_OP_CALL_CLOSURE),
+        LABEL(MTR_OP_CALL_NATIVE),
+        LABEL(MTR_OP_CALL_GLOBAL),
+        LABEL(MTR_OP_CALL_GLOBAL_NATIVE),
+        LABEL(MTR_OP_TAIL_CALL),
+        LABEL(MTR_OP_TAIL_CALL_GLOBAL),
+        LABEL(MTR_OP_INT_CAST),
+        LABEL(MTR_OP_FLOAT_CAST),
+        LABEL(MTR_OP_RETURN),
+    };
+#endif
+
+    const u32 entry = engine->frame_count;
+    struct mtr_call_frame* frame = engine->frames + entry - 1;
+    register u8* ip = frame->ip;
+
+    DISPATCH_LOOP()
+    {
+        CASE(MTR_OP_CONSTANT): {
+            const u8 index = READ(u8);
+            push(engine, frame->chunk->constants[index]);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_CONSTANT_LONG): {
+            const u16 index = READ(u16);
+            push(engine, frame->chunk->constants[index]);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_SMALL_INT): {
+            const i16 value = READ(i16);
+            const mtr_value constant = MTR_INT(value);
+            push(engine, constant);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_FALSE): {
+            const mtr_value c = MTR_INT(0);
+            push(engine , c);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_TRUE): {
+            const mtr_value c = MTR_INT(1);
+            push(engine , c);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_STRING_LITERAL): {
+            const u16 index = READ(u16);
+            SAFEPOINT(ip);
+            string_literal(engine, frame, index);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_ARRAY_LITERAL): {
+            const u8 count = READ(u8);
+            const u8 layout = READ(u8);
+            SAFEPOINT(ip);
+            array_literal(engine, count, layout, false);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_MAP_LITERAL): {
+            const u8 count = READ(u8);
+            const u8 key_type = READ(u8);
+            const u8 value_type = READ(u8);
+            SAFEPOINT(ip);
+            map_literal(engine, count, key_type, value_type);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_CONSTRUCTOR): {
+            const u8 count = READ(u8);
+            const u8* types = ip;
+            ip += count;
+            SAFEPOINT(ip);
+            construct(engine, count, types, false);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_CLOSURE): {
+            SAFEPOINT(ip - 1 + mtr_instruction_length(ip - 1));
+            ip = closure(engine, frame, ip);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_NIL): {
+            const mtr_value c = MTR_NIL;
+            push(engine, c);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_EMPTY_STRING): {
+            // struct mtr_string* string_object = mtr_new_string(NULL, 0);
+            // push(engine, MTR_OBJ(string_object));
+            // break;
+            MTR_ASSERT(false, "Think about this");
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_EMPTY_ARRAY): {
+            const u8 layout = READ(u8);
+            SAFEPOINT(ip);
+            empty_array(engine, layout, false);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_EMPTY_MAP): {
+            const u8 key_type = READ(u8);
+            const u8 value_type = READ(u8);
+            SAFEPOINT(ip);
+            map_literal(engine, 0, key_type, value_type);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_FRAME_ARRAY_LITERAL): {
+            const u8 count = READ(u8);
+            const u8 layout = READ(u8);
+            SAFEPOINT(ip);
+            array_literal(engine, count, layout, true);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_FRAME_CONSTRUCTOR): {
+            const u8 count = READ(u8);
+            const u8* types = ip;
+            ip += count;
+            SAFEPOINT(ip);
+            construct(engine, count, types, true);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_FRAME_EMPTY_ARRAY): {
+            const u8 layout = READ(u8);
+            SAFEPOINT(ip);
+            empty_array(engine, layout, true);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_BOX): {
+            const u8 type = READ(u8);
+            SAFEPOINT(ip);
+            box(engine, type);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_NOT): {
+            engine->stack_top[-1] = MTR_INT(!MTR_AS_INT(engine->stack_top[-1]));
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_OR): {
+            const i16 where = READ(i16);
+            const mtr_value condition = peek(engine, 0);
+            if (MTR_AS_INT(condition)) {
+                ip += where;
+            } else {
+                pop(engine);
             }
+            DISPATCH();
+        }
 
-            case MTR_OP_NOT: {
-                (engine->stack_top - 1)->integer = !((engine->stack_top - 1)->integer);
-                break;
+        CASE(MTR_OP_AND): {
+            const i16 where = READ(i16);
+            const mtr_value condition = peek(engine, 0);
+            if (!MTR_AS_INT(condition)) {
+                ip += where;
+            } else {
+                pop(engine);
             }
+            DISPATCH();
+        }
 
-            case MTR_OP_OR: {
-                const i16 where = READ(i16);
-                const mtr_value condition = peek(engine, 0);
-                if (condition.integer) {
-                    ip += where;
-                } else {
-                    pop(engine);
-                }
+        CASE(MTR_OP_NEGATE_I): {
+            engine->stack_top[-1] = MTR_INT(-MTR_AS_INT(engine->stack_top[-1]));
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_NEGATE_F): {
+            engine->stack_top[-1] = MTR_FLOAT(-MTR_AS_FLOAT(engine->stack_top[-1]));
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_ADD_I): BINARY_OP(+, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_OP_SUB_I): BINARY_OP(-, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_OP_MUL_I): BINARY_OP(*, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_OP_DIV_I): BINARY_OP(/, MTR_AS_INT, MTR_INT); DISPATCH();
+
+        CASE(MTR_OP_ADD_F): BINARY_OP(+, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+        CASE(MTR_OP_SUB_F): BINARY_OP(-, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+        CASE(MTR_OP_MUL_F): BINARY_OP(*, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+        CASE(MTR_OP_DIV_F): BINARY_OP(/, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+
+        CASE(MTR_OP_ELEMENTWISE_I): {
+            const u8 op = READ(u8);
+            const u8 arrays = READ(u8);
+            SAFEPOINT(ip);
+            elementwise(engine, op, arrays, MTR_ARRAY_INTS);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_ELEMENTWISE_F): {
+            const u8 op = READ(u8);
+            const u8 arrays = READ(u8);
+            SAFEPOINT(ip);
+            elementwise(engine, op, arrays, MTR_ARRAY_FLOATS);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_LESS_I): BINARY_OP(<, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_OP_GREATER_I): BINARY_OP(>, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_OP_EQUAL_I): BINARY_OP(==, MTR_AS_INT, MTR_INT); DISPATCH();
+
+        CASE(MTR_OP_LESS_EQUAL_I): COMPARE_OP(<=, MTR_AS_INT); DISPATCH();
+        CASE(MTR_OP_GREATER_EQUAL_I): COMPARE_OP(>=, MTR_AS_INT); DISPATCH();
+        CASE(MTR_OP_NOT_EQUAL_I): COMPARE_OP(!=, MTR_AS_INT); DISPATCH();
+
+        CASE(MTR_OP_LESS_F): COMPARE_OP(<, MTR_AS_FLOAT); DISPATCH();
+        CASE(MTR_OP_GREATER_F): COMPARE_OP(>, MTR_AS_FLOAT); DISPATCH();
+        CASE(MTR_OP_EQUAL_F): COMPARE_OP(==, MTR_AS_FLOAT); DISPATCH();
+
+        CASE(MTR_OP_LESS_EQUAL_F): COMPARE_OP(<=, MTR_AS_FLOAT); DISPATCH();
+        CASE(MTR_OP_GREATER_EQUAL_F): COMPARE_OP(>=, MTR_AS_FLOAT); DISPATCH();
+        CASE(MTR_OP_NOT_EQUAL_F): COMPARE_OP(!=, MTR_AS_FLOAT); DISPATCH();
+
+        CASE(MTR_OP_GET): {
+            const u16 index = READ(u16);
+            push(engine, frame->slots[index]);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_SET): {
+            const u16 index = READ(u16);
+            frame->slots[index] = pop(engine);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_GET_GET): {
+            const u16 a = READ(u16);
+            const u16 b = READ(u16);
+            push(engine, frame->slots[a]);
+            push(engine, frame->slots[b]);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_LOCAL_ADD_I): {
+            const u16 dst = READ(u16);
+            const u16 a = READ(u16);
+            const u16 b = READ(u16);
+            frame->slots[dst] = MTR_INT(MTR_AS_INT(frame->slots[a]) + MTR_AS_INT(frame->slots[b]));
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_LOCAL_SUB_I): {
+            const u16 dst = READ(u16);
+            const u16 a = READ(u16);
+            const u16 b = READ(u16);
+            frame->slots[dst] = MTR_INT(MTR_AS_INT(frame->slots[a]) - MTR_AS_INT(frame->slots[b]));
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_LOCAL_INC_I): {
+            const u16 dst = READ(u16);
+            const i16 value = READ(i16);
+            frame->slots[dst] = MTR_INT(MTR_AS_INT(frame->slots[dst]) + value);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_SET_GET): {
+            const u16 index = READ(u16);
+            frame->slots[index] = peek(engine, 0);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_GLOBAL_GET): {
+            const u16 index = READ(u16);
+            struct mtr_object* o = engine->globals[index];
+            push(engine, MTR_OBJ(o));
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_UPVALUE_GET): {
+            const u16 index = READ(u16);
+            mtr_value val = frame->upvalues[index];
+            push(engine, val);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_UPVALUE_SET): {
+            const u16 index = READ(u16);
+            upvalue_set(engine, frame, index);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_INDEX_GET): {
+            const struct mtr_object* object = MTR_AS_OBJ(peek(engine, 1));
+            switch (object->type) {
+            case MTR_OBJ_ARRAY: QUICKEN(MTR_OP_INDEX_GET_ARRAY);
+            case MTR_OBJ_MAP:   QUICKEN(MTR_OP_INDEX_GET_MAP);
+            default:
                 break;
             }
+            if (!index_get(engine)) {
+                return false;
+            }
+            DISPATCH();
+        }
 
-            case MTR_OP_AND: {
-                const i16 where = READ(i16);
-                const mtr_value condition = peek(engine, 0);
-                if (!condition.integer) {
-                    ip += where;
-                } else {
-                    pop(engine);
-                }
+        CASE(MTR_OP_INDEX_SET): {
+            const struct mtr_object* object = MTR_AS_OBJ(peek(engine, 1));
+            switch (object->type) {
+            case MTR_OBJ_ARRAY: QUICKEN(MTR_OP_INDEX_SET_ARRAY);
+            case MTR_OBJ_MAP:   QUICKEN(MTR_OP_INDEX_SET_MAP);
+            default:
                 break;
             }
+            if (!index_set(engine)) {
+                return false;
+            }
+            DISPATCH();
+        }
 
-            case MTR_OP_NEGATE_I: {
-                (engine->stack_top - 1)->integer = -((engine->stack_top - 1)->integer);
-                break;
+        CASE(MTR_OP_INDEX_GET_ARRAY): {
+            GUARD(peek(engine, 1), MTR_OBJ_ARRAY, MTR_OP_INDEX_GET);
+            if (!index_get_array(engine)) {
+                return false;
             }
+            DISPATCH();
+        }
 
-            case MTR_OP_NEGATE_F: {
-                (engine->stack_top - 1)->floating = -((engine->stack_top - 1)->floating);
-                break;
+        CASE(MTR_OP_INDEX_GET_MAP): {
+            GUARD(peek(engine, 1), MTR_OBJ_MAP, MTR_OP_INDEX_GET);
+            index_get_map(engine);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_INDEX_SET_ARRAY): {
+            GUARD(peek(engine, 1), MTR_OBJ_ARRAY, MTR_OP_INDEX_SET);
+            if (!index_set_array(engine)) {
+                return false;
             }
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_INDEX_SET_MAP): {
+            GUARD(peek(engine, 1), MTR_OBJ_MAP, MTR_OP_INDEX_SET);
+            index_set_map(engine);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_INDEX_GET_ARRAY_UNCHECKED): {
+            const i64 index = MTR_AS_INT(pop(engine));
+            const struct mtr_array* array = (const struct mtr_array*) MTR_AS_OBJ(engine->stack_top[-1]);
+            engine->stack_top[-1] = mtr_array_get(array, (size_t) index);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_INDEX_SET_ARRAY_UNCHECKED): {
+            const i64 index = MTR_AS_INT(pop(engine));
+            struct mtr_array* array = (struct mtr_array*) MTR_AS_OBJ(pop(engine));
+            const mtr_value val = pop(engine);
+            mtr_array_store(array, (size_t) index, val);
+            mtr_write_barrier(engine, &array->obj, val);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_CHECK_BOUNDS): {
+            check_bounds(engine);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_STRUCT_GET): {
+            const mtr_value v = pop(engine);
+            const struct mtr_struct* s = (const struct mtr_struct*) MTR_AS_OBJ(v);
+            const u8 index = READ(u16);
+            push(engine, s->members[index]);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_STRUCT_SET): {
+            const u8 index = READ(u16);
+            struct_set(engine, index);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_JMP): {
+            const i16 where = READ(i16);
+            ip += where;
+            BACK_EDGE(where);
+            DISPATCH();
+        }
 
-            case MTR_OP_ADD_I: BINARY_OP(+, integer, MTR_VAL_INT); break;
-            case MTR_OP_SUB_I: BINARY_OP(-, integer, MTR_VAL_INT); break;
-            case MTR_OP_MUL_I: BINARY_OP(*, integer, MTR_VAL_INT); break;
-            case MTR_OP_DIV_I: BINARY_OP(/, integer, MTR_VAL_INT); break;
+        CASE(MTR_OP_JMP_Z): {
+            const mtr_value value = pop(engine);
+            const bool condition = MTR_AS_INT(value);
+            const i16 where = READ(i16);
+            const i32 offset = where * (condition == false);
+            ip += offset;
+            BACK_EDGE(offset);
+            DISPATCH();
+        }
+
+        CASE(MTR_OP_JMP_NZ): {
+            const mtr_value value = pop(engine);
+            const bool condition = MTR_AS_INT(value);
+            const i16 where = READ(i16);
+            const i32 offset = where * (condition == true);
+            ip += offset;
+            BACK_EDGE(offset);
+            DISPATCH();
+        }
 
-            case MTR_OP_ADD_F: BINARY_OP(+, floating, MTR_VAL_FLOAT); break;
-            case MTR_OP_SUB_F: BINARY_OP(-, floating, MTR_VAL_FLOAT); break;
-            case MTR_OP_MUL_F: BINARY_OP(*, floating, MTR_VAL_FLOAT); break;
-            case MTR_OP_DIV_F: BINARY_OP(/, floating, MTR_VAL_FLOAT); break;
+        CASE(MTR_OP_LESS_I_JMP_Z): COMPARE_JMP(<); DISPATCH();
+        CASE(MTR_OP_GREATER_I_JMP_Z): COMPARE_JMP(>); DISPATCH();
+        CASE(MTR_OP_EQUAL_I_JMP_Z): COMPARE_JMP(==); DISPATCH();
+        CASE(MTR_OP_LESS_EQUAL_I_JMP_Z): COMPARE_JMP(<=); DISPATCH();
+        CASE(MTR_OP_GREATER_EQUAL_I_JMP_Z): COMPARE_JMP(>=); DISPATCH();
+        CASE(MTR_OP_NOT_EQUAL_I_JMP_Z): COMPARE_JMP(!=); DISPATCH();
 
-            case MTR_OP_LESS_I: BINARY_OP(<, integer, MTR_VAL_INT); break;
-            case MTR_OP_GREATER_I: BINARY_OP(>, integer, MTR_VAL_INT); break;
-            case MTR_OP_EQUAL_I: BINARY_OP(==, integer, MTR_VAL_INT); break;
+        CASE(MTR_OP_POP): {
+            pop(engine);
+            DISPATCH();
+        }
 
-            case MTR_OP_LESS_F: BINARY_OP(<, floating, MTR_VAL_FLOAT); break;
-            case MTR_OP_GREATER_F: BINARY_OP(>, floating, MTR_VAL_FLOAT); break;
-            case MTR_OP_EQUAL_F: BINARY_OP(==, floating, MTR_VAL_FLOAT); break;
+        CASE(MTR_OP_POP_V): {
+            const u16 count = READ(u16);
+            engine->stack_top -= count;
+            DISPATCH();
+        }
 
-            case MTR_OP_GET: {
-                const u16 index = READ(u16);
-                push(engine, frame.stack[index]);
+        CASE(MTR_OP_CALL): {
+            const struct mtr_object* object = MTR_AS_OBJ(peek(engine, 0));
+            switch (object->type) {
+            case MTR_OBJ_FUNCTION:  QUICKEN(MTR_OP_CALL_FUNCTION);
+            case MTR_OBJ_CLOSURE:   QUICKEN(MTR_OP_CALL_CLOSURE);
+            case MTR_OBJ_NATIVE_FN: QUICKEN(MTR_OP_CALL_NATIVE);
+            default:
                 break;
             }
+            MTR_ASSERT(false, "Object is not invokable");
+            DISPATCH();
+        }
 
-            case MTR_OP_SET: {
-                const u16 index = READ(u16);
-                frame.stack[index] = pop(engine);
-                break;
+        CASE(MTR_OP_CALL_FUNCTION): {
+            GUARD(peek(engine, 0), MTR_OBJ_FUNCTION, MTR_OP_CALL);
+            const u8 argc = READ(u8);
+            struct mtr_function* f = (struct mtr_function*) MTR_AS_OBJ(pop(engine));
+            CHECK_STACK_MAP();
+            frame->ip = ip;
+            if (!push_frame(engine, &f->chunk, argc, NULL)) {
+                return false;
             }
+            frame = engine->frames + engine->frame_count - 1;
+            ip = frame->ip;
+            JIT_ENTER();
+            DISPATCH();
+        }
 
-            case MTR_OP_GLOBAL_GET: {
-                const u16 index = READ(u16);
-                struct mtr_object* o = engine->globals[index];
-                push(engine, MTR_OBJ(o));
-                break;
+        CASE(MTR_OP_CALL_CLOSURE): {
+            GUARD(peek(engine, 0), MTR_OBJ_CLOSURE, MTR_OP_CALL);
+            const u8 argc = READ(u8);
+            struct mtr_closure* c = (struct mtr_closure*) MTR_AS_OBJ(pop(engine));
+            CHECK_STACK_MAP();
+            frame->ip = ip;
+            if (!push_frame(engine, &c->function->chunk, argc, c->upvalues)) {
+                return false;
             }
+            frame = engine->frames + engine->frame_count - 1;
+            ip = frame->ip;
+            JIT_ENTER();
+            DISPATCH();
+        }
 
-            case MTR_OP_UPVALUE_GET: {
-                const u16 index = READ(u16);
-                mtr_value val = frame.closed[index];
-                push(engine, val);
-                break;
+        CASE(MTR_OP_CALL_NATIVE): {
+            GUARD(peek(engine, 0), MTR_OBJ_NATIVE_FN, MTR_OP_CALL);
+            const u8 argc = READ(u8);
+            struct mtr_native_fn* n = (struct mtr_native_fn*) MTR_AS_OBJ(pop(engine));
+            CHECK_STACK_MAP();
+            mtr_value val = n->function(argc, engine->stack_top - argc);
+            if (mtr_native_failed()) {
+                return false;
             }
+            engine->stack_top -= argc;
+            push(engine, val);
+            DISPATCH();
+        }
 
-            case MTR_OP_UPVALUE_SET: {
-                const u16 index = READ(u16);
-                frame.closed[index] = pop(engine);
-                break;
+        CASE(MTR_OP_CALL_GLOBAL): {
+            const u16 index = READ(u16);
+            const u8 argc = READ(u8);
+            const struct mtr_function* f = (const struct mtr_function*) engine->globals[index];
+            CHECK_STACK_MAP();
+            frame->ip = ip;
+            if (!push_frame(engine, &f->chunk, argc, NULL)) {
+                return false;
             }
+            frame = engine->frames + engine->frame_count - 1;
+            ip = frame->ip;
+            JIT_ENTER();
+            DISPATCH();
+        }
 
-            case MTR_OP_INDEX_GET: {
-                const mtr_value key = pop(engine);
-                const struct mtr_object* object = MTR_AS_OBJ(pop(engine));
-                switch (object->type) {
-                case MTR_OBJ_STRING: {
-                    const struct mtr_string* string = (const struct mtr_string*) object;
-                    const i64 i = MTR_AS_INT(key);
-                    const size_t index = mtr_reinterpret_cast(size_t, i);
-                    if (index >= string->length) {
-                        IMPLEMENT // runtime error;
-                        MTR_LOG_ERROR("Indexing string of size %zu with index %zu", string->length, index);
-                        exit(-1);
-                        break;
-                    }
-                    // need to think whether to malloc a whole new string for a single char or not.
-                    // I dont like the idea. I could have a reference to it
-                    MTR_LOG_ERROR("String indexing not yet implemented");
-                    exit(-1);
-                    break;
-                }
-                case MTR_OBJ_ARRAY: {
-                    const struct mtr_array* array = (const struct mtr_array*) object;
-                    const i64 i = MTR_AS_INT(key);
-                    const size_t index = mtr_reinterpret_cast(size_t, i);
-                    if (index >= array->size) {
-                        IMPLEMENT // runtime error;
-                        MTR_LOG_ERROR("Out of bounds: Indexing array of size %zu with index %zu", array->size, index);
-                        exit(-1);
-                        break;
-                    }
-                    push(engine, array->elements[index]);
-                    break;
-                }
-                case MTR_OBJ_MAP: {
-                    struct mtr_map* map = (struct mtr_map*) object;
-                    mtr_value val = mtr_map_get(map, key);
-                    push(engine, val);
-                    break;
-                }
-                default:
-                    IMPLEMENT // runtime error
-                    exit(-1);
-                    break;
-                }
-                break;
+        CASE(MTR_OP_CALL_GLOBAL_NATIVE): {
+            const u16 index = READ(u16);
+            const u8 argc = READ(u8);
+            const struct mtr_native_fn* n = (const struct mtr_native_fn*) engine->globals[index];
+            CHECK_STACK_MAP();
+            mtr_value val = n->function(argc, engine->stack_top - argc);
+            if (mtr_native_failed()) {
+                return false;
             }
+            engine->stack_top -= argc;
+            push(engine, val);
+            DISPATCH();
+        }
 
-            case MTR_OP_INDEX_SET: {
-                const mtr_value key = pop(engine);
-                const struct mtr_object* object = MTR_AS_OBJ(pop(engine));
-                mtr_value val = pop(engine);
-                switch (object->type) {
-                case MTR_OBJ_STRING: {
-                    MTR_LOG_ERROR("<String> object does not support item assignment.");
-                    exit(-1);
-                    break;
+        CASE(MTR_OP_TAIL_CALL): {
+            const u8 argc = READ(u8);
+            struct mtr_object* object = MTR_AS_OBJ(pop(engine));
+            CHECK_STACK_MAP();
+            switch (object->type) {
+            case MTR_OBJ_FUNCTION: {
+                struct mtr_function* f = (struct mtr_function*) object;
+                if (!reuse_frame(engine, frame, &f->chunk, argc, NULL)) {
+                    return false;
                 }
-                case MTR_OBJ_ARRAY: {
-                    const struct mtr_array* array = (const struct mtr_array*) object;
-                    const i64 i = MTR_AS_INT(key);
-                    const size_t index = mtr_reinterpret_cast(size_t, i);
-                    if (index >= array->size) {
-                        IMPLEMENT // runtime error;
-                        MTR_LOG_ERROR("Out of bounds: Indexing array of size %zu with index %zu", array->size, index);
-                        exit(-1);
-                        break;
-                    }
-                    array->elements[index] = val;
-                    break;
+                break;
+            }
+            case MTR_OBJ_CLOSURE: {
+                struct mtr_closure* c = (struct mtr_closure*) object;
+                if (!reuse_frame(engine, frame, &c->function->chunk, argc, c->upvalues)) {
+                    return false;
                 }
-                case MTR_OBJ_MAP: {
-                    struct mtr_map* map = (struct mtr_map*) object;
-                    mtr_map_insert(map, key, val);
-                    break;
+                break;
+            }
+            case MTR_OBJ_NATIVE_FN: {
+                // nothing to reuse, call it and return what it gives back
+                struct mtr_native_fn* n = (struct mtr_native_fn*) object;
+                mtr_value val = n->function(argc, engine->stack_top - argc);
+                if (mtr_native_failed()) {
+                    return false;
                 }
-                default:
-                    MTR_ASSERT(false, "Invalid object type");
-                    break;
+                engine->stack_top = frame->slots;
+                engine->storage_top = frame->storage;
+                push(engine, val);
+                if (--engine->frame_count < entry) {
+                    return true;
                 }
+                frame = engine->frames + engine->frame_count - 1;
                 break;
             }
-
-            case MTR_OP_STRUCT_GET: {
-                const mtr_value v = pop(engine);
-                const struct mtr_struct* s = (const struct mtr_struct*) MTR_AS_OBJ(v);
-                const u8 index = READ(u16);
-                push(engine, s->members[index]);
+            default:
+                MTR_ASSERT(false, "Object is not invokable");
                 break;
             }
+            ip = frame->ip;
+            JIT_ENTER();
+            DISPATCH();
+        }
 
-            case MTR_OP_STRUCT_SET: {
-                mtr_value k = pop(engine);
-                mtr_value val = pop(engine);
-                struct mtr_struct* s = (struct mtr_struct*) MTR_AS_OBJ(k);
-                const u8 index = READ(u16);
-                s->members[index] = val;
-                break;
+        CASE(MTR_OP_TAIL_CALL_GLOBAL): {
+            const u16 index = READ(u16);
+            const u8 argc = READ(u8);
+            const struct mtr_function* f = (const struct mtr_function*) engine->globals[index];
+            CHECK_STACK_MAP();
+            if (!reuse_frame(engine, frame, &f->chunk, argc, NULL)) {
+                return false;
             }
+            ip = frame->ip;
+            JIT_ENTER();
+            DISPATCH();
+        }
 
-            case MTR_OP_JMP: {
-                const i16 where = READ(i16);
-                ip += where;
-                break;
+        CASE(MTR_OP_RETURN): {
+            mtr_value res = pop(engine);
+            engine->stack_top = frame->slots;
+            engine->storage_top = frame->storage;
+            push(engine, res);
+            if (--engine->frame_count < entry) {
+                return true;
             }
+            frame = engine->frames + engine->frame_count - 1;
+            ip = frame->ip;
+            DISPATCH();
+        }
 
-            case MTR_OP_JMP_Z: {
-                const mtr_value value = pop(engine);
-                const bool condition = MTR_AS_INT(value);
-                const i16 where = READ(i16);
-                ip += where * (condition == false);
-                break;
-            }
+        CASE(MTR_OP_INT_CAST): {
+            const mtr_value from = pop(engine);
+            const mtr_value to = MTR_INT((i64) MTR_AS_FLOAT(from));
+            push(engine, to);
+            DISPATCH();
+        }
 
-            case MTR_OP_POP: {
-                pop(engine);
-                break;
-            }
+        CASE(MTR_OP_FLOAT_CAST): {
+            const mtr_value from = pop(engine);
+            const mtr_value to = MTR_FLOAT((f64) MTR_AS_INT(from));
+            push(engine, to);
+            DISPATCH();
+        }
+    }
+}
 
-            case MTR_OP_POP_V: {
-                const u16 count = READ(u16);
-                engine->stack_top -= count;
-                break;
-            }
+#ifdef MTR_THREADED_DISPATCH
+#   pragma GCC diagnostic pop
+#endif
 
-            case MTR_OP_CALL: {
-                const u8 argc = READ(u8);
-                struct mtr_object* object = MTR_AS_OBJ(pop(engine));
-                if (object->type == MTR_OBJ_FUNCTION) {
-                    struct mtr_function* f = (struct mtr_function*) object;
-                    call(engine, f->chunk, argc, NULL);
-                    break;
-                } else if (object->type == MTR_OBJ_CLOSURE) {
-                    struct mtr_closure* c = (struct mtr_closure*) object;
-                    call(engine, c->chunk, argc, c->upvalues);
-                    break;
-                } else if (object->type == MTR_OBJ_NATIVE_FN) {
-                    struct mtr_native_fn* n = (struct mtr_native_fn*) object;
-                    mtr_value val = n->function(argc, engine->stack_top - argc);
-                    engine->stack_top -= argc;
-                    push(engine, val);
-                    break;
-                }
-                MTR_ASSERT(false, "Object is not invokable");
-                break;
-            }
+// Runs the frame on top of the frame stack until it returns
+static bool execute(struct mtr_engine* engine) {
+#ifdef MTR_JIT_ENABLED
+    const struct mtr_call_frame* frame = engine->frames + engine->frame_count - 1;
+    if (jit_hot(engine, frame->chunk)) {
+        return run_compiled(engine, frame->ip);
+    }
+#endif
+    return run(engine);
+}
 
-            case MTR_OP_RETURN: {
-                mtr_value res = pop(engine);
-                engine->stack_top = frame.stack;
-                push(engine, res);
-                return;
-            }
+#ifdef MTR_JIT_ENABLED
 
-            case MTR_OP_INT_CAST: {
-                const mtr_value from = pop(engine);
-                const mtr_value to = MTR_INT((i64) from.floating);
-                push(engine, to);
-                break;
-            }
+// Runs the frame just pushed for a call from machine code
+static bool execute_nested(struct mtr_engine* engine) {
+    ++engine->jit_nesting;
+    const bool ok = execute(engine);
+    --engine->jit_nesting;
+    return ok;
+}
 
-            case MTR_OP_FLOAT_CAST: {
-                const mtr_value from = pop(engine);
-                const mtr_value to = MTR_FLOAT((f64) from.integer);
-                push(engine, to);
-                break;
-            }
+// Calls made from machine code run to completion before the machine code carries on
+static bool call(struct mtr_engine* engine, const struct mtr_object* callable, u8 argc) {
+    switch (callable->type) {
+    case MTR_OBJ_FUNCTION: {
+        const struct mtr_function* f = (const struct mtr_function*) callable;
+        return push_frame(engine, &f->chunk, argc, NULL) && execute_nested(engine);
+    }
+    case MTR_OBJ_CLOSURE: {
+        struct mtr_closure* c = (struct mtr_closure*) callable;
+        return push_frame(engine, &c->function->chunk, argc, c->upvalues) && execute_nested(engine);
+    }
+    case MTR_OBJ_NATIVE_FN: {
+        const struct mtr_native_fn* n = (const struct mtr_native_fn*) callable;
+        mtr_value val = n->function(argc, engine->stack_top - argc);
+        if (mtr_native_failed()) {
+            return false;
+        }
+        engine->stack_top -= argc;
+        push(engine, val);
+        return true;
+    }
+    default:
+        MTR_ASSERT(false, "Object is not invokable");
+        return false;
+    }
+}
+
+static enum mtr_jit_status tail_call(struct mtr_engine* engine, struct mtr_call_frame* frame, const struct mtr_object* callable, u8 argc) {
+    switch (callable->type) {
+    case MTR_OBJ_FUNCTION: {
+        const struct mtr_function* f = (const struct mtr_function*) callable;
+        return reuse_frame(engine, frame, &f->chunk, argc, NULL) ? MTR_JIT_TAIL_CALLED : MTR_JIT_FAILED;
+    }
+    case MTR_OBJ_CLOSURE: {
+        struct mtr_closure* c = (struct mtr_closure*) callable;
+        return reuse_frame(engine, frame, &c->function->chunk, argc, c->upvalues) ? MTR_JIT_TAIL_CALLED : MTR_JIT_FAILED;
+    }
+    default: {
+        if (!call(engine, callable, argc)) {
+            return MTR_JIT_FAILED;
         }
+        mtr_value res = pop(engine);
+        engine->stack_top = frame->slots;
+        push(engine, res);
+        --engine->frame_count;
+        return MTR_JIT_RETURNED;
+    }
     }
 }
 
+// The quickened forms are run like the generic ones, the machine code was compiled from
+// whatever the chunk held at the time and doesn't guard anything.
+enum mtr_jit_status mtr_jit_step(struct mtr_engine* engine, struct mtr_call_frame* frame, u8* ip) {
+    switch (*ip++)
+    {
+    case MTR_OP_STRING_LITERAL: {
+        const u16 index = READ(u16);
+        string_literal(engine, frame, index);
+        break;
+    }
+
+    case MTR_OP_ARRAY_LITERAL: {
+        const u8 count = READ(u8);
+        const u8 layout = READ(u8);
+        array_literal(engine, count, layout, false);
+        break;
+    }
+
+    case MTR_OP_MAP_LITERAL: {
+        const u8 count = READ(u8);
+        const u8 key_type = READ(u8);
+        const u8 value_type = READ(u8);
+        map_literal(engine, count, key_type, value_type);
+        break;
+    }
+
+    case MTR_OP_CONSTRUCTOR: {
+        const u8 count = READ(u8);
+        construct(engine, count, ip, false);
+        break;
+    }
+
+    case MTR_OP_CLOSURE:
+        closure(engine, frame, ip);
+        break;
+
+    case MTR_OP_EMPTY_ARRAY: {
+        const u8 layout = READ(u8);
+        empty_array(engine, layout, false);
+        break;
+    }
+
+    case MTR_OP_EMPTY_MAP: {
+        const u8 key_type = READ(u8);
+        const u8 value_type = READ(u8);
+        map_literal(engine, 0, key_type, value_type);
+        break;
+    }
+
+    case MTR_OP_FRAME_ARRAY_LITERAL: {
+        const u8 count = READ(u8);
+        const u8 layout = READ(u8);
+        array_literal(engine, count, layout, true);
+        break;
+    }
+
+    case MTR_OP_FRAME_CONSTRUCTOR: {
+        const u8 count = READ(u8);
+        construct(engine, count, ip, true);
+        break;
+    }
+
+    case MTR_OP_FRAME_EMPTY_ARRAY: {
+        const u8 layout = READ(u8);
+        empty_array(engine, layout, true);
+        break;
+    }
+
+    // the machine code stores numbers itself, objects come here for the write barrier
+    case MTR_OP_UPVALUE_SET: {
+        const u16 index = READ(u16);
+        upvalue_set(engine, frame, index);
+        break;
+    }
+
+    case MTR_OP_STRUCT_SET: {
+        const u8 index = READ(u16);
+        struct_set(engine, index);
+        break;
+    }
+
+    case MTR_OP_INDEX_GET:
+    case MTR_OP_INDEX_GET_ARRAY:
+    case MTR_OP_INDEX_GET_MAP:
+    case MTR_OP_INDEX_GET_ARRAY_UNCHECKED:
+        if (!index_get(engine)) {
+            return MTR_JIT_FAILED;
+        }
+        break;
+
+    case MTR_OP_INDEX_SET:
+    case MTR_OP_INDEX_SET_ARRAY:
+    case MTR_OP_INDEX_SET_MAP:
+    case MTR_OP_INDEX_SET_ARRAY_UNCHECKED:
+        if (!index_set(engine)) {
+            return MTR_JIT_FAILED;
+        }
+        break;
+
+    case MTR_OP_CHECK_BOUNDS:
+        check_bounds(engine);
+        break;
+
+    case MTR_OP_ELEMENTWISE_I: {
+        const u8 op = READ(u8);
+        const u8 arrays = READ(u8);
+        elementwise(engine, op, arrays, MTR_ARRAY_INTS);
+        break;
+    }
+
+    case MTR_OP_ELEMENTWISE_F: {
+        const u8 op = READ(u8);
+        const u8 arrays = READ(u8);
+        elementwise(engine, op, arrays, MTR_ARRAY_FLOATS);
+        break;
+    }
+
+    case MTR_OP_CALL:
+    case MTR_OP_CALL_FUNCTION:
+    case MTR_OP_CALL_CLOSURE:
+    case MTR_OP_CALL_NATIVE: {
+        const u8 argc = READ(u8);
+        const struct mtr_object* callable = MTR_AS_OBJ(pop(engine));
+        frame->ip = ip;
+        return call(engine, callable, argc) ? MTR_JIT_NEXT : MTR_JIT_FAILED;
+    }
+
+    case MTR_OP_CALL_GLOBAL:
+    case MTR_OP_CALL_GLOBAL_NATIVE: {
+        const u16 index = READ(u16);
+        const u8 argc = READ(u8);
+        frame->ip = ip;
+        return call(engine, engine->globals[index], argc) ? MTR_JIT_NEXT : MTR_JIT_FAILED;
+    }
+
+    case MTR_OP_TAIL_CALL: {
+        const u8 argc = READ(u8);
+        const struct mtr_object* callable = MTR_AS_OBJ(pop(engine));
+        return tail_call(engine, frame, callable, argc);
+    }
+
+    case MTR_OP_TAIL_CALL_GLOBAL: {
+        const u16 index = READ(u16);
+        const u8 argc = READ(u8);
+        return tail_call(engine, frame, engine->globals[index], argc);
+    }
+
+    default:
+        MTR_ASSERT(false, "Op code is compiled by the JIT.");
+        return MTR_JIT_FAILED;
+    }
+    return MTR_JIT_NEXT;
+}
+
+#endif
+
+#undef COMPARE_JMP
+#undef COMPARE_OP
 #undef BINARY_OP
+#undef SET_TYPES
+#undef SET_TYPE
+#undef SAFEPOINT
+#undef FRAME_HEADER
+#undef CHECK_STACK_MAP
+#undef BACK_EDGE
+#undef JIT_ENTER
+#undef GUARD
+#undef QUICKEN
 #undef READ
 
+#endif // MTR_REGISTER_VM
+
 i32 mtr_execute(struct mtr_engine* engine, struct mtr_package* package) {
     engine->globals = package->objects;
+    engine->global_count = package->count;
     engine->stack_top = engine->stack;
-    engine->objects = NULL;
+    engine->frame_count = 0;
+#ifdef MTR_JIT_ENABLED
+    engine->jit_nesting = 0;
+#endif
+    mtr_init_heap(engine);
     struct mtr_function* f = package->main;
     if (NULL == f) {
         MTR_LOG_ERROR("Did not find main.");
         return -1;
     }
+    engine->storage = malloc(sizeof(mtr_value) * MTR_FRAME_STORAGE);
+    engine->storage_top = engine->storage;
 
-    call(engine, f->chunk, 0, NULL);
+#ifdef MTR_INSTRUCTION_STATS
+    mtr_init_opcode_stats(&engine->stats);
+#endif
 
-    struct mtr_object* o = engine->objects;
-    while (o) {
-        struct mtr_object* next = o->next;
-        mtr_delete_object(o);
-        o = next;
+#ifdef MTR_REGISTER_VM
+    bool ok = mtr_run_registers(engine, &f->chunk);
+#else
+    bool ok = push_frame(engine, &f->chunk, 0, NULL) && execute(engine);
+#endif
 
-    }
+#ifdef MTR_INSTRUCTION_STATS
+    mtr_print_opcode_stats(&engine->stats, 12);
+    mtr_delete_opcode_stats(&engine->stats);
+#endif
+
+    mtr_delete_heap(engine);
+    free(engine->storage);
 
     // mtr_dump_stack(engine->stack, engine->stack_top);
-    return 0;
+    return ok ? 0 : -1;
 }
@@ -6,13 +6,86 @@
 
 #include "core/types.h"
 
-#define MTR_MAX_STACK 1024
+#ifdef MTR_INSTRUCTION_STATS
+#   include "debug/opcodeStats.h"
+#endif
+
+#define MTR_MAX_FRAMES 16384
+#define MTR_MAX_STACK (MTR_MAX_FRAMES * 16)
+
+// Values of room for the objects frames keep to themselves (MTR_OP_FRAME_CONSTRUCTOR and the
+// like). The ones that don't fit go on the heap.
+#define MTR_FRAME_STORAGE (MTR_MAX_STACK / 4)
+
+struct mtr_call_frame {
+    u8* ip;
+    mtr_value* slots;
+    mtr_value* upvalues;
+    const struct mtr_chunk* chunk;
+    mtr_value* storage;     // where its objects in the frame storage start
+};
+
+struct mtr_object_stack {
+    struct mtr_object** objects;
+    size_t count;
+    size_t capacity;
+};
+
+// Where the full collection of the old space is (runtime/memory.h)
+enum mtr_gc_phase {
+    MTR_GC_IDLE,
+    MTR_GC_MARKING,
+    MTR_GC_SWEEPING
+};
+
+// Collector pauses counted by the power of two of their microseconds, the last one takes the rest
+#define MTR_GC_PAUSE_BUCKETS 20
 
 struct mtr_engine {
     mtr_value stack[MTR_MAX_STACK];
     mtr_value* stack_top;
+    struct mtr_call_frame frames[MTR_MAX_FRAMES];
+    u32 frame_count;
     struct mtr_object** globals;
+    size_t global_count;
     struct mtr_object* objects;
+    mtr_value* storage;
+    mtr_value* storage_top;
+    // the collector (runtime/memory.h)
+    u8* nursery;                            // young objects, made by bumping nursery_top
+    u8* nursery_top;
+    u8* nursery_end;
+    struct mtr_object_stack remembered;     // old objects a young object was written into
+    struct mtr_object_stack young_buffers;  // young arrays and maps, their elements are malloc'd
+    size_t heap_size;                       // bytes of the old objects
+    size_t next_collection;                 // heap_size that starts the next full collection
+    u32 marks;                              // numbers handed out to collections so far
+    u32 mark;                               // objects the last full collection reached have it in obj.mark
+    struct mtr_object_stack gray;           // marked objects whose values aren't yet
+    struct mtr_object_stack copied;         // objects a minor collection copied whose values aren't forwarded yet
+    enum mtr_gc_phase phase;
+    struct mtr_object** sweeping;           // the link the sweep goes on from
+    size_t allocated;                       // bytes since the last slice of a full collection
+#if defined(MTR_GC_PARALLEL) && !defined(MTR_GC_INCREMENTAL)
+    struct mtr_object_stack cuts;           // where the sweep cuts the old objects into pieces, in list order
+    struct mtr_object_stack fresh_cuts;     // the same for objects made old since, newest last
+    size_t linked;                          // objects made old so far
+#endif
+#ifdef MTR_GC_REPORT
+    u32 minor_collections;
+    u32 full_collections;
+    size_t peak_heap;
+    u32 pauses[MTR_GC_PAUSE_BUCKETS];
+    u64 longest_pause;                      // in nanoseconds
+    u64 mark_time;                          // nanoseconds full collections spent marking
+    u64 sweep_time;                         // and sweeping
+#endif
+#ifdef MTR_JIT_ENABLED
+    u32 jit_nesting;                        // calls from machine code that haven't returned
+#endif
+#ifdef MTR_INSTRUCTION_STATS
+    struct mtr_opcode_stats stats;
+#endif
 };
 
 i32 mtr_execute(struct mtr_engine* engine, struct mtr_package* package);
@@ -1,6 +1,999 @@
 #include "memory.h"
 
+#include "core/log.h"
+#include "core/macros.h"
+
+#ifdef MTR_REGISTER_VM
+#   include "registerBytecode.h"
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef MTR_GC_PARALLEL
+#   include <pthread.h>
+#   include <sched.h>
+#   include <stdatomic.h>
+#   include <unistd.h>
+#endif
+
+// Objects bigger than this are put straight in the old space
+#define LARGE_OBJECT (MTR_NURSERY_SIZE / 8)
+
+// The bit of obj.mark an old object in engine->remembered has, the other bits are the number of
+// the last collection that reached it
+#define REMEMBERED (1u << 31)
+
+#if defined(MTR_GC_REPORT) || MTR_GC_SLICE_TIME > 0
+// In nanoseconds
+static u64 now(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (u64) ts.tv_sec * 1000000000u + (u64) ts.tv_nsec;
+}
+#endif
+
+#ifdef MTR_GC_REPORT
+#   define PAUSE_START() const u64 pause_start = now()
+#   define PAUSE_END() count_pause(engine, now() - pause_start)
+
+static void count_pause(struct mtr_engine* engine, u64 pause) {
+    u32 bucket = 0;
+    while (bucket + 1 < MTR_GC_PAUSE_BUCKETS && (pause / 1000) >> bucket) {
+        ++bucket;
+    }
+    engine->pauses[bucket] += 1;
+    if (pause > engine->longest_pause) {
+        engine->longest_pause = pause;
+    }
+}
+
+static void report_pauses(const struct mtr_engine* engine) {
+    MTR_PRINT("gc: pauses");
+    for (u32 i = 0; i < MTR_GC_PAUSE_BUCKETS; ++i) {
+        if (engine->pauses[i] == 0) {
+            continue;
+        }
+        if (i + 1 < MTR_GC_PAUSE_BUCKETS) {
+            MTR_PRINT(" <%u us: %u,", 1u << i, engine->pauses[i]);
+        } else {
+            MTR_PRINT(" longer: %u,", engine->pauses[i]);
+        }
+    }
+    MTR_LOG(" longest %.1f us", (double) engine->longest_pause / 1000.0);
+    MTR_LOG("gc: full collections spent %.2f ms marking and %.2f ms sweeping",
+        (double) engine->mark_time / 1e6, (double) engine->sweep_time / 1e6);
+}
+
+#   define CLOCK_START() const u64 clock_start = now()
+#   define CLOCK_ADD(total) (engine->total += now() - clock_start)
+#else
+#   define PAUSE_START()
+#   define PAUSE_END()
+#   define CLOCK_START()
+#   define CLOCK_ADD(total)
+#endif
+
+#if defined(MTR_GC_PARALLEL) && !defined(MTR_GC_INCREMENTAL)
+#   define PARALLEL_SWEEP
+// Objects in a piece of the sweep
+#   define PIECE 4096
+#endif
+
+static void push_object(struct mtr_object_stack* stack, struct mtr_object* object) {
+    if (stack->count == stack->capacity) {
+        stack->capacity = stack->capacity == 0 ? 256 : stack->capacity * 2;
+        stack->objects = realloc(stack->objects, sizeof(struct mtr_object*) * stack->capacity);
+    }
+    stack->objects[stack->count++] = object;
+}
+
+static void delete_stack(struct mtr_object_stack* stack) {
+    free(stack->objects);
+    *stack = (struct mtr_object_stack) { 0 };
+}
+
+void mtr_init_heap(struct mtr_engine* engine) {
+    engine->objects = NULL;
+    engine->nursery = malloc(MTR_NURSERY_SIZE);
+    engine->nursery_end = engine->nursery + MTR_NURSERY_SIZE;
+    engine->nursery_top = engine->nursery;
+    engine->remembered = (struct mtr_object_stack) { 0 };
+    engine->young_buffers = (struct mtr_object_stack) { 0 };
+    engine->heap_size = 0;
+    engine->next_collection = MTR_GC_MIN_HEAP;
+    engine->marks = 0;
+    engine->mark = 0;
+    engine->gray = (struct mtr_object_stack) { 0 };
+    engine->copied = (struct mtr_object_stack) { 0 };
+    engine->phase = MTR_GC_IDLE;
+    engine->sweeping = NULL;
+    engine->allocated = 0;
+#ifdef MTR_GC_REPORT
+    engine->minor_collections = 0;
+    engine->full_collections = 0;
+    engine->peak_heap = 0;
+    memset(engine->pauses, 0, sizeof(engine->pauses));
+    engine->longest_pause = 0;
+    engine->mark_time = 0;
+    engine->sweep_time = 0;
+#endif
+#ifdef PARALLEL_SWEEP
+    engine->cuts = (struct mtr_object_stack) { 0 };
+    engine->fresh_cuts = (struct mtr_object_stack) { 0 };
+    engine->linked = 0;
+#endif
+}
+
+// Young objects that weren't copied still own the elements of arrays and maps
+static void free_young_buffers(struct mtr_engine* engine) {
+    for (size_t i = 0; i < engine->young_buffers.count; ++i) {
+        struct mtr_object* object = engine->young_buffers.objects[i];
+        if (object->next) {
+            continue;
+        }
+        if (object->type == MTR_OBJ_ARRAY) {
+            free(((struct mtr_array*) object)->elements);
+        } else {
+            free(((struct mtr_map*) object)->entries);
+        }
+    }
+    engine->young_buffers.count = 0;
+}
+
+void mtr_delete_heap(struct mtr_engine* engine) {
+#ifdef MTR_GC_REPORT
+    MTR_LOG("gc: %u minor and %u full collections, peak old space %zu bytes, final old space %zu bytes",
+        engine->minor_collections, engine->full_collections,
+        engine->peak_heap > engine->heap_size ? engine->peak_heap : engine->heap_size, engine->heap_size);
+    report_pauses(engine);
+#endif
+    free_young_buffers(engine);
+    free(engine->nursery);
+    engine->nursery = NULL;
+    engine->nursery_top = NULL;
+    engine->nursery_end = NULL;
+
+    struct mtr_object* o = engine->objects;
+    while (o) {
+        struct mtr_object* next = o->next;
+        mtr_delete_object(o);
+        o = next;
+    }
+    engine->objects = NULL;
+    engine->heap_size = 0;
+    delete_stack(&engine->remembered);
+    delete_stack(&engine->young_buffers);
+    delete_stack(&engine->gray);
+    delete_stack(&engine->copied);
+#ifdef PARALLEL_SWEEP
+    delete_stack(&engine->cuts);
+    delete_stack(&engine->fresh_cuts);
+#endif
+}
+
+static void collect(struct mtr_engine* engine, size_t incoming);
+static void note_old(struct mtr_engine* engine, struct mtr_object* object);
+#ifdef MTR_GC_INCREMENTAL
+static void slice(struct mtr_engine* engine);
+#endif
+
+void* mtr_allocate(struct mtr_engine* engine, size_t size) {
+    // everything in the nursery stays 8 byte aligned
+    size = (size + 7) & ~(size_t) 7;
+#ifdef MTR_GC_INCREMENTAL
+    if (engine->phase != MTR_GC_IDLE) {
+        engine->allocated += size;
+        if (engine->allocated >= MTR_GC_SLICE_ALLOCATION) {
+            slice(engine);
+        }
+    }
+#endif
+    if (size <= LARGE_OBJECT) {
+        if (engine->nursery_top + size > engine->nursery_end) {
+            collect(engine, 0);
+        }
+        void* memory = engine->nursery_top;
+        engine->nursery_top += size;
+        return memory;
+    }
+    if (engine->phase == MTR_GC_IDLE && engine->heap_size + size > engine->next_collection) {
+        collect(engine, size);
+    }
+    return malloc(size);
+}
+
 void mtr_link_obj(struct mtr_engine* engine, struct mtr_object* object) {
+    if (mtr_is_young(engine, object)) {
+        // next says where a minor collection copied it to
+        object->next = NULL;
+        if (object->type == MTR_OBJ_ARRAY || object->type == MTR_OBJ_MAP) {
+            push_object(&engine->young_buffers, object);
+        }
+        return;
+    }
+
+    engine->heap_size += mtr_object_size(object);
     object->next = engine->objects;
     engine->objects = object;
+    note_old(engine, object);
+    if (engine->phase != MTR_GC_IDLE) {
+        mtr_shade(engine, object);
+    }
+    // nothing tells the barrier about what it is filled with
+    mtr_remember(engine, object);
+}
+
+static bool in_frame_storage(const struct mtr_engine* engine, const struct mtr_object* object) {
+    const mtr_value* at = (const mtr_value*) (const void*) object;
+    return at >= engine->storage && at < engine->storage + MTR_FRAME_STORAGE;
+}
+
+void mtr_remember(struct mtr_engine* engine, struct mtr_object* object) {
+    // objects in the frame storage are found from the stack by every minor collection
+    if ((object->mark & REMEMBERED) || in_frame_storage(engine, object)) {
+        return;
+    }
+    object->mark |= REMEMBERED;
+    push_object(&engine->remembered, object);
+}
+
+// Visitors are only handed values that hold an object
+typedef void (*visitor)(struct mtr_engine* engine, mtr_value* value);
+
+// Untagged values go by the type the compiler wrote down for them, nil is a NULL object
+#ifdef MTR_UNTAGGED_VALUES
+#   define IS_OBJECT(value, type) ((type) == MTR_VAL_OBJ && NULL != MTR_AS_OBJ(value))
+#   define TYPES(object) ((object)->types)
+#   define KEY_TYPE(map) ((map)->key_type)
+#   define VALUE_TYPE(map) ((map)->value_type)
+#else
+#   define IS_OBJECT(value, type) ((void) (type), MTR_IS_OBJ(value))
+#   define TYPES(object) NULL
+#   define KEY_TYPE(map) MTR_VAL_OBJ
+#   define VALUE_TYPE(map) MTR_VAL_OBJ
+#endif
+
+static void visit_value(struct mtr_engine* engine, mtr_value* value, enum mtr_value_type type, visitor visit) {
+    if (IS_OBJECT(*value, type)) {
+        visit(engine, value);
+    }
+}
+
+// types holds an enum mtr_value_type for every value, NULL when they are all objects or nil
+static void visit_values(struct mtr_engine* engine, mtr_value* values, size_t count, const u8* types, visitor visit) {
+    for (size_t i = 0; i < count; ++i) {
+        visit_value(engine, values + i, types ? (enum mtr_value_type) types[i] : MTR_VAL_OBJ, visit);
+    }
 }
+
+static void visit_children(struct mtr_engine* engine, struct mtr_object* object, visitor visit) {
+    switch (object->type) {
+    case MTR_OBJ_STRUCT: {
+        struct mtr_struct* s = (struct mtr_struct*) object;
+        visit_values(engine, s->members, s->count, TYPES(s), visit);
+        break;
+    }
+    case MTR_OBJ_ARRAY: {
+        // packed layouts hold no objects
+        struct mtr_array* a = (struct mtr_array*) object;
+        if (a->layout == MTR_ARRAY_VALUES) {
+            visit_values(engine, a->elements, a->size, NULL, visit);
+        }
+        break;
+    }
+    case MTR_OBJ_MAP: {
+        // removed entries keep their key, lookups still compare it
+        struct mtr_map* m = (struct mtr_map*) object;
+        for (size_t i = 0; i < m->capacity; ++i) {
+            struct mtr_map_element* e = mtr_get_key_value_pair(m, i);
+            if (e) {
+                visit_value(engine, &e->key, KEY_TYPE(m), visit);
+                visit_value(engine, &e->value, VALUE_TYPE(m), visit);
+            }
+        }
+        break;
+    }
+    case MTR_OBJ_CLOSURE: {
+        struct mtr_closure* c = (struct mtr_closure*) object;
+        visit_values(engine, c->upvalues, c->count, TYPES(c), visit);
+        break;
+    }
+    case MTR_OBJ_BOX: {
+        struct mtr_box* b = (struct mtr_box*) object;
+        visit_value(engine, &b->value, b->type, visit);
+        break;
+    }
+    default:
+        // strings hold no values, functions and natives only hold constants, which are never collected
+        break;
+    }
+}
+
+#ifdef MTR_UNTAGGED_VALUES
+// Every frame is stopped at a call or, the last one, at the instruction that allocates. Its slots
+// end where the next frame's start, a tail call may have put other types in the arguments the
+// map of the call counts.
+static void visit_stack(struct mtr_engine* engine, visitor visit) {
+    for (u32 i = 0; i < engine->frame_count; ++i) {
+        const struct mtr_call_frame* frame = engine->frames + i;
+        const struct mtr_stack_map* map = mtr_find_stack_map(frame->chunk, (u32) (frame->ip - frame->chunk->bytecode));
+        MTR_ASSERT(map != NULL, "Collection where a frame has no stack map.");
+        const mtr_value* end = i + 1 < engine->frame_count ? engine->frames[i + 1].slots : engine->stack_top;
+        const u32 count = map->count < (u32) (end - frame->slots) ? map->count : (u32) (end - frame->slots);
+        for (u32 slot = 0; slot < count; ++slot) {
+            if (MTR_STACK_MAP_HAS_OBJECT(map, slot)) {
+                visit_value(engine, frame->slots + slot, MTR_VAL_OBJ, visit);
+            }
+        }
+    }
+}
+#endif
+
+static void visit_roots(struct mtr_engine* engine, visitor visit) {
+    mtr_value* top = engine->stack_top;
+    for (u32 i = 0; i < engine->frame_count; ++i) {
+        struct mtr_call_frame* frame = engine->frames + i;
+#ifdef MTR_REGISTER_VM
+        // returns lower the stack top below the registers of the frames still running, ENTER
+        // says how many a frame has
+        u16 count;
+        memcpy(&count, frame->chunk->bytecode + 1, sizeof(count));
+        if (frame->slots + count > top) {
+            top = frame->slots + count;
+        }
+#endif
+        // the callee took the closure off the stack, it only kept the upvalues
+        if (frame->upvalues) {
+            mtr_value closure = MTR_OBJ(mtr_closure_of(frame->upvalues));
+            visit(engine, &closure);
+            frame->upvalues = ((struct mtr_closure*) MTR_AS_OBJ(closure))->upvalues;
+        }
+    }
+#ifdef MTR_UNTAGGED_VALUES
+    (void) top;
+    visit_stack(engine, visit);
+#else
+    visit_values(engine, engine->stack, (size_t) (top - engine->stack), NULL, visit);
+#endif
+
+    for (size_t i = 0; i < engine->global_count; ++i) {
+        if (engine->globals[i]) {
+            mtr_value global = MTR_OBJ(engine->globals[i]);
+            visit(engine, &global);
+        }
+    }
+}
+
+static u32 next_mark(struct mtr_engine* engine) {
+    engine->marks += 1;
+    if (engine->marks == REMEMBERED) {
+        engine->marks = 1;
+    }
+    return engine->marks;
+}
+
+static bool marked(const struct mtr_engine* engine, const struct mtr_object* object) {
+    return (object->mark & ~REMEMBERED) == engine->mark;
+}
+
+// The sweep keeps what is marked, only the marking traces it
+void mtr_shade(struct mtr_engine* engine, struct mtr_object* object) {
+    if (!marked(engine, object)) {
+        object->mark = (object->mark & REMEMBERED) | engine->mark;
+        if (engine->phase == MTR_GC_MARKING) {
+            push_object(&engine->gray, object);
+        }
+    }
+}
+
+// Minor collections
+
+// The block mtr_allocate gave the object
+static size_t block_size(const struct mtr_object* object) {
+    switch (object->type) {
+    case MTR_OBJ_STRUCT:  return mtr_struct_size(((const struct mtr_struct*) object)->count);
+    case MTR_OBJ_STRING:  return mtr_string_size(((const struct mtr_string*) object)->length);
+    case MTR_OBJ_CLOSURE: return mtr_closure_size(((const struct mtr_closure*) object)->count);
+    case MTR_OBJ_ARRAY:   return sizeof(struct mtr_array);
+    case MTR_OBJ_MAP:     return sizeof(struct mtr_map);
+    case MTR_OBJ_BOX:     return sizeof(struct mtr_box);
+    default:
+        MTR_ASSERT(false, "Object is never young.");
+        return 0;
+    }
+}
+
+// Copy a young object to the old space, once. The copy takes over the elements of arrays and maps.
+// While a full collection runs it counts as reached by it.
+static struct mtr_object* promote(struct mtr_engine* engine, struct mtr_object* object) {
+    if (object->next) {
+        return object->next;
+    }
+
+    const size_t size = block_size(object);
+    struct mtr_object* copy = malloc(size);
+    memcpy(copy, object, size);
+    switch (copy->type) {
+    case MTR_OBJ_STRUCT: ((struct mtr_struct*) copy)->members = (mtr_value*) ((struct mtr_struct*) copy + 1); break;
+    case MTR_OBJ_STRING: ((struct mtr_string*) copy)->s = (char*) ((struct mtr_string*) copy + 1); break;
+    default: break;
+    }
+
+    copy->mark = 0;
+    copy->next = engine->objects;
+    engine->objects = copy;
+    engine->heap_size += mtr_object_size(copy);
+    note_old(engine, copy);
+    object->next = copy;
+    push_object(&engine->copied, copy);
+    if (engine->phase != MTR_GC_IDLE) {
+        mtr_shade(engine, copy);
+    }
+    return copy;
+}
+
+static void forward(struct mtr_engine* engine, mtr_value* value) {
+    struct mtr_object* object = MTR_AS_OBJ(*value);
+    if (mtr_is_young(engine, object)) {
+        *value = MTR_OBJ(promote(engine, object));
+    } else if (in_frame_storage(engine, object) && object->mark != engine->marks) {
+        // only ever reached from the stack, what they hold is looked at every time
+        object->mark = engine->marks;
+        push_object(&engine->copied, object);
+    }
+}
+
+static void minor_collection(struct mtr_engine* engine) {
+#ifdef MTR_GC_REPORT
+    engine->minor_collections += 1;
+#endif
+    // frame storage objects get its number, a full collection that runs doesn't need theirs
+    next_mark(engine);
+
+    visit_roots(engine, forward);
+    for (size_t i = 0; i < engine->remembered.count; ++i) {
+        struct mtr_object* object = engine->remembered.objects[i];
+        object->mark &= ~REMEMBERED;
+        visit_children(engine, object, forward);
+    }
+    engine->remembered.count = 0;
+
+    while (engine->copied.count > 0) {
+        visit_children(engine, engine->copied.objects[--engine->copied.count], forward);
+    }
+
+    free_young_buffers(engine);
+    engine->nursery_top = engine->nursery;
+}
+
+// Full collections
+
+static void mark(struct mtr_engine* engine, mtr_value* value) {
+    // young objects are left to minor collections, the last slice empties the nursery first
+    if (!mtr_is_young(engine, MTR_AS_OBJ(*value))) {
+        // objects in the frame storage and the globals are marked and traced like the rest but
+        // never swept, marks are collection numbers so theirs don't need clearing
+        mtr_shade(engine, MTR_AS_OBJ(*value));
+    }
+}
+
+static void begin_marking(struct mtr_engine* engine) {
+#ifdef MTR_GC_REPORT
+    engine->full_collections += 1;
+    if (engine->heap_size > engine->peak_heap) {
+        engine->peak_heap = engine->heap_size;
+    }
+#endif
+    CLOCK_START();
+    engine->mark = next_mark(engine);
+    engine->phase = MTR_GC_MARKING;
+    visit_roots(engine, mark);
+    CLOCK_ADD(mark_time);
+}
+
+// Slices stop once they looked at work bytes of objects or at the deadline, 0 for none
+static bool slice_over(size_t done, size_t work, u32 objects, u64 deadline) {
+    if (done >= work) {
+        return true;
+    }
+#if MTR_GC_SLICE_TIME > 0
+    // the clock isn't free, it is read every few objects
+    if (deadline != 0 && objects % 64 == 0 && now() >= deadline) {
+        return true;
+    }
+#else
+    (void) objects;
+    (void) deadline;
+#endif
+    return false;
+}
+
+// Traces gray objects, true once there are none left
+static bool mark_some(struct mtr_engine* engine, size_t work, u64 deadline) {
+    size_t done = 0;
+    for (u32 objects = 1; engine->gray.count > 0; ++objects) {
+        if (slice_over(done, work, objects, deadline)) {
+            return false;
+        }
+        struct mtr_object* object = engine->gray.objects[--engine->gray.count];
+        done += mtr_object_size(object);
+        visit_children(engine, object, mark);
+    }
+    return true;
+}
+
+static void end_sweep(struct mtr_engine* engine) {
+    engine->phase = MTR_GC_IDLE;
+    engine->sweeping = NULL;
+    const size_t live = engine->heap_size;
+    engine->next_collection = live * MTR_GC_GROWTH > MTR_GC_MIN_HEAP ? live * MTR_GC_GROWTH : MTR_GC_MIN_HEAP;
+}
+
+static void begin_sweeping(struct mtr_engine* engine) {
+    engine->phase = MTR_GC_SWEEPING;
+    engine->sweeping = &engine->objects;
+    // counted again by the sweep as it keeps them
+    engine->heap_size = 0;
+}
+
+#ifndef PARALLEL_SWEEP
+// Frees the objects the marking didn't reach, true once the sweep got to the end of the list.
+// Objects linked while it runs go in front of where it is, and they are marked in case it is
+// still at the head.
+static bool sweep_some(struct mtr_engine* engine, size_t work, u64 deadline) {
+    size_t done = 0;
+    for (u32 objects = 1; *engine->sweeping; ++objects) {
+        if (slice_over(done, work, objects, deadline)) {
+            return false;
+        }
+        struct mtr_object* o = *engine->sweeping;
+        const size_t size = mtr_object_size(o);
+        done += size;
+        if (marked(engine, o)) {
+            engine->heap_size += size;
+            engine->sweeping = &o->next;
+        } else {
+            *engine->sweeping = o->next;
+            mtr_delete_object(o);
+        }
+    }
+
+    end_sweep(engine);
+    return true;
+}
+#endif
+
+#ifdef MTR_GC_PARALLEL
+
+u32 mtr_gc_threads = MTR_GC_THREADS;
+
+static u32 thread_count(void) {
+    long count = mtr_gc_threads;
+    if (count == 0) {
+        count = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    return count < 1 ? 1 : count > MTR_GC_MAX_THREADS ? MTR_GC_MAX_THREADS : (u32) count;
+}
+
+// Runs work(arg + i * size) for i in [0, count), the first on this thread
+static void run_threads(u32 count, void* (*work)(void*), void* arg, size_t size) {
+    pthread_t threads[MTR_GC_MAX_THREADS];
+    u32 started = 1;
+    for (; started < count; ++started) {
+        if (pthread_create(threads + started, NULL, work, (u8*) arg + started * size) != 0) {
+            break;
+        }
+    }
+    work(arg);
+    for (u32 i = 1; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    // the ones that couldn't start are done here
+    for (u32 i = started; i < count; ++i) {
+        work((u8*) arg + i * size);
+    }
+}
+
+// A work stealing deque (Chase and Lev, with the C11 orderings of Lê et al.). Its thread pushes
+// and takes at the bottom, the others steal from the top.
+
+struct deque_array {
+    i64 size;
+    _Atomic(struct mtr_object*) objects[];
+};
+
+struct deque {
+    _Atomic(i64) top;
+    _Atomic(i64) bottom;
+    _Atomic(struct deque_array*) array;
+    // thieves may still be reading the arrays it outgrew, they go when the marking is over
+    struct deque_array* retired[48];
+    u32 retired_count;
+};
+
+static struct deque_array* new_deque_array(i64 size) {
+    struct deque_array* array = malloc(sizeof(struct deque_array) + sizeof(array->objects[0]) * (size_t) size);
+    array->size = size;
+    return array;
+}
+
+static void init_deque(struct deque* deque) {
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, new_deque_array(1024));
+    deque->retired_count = 0;
+}
+
+static void delete_deque(struct deque* deque) {
+    free(atomic_load_explicit(&deque->array, memory_order_relaxed));
+    for (u32 i = 0; i < deque->retired_count; ++i) {
+        free(deque->retired[i]);
+    }
+}
+
+static void push(struct deque* deque, struct mtr_object* object) {
+    const i64 b = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const i64 t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    struct deque_array* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    if (b - t > array->size - 1) {
+        struct deque_array* bigger = new_deque_array(array->size * 2);
+        for (i64 i = t; i < b; ++i) {
+            struct mtr_object* o = atomic_load_explicit(&array->objects[i % array->size], memory_order_relaxed);
+            atomic_store_explicit(&bigger->objects[i % bigger->size], o, memory_order_relaxed);
+        }
+        deque->retired[deque->retired_count++] = array;
+        atomic_store_explicit(&deque->array, bigger, memory_order_release);
+        array = bigger;
+    }
+    atomic_store_explicit(&array->objects[b % array->size], object, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+}
+
+static struct mtr_object* take(struct deque* deque) {
+    const i64 b = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    struct deque_array* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    i64 t = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+
+    struct mtr_object* object = atomic_load_explicit(&array->objects[b % array->size], memory_order_relaxed);
+    if (t == b) {
+        // the last one, a thief may be taking it too
+        if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+            object = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, b + 1, memory_order_relaxed);
+    }
+    return object;
+}
+
+static struct mtr_object* steal(struct deque* deque) {
+    i64 t = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const i64 b = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (t >= b) {
+        return NULL;
+    }
+
+    struct deque_array* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    struct mtr_object* object = atomic_load_explicit(&array->objects[t % array->size], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) {
+        return NULL;
+    }
+    return object;
+}
+
+static bool has_work(struct deque* deque) {
+    return atomic_load_explicit(&deque->bottom, memory_order_acquire) > atomic_load_explicit(&deque->top, memory_order_acquire);
+}
+
+struct marker {
+    struct mtr_engine* engine;
+    struct marker* markers;
+    u32 count;
+    u32 index;
+    _Atomic(u32)* idle;         // markers that found nothing to do
+    struct deque deque;
+};
+
+// The marker of this thread, visitors don't take one
+static _Thread_local struct marker* marker;
+
+static bool try_mark(const struct mtr_engine* engine, struct mtr_object* object) {
+    u32 old = atomic_load_explicit(&object->mark, memory_order_relaxed);
+    do {
+        if ((old & ~REMEMBERED) == engine->mark) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&object->mark, &old, (old & REMEMBERED) | engine->mark, memory_order_relaxed, memory_order_relaxed));
+    return true;
+}
+
+static void mark_shared(struct mtr_engine* engine, mtr_value* value) {
+    if (!mtr_is_young(engine, MTR_AS_OBJ(*value)) && try_mark(engine, MTR_AS_OBJ(*value))) {
+        push(&marker->deque, MTR_AS_OBJ(*value));
+    }
+}
+
+static struct mtr_object* steal_from_others(struct marker* m) {
+    for (u32 i = 1; i < m->count; ++i) {
+        struct mtr_object* object = steal(&m->markers[(m->index + i) % m->count].deque);
+        if (object) {
+            return object;
+        }
+    }
+    return NULL;
+}
+
+// False once every marker ran out of work. Only a marker pushes onto its own deque, so when all
+// of them are waiting every deque is empty for good.
+static bool wait_for_work(struct marker* m) {
+    atomic_fetch_add(m->idle, 1);
+    for (;;) {
+        if (atomic_load(m->idle) == m->count) {
+            return false;
+        }
+        for (u32 i = 0; i < m->count; ++i) {
+            if (has_work(&m->markers[i].deque)) {
+                atomic_fetch_sub(m->idle, 1);
+                return true;
+            }
+        }
+        sched_yield();
+    }
+}
+
+static void* run_marker(void* arg) {
+    marker = arg;
+    for (;;) {
+        struct mtr_object* object = take(&marker->deque);
+        if (!object) {
+            object = steal_from_others(marker);
+        }
+        if (object) {
+            visit_children(marker->engine, object, mark_shared);
+        } else if (!wait_for_work(marker)) {
+            return NULL;
+        }
+    }
+}
+
+static void mark_in_parallel(struct mtr_engine* engine, u32 count) {
+    struct marker markers[MTR_GC_MAX_THREADS];
+    _Atomic(u32) idle;
+    atomic_init(&idle, 0);
+    for (u32 i = 0; i < count; ++i) {
+        markers[i] = (struct marker) { .engine = engine, .markers = markers, .count = count, .index = i, .idle = &idle };
+        init_deque(&markers[i].deque);
+    }
+    // the gray objects are dealt out before any thread starts
+    for (size_t i = 0; i < engine->gray.count; ++i) {
+        push(&markers[i % count].deque, engine->gray.objects[i]);
+    }
+    engine->gray.count = 0;
+
+    run_threads(count, run_marker, markers, sizeof(struct marker));
+
+    for (u32 i = 0; i < count; ++i) {
+        delete_deque(&markers[i].deque);
+    }
+}
+
+#endif
+
+#ifdef PARALLEL_SWEEP
+
+// A run of the list of old objects from first up to end, and what the sweep kept of it
+struct piece {
+    struct mtr_object* first;
+    struct mtr_object* end;
+    struct mtr_object* head;
+    struct mtr_object* tail;
+    size_t live;
+    size_t count;
+};
+
+struct sweeper {
+    struct mtr_engine* engine;
+    struct piece* pieces;
+    size_t piece_count;
+    _Atomic(size_t)* next;
+};
+
+static void* run_sweeper(void* arg) {
+    struct sweeper* sweeper = arg;
+    for (;;) {
+        const size_t i = atomic_fetch_add(sweeper->next, 1);
+        if (i >= sweeper->piece_count) {
+            return NULL;
+        }
+
+        struct piece* piece = sweeper->pieces + i;
+        struct mtr_object* o = piece->first;
+        while (o != piece->end) {
+            struct mtr_object* next = o->next;
+            if (marked(sweeper->engine, o)) {
+                if (piece->tail) {
+                    piece->tail->next = o;
+                } else {
+                    piece->head = o;
+                }
+                piece->tail = o;
+                piece->live += mtr_object_size(o);
+                piece->count += 1;
+            } else {
+                mtr_delete_object(o);
+            }
+            o = next;
+        }
+    }
+}
+
+static void note_old(struct mtr_engine* engine, struct mtr_object* object) {
+    engine->linked += 1;
+    if (engine->linked % PIECE == 0) {
+        push_object(&engine->fresh_cuts, object);
+    }
+}
+
+// The list is the objects made old since the last sweep, newest first, then the ones it kept
+static void sweep_in_parallel(struct mtr_engine* engine, u32 count) {
+    const size_t piece_count = 1 + engine->fresh_cuts.count + engine->cuts.count;
+    struct piece* pieces = calloc(piece_count, sizeof(struct piece));
+    size_t p = 0;
+    pieces[p++].first = engine->objects;
+    for (size_t i = engine->fresh_cuts.count; i > 0; --i) {
+        pieces[p++].first = engine->fresh_cuts.objects[i - 1];
+    }
+    for (size_t i = 0; i < engine->cuts.count; ++i) {
+        pieces[p++].first = engine->cuts.objects[i];
+    }
+    for (size_t i = 0; i + 1 < piece_count; ++i) {
+        pieces[i].end = pieces[i + 1].first;
+    }
+
+    struct sweeper sweepers[MTR_GC_MAX_THREADS];
+    _Atomic(size_t) next;
+    atomic_init(&next, 0);
+    for (u32 i = 0; i < count; ++i) {
+        sweepers[i] = (struct sweeper) { .engine = engine, .pieces = pieces, .piece_count = piece_count, .next = &next };
+    }
+    run_threads(count, run_sweeper, sweepers, sizeof(struct sweeper));
+
+    // the pieces are put back together, the next sweep cuts them where they hold PIECE objects
+    engine->cuts.count = 0;
+    engine->fresh_cuts.count = 0;
+    struct mtr_object** link = &engine->objects;
+    size_t since_cut = 0;
+    for (size_t i = 0; i < piece_count; ++i) {
+        if (!pieces[i].head) {
+            continue;
+        }
+        if (since_cut == 0) {
+            push_object(&engine->cuts, pieces[i].head);
+        }
+        since_cut = since_cut + pieces[i].count >= PIECE ? 0 : since_cut + pieces[i].count;
+        *link = pieces[i].head;
+        link = &pieces[i].tail->next;
+        engine->heap_size += pieces[i].live;
+    }
+    *link = NULL;
+    free(pieces);
+
+    end_sweep(engine);
+}
+
+#else
+
+static void note_old(struct mtr_engine* engine, struct mtr_object* object) {
+    (void) engine;
+    (void) object;
+}
+
+#endif
+
+// Marks what the gray objects lead to with the program stopped
+static void mark_all(struct mtr_engine* engine) {
+    CLOCK_START();
+#ifdef MTR_GC_PARALLEL
+    const u32 count = thread_count();
+    if (count > 1) {
+        mark_in_parallel(engine, count);
+    } else {
+        mark_some(engine, SIZE_MAX, 0);
+    }
+#else
+    mark_some(engine, SIZE_MAX, 0);
+#endif
+    CLOCK_ADD(mark_time);
+}
+
+// The rest of the sweep, with the program stopped
+static void sweep_all(struct mtr_engine* engine) {
+    CLOCK_START();
+#ifdef PARALLEL_SWEEP
+    sweep_in_parallel(engine, thread_count());
+#else
+    sweep_some(engine, SIZE_MAX, 0);
+#endif
+    CLOCK_ADD(sweep_time);
+}
+
+// Neither the stack nor the nursery are behind the barrier, what they point to is marked again
+// with nothing running in between
+static void finish_marking(struct mtr_engine* engine) {
+    minor_collection(engine);
+    visit_roots(engine, mark);
+    mark_all(engine);
+    begin_sweeping(engine);
+}
+
+static void finish_collection(struct mtr_engine* engine) {
+    if (engine->phase == MTR_GC_MARKING) {
+        finish_marking(engine);
+    }
+    if (engine->phase == MTR_GC_SWEEPING) {
+        sweep_all(engine);
+    }
+}
+
+#ifdef MTR_GC_INCREMENTAL
+static void slice(struct mtr_engine* engine) {
+    PAUSE_START();
+    engine->allocated = 0;
+#   if MTR_GC_SLICE_TIME > 0
+    const u64 deadline = now() + (u64) MTR_GC_SLICE_TIME * 1000u;
+#   else
+    const u64 deadline = 0;
+#   endif
+    if (engine->phase == MTR_GC_MARKING) {
+        CLOCK_START();
+        const bool marked_all = mark_some(engine, MTR_GC_SLICE_WORK, deadline);
+        CLOCK_ADD(mark_time);
+        if (marked_all) {
+            finish_marking(engine);
+        }
+    } else {
+        CLOCK_START();
+        sweep_some(engine, MTR_GC_SLICE_WORK, deadline);
+        CLOCK_ADD(sweep_time);
+    }
+    PAUSE_END();
+}
+#endif
+
+// A minor collection, then a full one if the old space would be past next_collection with incoming
+// more bytes. Without MTR_GC_INCREMENTAL the full one is done before this returns, with it it is
+// only started.
+static void collect(struct mtr_engine* engine, size_t incoming) {
+    PAUSE_START();
+    minor_collection(engine);
+    if (engine->phase == MTR_GC_IDLE && engine->heap_size + incoming > engine->next_collection) {
+        begin_marking(engine);
+#ifndef MTR_GC_INCREMENTAL
+        // nothing ran since the minor collection, the roots are all there is to mark from
+        mark_all(engine);
+        begin_sweeping(engine);
+        sweep_all(engine);
+#endif
+    }
+    PAUSE_END();
+}
+
+void mtr_collect_garbage(struct mtr_engine* engine) {
+    PAUSE_START();
+    finish_collection(engine);
+    minor_collection(engine);
+    begin_marking(engine);
+    finish_collection(engine);
+    PAUSE_END();
+}
+
@@ -6,8 +6,127 @@
 #include "object.h"
 #include "core/types.h"
 
+// The engines make objects with mtr_allocate and mtr_link_obj. New objects go in the nursery,
+// a block of MTR_NURSERY_SIZE bytes handed out by bumping a pointer. Once it is full a minor
+// collection copies the young objects still reachable out of it into malloc'd blocks, the old
+// space, and the nursery starts over. Old objects are linked into engine->objects and only
+// looked at by full collections, a mark and sweep of the old space that runs when it has grown
+// to MTR_GC_GROWTH times what stayed after the last one.
+//
+// A minor collection reaches young objects from the stack, the closures of the running frames
+// and the old objects a young object was written into since the last one. The engines tell the
+// collector about those with mtr_write_barrier wherever they store a value into an object.
+//
+// With MTR_GC_INCREMENTAL (gc=incremental) the full collection doesn't stop the program until it
+// is done. Starting it marks what the roots point to, then every MTR_GC_SLICE_ALLOCATION bytes
+// allocated a slice marks the old objects the marked ones point to, MTR_GC_SLICE_WORK bytes of
+// them or for MTR_GC_SLICE_TIME microseconds at most. While it marks, mtr_write_barrier marks the
+// old objects stored into other objects too (Dijkstra's barrier), so the program can't hide an
+// object behind one the collector is done with. The stack and the nursery aren't behind the
+// barrier: the last slice empties the nursery with a minor collection and marks from the roots
+// once more. The sweep is split into slices the same way. Objects that get to the old space
+// while a full collection runs are marked, they live until the next one.
+//
+// With MTR_GC_PARALLEL (gc=parallel) the marking that runs to the end with the program stopped,
+// all of it or the last slice, is shared by mtr_gc_threads threads. Each one traces from a stack
+// of its own and steals from the others' when it runs out, marks are set with a compare and swap
+// so every object is traced once. Without MTR_GC_INCREMENTAL the sweep is shared too: the list of
+// old objects is cut into pieces of about 4096 objects at objects noted when they got old or by
+// the last sweep, and the threads take the pieces one at a time. It needs POSIX threads.
+//
+// Untagged values (MTR_UNTAGGED_VALUES) don't say which words are objects. Collections only
+// run at the instructions that allocate, where every frame is stopped at a call or at that
+// instruction, and the stack map there (bytecode.h) says which slots hold objects. Structs and
+// closures point at the member and upvalue types their instruction was written with, arrays and
+// maps keep their layout and element types. Their write barrier can't tell an object from an Int
+// either, it remembers the object when the stored word points into the nursery. An Int that
+// looks like such a pointer only costs a look at the object. Incremental collections need
+// to know which stored words are old objects, they only work with tagged values. The
+// ahead-of-time runtime (aot/runtime.h) doesn't collect.
+
+#if defined(MTR_UNTAGGED_VALUES) && defined(MTR_GC_INCREMENTAL)
+#   error "Incremental collections only work with tagged values"
+#endif
+
+#ifndef MTR_NURSERY_SIZE
+#   define MTR_NURSERY_SIZE (1u << 20)
+#endif
+
+// Full collections don't run before the old space has this many bytes
+#ifndef MTR_GC_MIN_HEAP
+#   define MTR_GC_MIN_HEAP (1u << 20)
+#endif
+
+#ifndef MTR_GC_GROWTH
+#   define MTR_GC_GROWTH 2
+#endif
+
+#ifndef MTR_GC_SLICE_ALLOCATION
+#   define MTR_GC_SLICE_ALLOCATION (64u << 10)
+#endif
+
+#ifndef MTR_GC_SLICE_WORK
+#   define MTR_GC_SLICE_WORK (256u << 10)
+#endif
+
+// 0 leaves slices to the work budget alone
+#ifndef MTR_GC_SLICE_TIME
+#   define MTR_GC_SLICE_TIME 0
+#endif
+
+// 0 starts one thread for every processor
+#ifndef MTR_GC_THREADS
+#   define MTR_GC_THREADS 0
+#endif
+
+#define MTR_GC_MAX_THREADS 64
+
+#ifdef MTR_GC_PARALLEL
+// How many threads mark and sweep, 1 does it on the program's thread alone
+extern u32 mtr_gc_threads;
+#endif
+
+void mtr_init_heap(struct mtr_engine* engine);
+// Deletes every object still around, gc=report prints how the heap did first
+void mtr_delete_heap(struct mtr_engine* engine);
+
+// Memory for an object of size bytes, which may run a collection first. Big objects are put
+// straight in the old space.
+void* mtr_allocate(struct mtr_engine* engine, size_t size);
+// Called once the object in that memory is built and before anything else is allocated
 void mtr_link_obj(struct mtr_engine* engine, struct mtr_object* object);
 
+// A minor and a whole full collection, a full collection that is running is finished first. The
+// values below engine->stack_top and the ones passed to the running frames are roots, the caller
+// makes sure nothing it still needs lives elsewhere. With untagged values every frame has to be
+// stopped where it has a stack map.
 void mtr_collect_garbage(struct mtr_engine* engine);
 
+static inline bool mtr_is_young(const struct mtr_engine* engine, const struct mtr_object* object) {
+    return (const u8*) object >= engine->nursery && (const u8*) object < engine->nursery_end;
+}
+
+void mtr_remember(struct mtr_engine* engine, struct mtr_object* object);
+// Marks an old object the running full collection hasn't reached yet
+void mtr_shade(struct mtr_engine* engine, struct mtr_object* object);
+
+// After value was stored into object
+static inline void mtr_write_barrier(struct mtr_engine* engine, struct mtr_object* object, mtr_value value) {
+#ifndef MTR_UNTAGGED_VALUES
+    if (!MTR_IS_OBJ(value)) {
+        return;
+    }
+#endif
+    if (mtr_is_young(engine, MTR_AS_OBJ(value))) {
+        if (!mtr_is_young(engine, object)) {
+            mtr_remember(engine, object);
+        }
+    }
+#ifdef MTR_GC_INCREMENTAL
+    else if (engine->phase == MTR_GC_MARKING) {
+        mtr_shade(engine, MTR_AS_OBJ(value));
+    }
+#endif
+}
+
 #endif
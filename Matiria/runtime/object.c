@@ -9,16 +9,9 @@
 
 void mtr_delete_object(struct mtr_object* object) {
     switch (object->type) {
-    case MTR_OBJ_STRUCT: {
-        struct mtr_struct* s = (struct mtr_struct*) object;
-        free(s->members);
-        free(s);
-        break;
-    }
+    case MTR_OBJ_STRUCT:
     case MTR_OBJ_STRING: {
-        struct mtr_string* s = (struct mtr_string*) object;
-        free(s->s);
-        free(s);
+        free(object);
         break;
     }
     case MTR_OBJ_ARRAY: {
@@ -45,10 +38,12 @@ void mtr_delete_object(struct mtr_object* object) {
         break;
     }
     case MTR_OBJ_CLOSURE: {
-        struct mtr_closure* c = (struct mtr_closure*) object;
-        mtr_delete_chunk(&c->chunk);
-        free(c->upvalues);
-        free(c);
+        free(object);
+        break;
+    }
+    case MTR_OBJ_BOX: {
+        free(object);
+        break;
     }
     default:
         break;
@@ -57,20 +52,43 @@ void mtr_delete_object(struct mtr_object* object) {
 
 // Struct
 
-struct mtr_struct* mtr_new_struct(u8 count) {
-    struct mtr_struct* s = malloc(sizeof(*s));
+struct mtr_struct* mtr_init_struct(void* memory, u8 count) {
+    struct mtr_struct* s = memory;
     s->obj.type = MTR_OBJ_STRUCT;
-    s->members = malloc(sizeof(mtr_value) * count);
+    s->obj.mark = 0;
+    s->members = (mtr_value*) (s + 1);
+#ifdef MTR_UNTAGGED_VALUES
+    s->types = NULL;
+#endif
+    s->count = count;
     return s;
 }
 
+struct mtr_struct* mtr_new_struct(u8 count) {
+    return mtr_init_struct(malloc(mtr_struct_size(count)), count);
+}
+
 // Struct end
 
 // Function
 
+// Natives don't get the engine and engines run one at a time
+static bool native_failed = false;
+
+void mtr_native_error(void) {
+    native_failed = true;
+}
+
+bool mtr_native_failed(void) {
+    const bool failed = native_failed;
+    native_failed = false;
+    return failed;
+}
+
 struct mtr_native_fn* mtr_new_native_function(mtr_native native) {
     struct mtr_native_fn* fn = malloc(sizeof(*fn));
     fn->obj.type = MTR_OBJ_NATIVE_FN;
+    fn->obj.mark = 0;
     fn->function = native;
     return fn;
 }
@@ -78,71 +96,106 @@ struct mtr_native_fn* mtr_new_native_function(mtr_native native) {
 struct mtr_function* mtr_new_function(struct mtr_chunk chunk) {
     struct mtr_function* fn = malloc(sizeof(*fn));
     fn->obj.type = MTR_OBJ_FUNCTION;
+    fn->obj.mark = 0;
     fn->chunk = chunk;
     return fn;
 }
 
 // Function End
 
-struct mtr_closure* mtr_new_closure(struct mtr_chunk chunk, mtr_value* upvalues, u8 count) {
-    struct mtr_closure* cl = malloc(sizeof(*cl));
+struct mtr_closure* mtr_init_closure(void* memory, const struct mtr_function* function, u8 count) {
+    struct mtr_closure* cl = memory;
     cl->obj.type = MTR_OBJ_CLOSURE;
-    cl->chunk = chunk;
+    cl->obj.mark = 0;
+    cl->function = function;
+#ifdef MTR_UNTAGGED_VALUES
+    cl->types = NULL;
+#endif
     cl->count = count;
-    if (upvalues != NULL && count > 0) {
-        cl->upvalues = malloc(sizeof(mtr_value) * count);
-        memcpy(cl->upvalues, upvalues, sizeof(mtr_value) * count);
-    }
     return cl;
 }
 
+struct mtr_closure* mtr_new_closure(const struct mtr_function* function, u8 count) {
+    return mtr_init_closure(malloc(mtr_closure_size(count)), function, count);
+}
+
 // Array
 
-struct mtr_array* mtr_new_array(size_t length) {
-    struct mtr_array* a = malloc(sizeof(*a));
+struct mtr_array* mtr_init_array(void* memory, size_t length, enum mtr_array_layout layout) {
+    struct mtr_array* a = memory;
 
     a->obj.type = MTR_OBJ_ARRAY;
-    a->elements = malloc(sizeof(mtr_value) * length);
+    a->obj.mark = 0;
+    a->elements = malloc(mtr_array_element_size(layout) * length);
     a->capacity = length;
     a->size = 0;
+    a->layout = layout;
 
     return a;
 }
 
+struct mtr_array* mtr_new_array(size_t length, enum mtr_array_layout layout) {
+    return mtr_init_array(malloc(sizeof(struct mtr_array)), length, layout);
+}
+
 void mtr_delete_array(struct mtr_array* array) {
     free(array->elements);
     array->elements = NULL;
     free(array);
 }
 
+size_t mtr_array_element_size(enum mtr_array_layout layout) {
+    switch (layout) {
+    case MTR_ARRAY_INTS:   return sizeof(i64);
+    case MTR_ARRAY_FLOATS: return sizeof(f64);
+    case MTR_ARRAY_BOOLS:  return sizeof(u8);
+    default:               return sizeof(mtr_value);
+    }
+}
+
 void mtr_array_append(struct mtr_array* array, mtr_value value) {
     if (array->size == array->capacity) {
         size_t new_cap = array->capacity * 2;
-        array->elements = realloc(array->elements, new_cap * sizeof(mtr_value));
+        array->elements = realloc(array->elements, new_cap * mtr_array_element_size(array->layout));
         array->capacity = new_cap;
     }
 
-    array->elements[array->size++] = value;
+    mtr_array_store(array, array->size++, value);
+}
+
+void mtr_array_unpack(struct mtr_array* array) {
+    mtr_value* elements = malloc(sizeof(mtr_value) * array->capacity);
+    for (size_t i = 0; i < array->size; ++i) {
+        elements[i] = mtr_array_get(array, i);
+    }
+    free(array->ints);
+    array->elements = elements;
+    array->layout = MTR_ARRAY_VALUES;
 }
 
 mtr_value mtr_array_pop(struct mtr_array* array) {
-    return array->elements[--array->size];
+    return mtr_array_get(array, --array->size);
 }
 
 // Array end
 
 // String
 
-struct mtr_string* mtr_new_string(const char* string, size_t length) {
-    struct mtr_string* s = malloc(sizeof(*s));
+struct mtr_string* mtr_init_string(void* memory, const char* string, size_t length) {
+    struct mtr_string* s = memory;
     s->obj.type = MTR_OBJ_STRING;
+    s->obj.mark = 0;
 
-    s->s = malloc(sizeof(char) * length);
+    s->s = (char*) (s + 1);
     memcpy(s->s, string, sizeof(char) * length);
     s->length = length;
     return s;
 }
 
+struct mtr_string* mtr_new_string(const char* string, size_t length) {
+    return mtr_init_string(malloc(mtr_string_size(length)), string, length);
+}
+
 // String end
 
 // Map
@@ -161,18 +214,26 @@ struct mtr_map_element* mtr_get_key_value_pair(struct mtr_map* map, size_t index
     return entry->is_used ? (struct mtr_map_element*) entry : NULL;
 }
 
-struct mtr_map* mtr_new_map(void) {
-
-    struct mtr_map* map = malloc(sizeof(*map));
+struct mtr_map* mtr_init_map(void* memory) {
+    struct mtr_map* map = memory;
 
     map->obj.type = MTR_OBJ_MAP;
+    map->obj.mark = 0;
     map->entries = calloc(8, sizeof(struct map_entry));
     map->capacity = 8;
     map->size = 0;
+#ifdef MTR_UNTAGGED_VALUES
+    map->key_type = MTR_VAL_INT;
+    map->value_type = MTR_VAL_INT;
+#endif
 
     return map;
 }
 
+struct mtr_map* mtr_new_map(void) {
+    return mtr_init_map(malloc(sizeof(struct mtr_map)));
+}
+
 void mtr_delete_map(struct mtr_map* map) {
     free(map->entries);
     map->entries = NULL;
@@ -181,9 +242,17 @@ void mtr_delete_map(struct mtr_map* map) {
     free(map);
 }
 
-static u32 hash_val(mtr_value key) {
-    if (key.type == MTR_VAL_OBJ) {
-        struct mtr_object* obj = key.object;
+#ifdef MTR_UNTAGGED_VALUES
+#   define KEY_IS_OBJ(map, key) ((map)->key_type == MTR_VAL_OBJ)
+#   define KEY_IS_INT(map, key) ((map)->key_type == MTR_VAL_INT)
+#else
+#   define KEY_IS_OBJ(map, key) MTR_IS_OBJ(key)
+#   define KEY_IS_INT(map, key) MTR_IS_INT(key)
+#endif
+
+static u32 hash_val(const struct mtr_map* map, mtr_value key) {
+    if (KEY_IS_OBJ(map, key)) {
+        struct mtr_object* obj = MTR_AS_OBJ(key);
         if (obj->type != MTR_OBJ_STRING) {
             MTR_LOG_ERROR("Object is not hashable.");
             exit(-1);
@@ -191,13 +260,16 @@ static u32 hash_val(mtr_value key) {
         struct mtr_string* s = (struct mtr_string*) obj;
         return hash(s->s, s->length);
     }
-    return hashi64(key.integer);
+    if (KEY_IS_INT(map, key)) {
+        return hashi64(MTR_AS_INT(key));
+    }
+    return hashi64((i64) MTR_BITS(key));
 }
 
-static bool compare_keys(mtr_value entry_key, mtr_value key) {
-    if (entry_key.type == MTR_VAL_OBJ && key.type == MTR_VAL_OBJ) {
-        struct mtr_object* entry_obj = entry_key.object;
-        struct mtr_object* obj = key.object;
+static bool compare_keys(const struct mtr_map* map, mtr_value entry_key, mtr_value key) {
+    if (KEY_IS_OBJ(map, entry_key) && KEY_IS_OBJ(map, key)) {
+        struct mtr_object* entry_obj = MTR_AS_OBJ(entry_key);
+        struct mtr_object* obj = MTR_AS_OBJ(key);
         if (entry_obj->type != MTR_OBJ_STRING || obj->type != MTR_OBJ_STRING) {
             MTR_LOG_ERROR("Object is not hashable.");
             exit(-1);
@@ -206,16 +278,19 @@ static bool compare_keys(mtr_value entry_key, mtr_value key) {
         struct mtr_string* s = (struct mtr_string*) obj;
         return entry_s->length == s->length && memcmp(entry_s->s, s->s, s->length) == 0;;
     }
-    return entry_key.integer == key.integer;
+    if (KEY_IS_INT(map, entry_key) && KEY_IS_INT(map, key)) {
+        return MTR_AS_INT(entry_key) == MTR_AS_INT(key);
+    }
+    return MTR_BITS(entry_key) == MTR_BITS(key);
 }
 
-static struct map_entry* find_entry(struct map_entry* entries, mtr_value key, size_t cap, bool return_tombstone) {
-    u32 hash_ = hash_val(key);
+static struct map_entry* find_entry(const struct mtr_map* map, struct map_entry* entries, mtr_value key, size_t cap, bool return_tombstone) {
+    u32 hash_ = hash_val(map, key);
     u32 index = hash_ & (cap - 1);
 
     struct map_entry* entry = entries + index;
     while (entry->is_used && !(return_tombstone && entry->is_tombstone)) {
-        bool same = compare_keys(entry->key, key);
+        bool same = compare_keys(map, entry->key, key);
         if (same) {
             break;
         }
@@ -227,7 +302,7 @@ static struct map_entry* find_entry(struct map_entry* entries, mtr_value key, si
     return entry;
 }
 
-static struct map_entry* resize_entries(struct map_entry* entries, size_t old_cap) {
+static struct map_entry* resize_entries(const struct mtr_map* map, struct map_entry* entries, size_t old_cap) {
     size_t new_cap = old_cap * 2;
     struct map_entry* temp = calloc(new_cap, sizeof(struct map_entry));
 
@@ -235,7 +310,7 @@ static struct map_entry* resize_entries(struct map_entry* entries, size_t old_ca
         struct map_entry* old = entries + i;
         if (!old->is_used || old->is_tombstone)
             continue;
-        struct map_entry* entry = find_entry(temp, old->key, new_cap, true);
+        struct map_entry* entry = find_entry(map, temp, old->key, new_cap, true);
         entry->key = old->key;
         entry->value = old->value;
         entry->is_used = true;
@@ -247,7 +322,7 @@ static struct map_entry* resize_entries(struct map_entry* entries, size_t old_ca
 }
 
 void mtr_map_insert(struct mtr_map* map, mtr_value key, mtr_value value) {
-    struct map_entry* entry = find_entry(map->entries, key, map->capacity, true);
+    struct map_entry* entry = find_entry(map, map->entries, key, map->capacity, true);
     entry->value = value;
 
     if (entry->is_used && !entry->is_tombstone) {
@@ -263,13 +338,13 @@ void mtr_map_insert(struct mtr_map* map, mtr_value key, mtr_value value) {
 
     map->size += 1;
     if (map->size >= map->capacity * LOAD_FACTOR) {
-        map->entries = resize_entries(map->entries, map->capacity);
+        map->entries = resize_entries(map, map->entries, map->capacity);
         map->capacity *= 2;
     }
 }
 
 mtr_value mtr_map_get(struct mtr_map* map, mtr_value key) {
-    struct map_entry* entry = find_entry(map->entries, key, map->capacity, false);
+    struct map_entry* entry = find_entry(map, map->entries, key, map->capacity, false);
     if (!entry->is_used) {
         return MTR_NIL;
     }
@@ -279,7 +354,7 @@ mtr_value mtr_map_get(struct mtr_map* map, mtr_value key) {
 
 
 mtr_value mtr_map_remove(struct mtr_map* map, mtr_value key) {
-    struct map_entry* entry = find_entry(map->entries, key, map->capacity, false);
+    struct map_entry* entry = find_entry(map, map->entries, key, map->capacity, false);
     if (!entry->is_used) {
         return MTR_NIL;
     }
@@ -288,3 +363,46 @@ mtr_value mtr_map_remove(struct mtr_map* map, mtr_value key) {
 }
 
 // Map end
+
+// Box
+
+struct mtr_box* mtr_init_box(void* memory, mtr_value value, enum mtr_value_type type) {
+    struct mtr_box* b = memory;
+    b->obj.type = MTR_OBJ_BOX;
+    b->obj.mark = 0;
+    b->type = type;
+    b->value = value;
+    return b;
+}
+
+struct mtr_box* mtr_new_box(mtr_value value, enum mtr_value_type type) {
+    return mtr_init_box(malloc(sizeof(struct mtr_box)), value, type);
+}
+
+// Box end
+
+size_t mtr_object_size(const struct mtr_object* object) {
+    switch (object->type) {
+    case MTR_OBJ_STRUCT: {
+        return mtr_struct_size(((const struct mtr_struct*) object)->count);
+    }
+    case MTR_OBJ_STRING: {
+        return mtr_string_size(((const struct mtr_string*) object)->length);
+    }
+    case MTR_OBJ_ARRAY: {
+        const struct mtr_array* a = (const struct mtr_array*) object;
+        return sizeof(*a) + mtr_array_element_size(a->layout) * a->capacity;
+    }
+    case MTR_OBJ_MAP: {
+        const struct mtr_map* m = (const struct mtr_map*) object;
+        return sizeof(*m) + sizeof(struct map_entry) * m->capacity;
+    }
+    case MTR_OBJ_CLOSURE: {
+        return mtr_closure_size(((const struct mtr_closure*) object)->count);
+    }
+    case MTR_OBJ_FUNCTION:  return sizeof(struct mtr_function);
+    case MTR_OBJ_NATIVE_FN: return sizeof(struct mtr_native_fn);
+    case MTR_OBJ_BOX:       return sizeof(struct mtr_box);
+    default:                return 0;
+    }
+}
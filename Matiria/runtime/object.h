@@ -6,6 +6,8 @@
 
 #include "core/types.h"
 
+#include <stddef.h>
+
 enum mtr_object_t {
     MTR_OBJ_STRUCT,
     MTR_OBJ_FUNCTION,
@@ -13,27 +15,60 @@ enum mtr_object_t {
     MTR_OBJ_CLOSURE,
     MTR_OBJ_STRING,
     MTR_OBJ_ARRAY,
-    MTR_OBJ_MAP
+    MTR_OBJ_MAP,
+    MTR_OBJ_BOX
 };
 
 struct mtr_object {
     enum mtr_object_t type;
+#ifdef MTR_GC_PARALLEL
+    _Atomic(u32) mark;          // the last collection that reached it, set by several threads (runtime/memory.h)
+#else
+    u32 mark;                   // the last collection that reached it (runtime/memory.h)
+#endif
     struct mtr_object* next;
 };
 
 void mtr_delete_object(struct mtr_object* object);
 
+// Bytes the object and the buffers it owns take
+size_t mtr_object_size(const struct mtr_object* object);
+
+// mtr_new_* take the memory of an object from malloc, the engines take it from the collector
+// (runtime/memory.h) and build the object in it with mtr_init_*. Struct members, the characters
+// of strings and the upvalues of closures are kept in the block of the object, the sizes below
+// count them. Arrays and maps malloc their elements either way. Untagged values (runtime/value.h)
+// leave the types of members and upvalues NULL for the engine to point at its bytecode.
+
 struct mtr_engine;
 
 struct mtr_struct {
     struct mtr_object obj;
     mtr_value* members;
+#ifdef MTR_UNTAGGED_VALUES
+    const u8* types;    // enum mtr_value_type of every member, the operands of the CONSTRUCTOR that made it
+#endif
+    u8 count;
 };
 
+static inline size_t mtr_struct_size(u8 count) {
+    return sizeof(struct mtr_struct) + sizeof(mtr_value) * count;
+}
+
+struct mtr_struct* mtr_init_struct(void* memory, u8 count);
 struct mtr_struct* mtr_new_struct(u8 count);
 
+// Natives only look at their arguments while they run: they don't keep them, return them or
+// grow the arrays among them. The escape analysis (optimizer/ssa.h) counts on it and passes
+// them objects that live in the frame of the caller.
 typedef mtr_value (*mtr_native)(u8 argc, mtr_value* first);
 
+// A native that can't give a result logs why, calls mtr_native_error and returns anything. The
+// engine that called it stops with a runtime error once it returns.
+void mtr_native_error(void);
+// Whether the native that just returned failed, it is cleared for the next one
+bool mtr_native_failed(void);
+
 struct mtr_native_fn {
     struct mtr_object obj;
     mtr_native function;
@@ -56,25 +91,107 @@ struct mtr_upvalue {
 
 struct mtr_closure {
     struct mtr_object obj;
-    struct mtr_chunk chunk;
-    mtr_value* upvalues;
+    const struct mtr_function* function; // owned by the constant table of the chunk that made the closure
+#ifdef MTR_UNTAGGED_VALUES
+    const u8* types;    // enum mtr_value_type of every upvalue, the operands of the CLOSURE that made it
+#endif
     u8 count;
+    // A frame only keeps the upvalues of the closure it runs, mtr_closure_of finds the closure
+    mtr_value upvalues[];
 };
 
-struct mtr_closure* mtr_new_closure(struct mtr_chunk chunk, mtr_value* upvalues, u8 count);
+static inline size_t mtr_closure_size(u8 count) {
+    return sizeof(struct mtr_closure) + sizeof(mtr_value) * count;
+}
+
+// The closure the upvalues of a frame belong to
+static inline struct mtr_closure* mtr_closure_of(mtr_value* upvalues) {
+    return (struct mtr_closure*) (void*) ((char*) upvalues - offsetof(struct mtr_closure, upvalues));
+}
+
+// upvalues are left for the caller to fill
+struct mtr_closure* mtr_init_closure(void* memory, const struct mtr_function* function, u8 count);
+struct mtr_closure* mtr_new_closure(const struct mtr_function* function, u8 count);
+
+// How an array keeps its elements. Ints, Floats and Bools are packed without the tag of their
+// values, everything else is kept as values. The compiler picks it from the static element type
+// (ARRAY_LITERAL and EMPTY_ARRAY in bytecode.h).
+enum mtr_array_layout {
+    MTR_ARRAY_VALUES,
+    MTR_ARRAY_INTS,    // i64
+    MTR_ARRAY_FLOATS,  // f64
+    MTR_ARRAY_BOOLS    // a byte each, 0 or 1
+};
 
 struct mtr_array {
     struct mtr_object obj;
-    mtr_value* elements;
+    union {
+        mtr_value* elements;
+        i64* ints;
+        f64* floats;
+        u8* bools;
+    };
     size_t size;
     size_t capacity;
+    enum mtr_array_layout layout;
 };
 
-struct mtr_array* mtr_new_array(size_t length);
+struct mtr_array* mtr_init_array(void* memory, size_t length, enum mtr_array_layout layout);
+struct mtr_array* mtr_new_array(size_t length, enum mtr_array_layout layout);
 void mtr_delete_array(struct mtr_array* array);
 
+size_t mtr_array_element_size(enum mtr_array_layout layout);
+
 void mtr_array_append(struct mtr_array* array, mtr_value value);
 mtr_value mtr_array_pop(struct mtr_array* array);
+
+// Element access for every layout, the index is not checked
+static inline mtr_value mtr_array_get(const struct mtr_array* array, size_t index) {
+    switch (array->layout) {
+    case MTR_ARRAY_INTS:   return MTR_INT(array->ints[index]);
+    case MTR_ARRAY_FLOATS: return MTR_FLOAT(array->floats[index]);
+    case MTR_ARRAY_BOOLS:  return MTR_INT(array->bools[index]);
+    default:               return array->elements[index];
+    }
+}
+
+static inline void mtr_array_set(const struct mtr_array* array, size_t index, mtr_value value) {
+    switch (array->layout) {
+    case MTR_ARRAY_INTS:   array->ints[index] = MTR_AS_INT(value); break;
+    case MTR_ARRAY_FLOATS: array->floats[index] = MTR_AS_FLOAT(value); break;
+    case MTR_ARRAY_BOOLS:  array->bools[index] = (u8) (MTR_AS_INT(value) != 0); break;
+    default:               array->elements[index] = value; break;
+    }
+}
+
+// [Int] matches [Any], so a packed array can be handed something its layout can't hold. Such
+// an array goes back to values for good (heap arrays only, the escape analysis keeps arrays
+// in frames at the layout of their static type).
+void mtr_array_unpack(struct mtr_array* array);
+
+static inline bool mtr_array_holds(const struct mtr_array* array, mtr_value value) {
+#ifdef MTR_UNTAGGED_VALUES
+    // untagged values can't be told apart, the validator doesn't let a packed array become an [Any] there
+    (void) array;
+    (void) value;
+    return true;
+#else
+    switch (array->layout) {
+    case MTR_ARRAY_INTS:   return MTR_IS_INT(value);
+    case MTR_ARRAY_FLOATS: return MTR_IS_FLOAT(value);
+    case MTR_ARRAY_BOOLS:  return MTR_IS_INT(value) && (u64) MTR_AS_INT(value) <= 1;
+    default:               return true;
+    }
+#endif
+}
+
+// mtr_array_set for values that may not fit the layout
+static inline void mtr_array_store(struct mtr_array* array, size_t index, mtr_value value) {
+    if (!mtr_array_holds(array, value)) {
+        mtr_array_unpack(array);
+    }
+    mtr_array_set(array, index, value);
+}
 // void mtr_array_insert(struct mtr_array* array, mtr_value value, size_t index);
 
 struct mtr_string {
@@ -83,6 +200,11 @@ struct mtr_string {
     size_t length;
 };
 
+static inline size_t mtr_string_size(size_t length) {
+    return sizeof(struct mtr_string) + length;
+}
+
+struct mtr_string* mtr_init_string(void* memory, const char* string, size_t length);
 struct mtr_string* mtr_new_string(const char* string, size_t length);
 
 struct mtr_map {
@@ -90,6 +212,10 @@ struct mtr_map {
     struct map_entry* entries;
     size_t size;
     size_t capacity;
+#ifdef MTR_UNTAGGED_VALUES
+    enum mtr_value_type key_type;
+    enum mtr_value_type value_type;
+#endif
 };
 
 struct mtr_map_element {
@@ -99,6 +225,7 @@ struct mtr_map_element {
 
 struct mtr_map_element* mtr_get_key_value_pair(struct mtr_map* map, size_t index);
 
+struct mtr_map* mtr_init_map(void* memory);
 struct mtr_map* mtr_new_map(void);
 void mtr_delete_map(struct mtr_map* map);
 
@@ -106,4 +233,15 @@ void mtr_map_insert(struct mtr_map* map, mtr_value key, mtr_value value);
 mtr_value mtr_map_get(struct mtr_map* map, mtr_value key);
 mtr_value mtr_map_remove(struct mtr_map* map, mtr_value key);
 
+// An Int or Float that was converted to Any or to a union, values of those types are always
+// objects when values are untagged
+struct mtr_box {
+    struct mtr_object obj;
+    enum mtr_value_type type;
+    mtr_value value;
+};
+
+struct mtr_box* mtr_init_box(void* memory, mtr_value value, enum mtr_value_type type);
+struct mtr_box* mtr_new_box(mtr_value value, enum mtr_value_type type);
+
 #endif
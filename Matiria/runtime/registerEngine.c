@@ -0,0 +1,588 @@
+#include "registerEngine.h"
+
+#include "registerBytecode.h"
+#include "object.h"
+#include "value.h"
+#include "memory.h"
+#include "dispatch.h"
+#include "vector.h"
+
+#include "core/log.h"
+#include "core/macros.h"
+
+#include <string.h>
+
+// The register engine, only built with MTR_REGISTER_VM. The stack engine lives in engine.c.
+#ifdef MTR_REGISTER_VM
+
+static bool push_frame(struct mtr_engine* engine, const struct mtr_chunk* chunk, mtr_value* slots, mtr_value* upvalues) {
+    if (engine->frame_count == MTR_MAX_FRAMES) {
+        MTR_LOG_ERROR("Stack overflow (%u nested calls).", engine->frame_count);
+        return false;
+    }
+
+    struct mtr_call_frame* frame = engine->frames + engine->frame_count++;
+    frame->ip = chunk->bytecode;
+    frame->slots = slots;
+    frame->upvalues = upvalues;
+    frame->chunk = chunk;
+    return true;
+}
+
+#define BINARY_OP(op, as, make)                                            \
+    do {                                                                   \
+        const u8 dst = READ(u8);                                           \
+        const u8 a = READ(u8);                                             \
+        const u8 b = READ(u8);                                             \
+        regs[dst] = make(as(regs[a]) op as(regs[b]));                      \
+    } while (false)
+
+// comparisons always produce an Int, whatever the operands are
+#define COMPARE_OP(op, as) BINARY_OP(op, as, MTR_INT)
+
+#define ELEMENTWISE_OP(layout)                                             \
+    do {                                                                   \
+        const u8 dst = READ(u8);                                           \
+        const u8 a = READ(u8);                                             \
+        const u8 b = READ(u8);                                             \
+        const u8 op = READ(u8);                                            \
+        const u8 arrays = (MTR_IS_OBJ(regs[a]) ? MTR_ELEMENTWISE_LEFT : 0) \
+            | (MTR_IS_OBJ(regs[b]) ? MTR_ELEMENTWISE_RIGHT : 0);           \
+        size_t size;                                                       \
+        if (!mtr_elementwise_size(arrays, regs[a], regs[b], &size)) {      \
+            IMPLEMENT /* runtime error */                                  \
+            MTR_LOG_ERROR("Element-wise operation between arrays of size %zu and %zu", \
+                ((const struct mtr_array*) MTR_AS_OBJ(regs[a]))->size,     \
+                ((const struct mtr_array*) MTR_AS_OBJ(regs[b]))->size);    \
+            exit(-1);                                                      \
+        }                                                                  \
+        struct mtr_array* array = mtr_init_array(ALLOCATE(sizeof(struct mtr_array)), size > 0 ? size : 8, layout); \
+        LINK(array);                                                       \
+        array->size = size;                                                \
+        mtr_elementwise(array, (enum mtr_elementwise) op, arrays, regs[a], regs[b]); \
+        regs[dst] = MTR_OBJ(array);                                        \
+    } while (false)
+
+#define READ(type) *((type*)ip); ip += sizeof(type)
+#define ALLOCATE(size) mtr_allocate(engine, size)
+#define LINK(obj) mtr_link_obj(engine, (struct mtr_object*) obj)
+
+#ifdef MTR_THREADED_DISPATCH
+// labels as values are a GNU extension
+#   pragma GCC diagnostic push
+#   pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// Same frame handling as the stack engine, but each frame owns a window of registers
+// starting at frame->slots instead of sharing the operand stack.
+static bool run(struct mtr_engine* engine) {
+#ifdef MTR_THREADED_DISPATCH
+    static const void* const dispatch_table[] = {
+        LABEL(MTR_REG_OP_ENTER),
+        LABEL(MTR_REG_OP_MOVE),
+        LABEL(MTR_REG_OP_CONSTANT),
+        LABEL(MTR_REG_OP_SMALL_INT),
+        LABEL(MTR_REG_OP_FALSE),
+        LABEL(MTR_REG_OP_TRUE),
+        LABEL(MTR_REG_OP_NIL),
+        LABEL(MTR_REG_OP_STRING_LITERAL),
+        LABEL(MTR_REG_OP_ARRAY_LITERAL),
+        LABEL(MTR_REG_OP_MAP_LITERAL),
+        LABEL(MTR_REG_OP_CONSTRUCTOR),
+        LABEL(MTR_REG_OP_CLOSURE),
+        LABEL(MTR_REG_OP_EMPTY_ARRAY),
+        LABEL(MTR_REG_OP_EMPTY_MAP),
+        LABEL(MTR_REG_OP_NOT),
+        LABEL(MTR_REG_OP_NEGATE_I),
+        LABEL(MTR_REG_OP_NEGATE_F),
+        LABEL(MTR_REG_OP_ADD_I),
+        LABEL(MTR_REG_OP_SUB_I),
+        LABEL(MTR_REG_OP_MUL_I),
+        LABEL(MTR_REG_OP_DIV_I),
+        LABEL(MTR_REG_OP_ADD_F),
+        LABEL(MTR_REG_OP_SUB_F),
+        LABEL(MTR_REG_OP_MUL_F),
+        LABEL(MTR_REG_OP_DIV_F),
+        LABEL(MTR_REG_OP_ELEMENTWISE_I),
+        LABEL(MTR_REG_OP_ELEMENTWISE_F),
+        LABEL(MTR_REG_OP_LESS_I),
+        LABEL(MTR_REG_OP_GREATER_I),
+        LABEL(MTR_REG_OP_EQUAL_I),
+        LABEL(MTR_REG_OP_LESS_F),
+        LABEL(MTR_REG_OP_GREATER_F),
+        LABEL(MTR_REG_OP_EQUAL_F),
+        LABEL(MTR_REG_OP_GLOBAL_GET),
+        LABEL(MTR_REG_OP_UPVALUE_GET),
+        LABEL(MTR_REG_OP_UPVALUE_SET),
+        LABEL(MTR_REG_OP_INDEX_GET),
+        LABEL(MTR_REG_OP_INDEX_SET),
+        LABEL(MTR_REG_OP_STRUCT_GET),
+        LABEL(MTR_REG_OP_STRUCT_SET),
+        LABEL(MTR_REG_OP_JMP),
+        LABEL(MTR_REG_OP_JMP_Z),
+        LABEL(MTR_REG_OP_JMP_NZ),
+        LABEL(MTR_REG_OP_CALL),
+        LABEL(MTR_REG_OP_TAIL_CALL),
+        LABEL(MTR_REG_OP_INT_CAST),
+        LABEL(MTR_REG_OP_FLOAT_CAST),
+        LABEL(MTR_REG_OP_RETURN),
+    };
+#endif
+
+    const u32 entry = engine->frame_count;
+    struct mtr_call_frame* frame = engine->frames + entry - 1;
+    register u8* ip = frame->ip;
+    register mtr_value* regs = frame->slots;
+
+    DISPATCH_LOOP()
+    {
+        CASE(MTR_REG_OP_ENTER): {
+            const u16 count = READ(u16);
+            if (regs + count > engine->stack + MTR_MAX_STACK) {
+                MTR_LOG_ERROR("Stack overflow (%u nested calls).", engine->frame_count);
+                return false;
+            }
+            // the collector looks at every register of the frame, what an earlier call left in them may be gone
+            for (u16 i = frame->chunk->arity; i < count; ++i) {
+                regs[i] = MTR_NIL;
+            }
+            engine->stack_top = regs + count;
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_MOVE): {
+            const u8 dst = READ(u8);
+            const u8 src = READ(u8);
+            regs[dst] = regs[src];
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_CONSTANT): {
+            const u8 dst = READ(u8);
+            const u16 index = READ(u16);
+            regs[dst] = frame->chunk->constants[index];
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_SMALL_INT): {
+            const u8 dst = READ(u8);
+            const i16 value = READ(i16);
+            regs[dst] = MTR_INT(value);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_FALSE): {
+            const u8 dst = READ(u8);
+            regs[dst] = MTR_INT(0);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_TRUE): {
+            const u8 dst = READ(u8);
+            regs[dst] = MTR_INT(1);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_NIL): {
+            const u8 dst = READ(u8);
+            regs[dst] = MTR_NIL;
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_STRING_LITERAL): {
+            const u8 dst = READ(u8);
+            const u16 index = READ(u16);
+            const struct mtr_string* constant = (const struct mtr_string*) MTR_AS_OBJ(frame->chunk->constants[index]);
+            struct mtr_string* s = mtr_init_string(ALLOCATE(mtr_string_size(constant->length)), constant->s, constant->length);
+            LINK(s);
+            regs[dst] = MTR_OBJ(s);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_ARRAY_LITERAL): {
+            const u8 dst = READ(u8);
+            const u8 first = READ(u8);
+            const u8 count = READ(u8);
+            struct mtr_array* array = mtr_init_array(ALLOCATE(sizeof(struct mtr_array)), count, MTR_ARRAY_VALUES);
+            LINK(array);
+            for (u8 i = 0; i < count; ++i) {
+                array->elements[i] = regs[first + i];
+            }
+
+            array->size = count;
+
+            regs[dst] = MTR_OBJ(array);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_MAP_LITERAL): {
+            const u8 dst = READ(u8);
+            const u8 first = READ(u8);
+            const u8 count = READ(u8);
+            struct mtr_map* map = mtr_init_map(ALLOCATE(sizeof(struct mtr_map)));
+            LINK(map);
+
+            for (u8 i = 0; i < count; ++i) {
+                const mtr_value key = regs[first + 2 * i];
+                const mtr_value value = regs[first + 2 * i + 1];
+                mtr_map_insert(map, key, value);
+            }
+
+            regs[dst] = MTR_OBJ(map);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_CONSTRUCTOR): {
+            const u8 dst = READ(u8);
+            const u8 first = READ(u8);
+            const u8 count = READ(u8);
+            struct mtr_struct* s = mtr_init_struct(ALLOCATE(mtr_struct_size(count)), count);
+            LINK(s);
+            for (u8 i = 0; i < count; ++i) {
+                s->members[i] = regs[first + i];
+            }
+            regs[dst] = MTR_OBJ(s);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_CLOSURE): {
+            const u8 dst = READ(u8);
+            const u16 body_index = READ(u16);
+            const u8 count = READ(u8);
+            const struct mtr_function* body = (const struct mtr_function*) MTR_AS_OBJ(frame->chunk->constants[body_index]);
+            struct mtr_closure* c = mtr_init_closure(ALLOCATE(mtr_closure_size(count)), body, count);
+            LINK(c);
+
+            for (u16 i = 0; i < count; ++i) {
+                u16 index = READ(u16);
+                bool local = READ(bool);
+
+                if (local) {
+                    c->upvalues[i] = regs[index];
+                } else {
+                    c->upvalues[i] = frame->upvalues[index];
+                }
+            }
+
+            regs[dst] = MTR_OBJ(c);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_EMPTY_ARRAY): {
+            const u8 dst = READ(u8);
+            struct mtr_array* array_object = mtr_init_array(ALLOCATE(sizeof(struct mtr_array)), 8, MTR_ARRAY_VALUES);
+            LINK(array_object);
+            regs[dst] = MTR_OBJ(array_object);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_EMPTY_MAP): {
+            const u8 dst = READ(u8);
+            struct mtr_map* map = mtr_init_map(ALLOCATE(sizeof(struct mtr_map)));
+            LINK(map);
+            regs[dst] = MTR_OBJ(map);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_NOT): {
+            const u8 dst = READ(u8);
+            const u8 src = READ(u8);
+            regs[dst] = MTR_INT(!MTR_AS_INT(regs[src]));
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_NEGATE_I): {
+            const u8 dst = READ(u8);
+            const u8 src = READ(u8);
+            regs[dst] = MTR_INT(-MTR_AS_INT(regs[src]));
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_NEGATE_F): {
+            const u8 dst = READ(u8);
+            const u8 src = READ(u8);
+            regs[dst] = MTR_FLOAT(-MTR_AS_FLOAT(regs[src]));
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_ADD_I): BINARY_OP(+, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_REG_OP_SUB_I): BINARY_OP(-, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_REG_OP_MUL_I): BINARY_OP(*, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_REG_OP_DIV_I): BINARY_OP(/, MTR_AS_INT, MTR_INT); DISPATCH();
+
+        CASE(MTR_REG_OP_ADD_F): BINARY_OP(+, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+        CASE(MTR_REG_OP_SUB_F): BINARY_OP(-, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+        CASE(MTR_REG_OP_MUL_F): BINARY_OP(*, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+        CASE(MTR_REG_OP_DIV_F): BINARY_OP(/, MTR_AS_FLOAT, MTR_FLOAT); DISPATCH();
+
+        CASE(MTR_REG_OP_ELEMENTWISE_I): ELEMENTWISE_OP(MTR_ARRAY_INTS); DISPATCH();
+        CASE(MTR_REG_OP_ELEMENTWISE_F): ELEMENTWISE_OP(MTR_ARRAY_FLOATS); DISPATCH();
+
+        CASE(MTR_REG_OP_LESS_I): BINARY_OP(<, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_REG_OP_GREATER_I): BINARY_OP(>, MTR_AS_INT, MTR_INT); DISPATCH();
+        CASE(MTR_REG_OP_EQUAL_I): BINARY_OP(==, MTR_AS_INT, MTR_INT); DISPATCH();
+
+        CASE(MTR_REG_OP_LESS_F): COMPARE_OP(<, MTR_AS_FLOAT); DISPATCH();
+        CASE(MTR_REG_OP_GREATER_F): COMPARE_OP(>, MTR_AS_FLOAT); DISPATCH();
+        CASE(MTR_REG_OP_EQUAL_F): COMPARE_OP(==, MTR_AS_FLOAT); DISPATCH();
+
+        CASE(MTR_REG_OP_GLOBAL_GET): {
+            const u8 dst = READ(u8);
+            const u16 index = READ(u16);
+            struct mtr_object* o = engine->globals[index];
+            regs[dst] = MTR_OBJ(o);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_UPVALUE_GET): {
+            const u8 dst = READ(u8);
+            const u16 index = READ(u16);
+            regs[dst] = frame->upvalues[index];
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_UPVALUE_SET): {
+            const u16 index = READ(u16);
+            const u8 src = READ(u8);
+            frame->upvalues[index] = regs[src];
+            mtr_write_barrier(engine, &mtr_closure_of(frame->upvalues)->obj, regs[src]);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_INDEX_GET): {
+            const u8 dst = READ(u8);
+            const u8 o = READ(u8);
+            const u8 k = READ(u8);
+            const mtr_value key = regs[k];
+            const struct mtr_object* object = MTR_AS_OBJ(regs[o]);
+            switch (object->type) {
+            case MTR_OBJ_STRING: {
+                const struct mtr_string* string = (const struct mtr_string*) object;
+                const i64 i = MTR_AS_INT(key);
+                const size_t index = mtr_reinterpret_cast(size_t, i);
+                if (index >= string->length) {
+                    MTR_LOG_ERROR("Indexing string of size %zu with index %zu", string->length, index);
+                    return false;
+                }
+                MTR_LOG_ERROR("String indexing not yet implemented");
+                return false;
+            }
+            case MTR_OBJ_ARRAY: {
+                const struct mtr_array* array = (const struct mtr_array*) object;
+                const i64 i = MTR_AS_INT(key);
+                const size_t index = mtr_reinterpret_cast(size_t, i);
+                if (index >= array->size) {
+                    MTR_LOG_ERROR("Out of bounds: Indexing array of size %zu with index %zu", array->size, index);
+                    return false;
+                }
+                regs[dst] = mtr_array_get(array, index);
+                break;
+            }
+            case MTR_OBJ_MAP: {
+                struct mtr_map* map = (struct mtr_map*) object;
+                regs[dst] = mtr_map_get(map, key);
+                break;
+            }
+            default:
+                IMPLEMENT // runtime error
+                exit(-1);
+                break;
+            }
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_INDEX_SET): {
+            const u8 o = READ(u8);
+            const u8 k = READ(u8);
+            const u8 src = READ(u8);
+            const mtr_value key = regs[k];
+            struct mtr_object* object = MTR_AS_OBJ(regs[o]);
+            mtr_value val = regs[src];
+            switch (object->type) {
+            case MTR_OBJ_STRING: {
+                MTR_LOG_ERROR("<String> object does not support item assignment.");
+                return false;
+            }
+            case MTR_OBJ_ARRAY: {
+                const struct mtr_array* array = (const struct mtr_array*) object;
+                const i64 i = MTR_AS_INT(key);
+                const size_t index = mtr_reinterpret_cast(size_t, i);
+                if (index >= array->size) {
+                    MTR_LOG_ERROR("Out of bounds: Indexing array of size %zu with index %zu", array->size, index);
+                    return false;
+                }
+                mtr_array_set(array, index, val);
+                mtr_write_barrier(engine, object, val);
+                break;
+            }
+            case MTR_OBJ_MAP: {
+                struct mtr_map* map = (struct mtr_map*) object;
+                mtr_map_insert(map, key, val);
+                mtr_write_barrier(engine, object, key);
+                mtr_write_barrier(engine, object, val);
+                break;
+            }
+            default:
+                MTR_ASSERT(false, "Invalid object type");
+                break;
+            }
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_STRUCT_GET): {
+            const u8 dst = READ(u8);
+            const u8 o = READ(u8);
+            const u8 index = READ(u8);
+            const struct mtr_struct* s = (const struct mtr_struct*) MTR_AS_OBJ(regs[o]);
+            regs[dst] = s->members[index];
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_STRUCT_SET): {
+            const u8 o = READ(u8);
+            const u8 index = READ(u8);
+            const u8 src = READ(u8);
+            struct mtr_struct* s = (struct mtr_struct*) MTR_AS_OBJ(regs[o]);
+            s->members[index] = regs[src];
+            mtr_write_barrier(engine, &s->obj, regs[src]);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_JMP): {
+            const i16 where = READ(i16);
+            ip += where;
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_JMP_Z): {
+            const u8 src = READ(u8);
+            const i16 where = READ(i16);
+            ip += where * (MTR_AS_INT(regs[src]) == 0);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_JMP_NZ): {
+            const u8 src = READ(u8);
+            const i16 where = READ(i16);
+            ip += where * (MTR_AS_INT(regs[src]) != 0);
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_CALL): {
+            const u8 f = READ(u8);
+            const u8 argc = READ(u8);
+            struct mtr_object* object = MTR_AS_OBJ(regs[f]);
+            if (object->type == MTR_OBJ_FUNCTION) {
+                struct mtr_function* fn = (struct mtr_function*) object;
+                frame->ip = ip;
+                if (!push_frame(engine, &fn->chunk, regs + f + 1, NULL)) {
+                    return false;
+                }
+                frame = engine->frames + engine->frame_count - 1;
+                ip = frame->ip;
+                regs = frame->slots;
+                DISPATCH();
+            } else if (object->type == MTR_OBJ_CLOSURE) {
+                struct mtr_closure* c = (struct mtr_closure*) object;
+                frame->ip = ip;
+                if (!push_frame(engine, &c->function->chunk, regs + f + 1, c->upvalues)) {
+                    return false;
+                }
+                frame = engine->frames + engine->frame_count - 1;
+                ip = frame->ip;
+                regs = frame->slots;
+                DISPATCH();
+            } else if (object->type == MTR_OBJ_NATIVE_FN) {
+                struct mtr_native_fn* n = (struct mtr_native_fn*) object;
+                regs[f] = n->function(argc, regs + f + 1);
+                if (mtr_native_failed()) {
+                    return false;
+                }
+                DISPATCH();
+            }
+            MTR_ASSERT(false, "Object is not invokable");
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_TAIL_CALL): {
+            const u8 f = READ(u8);
+            const u8 argc = READ(u8);
+            struct mtr_object* object = MTR_AS_OBJ(regs[f]);
+            const struct mtr_chunk* chunk = NULL;
+            mtr_value* upvalues = NULL;
+            if (object->type == MTR_OBJ_FUNCTION) {
+                chunk = &((struct mtr_function*) object)->chunk;
+            } else if (object->type == MTR_OBJ_CLOSURE) {
+                struct mtr_closure* c = (struct mtr_closure*) object;
+                chunk = &c->function->chunk;
+                upvalues = c->upvalues;
+            } else {
+                MTR_ASSERT(object->type == MTR_OBJ_NATIVE_FN, "Object is not invokable");
+                struct mtr_native_fn* n = (struct mtr_native_fn*) object;
+                regs[-1] = n->function(argc, regs + f + 1);
+                if (mtr_native_failed()) {
+                    return false;
+                }
+                engine->stack_top = regs;
+                if (--engine->frame_count < entry) {
+                    return true;
+                }
+                frame = engine->frames + engine->frame_count - 1;
+                ip = frame->ip;
+                regs = frame->slots;
+                DISPATCH();
+            }
+
+            // the arguments become the callee's first registers, the rest of the window is dead
+            memmove(regs, regs + f + 1, sizeof(mtr_value) * argc);
+            frame->ip = chunk->bytecode;
+            frame->upvalues = upvalues;
+            frame->chunk = chunk;
+            ip = frame->ip;
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_RETURN): {
+            const u8 src = READ(u8);
+            regs[-1] = regs[src];
+            // everything the caller still uses sits below the callee's window
+            engine->stack_top = regs;
+            if (--engine->frame_count < entry) {
+                return true;
+            }
+            frame = engine->frames + engine->frame_count - 1;
+            ip = frame->ip;
+            regs = frame->slots;
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_INT_CAST): {
+            const u8 dst = READ(u8);
+            const u8 src = READ(u8);
+            regs[dst] = MTR_INT((i64) MTR_AS_FLOAT(regs[src]));
+            DISPATCH();
+        }
+
+        CASE(MTR_REG_OP_FLOAT_CAST): {
+            const u8 dst = READ(u8);
+            const u8 src = READ(u8);
+            regs[dst] = MTR_FLOAT((f64) MTR_AS_INT(regs[src]));
+            DISPATCH();
+        }
+    }
+}
+
+#ifdef MTR_THREADED_DISPATCH
+#   pragma GCC diagnostic pop
+#endif
+
+#undef BINARY_OP
+#undef READ
+
+bool mtr_run_registers(struct mtr_engine* engine, const struct mtr_chunk* main) {
+    // register 0 of the bottom frame is reserved for main's return value
+    mtr_value* slots = engine->stack + 1;
+    return push_frame(engine, main, slots, NULL) && run(engine);
+}
+
+#endif // MTR_REGISTER_VM
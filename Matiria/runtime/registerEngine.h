@@ -0,0 +1,10 @@
+#ifndef MTR_REGISTER_ENGINE_H
+#define MTR_REGISTER_ENGINE_H
+
+#include "engine.h"
+
+// Interpreter for the register instruction set (registerBytecode.h).
+// Only used when the package was compiled with MTR_REGISTER_VM.
+bool mtr_run_registers(struct mtr_engine* engine, const struct mtr_chunk* main);
+
+#endif
@@ -0,0 +1,32 @@
+#include "value.h"
+
+#ifdef MTR_NAN_BOXING
+
+#include "core/log.h"
+
+#include <stdlib.h>
+
+// Every box ever made, most recent first
+static struct mtr_int_box* boxes = NULL;
+
+mtr_value mtr_box_int(i64 value) {
+    struct mtr_int_box* box = malloc(sizeof(*box));
+    if (NULL == box) {
+        MTR_LOG_ERROR("Bad allocation.");
+        exit(-1);
+    }
+    box->value = value;
+    box->next = boxes;
+    boxes = box;
+    return MTR_BOXED_INT_TAG | (u64) (uintptr_t) box;
+}
+
+void mtr_free_int_boxes(void) {
+    while (boxes) {
+        struct mtr_int_box* next = boxes->next;
+        free(boxes);
+        boxes = next;
+    }
+}
+
+#endif
@@ -3,12 +3,118 @@
 
 #include "core/types.h"
 
+// What a value holds. Tagged values carry it, untagged ones leave it to the static types.
 enum mtr_value_type {
     MTR_VAL_INT,
     MTR_VAL_FLOAT,
     MTR_VAL_OBJ
 };
 
+#if defined(MTR_UNTAGGED_VALUES) && (defined(MTR_NAN_BOXING) || defined(MTR_REGISTER_VM))
+#   error "Untagged values only work with the stack engine and without NaN boxing"
+#endif
+
+#ifdef MTR_NAN_BOXING
+
+#include <string.h>
+
+// Every value is 8 bytes. Anything that is not one of the quiet NaN patterns below is a Float,
+// so Floats that come out of arithmetic as NaN are stored as the canonical NaN.
+//
+//  Int     1111 1111 1111 1iii ... iiii   51 bit two's complement payload
+//  Object  0111 1111 1111 1100 pppp ...   48 bit pointer
+//  Boxed   0111 1111 1111 1101 pppp ...   48 bit pointer to a struct mtr_int_box
+//
+// Ints in [-2^50, 2^50) live in the value itself. The rest of the 64 bit range is boxed on the
+// heap, so the language keeps full 64 bit Ints and only pays for an allocation past the fast path.
+typedef u64 mtr_value;
+
+#define MTR_SIGN_BIT      0x8000000000000000ull
+#define MTR_INFINITY      0x7FF0000000000000ull
+#define MTR_CANONICAL_NAN 0x7FF8000000000000ull
+#define MTR_INT_TAG       0xFFF8000000000000ull
+#define MTR_OBJ_TAG       0x7FFC000000000000ull
+#define MTR_BOXED_INT_TAG 0x7FFD000000000000ull
+#define MTR_TAG_MASK      0xFFFF000000000000ull
+#define MTR_PAYLOAD_MASK  0x0000FFFFFFFFFFFFull
+
+#define MTR_INLINE_INT_MIN (-((i64) 1 << 50))
+#define MTR_INLINE_INT_MAX (((i64) 1 << 50) - 1)
+
+struct mtr_int_box {
+    struct mtr_int_box* next;
+    i64 value;
+};
+
+// Boxes are never shared and live until mtr_free_int_boxes
+mtr_value mtr_box_int(i64 value);
+void mtr_free_int_boxes(void);
+
+static inline mtr_value mtr_int_value(i64 value) {
+    if (value < MTR_INLINE_INT_MIN || value > MTR_INLINE_INT_MAX) {
+        return mtr_box_int(value);
+    }
+    return MTR_INT_TAG | ((u64) value & ~MTR_INT_TAG);
+}
+
+static inline mtr_value mtr_float_value(f64 value) {
+    mtr_value v;
+    memcpy(&v, &value, sizeof(v));
+    // not value != value, that is folded away under -ffast-math
+    return (v & ~MTR_SIGN_BIT) > MTR_INFINITY ? MTR_CANONICAL_NAN : v;
+}
+
+static inline i64 mtr_value_as_int(mtr_value value) {
+    if ((value & MTR_INT_TAG) == MTR_INT_TAG) {
+        return ((i64) (value << 13)) >> 13;
+    }
+    return ((const struct mtr_int_box*) (uintptr_t) (value & MTR_PAYLOAD_MASK))->value;
+}
+
+static inline f64 mtr_value_as_float(mtr_value value) {
+    f64 f;
+    memcpy(&f, &value, sizeof(f));
+    return f;
+}
+
+#define MTR_INT(value)   mtr_int_value(value)
+#define MTR_FLOAT(value) mtr_float_value(value)
+#define MTR_OBJ(value)   (MTR_OBJ_TAG | (u64) (uintptr_t) (value))
+
+#define MTR_AS_INT(value)   mtr_value_as_int(value)
+#define MTR_AS_FLOAT(value) mtr_value_as_float(value)
+#define MTR_AS_OBJ(value)   ((struct mtr_object*) (uintptr_t) ((value) & MTR_PAYLOAD_MASK))
+
+#define MTR_IS_INT(value)   (((value) & MTR_INT_TAG) == MTR_INT_TAG || ((value) & MTR_TAG_MASK) == MTR_BOXED_INT_TAG)
+#define MTR_IS_OBJ(value)   (((value) & MTR_TAG_MASK) == MTR_OBJ_TAG)
+#define MTR_IS_FLOAT(value) (!MTR_IS_INT(value) && !MTR_IS_OBJ(value))
+
+// The raw 64 bits, two values with the same bits are the same value. Equal Ints may differ when boxed.
+#define MTR_BITS(value) (value)
+
+#elif defined(MTR_UNTAGGED_VALUES)
+
+// Every value is a bare 8 byte word. The compiler knows the type of every slot and writes it
+// down where the runtime needs it: the stack maps of a chunk (bytecode.h), the element types of
+// arrays and maps, and a struct mtr_box around Ints and Floats that become Any or a union.
+typedef union {
+    i64 integer;
+    f64 floating;
+    struct mtr_object* object;
+} mtr_value;
+
+#define MTR_INT(value)   (mtr_value){ .integer = value }
+#define MTR_FLOAT(value) (mtr_value){ .floating = value }
+#define MTR_OBJ(value)   (mtr_value){ .object = (struct mtr_object*) value }
+
+#define MTR_AS_INT(value)   (value).integer
+#define MTR_AS_FLOAT(value) (value).floating
+#define MTR_AS_OBJ(value)   (value).object
+
+#define MTR_BITS(value) ((u64) (value).integer)
+
+#else
+
 typedef struct {
     enum mtr_value_type type;
     u32 pad; // I have an extra four bytes use because of alignment
@@ -23,9 +129,21 @@ typedef struct {
 #define MTR_FLOAT(value) (mtr_value){ .floating = value, .type = MTR_VAL_FLOAT }
 #define MTR_OBJ(value)   (mtr_value){ .object = (struct mtr_object*) value, .type = MTR_VAL_OBJ }
 
-#define MTR_AS_INT(value)   value.integer
-#define MTR_AS_FLOAT(value) value.floating
-#define MTR_AS_OBJ(value)   value.object
+#define MTR_AS_INT(value)   (value).integer
+#define MTR_AS_FLOAT(value) (value).floating
+#define MTR_AS_OBJ(value)   (value).object
+
+#define MTR_IS_INT(value)   ((value).type == MTR_VAL_INT)
+#define MTR_IS_OBJ(value)   ((value).type == MTR_VAL_OBJ)
+#define MTR_IS_FLOAT(value) ((value).type == MTR_VAL_FLOAT)
+
+#define MTR_BITS(value) ((u64) (value).integer)
+
+#endif
+
+#ifndef MTR_UNTAGGED_VALUES
+#   define MTR_TYPE_OF(value) (MTR_IS_INT(value) ? MTR_VAL_INT : MTR_IS_FLOAT(value) ? MTR_VAL_FLOAT : MTR_VAL_OBJ)
+#endif
 
 #define MTR_NIL MTR_INT(0)
 
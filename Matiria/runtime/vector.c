@@ -0,0 +1,475 @@
+#include "vector.h"
+
+#include <stdlib.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#   define MTR_X86_KERNELS
+#   include <immintrin.h>
+#endif
+
+// One loop for every operator and element type. A number on one side is a single element
+// every iteration reads.
+typedef void (*float_kernel)(f64* out, const f64* l, const f64* r, size_t n, u8 arrays);
+typedef void (*int_kernel)(i64* out, const i64* l, const i64* r, size_t n, u8 arrays);
+
+// Reductions read n elements, min and max at least one. The searches compare every element
+// with x, index_i and index_f return n when none is equal.
+struct kernels {
+    const char* isa;
+    float_kernel floats[4];  // by enum mtr_elementwise
+    int_kernel ints[4];
+    i64 (*sum_i)(const i64* a, size_t n);
+    f64 (*sum_f)(const f64* a, size_t n);
+    i64 (*min_i)(const i64* a, size_t n);
+    f64 (*min_f)(const f64* a, size_t n);
+    i64 (*max_i)(const i64* a, size_t n);
+    f64 (*max_f)(const f64* a, size_t n);
+    i64 (*dot_i)(const i64* a, const i64* b, size_t n);
+    f64 (*dot_f)(const f64* a, const f64* b, size_t n);
+    size_t (*count_i)(const i64* a, size_t n, i64 x);
+    size_t (*count_f)(const f64* a, size_t n, f64 x);
+    size_t (*index_i)(const i64* a, size_t n, i64 x);
+    size_t (*index_f)(const f64* a, size_t n, f64 x);
+};
+
+#define BOTH (MTR_ELEMENTWISE_LEFT | MTR_ELEMENTWISE_RIGHT)
+
+#define AT(p, array, i) ((array) ? (p)[i] : (p)[0])
+
+// The kernel calls its body with constant flags for each of the three shapes, so every
+// copy of the body that is inlined there loses the checks of the scalar sides
+#define KERNEL(name, attributes, T, body)                            \
+    attributes static void name(T* out, const T* l, const T* r, size_t n, u8 arrays) { \
+        switch (arrays) {                                            \
+        case BOTH:                  body(out, l, r, n, true, true); break;  \
+        case MTR_ELEMENTWISE_LEFT:  body(out, l, r, n, true, false); break; \
+        default:                    body(out, l, r, n, false, true); break; \
+        }                                                            \
+    }
+
+// Plain C, for the operators without a vector instruction and for other architectures
+
+#define SCALAR(name, T, op)                                          \
+    static inline void name ## _body(T* out, const T* l, const T* r, size_t n, bool la, bool ra) { \
+        for (size_t i = 0; i < n; ++i) {                             \
+            out[i] = AT(l, la, i) op AT(r, ra, i);                   \
+        }                                                            \
+    }                                                                \
+    KERNEL(name, , T, name ## _body)
+
+SCALAR(mul_i, i64, *)
+SCALAR(div_i, i64, /)
+
+#define SUM(a, b) ((a) + (b))
+#define MIN(a, b) ((b) < (a) ? (b) : (a))
+#define MAX(a, b) ((b) > (a) ? (b) : (a))
+
+// The reductions keep four accumulators of width elements each, so four independent chains of
+// additions or comparisons run at the same time instead of one waiting on the last. The order
+// of Float additions differs from a loop over the elements, the last bits of a sum can too.
+// A width of 1 makes them plain C: the vector type is the element type and every operation
+// works on a single element.
+#define REDUCE(name, attributes, T, V, width, set1, load, store, vop, combine, first) \
+    attributes static T name(const T* a, size_t n) {                 \
+        V acc0 = set1(first);                                        \
+        V acc1 = acc0;                                               \
+        V acc2 = acc0;                                               \
+        V acc3 = acc0;                                               \
+        size_t i = 0;                                                \
+        for (; i + 4 * (width) <= n; i += 4 * (width)) {             \
+            acc0 = vop(acc0, load(a + i));                           \
+            acc1 = vop(acc1, load(a + i + (width)));                 \
+            acc2 = vop(acc2, load(a + i + 2 * (width)));             \
+            acc3 = vop(acc3, load(a + i + 3 * (width)));             \
+        }                                                            \
+        T lanes[width];                                              \
+        store(lanes, vop(vop(acc0, acc1), vop(acc2, acc3)));         \
+        T result = lanes[0];                                         \
+        for (size_t k = 1; k < (width); ++k) {                       \
+            result = combine(result, lanes[k]);                      \
+        }                                                            \
+        for (; i < n; ++i) {                                         \
+            result = combine(result, a[i]);                          \
+        }                                                            \
+        return result;                                               \
+    }
+
+#define DOT(name, attributes, T, V, width, set1, load, store, vadd, vmul) \
+    attributes static T name(const T* a, const T* b, size_t n) {     \
+        V acc0 = set1(0);                                            \
+        V acc1 = acc0;                                               \
+        V acc2 = acc0;                                               \
+        V acc3 = acc0;                                               \
+        size_t i = 0;                                                \
+        for (; i + 4 * (width) <= n; i += 4 * (width)) {             \
+            acc0 = vadd(acc0, vmul(load(a + i), load(b + i)));       \
+            acc1 = vadd(acc1, vmul(load(a + i + (width)), load(b + i + (width)))); \
+            acc2 = vadd(acc2, vmul(load(a + i + 2 * (width)), load(b + i + 2 * (width)))); \
+            acc3 = vadd(acc3, vmul(load(a + i + 3 * (width)), load(b + i + 3 * (width)))); \
+        }                                                            \
+        T lanes[width];                                              \
+        store(lanes, vadd(vadd(acc0, acc1), vadd(acc2, acc3)));      \
+        T result = 0;                                                \
+        for (size_t k = 0; k < (width); ++k) {                       \
+            result += lanes[k];                                      \
+        }                                                            \
+        for (; i < n; ++i) {                                         \
+            result += a[i] * b[i];                                   \
+        }                                                            \
+        return result;                                               \
+    }
+
+// equal(p, x) is a mask with bit k set when p[k] == x, for the width elements at p
+static const u8 bits_set[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+#define COUNT(name, attributes, T, V, width, set1, equal)            \
+    attributes static size_t name(const T* a, size_t n, T x) {       \
+        const V target = set1(x);                                    \
+        size_t count = 0;                                            \
+        size_t i = 0;                                                \
+        for (; i + 2 * (width) <= n; i += 2 * (width)) {             \
+            count += bits_set[equal(a + i, target)] + bits_set[equal(a + i + (width), target)]; \
+        }                                                            \
+        for (; i < n; ++i) {                                         \
+            count += a[i] == x;                                      \
+        }                                                            \
+        return count;                                                \
+    }
+
+#define INDEX(name, attributes, T, V, width, set1, equal)            \
+    attributes static size_t name(const T* a, size_t n, T x) {       \
+        const V target = set1(x);                                    \
+        size_t i = 0;                                                \
+        for (; i + 2 * (width) <= n; i += 2 * (width)) {             \
+            const unsigned mask = (unsigned) equal(a + i, target)    \
+                | (unsigned) equal(a + i + (width), target) << (width); \
+            if (0 != mask) {                                         \
+                return i + (size_t) __builtin_ctz(mask);             \
+            }                                                        \
+        }                                                            \
+        for (; i < n; ++i) {                                         \
+            if (a[i] == x) {                                         \
+                return i;                                            \
+            }                                                        \
+        }                                                            \
+        return n;                                                    \
+    }
+
+#define ONE(x) (x)
+#define ONE_LOAD(p) (*(p))
+#define ONE_STORE(p, v) (*(p) = (v))
+#define ONE_MUL(a, b) ((a) * (b))
+#define ONE_EQUAL(p, x) (*(p) == (x))
+
+// No vector instruction multiplies 64 bit integers
+DOT(dot_i, , i64, i64, 1, ONE, ONE_LOAD, ONE_STORE, SUM, ONE_MUL)
+
+#ifndef MTR_X86_KERNELS
+
+SCALAR(add_f, f64, +)
+SCALAR(sub_f, f64, -)
+SCALAR(mul_f, f64, *)
+SCALAR(div_f, f64, /)
+SCALAR(add_i, i64, +)
+SCALAR(sub_i, i64, -)
+
+REDUCE(sum_i, , i64, i64, 1, ONE, ONE_LOAD, ONE_STORE, SUM, SUM, 0)
+REDUCE(sum_f, , f64, f64, 1, ONE, ONE_LOAD, ONE_STORE, SUM, SUM, 0)
+REDUCE(min_i, , i64, i64, 1, ONE, ONE_LOAD, ONE_STORE, MIN, MIN, a[0])
+REDUCE(min_f, , f64, f64, 1, ONE, ONE_LOAD, ONE_STORE, MIN, MIN, a[0])
+REDUCE(max_i, , i64, i64, 1, ONE, ONE_LOAD, ONE_STORE, MAX, MAX, a[0])
+REDUCE(max_f, , f64, f64, 1, ONE, ONE_LOAD, ONE_STORE, MAX, MAX, a[0])
+DOT(dot_f, , f64, f64, 1, ONE, ONE_LOAD, ONE_STORE, SUM, ONE_MUL)
+COUNT(count_i, , i64, i64, 1, ONE, ONE_EQUAL)
+COUNT(count_f, , f64, f64, 1, ONE, ONE_EQUAL)
+INDEX(index_i, , i64, i64, 1, ONE, ONE_EQUAL)
+INDEX(index_f, , f64, f64, 1, ONE, ONE_EQUAL)
+
+static const struct kernels scalar = {
+    .isa = "scalar",
+    .floats = { add_f, sub_f, mul_f, div_f },
+    .ints = { add_i, sub_i, mul_i, div_i },
+    .sum_i = sum_i, .sum_f = sum_f,
+    .min_i = min_i, .min_f = min_f,
+    .max_i = max_i, .max_f = max_f,
+    .dot_i = dot_i, .dot_f = dot_f,
+    .count_i = count_i, .count_f = count_f,
+    .index_i = index_i, .index_f = index_f
+};
+
+#else
+
+// Two vectors an iteration keep two independent operations in flight, the rest of the
+// elements are done one by one
+#define VECTOR(name, attributes, T, V, width, set1, load, store, vop, op) \
+    attributes static inline void name ## _body(T* out, const T* l, const T* r, size_t n, bool la, bool ra) { \
+        const V ls = set1(la ? 0 : l[0]);                            \
+        const V rs = set1(ra ? 0 : r[0]);                            \
+        size_t i = 0;                                                \
+        for (; i + 2 * (width) <= n; i += 2 * (width)) {             \
+            const V a0 = la ? load(l + i) : ls;                      \
+            const V a1 = la ? load(l + i + (width)) : ls;            \
+            const V b0 = ra ? load(r + i) : rs;                      \
+            const V b1 = ra ? load(r + i + (width)) : rs;            \
+            store(out + i, vop(a0, b0));                             \
+            store(out + i + (width), vop(a1, b1));                   \
+        }                                                            \
+        for (; i < n; ++i) {                                         \
+            out[i] = AT(l, la, i) op AT(r, ra, i);                   \
+        }                                                            \
+    }                                                                \
+    KERNEL(name, attributes, T, name ## _body)
+
+// SSE2 is part of x86-64, it needs no check
+
+static inline __m128i sse2_load_i(const i64* p) { return _mm_loadu_si128((const __m128i*) p); }
+static inline void sse2_store_i(i64* p, __m128i v) { _mm_storeu_si128((__m128i*) p, v); }
+
+VECTOR(sse2_add_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, +)
+VECTOR(sse2_sub_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_sub_pd, -)
+VECTOR(sse2_mul_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_mul_pd, *)
+VECTOR(sse2_div_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_div_pd, /)
+VECTOR(sse2_add_i, , i64, __m128i, 2, _mm_set1_epi64x, sse2_load_i, sse2_store_i, _mm_add_epi64, +)
+VECTOR(sse2_sub_i, , i64, __m128i, 2, _mm_set1_epi64x, sse2_load_i, sse2_store_i, _mm_sub_epi64, -)
+
+// SSE2 compares 64 bit integers neither for order nor for equality. The minimum and maximum
+// of Ints are done one element at a time, equality from the two 32 bit halves.
+static inline __m128i sse2_equal_i64(__m128i a, __m128i b) {
+    const __m128i halves = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(halves, _mm_shuffle_epi32(halves, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+static inline int sse2_equal_i(const i64* p, __m128i x) { return _mm_movemask_pd(_mm_castsi128_pd(sse2_equal_i64(sse2_load_i(p), x))); }
+static inline int sse2_equal_f(const f64* p, __m128d x) { return _mm_movemask_pd(_mm_cmpeq_pd(_mm_loadu_pd(p), x)); }
+
+REDUCE(sse2_sum_i, , i64, __m128i, 2, _mm_set1_epi64x, sse2_load_i, sse2_store_i, _mm_add_epi64, SUM, 0)
+REDUCE(sse2_sum_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, SUM, 0)
+REDUCE(sse2_min_i, , i64, i64, 1, ONE, ONE_LOAD, ONE_STORE, MIN, MIN, a[0])
+REDUCE(sse2_min_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_min_pd, MIN, a[0])
+REDUCE(sse2_max_i, , i64, i64, 1, ONE, ONE_LOAD, ONE_STORE, MAX, MAX, a[0])
+REDUCE(sse2_max_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_max_pd, MAX, a[0])
+DOT(sse2_dot_f, , f64, __m128d, 2, _mm_set1_pd, _mm_loadu_pd, _mm_storeu_pd, _mm_add_pd, _mm_mul_pd)
+COUNT(sse2_count_i, , i64, __m128i, 2, _mm_set1_epi64x, sse2_equal_i)
+COUNT(sse2_count_f, , f64, __m128d, 2, _mm_set1_pd, sse2_equal_f)
+INDEX(sse2_index_i, , i64, __m128i, 2, _mm_set1_epi64x, sse2_equal_i)
+INDEX(sse2_index_f, , f64, __m128d, 2, _mm_set1_pd, sse2_equal_f)
+
+// Neither has a 64 bit integer multiply or divide, those stay scalar
+static const struct kernels sse2 = {
+    .isa = "sse2",
+    .floats = { sse2_add_f, sse2_sub_f, sse2_mul_f, sse2_div_f },
+    .ints = { sse2_add_i, sse2_sub_i, mul_i, div_i },
+    .sum_i = sse2_sum_i, .sum_f = sse2_sum_f,
+    .min_i = sse2_min_i, .min_f = sse2_min_f,
+    .max_i = sse2_max_i, .max_f = sse2_max_f,
+    .dot_i = dot_i, .dot_f = sse2_dot_f,
+    .count_i = sse2_count_i, .count_f = sse2_count_f,
+    .index_i = sse2_index_i, .index_f = sse2_index_f
+};
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline __m256i avx2_load_i(const i64* p) { return _mm256_loadu_si256((const __m256i*) p); }
+AVX2 static inline void avx2_store_i(i64* p, __m256i v) { _mm256_storeu_si256((__m256i*) p, v); }
+
+VECTOR(avx2_add_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, +)
+VECTOR(avx2_sub_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sub_pd, -)
+VECTOR(avx2_mul_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_mul_pd, *)
+VECTOR(avx2_div_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_div_pd, /)
+VECTOR(avx2_add_i, AVX2, i64, __m256i, 4, _mm256_set1_epi64x, avx2_load_i, avx2_store_i, _mm256_add_epi64, +)
+VECTOR(avx2_sub_i, AVX2, i64, __m256i, 4, _mm256_set1_epi64x, avx2_load_i, avx2_store_i, _mm256_sub_epi64, -)
+
+// The greater of a and b where b is greater, the lesser where a is
+AVX2 static inline __m256i avx2_min_i64(__m256i a, __m256i b) { return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(a, b)); }
+AVX2 static inline __m256i avx2_max_i64(__m256i a, __m256i b) { return _mm256_blendv_epi8(a, b, _mm256_cmpgt_epi64(b, a)); }
+
+AVX2 static inline int avx2_equal_i(const i64* p, __m256i x) { return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpeq_epi64(avx2_load_i(p), x))); }
+AVX2 static inline int avx2_equal_f(const f64* p, __m256d x) { return _mm256_movemask_pd(_mm256_cmp_pd(_mm256_loadu_pd(p), x, _CMP_EQ_OQ)); }
+
+REDUCE(avx2_sum_i, AVX2, i64, __m256i, 4, _mm256_set1_epi64x, avx2_load_i, avx2_store_i, _mm256_add_epi64, SUM, 0)
+REDUCE(avx2_sum_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, SUM, 0)
+REDUCE(avx2_min_i, AVX2, i64, __m256i, 4, _mm256_set1_epi64x, avx2_load_i, avx2_store_i, avx2_min_i64, MIN, a[0])
+REDUCE(avx2_min_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_min_pd, MIN, a[0])
+REDUCE(avx2_max_i, AVX2, i64, __m256i, 4, _mm256_set1_epi64x, avx2_load_i, avx2_store_i, avx2_max_i64, MAX, a[0])
+REDUCE(avx2_max_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_max_pd, MAX, a[0])
+DOT(avx2_dot_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_add_pd, _mm256_mul_pd)
+COUNT(avx2_count_i, AVX2, i64, __m256i, 4, _mm256_set1_epi64x, avx2_equal_i)
+COUNT(avx2_count_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, avx2_equal_f)
+INDEX(avx2_index_i, AVX2, i64, __m256i, 4, _mm256_set1_epi64x, avx2_equal_i)
+INDEX(avx2_index_f, AVX2, f64, __m256d, 4, _mm256_set1_pd, avx2_equal_f)
+
+static const struct kernels avx2 = {
+    .isa = "avx2",
+    .floats = { avx2_add_f, avx2_sub_f, avx2_mul_f, avx2_div_f },
+    .ints = { avx2_add_i, avx2_sub_i, mul_i, div_i },
+    .sum_i = avx2_sum_i, .sum_f = avx2_sum_f,
+    .min_i = avx2_min_i, .min_f = avx2_min_f,
+    .max_i = avx2_max_i, .max_f = avx2_max_f,
+    .dot_i = dot_i, .dot_f = avx2_dot_f,
+    .count_i = avx2_count_i, .count_f = avx2_count_f,
+    .index_i = avx2_index_i, .index_f = avx2_index_f
+};
+
+#endif
+
+static const struct kernels* selected = NULL;
+
+static const struct kernels* kernels(void) {
+    if (NULL == selected) {
+#ifdef MTR_X86_KERNELS
+        // cpuid, and xgetbv for whether the OS saves the ymm registers
+        __builtin_cpu_init();
+        selected = __builtin_cpu_supports("avx2") ? &avx2 : &sse2;
+#else
+        selected = &scalar;
+#endif
+    }
+    return selected;
+}
+
+const char* mtr_vector_isa(void) {
+    return kernels()->isa;
+}
+
+static const struct mtr_array* as_array(mtr_value value) {
+    return (const struct mtr_array*) MTR_AS_OBJ(value);
+}
+
+bool mtr_elementwise_size(u8 arrays, mtr_value l, mtr_value r, size_t* size) {
+    const size_t l_size = arrays & MTR_ELEMENTWISE_LEFT ? as_array(l)->size : 0;
+    const size_t r_size = arrays & MTR_ELEMENTWISE_RIGHT ? as_array(r)->size : 0;
+    *size = arrays & MTR_ELEMENTWISE_LEFT ? l_size : r_size;
+    return arrays != BOTH || l_size == r_size;
+}
+
+union number {
+    i64 i;
+    f64 f;
+};
+
+// The elements of the array packed in layout: its own when the array is packed like that, a copy
+// in *copy otherwise (the register engine keeps values)
+static const void* packed(const struct mtr_array* array, enum mtr_array_layout layout, void** copy) {
+    *copy = NULL;
+    if (array->layout == layout) {
+        return array->ints;
+    }
+
+    union number* elements = malloc(sizeof(union number) * (array->size + 1));
+    for (size_t i = 0; i < array->size; ++i) {
+        const mtr_value element = mtr_array_get(array, i);
+        if (layout == MTR_ARRAY_INTS) {
+            elements[i].i = MTR_AS_INT(element);
+        } else {
+            elements[i].f = MTR_AS_FLOAT(element);
+        }
+    }
+    *copy = elements;
+    return elements;
+}
+
+// The packed elements of an operand, and the number itself for the other side
+static const void* elements_of(mtr_value value, bool array, enum mtr_array_layout layout, union number* number, void** copy) {
+    if (array) {
+        return packed(as_array(value), layout, copy);
+    }
+
+    *copy = NULL;
+    if (layout == MTR_ARRAY_INTS) {
+        number->i = MTR_AS_INT(value);
+    } else {
+        number->f = MTR_AS_FLOAT(value);
+    }
+    return number;
+}
+
+void mtr_elementwise(struct mtr_array* out, enum mtr_elementwise op, u8 arrays, mtr_value l, mtr_value r) {
+    union number l_number;
+    union number r_number;
+    void* l_copy;
+    void* r_copy;
+    const void* left = elements_of(l, arrays & MTR_ELEMENTWISE_LEFT, out->layout, &l_number, &l_copy);
+    const void* right = elements_of(r, arrays & MTR_ELEMENTWISE_RIGHT, out->layout, &r_number, &r_copy);
+
+    if (out->layout == MTR_ARRAY_INTS) {
+        kernels()->ints[op](out->ints, left, right, out->size, arrays);
+    } else {
+        kernels()->floats[op](out->floats, left, right, out->size, arrays);
+    }
+
+    free(l_copy);
+    free(r_copy);
+}
+
+enum mtr_array_layout mtr_vector_layout(const struct mtr_array* array) {
+    if (array->layout != MTR_ARRAY_VALUES) {
+        return array->layout == MTR_ARRAY_FLOATS ? MTR_ARRAY_FLOATS : MTR_ARRAY_INTS;
+    }
+#ifndef MTR_UNTAGGED_VALUES
+    // the register engine doesn't pack, the first element tells
+    if (array->size > 0 && MTR_IS_FLOAT(array->elements[0])) {
+        return MTR_ARRAY_FLOATS;
+    }
+#endif
+    return MTR_ARRAY_INTS;
+}
+
+// Runs int_call or float_call on the packed elements of array, named a, with n of them
+#define REDUCTION(array, int_call, float_call)                       \
+    do {                                                             \
+        const enum mtr_array_layout layout = mtr_vector_layout(array); \
+        void* copy;                                                  \
+        const void* a = packed(array, layout, &copy);                \
+        const size_t n = (array)->size;                              \
+        mtr_value result;                                            \
+        if (layout == MTR_ARRAY_INTS) {                              \
+            result = int_call;                                       \
+        } else {                                                     \
+            result = float_call;                                     \
+        }                                                            \
+        free(copy);                                                  \
+        return result;                                               \
+    } while (false)
+
+mtr_value mtr_vector_sum(const struct mtr_array* array) {
+    REDUCTION(array, MTR_INT(kernels()->sum_i(a, n)), MTR_FLOAT(kernels()->sum_f(a, n)));
+}
+
+mtr_value mtr_vector_min(const struct mtr_array* array) {
+    REDUCTION(array, MTR_INT(kernels()->min_i(a, n)), MTR_FLOAT(kernels()->min_f(a, n)));
+}
+
+mtr_value mtr_vector_max(const struct mtr_array* array) {
+    REDUCTION(array, MTR_INT(kernels()->max_i(a, n)), MTR_FLOAT(kernels()->max_f(a, n)));
+}
+
+mtr_value mtr_vector_count(const struct mtr_array* array, mtr_value x) {
+    REDUCTION(array,
+        MTR_INT((i64) kernels()->count_i(a, n, MTR_AS_INT(x))),
+        MTR_INT((i64) kernels()->count_f(a, n, MTR_AS_FLOAT(x))));
+}
+
+static i64 found(size_t index, size_t n) {
+    return index == n ? -1 : (i64) index;
+}
+
+mtr_value mtr_vector_index_of(const struct mtr_array* array, mtr_value x) {
+    REDUCTION(array,
+        MTR_INT(found(kernels()->index_i(a, n, MTR_AS_INT(x)), n)),
+        MTR_INT(found(kernels()->index_f(a, n, MTR_AS_FLOAT(x)), n)));
+}
+
+mtr_value mtr_vector_dot(const struct mtr_array* l, const struct mtr_array* r) {
+    // r is read in the layout of l
+    const enum mtr_array_layout layout = mtr_vector_layout(l);
+    void* l_copy;
+    void* r_copy;
+    const void* a = packed(l, layout, &l_copy);
+    const void* b = packed(r, layout, &r_copy);
+    const mtr_value result = layout == MTR_ARRAY_INTS
+        ? MTR_INT(kernels()->dot_i(a, b, l->size))
+        : MTR_FLOAT(kernels()->dot_f(a, b, l->size));
+    free(l_copy);
+    free(r_copy);
+    return result;
+}
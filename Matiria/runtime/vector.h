@@ -0,0 +1,52 @@
+#ifndef MTR_VECTOR_H
+#define MTR_VECTOR_H
+
+#include "object.h"
+#include "value.h"
+
+#include "core/types.h"
+
+// Arithmetic over whole [Int] and [Float] arrays: + - * / between two arrays of the same size,
+// or between an array and a number on either side, make a new array (ELEMENTWISE_I and
+// ELEMENTWISE_F in bytecode.h). The loops run on packed elements (runtime/object.h) with AVX2
+// or SSE2 when the library is built for x86-64, picked once with CPUID, and in plain C elsewhere.
+
+enum mtr_elementwise {
+    MTR_ELEMENTWISE_ADD,
+    MTR_ELEMENTWISE_SUB,
+    MTR_ELEMENTWISE_MUL,
+    MTR_ELEMENTWISE_DIV
+};
+
+// Which operands are arrays, the other one is an Int or a Float
+#define MTR_ELEMENTWISE_LEFT  1u
+#define MTR_ELEMENTWISE_RIGHT 2u
+
+// The size of l op r, false when both are arrays and their sizes differ
+bool mtr_elementwise_size(u8 arrays, mtr_value l, mtr_value r, size_t* size);
+
+// out[i] = l[i] op r[i] for every element of out, which has that size and the INTS or FLOATS
+// layout of the element type. Ints are divided like DIV_I does.
+void mtr_elementwise(struct mtr_array* out, enum mtr_elementwise op, u8 arrays, mtr_value l, mtr_value r);
+
+// Reductions and searches over a whole [Int] or [Float] array, for the natives in stl/mtr_array.c.
+// They answer with an Int or a Float like the elements, count and index_of always with an Int.
+
+// INTS or FLOATS, what the elements are whatever the array keeps
+enum mtr_array_layout mtr_vector_layout(const struct mtr_array* array);
+
+mtr_value mtr_vector_sum(const struct mtr_array* array);
+// The array can't be empty
+mtr_value mtr_vector_min(const struct mtr_array* array);
+mtr_value mtr_vector_max(const struct mtr_array* array);
+// r has the size of l
+mtr_value mtr_vector_dot(const struct mtr_array* l, const struct mtr_array* r);
+// How many elements are equal to x, an Int or a Float like the elements
+mtr_value mtr_vector_count(const struct mtr_array* array, mtr_value x);
+// The first element equal to x, -1 when there is none
+mtr_value mtr_vector_index_of(const struct mtr_array* array, mtr_value x);
+
+// The instruction set the loops use: "avx2", "sse2" or "scalar"
+const char* mtr_vector_isa(void);
+
+#endif
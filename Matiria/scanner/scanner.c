@@ -264,3 +264,33 @@ bool mtr_token_compare(struct mtr_token t1, struct mtr_token t2) {
     bool same_type = t1.type == t2.type;
     return same_type && t1.length == t2.length && memcmp(t1.start, t2.start, t1.length) == 0;
 }
+
+u64 mtr_token_to_int(struct mtr_token token) {
+    u64 s = 0;
+    for (u32 i = 0; i < token.length; ++i) {
+        s *= 10;
+        s += token.start[i] - '0';
+    }
+    return s;
+}
+
+f64 mtr_token_to_float(struct mtr_token token) {
+    f64 s = 0;
+    const char* c = token.start;
+    while (*c != '.') {
+        s *= 10;
+        s += *c - '0';
+        c++;
+    }
+
+    c++;
+
+    u64 i = 10;
+    while (c != token.start + token.length) {
+        f64 x = (f64)(*c - '0') / i;
+        s += x;
+        c++;
+        i *= 10;
+    }
+    return s;
+}
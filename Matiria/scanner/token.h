@@ -56,6 +56,9 @@ struct mtr_token {
 
 bool mtr_token_compare(struct mtr_token t1, struct mtr_token t2);
 
+u64 mtr_token_to_int(struct mtr_token token);
+f64 mtr_token_to_float(struct mtr_token token);
+
 extern const struct mtr_token invalid_token;
 
 #endif
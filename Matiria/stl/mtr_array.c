@@ -0,0 +1,103 @@
+#include "core/log.h"
+#include "mtr_stdlib.h"
+
+#include "package.h"
+#include "runtime/object.h"
+#include "runtime/value.h"
+#include "runtime/vector.h"
+
+#include "core/types.h"
+
+#include <string.h>
+
+// Scripts declare the ones they use with the element type they need, e.g.
+//     fn sum([Float] a) -> Float ...
+// and the loops in runtime/vector.h find out which it is from the array.
+
+static const struct mtr_array* array_arg(mtr_value value) {
+    return (const struct mtr_array*) MTR_AS_OBJ(value);
+}
+
+// Natives get every argument as Any, untagged Ints and Floats come boxed
+static mtr_value number_arg(mtr_value value) {
+#ifdef MTR_UNTAGGED_VALUES
+    return ((const struct mtr_box*) MTR_AS_OBJ(value))->value;
+#else
+    return value;
+#endif
+}
+
+// NULL for empty arrays, after the native failed
+static const struct mtr_array* not_empty(mtr_value value, const char* name) {
+    const struct mtr_array* array = array_arg(value);
+    if (array->size == 0) {
+        MTR_LOG_ERROR("%s of an empty array", name);
+        mtr_native_error();
+        return NULL;
+    }
+    return array;
+}
+
+static mtr_value mtr_sum(u8 argc, mtr_value* argv) {
+    return mtr_vector_sum(array_arg(argv[0]));
+}
+
+static mtr_value mtr_min(u8 argc, mtr_value* argv) {
+    const struct mtr_array* array = not_empty(argv[0], "min");
+    return array != NULL ? mtr_vector_min(array) : MTR_NIL;
+}
+
+static mtr_value mtr_max(u8 argc, mtr_value* argv) {
+    const struct mtr_array* array = not_empty(argv[0], "max");
+    return array != NULL ? mtr_vector_max(array) : MTR_NIL;
+}
+
+static mtr_value mtr_dot(u8 argc, mtr_value* argv) {
+    const struct mtr_array* l = array_arg(argv[0]);
+    const struct mtr_array* r = array_arg(argv[1]);
+    if (l->size != r->size) {
+        MTR_LOG_ERROR("dot of arrays of size %zu and %zu", l->size, r->size);
+        mtr_native_error();
+        return MTR_NIL;
+    }
+    return mtr_vector_dot(l, r);
+}
+
+// Always a Float
+static mtr_value mtr_mean(u8 argc, mtr_value* argv) {
+    const struct mtr_array* array = not_empty(argv[0], "mean");
+    if (array == NULL) {
+        return MTR_NIL;
+    }
+    const mtr_value sum = mtr_vector_sum(array);
+    const f64 total = mtr_vector_layout(array) == MTR_ARRAY_INTS ? (f64) MTR_AS_INT(sum) : MTR_AS_FLOAT(sum);
+    return MTR_FLOAT(total / (f64) array->size);
+}
+
+static mtr_value mtr_count_if_equal(u8 argc, mtr_value* argv) {
+    return mtr_vector_count(array_arg(argv[0]), number_arg(argv[1]));
+}
+
+static mtr_value mtr_index_of(u8 argc, mtr_value* argv) {
+    return mtr_vector_index_of(array_arg(argv[0]), number_arg(argv[1]));
+}
+
+// Only the names the script declared, and didn't define itself, get a native
+static void add(struct mtr_package* package, mtr_native native, const char* name) {
+    const struct mtr_symbol* s = mtr_symbol_table_get(&package->symbols, name, strlen(name));
+    if (NULL == s || NULL != package->objects[s->index]) {
+        return;
+    }
+    struct mtr_native_fn* n = mtr_new_native_function(native);
+    mtr_package_insert_native_function(package, (struct mtr_object*) n, name);
+}
+
+void mtr_add_array(struct mtr_package* package) {
+    add(package, mtr_sum, "sum");
+    add(package, mtr_min, "min");
+    add(package, mtr_max, "max");
+    add(package, mtr_dot, "dot");
+    add(package, mtr_mean, "mean");
+    add(package, mtr_count_if_equal, "count_if_equal");
+    add(package, mtr_index_of, "index_of");
+}
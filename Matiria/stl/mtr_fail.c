@@ -0,0 +1,29 @@
+#include "core/log.h"
+#include "mtr_stdlib.h"
+
+#include "package.h"
+#include "runtime/object.h"
+#include "runtime/value.h"
+
+#include "core/types.h"
+
+#include <string.h>
+
+// Scripts declare it as
+//     fn fail() ...
+// and call it where they got something wrong.
+
+static mtr_value mtr_fail(u8 argc, mtr_value* argv) {
+    MTR_LOG_ERROR("fail() was called");
+    mtr_native_error();
+    return MTR_NIL;
+}
+
+void mtr_add_fail(struct mtr_package* package) {
+    const struct mtr_symbol* s = mtr_symbol_table_get(&package->symbols, "fail", strlen("fail"));
+    if (NULL == s || NULL != package->objects[s->index]) {
+        return;
+    }
+    struct mtr_native_fn* n = mtr_new_native_function(mtr_fail);
+    mtr_package_insert_native_function(package, (struct mtr_object*) n, "fail");
+}
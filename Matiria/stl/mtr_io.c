@@ -11,96 +11,118 @@
 
 #include "core/types.h"
 
-static void print_value(mtr_value value) {
-    switch (value.type) {
-    case MTR_VAL_INT: {
-        MTR_PRINT("%li", value.integer);
-        break;
+// Tagged values know what they are, untagged ones are told by their container
+#ifdef MTR_UNTAGGED_VALUES
+#   define ELEMENT_TYPE(array, value)   ((array)->layout == MTR_ARRAY_VALUES ? MTR_VAL_OBJ : (array)->layout == MTR_ARRAY_FLOATS ? MTR_VAL_FLOAT : MTR_VAL_INT)
+#   define KEY_TYPE(map, value)         (map)->key_type
+#   define VALUE_TYPE(map, value)       (map)->value_type
+#else
+#   define ELEMENT_TYPE(array, value)   MTR_TYPE_OF(value)
+#   define KEY_TYPE(map, value)         MTR_TYPE_OF(value)
+#   define VALUE_TYPE(map, value)       MTR_TYPE_OF(value)
+#endif
+
+static void print_value(mtr_value value, enum mtr_value_type type) {
+    if (type == MTR_VAL_INT) {
+        MTR_PRINT("%li", MTR_AS_INT(value));
+        return;
+    }
+
+    if (type == MTR_VAL_FLOAT) {
+        MTR_PRINT("%f", MTR_AS_FLOAT(value));
+        return;
     }
-    case MTR_VAL_FLOAT: {
-        MTR_PRINT("%f", value.floating);
+
+    struct mtr_object* object = MTR_AS_OBJ(value);
+    switch (object->type) {
+    case MTR_OBJ_STRING: {
+        struct mtr_string* s = (struct mtr_string*) object;
+        MTR_PRINT("%.*s", (u32)s->length, s->s);
         break;
     }
-    case MTR_VAL_OBJ: {
-        switch (value.object->type) {
-        case MTR_OBJ_STRING: {
-            struct mtr_string* s = (struct mtr_string*) value.object;
-            MTR_PRINT("%.*s", (u32)s->length, s->s);
+    case MTR_OBJ_ARRAY: {
+        struct mtr_array* a = (struct mtr_array*) object;
+        if (a->size == 0) {
+            MTR_PRINT("[]");
             break;
         }
-        case MTR_OBJ_ARRAY: {
-            struct mtr_array* a = (struct mtr_array*) value.object;
-            if (a->size == 0) {
-                MTR_PRINT("[]");
-                break;
-            }
-            MTR_PRINT("[");
-            for (size_t i = 0; i < a->size-1; ++i) {
-                print_value(a->elements[i]);
-                MTR_PRINT(", ");
-            }
-            print_value(a->elements[a->size-1]);
-            MTR_PRINT("]");
-            break;
+        MTR_PRINT("[");
+        for (size_t i = 0; i < a->size-1; ++i) {
+            const mtr_value element = mtr_array_get(a, i);
+            print_value(element, ELEMENT_TYPE(a, element));
+            MTR_PRINT(", ");
         }
-        case MTR_OBJ_MAP: {
-            struct mtr_map* m = (struct mtr_map*) value.object;
-            MTR_PRINT("{");
-
-            size_t i = 0;
-            struct mtr_map_element* e = NULL;
+        const mtr_value last = mtr_array_get(a, a->size-1);
+        print_value(last, ELEMENT_TYPE(a, last));
+        MTR_PRINT("]");
+        break;
+    }
+    case MTR_OBJ_MAP: {
+        struct mtr_map* m = (struct mtr_map*) object;
+        MTR_PRINT("{");
 
-            // print first element
-            for (; i < m->capacity-1; ++i) {
-                e = mtr_get_key_value_pair(m, i);
-                if (e == NULL) {
-                    continue;
-                }
+        size_t i = 0;
+        struct mtr_map_element* e = NULL;
 
-                print_value(e->key);
-                MTR_PRINT(": ");
-                print_value(e->value);
-                break;
+        // print first element
+        for (; i < m->capacity-1; ++i) {
+            e = mtr_get_key_value_pair(m, i);
+            if (e == NULL) {
+                continue;
             }
 
-            // print middle elements;
-            for (++i; i < m->capacity-1; ++i) {
-                e = mtr_get_key_value_pair(m, i);
-                if (e == NULL) {
-                    continue;
-                }
-                MTR_PRINT(", ");
-                print_value(e->key);
-                MTR_PRINT(": ");
-                print_value(e->value);
-            }
+            print_value(e->key, KEY_TYPE(m, e->key));
+            MTR_PRINT(": ");
+            print_value(e->value, VALUE_TYPE(m, e->value));
+            break;
+        }
 
-            // print last elements;
-            e = mtr_get_key_value_pair(m, m->capacity-1);
-            if (e != NULL) {
-                MTR_PRINT(", ");
-                print_value(e->key);
-                MTR_PRINT(": ");
-                print_value(e->value);
+        // print middle elements;
+        for (++i; i < m->capacity-1; ++i) {
+            e = mtr_get_key_value_pair(m, i);
+            if (e == NULL) {
+                continue;
             }
-            MTR_PRINT("}");
-            break;
+            MTR_PRINT(", ");
+            print_value(e->key, KEY_TYPE(m, e->key));
+            MTR_PRINT(": ");
+            print_value(e->value, VALUE_TYPE(m, e->value));
         }
-        case MTR_OBJ_FUNCTION:
-        case MTR_OBJ_NATIVE_FN:
-            MTR_PRINT("%s", mtr_obj_type_to_str(value.object));
-        case MTR_OBJ_STRUCT:
-            MTR_PRINT("%s is not printable", mtr_obj_type_to_str(value.object));
-        default:
-            break;
+
+        // print last elements;
+        e = mtr_get_key_value_pair(m, m->capacity-1);
+        if (e != NULL) {
+            MTR_PRINT(", ");
+            print_value(e->key, KEY_TYPE(m, e->key));
+            MTR_PRINT(": ");
+            print_value(e->value, VALUE_TYPE(m, e->value));
         }
+        MTR_PRINT("}");
+        break;
     }
+    case MTR_OBJ_BOX: {
+        struct mtr_box* b = (struct mtr_box*) object;
+        print_value(b->value, b->type);
+        break;
+    }
+    case MTR_OBJ_FUNCTION:
+    case MTR_OBJ_NATIVE_FN:
+        MTR_PRINT("%s", mtr_obj_type_to_str(object));
+    case MTR_OBJ_STRUCT:
+        MTR_PRINT("%s is not printable", mtr_obj_type_to_str(object));
+    default:
+        break;
     }
 }
 
 mtr_value mtr_print(u8 argc, mtr_value* argv) {
     mtr_value value = *argv;
-    print_value(value);
+#ifdef MTR_UNTAGGED_VALUES
+    // Ints and Floats passed as Any are boxed
+    print_value(value, MTR_VAL_OBJ);
+#else
+    print_value(value, MTR_TYPE_OF(value));
+#endif
     MTR_PRINT("\n");
     return MTR_NIL;
 }
@@ -4,5 +4,9 @@
 #include "package.h"
 
 void mtr_add_io(struct mtr_package* package);
+// sum, min, max, dot, mean, count_if_equal and index_of over [Int] and [Float] arrays
+void mtr_add_array(struct mtr_package* package);
+// fail, stops the script with a runtime error
+void mtr_add_fail(struct mtr_package* package);
 
 #endif
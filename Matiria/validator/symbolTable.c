@@ -107,6 +107,14 @@ void mtr_symbol_table_remove(const struct mtr_symbol_table* table, const char* k
     entry->length = strlen(tombstone);
 }
 
+const struct mtr_symbol* mtr_symbol_table_at(const struct mtr_symbol_table* table, size_t i) {
+    const struct symbol_entry* entry = table->entries + i;
+    if (NULL == entry->key || entry->key == tombstone) {
+        return NULL;
+    }
+    return &entry->symbol;
+}
+
 // void mtr_init_scope(struct mtr_scope* scope, struct mtr_scope* parent) {
 //     scope->parent = parent;
 //     mtr_init_symbol_table(&scope->symbols);
@@ -16,4 +16,7 @@ void mtr_symbol_table_insert(struct mtr_symbol_table* table, const char* key, si
 struct mtr_symbol* mtr_symbol_table_get(const struct mtr_symbol_table* table, const char* key, size_t length);
 void mtr_symbol_table_remove(const struct mtr_symbol_table* table, const char* key, size_t length);
 
+// The symbol in slot i < table->capacity, NULL when the slot is empty or was removed
+const struct mtr_symbol* mtr_symbol_table_at(const struct mtr_symbol_table* table, size_t i);
+
 #endif
@@ -53,6 +53,7 @@ static size_t add_symbol(struct validator* validator, struct mtr_symbol symbol)
     symbol.index = validator->count++;
     symbol.is_global = validator->enclosing == NULL;
     symbol.upvalue = false;
+    symbol.native = false;
     mtr_symbol_table_insert(&validator->symbols, symbol.token.start, symbol.token.length, symbol);
     return symbol.index;
 }
@@ -90,6 +91,7 @@ static size_t add_upvalue(struct validator* validator, struct mtr_symbol symbol,
     u16 index = closure->count++;
 
     closure->upvalues[index].token = symbol.token;
+    closure->upvalues[index].type = symbol.type;
     closure->upvalues[index].index = symbol.index;
     closure->upvalues[index].local = local;
     return index;
@@ -127,7 +129,71 @@ static bool is_literal(struct mtr_expr* expr) {
 //     return t.type == MTR_DATA_FN;
 // }
 
-static bool check_assignemnt(const struct mtr_type* assign_to, const struct mtr_type* what) {
+#ifdef MTR_UNTAGGED_VALUES
+
+// Untagged Ints, Floats and Bools are boxed when one of them becomes Any or a union (compiler.c),
+// not when they are the elements of an array or a map or what a function takes and returns. A
+// type that holds them as they are can't stand for one that holds boxes, [Int] isn't an [Any].
+static bool is_unboxed(const struct mtr_type* type) {
+    return type->type == MTR_DATA_INT || type->type == MTR_DATA_FLOAT || type->type == MTR_DATA_BOOL;
+}
+
+static bool same_elements(const struct mtr_type* to, const struct mtr_type* from);
+
+static bool same_values(const struct mtr_type* to, const struct mtr_type* from) {
+    if (NULL == to || NULL == from) {
+        return true;
+    }
+    return is_unboxed(to) == is_unboxed(from) && same_elements(to, from);
+}
+
+static bool same_elements(const struct mtr_type* to, const struct mtr_type* from) {
+    if (to->type != from->type) {
+        return true;
+    }
+
+    switch (to->type) {
+    case MTR_DATA_ARRAY:
+        return same_values(((const struct mtr_array_type*) to)->element, ((const struct mtr_array_type*) from)->element);
+    case MTR_DATA_MAP: {
+        const struct mtr_map_type* t = (const struct mtr_map_type*) to;
+        const struct mtr_map_type* f = (const struct mtr_map_type*) from;
+        return same_values(t->key, f->key) && same_values(t->value, f->value);
+    }
+    case MTR_DATA_FN: {
+        const struct mtr_function_type* t = (const struct mtr_function_type*) to;
+        const struct mtr_function_type* f = (const struct mtr_function_type*) from;
+        for (u8 i = 0; i < t->argc; ++i) {
+            if (!same_values(t->argv[i], f->argv[i])) {
+                return false;
+            }
+        }
+        return same_values(t->return_, f->return_);
+    }
+    default:
+        return true;
+    }
+}
+
+// The elements of an array literal are converted one at a time, like the arguments of a call
+static bool converts(const struct mtr_type* to, const struct mtr_type* from, struct mtr_expr* expr) {
+    if (expr->type == MTR_EXPR_ARRAY_LITERAL && to->type == MTR_DATA_ARRAY && from->type == MTR_DATA_ARRAY) {
+        const struct mtr_array_literal* array = (const struct mtr_array_literal*) expr;
+        const struct mtr_type* element = ((const struct mtr_array_type*) to)->element;
+        const struct mtr_type* written = ((const struct mtr_array_type*) from)->element;
+        for (u8 i = 0; i < array->count; ++i) {
+            if (!converts(element, written, array->expressions[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return same_elements(to, from);
+}
+
+#endif
+
+static bool check_assignemnt(const struct mtr_type* assign_to, const struct mtr_type* what, struct mtr_expr* expr) {
     if (assign_to == what) {
         return true;
     }
@@ -148,7 +214,12 @@ static bool check_assignemnt(const struct mtr_type* assign_to, const struct mtr_
 
         return false;
     }
+#ifdef MTR_UNTAGGED_VALUES
+    return converts(assign_to, what, expr);
+#else
+    (void) expr;
     return true;
+#endif
 }
 
 static void expr_error(struct mtr_expr* expr, const char* message, const char* source) {
@@ -198,9 +269,37 @@ static void expr_error(struct mtr_expr* expr, const char* message, const char* s
     }
 }
 
+static bool is_arithmetic(enum mtr_token_type op) {
+    return op == MTR_TOKEN_PLUS || op == MTR_TOKEN_MINUS || op == MTR_TOKEN_STAR || op == MTR_TOKEN_SLASH;
+}
+
+// [Int] and [Float] arrays do arithmetic element by element, with an array of the same type
+// or with a number of their element type on either side. The result is a new array.
+static bool is_elementwise(enum mtr_token_type op, const struct mtr_type* lhs, const struct mtr_type* rhs) {
+    // unary operators have no rhs
+    return is_arithmetic(op) && NULL != rhs && (lhs->type == MTR_DATA_ARRAY || rhs->type == MTR_DATA_ARRAY);
+}
+
+static struct mtr_type* elementwise_type(const struct mtr_type* lhs, const struct mtr_type* rhs) {
+    const struct mtr_type* array = lhs->type == MTR_DATA_ARRAY ? lhs : rhs;
+    const struct mtr_type* other = array == lhs ? rhs : lhs;
+    const struct mtr_type* element = ((const struct mtr_array_type*) array)->element;
+    if (element->type != MTR_DATA_INT && element->type != MTR_DATA_FLOAT) {
+        return NULL;
+    }
+    if (other != array && other != element) {
+        return NULL;
+    }
+    return (struct mtr_type*) array;
+}
+
 static struct mtr_type* get_operator_type(struct mtr_type_list* list, struct mtr_token op, const struct mtr_type* lhs, const struct mtr_type* rhs) {
     struct mtr_type t;
 
+    if (is_elementwise(op.type, lhs, rhs)) {
+        return elementwise_type(lhs, rhs);
+    }
+
     switch (op.type)
     {
     case MTR_TOKEN_BANG:
@@ -246,7 +345,7 @@ static struct mtr_type* analyze_binary(struct mtr_binary* expr, struct validator
         return NULL;
     }
 
-    if (l != r) {
+    if (l != r && !is_elementwise(expr->operator.token.type, l, r)) {
         mtr_report_error(expr->operator.token, "Invalid operation between objects of different types.", validator->source);
         return NULL;
     }
@@ -334,7 +433,7 @@ static bool check_params(struct mtr_function_type* f, struct mtr_call* call, str
         }
 
         struct mtr_type* to = f->argv[i];
-        bool match = check_assignemnt(to, from);
+        bool match = check_assignemnt(to, from, a);
         if (!match) {
             expr_error(a, "Wrong type of argument.", validator->source);
             return false;
@@ -567,7 +666,7 @@ static struct mtr_stmt* analyze_variable(struct mtr_variable* decl, struct valid
     }
 
     if (decl->value) {
-        if (!check_assignemnt(decl->symbol.type, value_type)) {
+        if (!check_assignemnt(decl->symbol.type, value_type, decl->value)) {
             mtr_report_error(decl->symbol.token, "Invalid assignement to variable of different type", validator->source);
             expr = false;
         }
@@ -593,8 +692,9 @@ static struct mtr_stmt* analyze_function_no_validator(struct mtr_function_decl*
 
     struct mtr_stmt* checked = analyze(stmt->body, validator);
     stmt->body = checked;
-
-    all_ok = checked != NULL && all_ok;
+    if (NULL == checked) {
+        return sanitize_stmt(stmt, false);
+    }
 
     struct mtr_function_type* type =  (struct mtr_function_type*) stmt->symbol.type;
     struct mtr_stmt* last = NULL;
@@ -658,7 +758,7 @@ static struct mtr_stmt* analyze_assignment(struct mtr_assignment* stmt, struct v
     TYPE_CHECK(expr_t);
 
     bool expr_ok = true;
-    if (!check_assignemnt(right_t, expr_t)) {
+    if (!check_assignemnt(right_t, expr_t, stmt->expression)) {
         expr_error(stmt->right, "Invalid assignement to variable of different type", validator->source);
         expr_ok = false;
     }
@@ -858,6 +958,7 @@ static bool load_native_fn(struct mtr_function_decl* stmt, struct validator* val
     }
 
     stmt->symbol.index = i;
+    find_symbol(validator, stmt->symbol.token)->native = true;
     return true;
 }
 
@@ -1,8 +1,18 @@
+// fileno is hidden by -std=c17 otherwise
+#define _DEFAULT_SOURCE
+
 #include "AST/type.h"
+#include "bytecode.h"
+#include "compiler.h"
 #include "core/exitCode.h"
+#include "core/file.h"
 #include "core/log.h"
 #include "debug/dump.h"
 #include "launch.h"
+#include "package.h"
+#include "aot/aot.h"
+#include "jit/jit.h"
+#include "runtime/memory.h"
 
 #include "AST/typeList.h"
 
@@ -15,6 +25,16 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _WIN32
+#   include <io.h>
+#   define dup _dup
+#   define dup2 _dup2
+#   define close _close
+#   define fileno _fileno
+#else
+#   include <unistd.h>
+#endif
+
 
 #ifdef MTR_MK
 #   define MTR_PATH(path) "Tests/"path
@@ -22,6 +42,73 @@
 #   define MTR_PATH(path) "../../../Tests/"path
 #endif
 
+// Runs the file with what it prints written to 'output' instead of the terminal
+static enum mtr_exit_code launch_printing(const char* path, char* output, size_t size) {
+    fflush(stdout);
+    FILE* file = tmpfile();
+    const int terminal = dup(fileno(stdout));
+    dup2(fileno(file), fileno(stdout));
+    const enum mtr_exit_code code = mtr_launch(path);
+    fflush(stdout);
+    dup2(terminal, fileno(stdout));
+    close(terminal);
+
+    rewind(file);
+    const size_t read = fread(output, 1, size - 1, file);
+    output[read] = '\0';
+    fclose(file);
+    return code;
+}
+
+#ifndef MTR_REGISTER_VM
+// Compiles the file without running it, the tests look at the bytecode the optimizer left
+struct compiled {
+    char* source;
+    struct mtr_package package;
+};
+
+static bool compile(const char* path, struct compiled* c) {
+    mtr_init_package(&c->package);
+    c->source = mtr_read_file(path);
+    return c->source != NULL && mtr_compile(c->source, &c->package) == MTR_OK;
+}
+
+static void delete_compiled(struct compiled* c) {
+    mtr_delete_package(&c->package);
+    free(c->source);
+}
+
+static const struct mtr_chunk* chunk_of(struct compiled* c, const char* function) {
+    return &((const struct mtr_function*) mtr_package_get_function_by_name(&c->package, function))->chunk;
+}
+
+// instructions of the function with the op code
+static u32 count_ops(struct compiled* c, const char* function, u8 op) {
+    const struct mtr_chunk* chunk = chunk_of(c, function);
+    u32 count = 0;
+    for (size_t offset = 0; offset < chunk->size; offset += mtr_instruction_length(chunk->bytecode + offset)) {
+        count += chunk->bytecode[offset] == op;
+    }
+    return count;
+}
+
+// calls the function makes to 'callee', inlined ones aren't there any more
+static u32 count_calls(struct compiled* c, const char* function, const char* callee) {
+    const struct mtr_chunk* chunk = chunk_of(c, function);
+    const struct mtr_object* target = mtr_package_get_function_by_name(&c->package, callee);
+    u32 count = 0;
+    for (size_t offset = 0; offset < chunk->size; offset += mtr_instruction_length(chunk->bytecode + offset)) {
+        const u8 op = chunk->bytecode[offset];
+        if (op == MTR_OP_CALL_GLOBAL || op == MTR_OP_TAIL_CALL_GLOBAL) {
+            u16 index;
+            memcpy(&index, chunk->bytecode + offset + 1, sizeof(index));
+            count += c->package.objects[index] == target;
+        }
+    }
+    return count;
+}
+#endif
+
 TEST_CASE(no_file) {
     CHECK(mtr_launch("nofile.mtr") == MTR_FILE_ERROR);
 }
@@ -30,6 +117,10 @@ TEST_CASE(simple) {
     CHECK(mtr_launch(MTR_PATH("main.mtr")) == MTR_OK);
 }
 
+TEST_CASE(fail) {
+    CHECK(mtr_launch(MTR_PATH("fail.mtr")) == MTR_RUNTIME_ERROR);
+}
+
 TEST_CASE(parser) {
     CHECK(mtr_launch(MTR_PATH("parser_error.mtr")) == MTR_PARSER_ERROR);
 }
@@ -50,15 +141,213 @@ TEST_CASE(scope) {
     CHECK(mtr_launch(MTR_PATH("scope.mtr")) == MTR_OK);
 }
 
+TEST_CASE(recursion) {
+    CHECK(mtr_launch(MTR_PATH("recursion.mtr")) == MTR_OK);
+}
+
+TEST_CASE(comparisons) {
+    CHECK(mtr_launch(MTR_PATH("comparisons.mtr")) == MTR_OK);
+}
+
+TEST_CASE(peephole) {
+    CHECK(mtr_launch(MTR_PATH("peephole.mtr")) == MTR_OK);
+}
+
+TEST_CASE(ssa) {
+    CHECK(mtr_launch(MTR_PATH("ssa.mtr")) == MTR_OK);
+}
+
+TEST_CASE(inlining) {
+    CHECK(mtr_launch(MTR_PATH("inline.mtr")) == MTR_OK);
+
+#ifndef MTR_REGISTER_VM
+    struct compiled c;
+    CHECK(compile(MTR_PATH("inline.mtr"), &c));
+    CHECK(count_calls(&c, "main", "answer") == 0);
+    CHECK(count_calls(&c, "main", "get_count") == 0);
+    CHECK(count_calls(&c, "main", "pair") == 0);
+    CHECK(count_calls(&c, "main", "first") == 0);
+    CHECK(count_calls(&c, "main", "twice_pair") == 0);
+    CHECK(count_calls(&c, "twice_pair", "pair") == 0);
+    CHECK(count_calls(&c, "main", "half") == 0);
+    // bodies that aren't one expression and recursive functions are still called
+    CHECK(count_calls(&c, "main", "bump") == 3);
+    CHECK(count_calls(&c, "main", "countdown") == 1);
+    delete_compiled(&c);
+#endif
+}
+
+TEST_CASE(escape) {
+    CHECK(mtr_launch(MTR_PATH("escape.mtr")) == MTR_OK);
+
+#ifndef MTR_REGISTER_VM
+    struct compiled c;
+    CHECK(compile(MTR_PATH("escape.mtr"), &c));
+    CHECK(count_ops(&c, "main", MTR_OP_FRAME_CONSTRUCTOR) == 1);
+    CHECK(count_ops(&c, "main", MTR_OP_CONSTRUCTOR) == 0);
+    // squares, the one printed, last, current, the outer one of nested and the argument of sum_of
+    CHECK(count_ops(&c, "main", MTR_OP_FRAME_ARRAY_LITERAL) == 6);
+    CHECK(count_ops(&c, "main", MTR_OP_ARRAY_LITERAL) == 1);
+    CHECK(count_ops(&c, "depth", MTR_OP_FRAME_ARRAY_LITERAL) == 1);
+    // returned
+    CHECK(count_ops(&c, "made", MTR_OP_FRAME_CONSTRUCTOR) == 0);
+    delete_compiled(&c);
+#endif
+}
+
+TEST_CASE(bounds) {
+    CHECK(mtr_launch(MTR_PATH("bounds.mtr")) == MTR_OK);
+
+    // the iterations in bounds run before the error
+    char output[256];
+    CHECK(launch_printing(MTR_PATH("boundsError.mtr"), output, sizeof(output)) == MTR_RUNTIME_ERROR);
+    CHECK(strncmp(output, "0\n1\n2\n3\n", 8) == 0);
+    CHECK(strstr(output, "Out of bounds") != NULL);
+
+#ifndef MTR_REGISTER_VM
+    struct compiled c;
+    CHECK(compile(MTR_PATH("bounds.mtr"), &c));
+    // every access of main has a constant index or one its loops keep inside a literal
+    CHECK(count_ops(&c, "main", MTR_OP_INDEX_GET_ARRAY_UNCHECKED) == 6);
+    CHECK(count_ops(&c, "main", MTR_OP_INDEX_SET_ARRAY_UNCHECKED) == 1);
+    CHECK(count_ops(&c, "main", MTR_OP_INDEX_GET_ARRAY) == 0);
+    CHECK(count_ops(&c, "main", MTR_OP_INDEX_SET_ARRAY) == 0);
+    // checked before the loop, the copy that runs when that fails checks every access
+    CHECK(count_ops(&c, "sum", MTR_OP_CHECK_BOUNDS) == 1);
+    CHECK(count_ops(&c, "sum", MTR_OP_INDEX_GET_ARRAY_UNCHECKED) == 1);
+    CHECK(count_ops(&c, "sum", MTR_OP_INDEX_GET_ARRAY) == 1);
+    CHECK(count_ops(&c, "clear", MTR_OP_INDEX_SET_ARRAY_UNCHECKED) == 1);
+    // the inner loop, grid[row] stays checked
+    CHECK(count_ops(&c, "sum_grid", MTR_OP_INDEX_GET_ARRAY_UNCHECKED) == 1);
+    CHECK(count_ops(&c, "sum_odd", MTR_OP_INDEX_GET_ARRAY_UNCHECKED) == 0);
+    delete_compiled(&c);
+#endif
+}
+
+TEST_CASE(packed) {
+    CHECK(mtr_launch(MTR_PATH("packed.mtr")) == MTR_OK);
+#ifdef MTR_UNTAGGED_VALUES
+    CHECK(mtr_launch(MTR_PATH("covariance.mtr")) == MTR_TYPE_ERROR);
+#else
+    CHECK(mtr_launch(MTR_PATH("covariance.mtr")) == MTR_OK);
+#endif
+}
+
+TEST_CASE(elementwise) {
+    CHECK(mtr_launch(MTR_PATH("elementwise.mtr")) == MTR_OK);
+}
+
+TEST_CASE(reductions) {
+    CHECK(mtr_launch(MTR_PATH("reductions.mtr")) == MTR_OK);
+    CHECK(mtr_launch(MTR_PATH("floatReductions.mtr")) == MTR_OK);
+    CHECK(mtr_launch(MTR_PATH("emptyMin.mtr")) == MTR_RUNTIME_ERROR);
+    CHECK(mtr_launch(MTR_PATH("dotSizes.mtr")) == MTR_RUNTIME_ERROR);
+#ifdef MTR_JIT_ENABLED
+    // the native called from machine code
+    const u32 threshold = mtr_jit_threshold;
+    mtr_jit_threshold = 1;
+    CHECK(mtr_launch(MTR_PATH("emptyMin.mtr")) == MTR_RUNTIME_ERROR);
+    mtr_jit_threshold = threshold;
+#endif
+}
+
+TEST_CASE(garbage) {
+    CHECK(mtr_launch(MTR_PATH("garbage.mtr")) == MTR_OK);
+    CHECK(mtr_launch(MTR_PATH("writeBarrier.mtr")) == MTR_OK);
+    CHECK(mtr_launch(MTR_PATH("incremental.mtr")) == MTR_OK);
+#ifdef MTR_GC_PARALLEL
+    // several threads even when there is one processor, they have to steal from each other
+    const u32 threads = mtr_gc_threads;
+    mtr_gc_threads = 4;
+    CHECK(mtr_launch(MTR_PATH("writeBarrier.mtr")) == MTR_OK);
+    CHECK(mtr_launch(MTR_PATH("incremental.mtr")) == MTR_OK);
+    mtr_gc_threads = threads;
+#endif
+}
+
+TEST_CASE(constants) {
+    CHECK(mtr_launch(MTR_PATH("constants.mtr")) == MTR_OK);
+}
+
+TEST_CASE(values) {
+    CHECK(mtr_launch(MTR_PATH("values.mtr")) == MTR_OK);
+}
+
+TEST_CASE(stack_maps) {
+    CHECK(mtr_launch(MTR_PATH("stackMaps.mtr")) == MTR_OK);
+}
+
+TEST_CASE(quickening) {
+    CHECK(mtr_launch(MTR_PATH("quickening.mtr")) == MTR_OK);
+}
+
+TEST_CASE(tail_call) {
+    CHECK(mtr_launch(MTR_PATH("tailCall.mtr")) == MTR_OK);
+}
+
+TEST_CASE(jit) {
+    CHECK(mtr_launch(MTR_PATH("jit.mtr")) == MTR_OK);
+}
+
+TEST_CASE(trace) {
+    CHECK(mtr_launch(MTR_PATH("trace.mtr")) == MTR_OK);
+}
+
+TEST_CASE(stack_overflow) {
+    CHECK(mtr_launch(MTR_PATH("stack_overflow.mtr")) == MTR_RUNTIME_ERROR);
+    CHECK(mtr_launch(MTR_PATH("stackDepth.mtr")) == MTR_RUNTIME_ERROR);
+#ifdef MTR_JIT_ENABLED
+    // every call compiled, machine code calls through the C stack
+    const u32 threshold = mtr_jit_threshold;
+    mtr_jit_threshold = 1;
+    CHECK(mtr_launch(MTR_PATH("stack_overflow.mtr")) == MTR_RUNTIME_ERROR);
+    CHECK(mtr_launch(MTR_PATH("recursion.mtr")) == MTR_OK);
+    mtr_jit_threshold = threshold;
+#endif
+}
+
+// Only checks that the C is written, make aot_check builds and runs it
+TEST_CASE(aot) {
+#ifdef MTR_REGISTER_VM
+    CHECK(mtr_aot_compile(MTR_PATH("tailCall.mtr"), "aot_test.c") == MTR_COMPILER_ERROR);
+#else
+    CHECK(mtr_aot_compile(MTR_PATH("tailCall.mtr"), "aot_test.c") == MTR_OK);
+    CHECK(mtr_aot_compile(MTR_PATH("closure.mtr"), "aot_test.c") == MTR_OK);
+#endif
+    CHECK(mtr_aot_compile(MTR_PATH("parser_error.mtr"), "aot_test.c") == MTR_PARSER_ERROR);
+    remove("aot_test.c");
+}
+
 static void all_tests() {
     no_file();
     parser();
+    fail();
     simple();
     scope();
     fibbonacci();
     closure();
     user_types();
     scope();
+    recursion();
+    comparisons();
+    peephole();
+    ssa();
+    inlining();
+    escape();
+    bounds();
+    packed();
+    elementwise();
+    reductions();
+    garbage();
+    constants();
+    values();
+    stack_maps();
+    quickening();
+    tail_call();
+    jit();
+    trace();
+    stack_overflow();
+    aot();
     REPORT();
 }
 
@@ -1,5 +1,60 @@
 output_dir = '%{cfg.buildcfg}_%{cfg.architecture}_%{cfg.system}'
 
+newoption {
+	trigger		= 'switch-dispatch',
+	description	= 'Use the portable switch based interpreter loop instead of computed gotos'
+}
+
+newoption {
+	trigger		= 'register-vm',
+	description	= 'Compile to register bytecode and run it on the register engine'
+}
+
+newoption {
+	trigger		= 'instruction-stats',
+	description	= 'Count the instructions executed by the engine'
+}
+
+newoption {
+	trigger		= 'nan-boxing',
+	description	= 'Pack values into 8 bytes with NaN boxing'
+}
+
+newoption {
+	trigger		= 'untagged-values',
+	description	= 'Keep values untagged and rely on the static types (stack engine only)'
+}
+
+newoption {
+	trigger		= 'jit',
+	description	= 'Compile hot functions and loops to x86-64 machine code (stack engine only)'
+}
+
+newoption {
+	trigger		= 'dump-ssa',
+	description	= 'Print the SSA form of every function and what the optimizer removed'
+}
+
+newoption {
+	trigger		= 'report-inlining',
+	description	= 'Print every call the compiler inlined'
+}
+
+newoption {
+	trigger		= 'report-gc',
+	description	= 'Print the collections, the heap size and the collector pauses when a program ends'
+}
+
+newoption {
+	trigger		= 'incremental-gc',
+	description	= 'Split full collections into slices run between allocations'
+}
+
+newoption {
+	trigger		= 'parallel-gc',
+	description	= 'Mark and sweep on several threads (POSIX threads only)'
+}
+
 workspace 'Matiria'
 	startproject		'Tests'
 	architecture		'x64'
@@ -42,6 +97,42 @@ workspace 'Matiria'
 	filter "system:linux"
 		toolset("clang")
 
+	filter 'options:switch-dispatch'
+		defines			'MTR_SWITCH_DISPATCH'
+
+	filter 'options:register-vm'
+		defines			'MTR_REGISTER_VM'
+
+	filter 'options:instruction-stats'
+		defines			'MTR_INSTRUCTION_STATS'
+
+	filter 'options:nan-boxing'
+		defines			'MTR_NAN_BOXING'
+
+	filter 'options:untagged-values'
+		defines			'MTR_UNTAGGED_VALUES'
+
+	filter 'options:jit'
+		defines			'MTR_JIT'
+
+	filter 'options:dump-ssa'
+		defines			'MTR_DUMP_SSA'
+
+	filter 'options:report-inlining'
+		defines			'MTR_REPORT_INLINING'
+
+	filter 'options:report-gc'
+		defines			'MTR_GC_REPORT'
+
+	filter 'options:incremental-gc'
+		defines			'MTR_GC_INCREMENTAL'
+
+	filter 'options:parallel-gc'
+		defines			'MTR_GC_PARALLEL'
+
+	filter { 'options:parallel-gc', 'system:not windows' }
+		links			'pthread'
+
 project 'Matiria'
 	location			'%{prj.name}'
 	kind				'StaticLib'
@@ -52,3 +143,15 @@ project 'Tests'
 	kind				'ConsoleApp'
 	includedirs			{ '', '%{prj.name}', 'Matiria' }
 	links				'Matiria'
+
+project 'Benchmarks'
+	location			'%{prj.name}'
+	kind				'ConsoleApp'
+	includedirs			{ '', '%{prj.name}', 'Matiria' }
+	links				'Matiria'
+
+project 'Aot'
+	location			'%{prj.name}'
+	kind				'ConsoleApp'
+	includedirs			{ '', '%{prj.name}', 'Matiria' }
+	links				'Matiria'